@@ -0,0 +1,124 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__CSI_MODIFIERS_DECODER_HPP_
+#define KEYBOARD_HANDLER__CSI_MODIFIERS_DECODER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+/// \brief Decoder of the modifier parameter in xterm CSI sequences.
+/// \details xterm reports modified cursor, editing and function keys by adding modifier
+/// parameter to the sequence of the unmodified key:
+/// - `ESC [ 1 ; <mod> <final>` for keys which are `ESC [ <final>` or `ESC O <final>` without
+///   modifiers, e.g. Ctrl+Right `ESC [ 1 ; 5 C` or Shift+F1 `ESC [ 1 ; 2 P`.
+/// - `ESC [ <code> ; <mod> ~` for keys which are `ESC [ <code> ~` without modifiers, e.g.
+///   Shift+F5 `ESC [ 15 ; 2 ~`.
+///
+/// Modifier parameter is 1 plus bitmask of Shift = 1, Alt = 2, Ctrl = 4 and Meta = 8. Decoder
+/// strips the parameter in one pass over the sequence and returns the sequence of the unmodified
+/// key, which is then looked up in the regular key map, along with the decoded modifiers. This
+/// way all modifier combinations are supported without adding them to the key map.
+class CsiModifiersDecoder
+{
+public:
+  using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+  /// \brief Longest sequence which could be decoded, longer ones are never produced by xterm.
+  static constexpr size_t MAX_SEQUENCE_LENGTH = 16;
+
+  /// \brief Sequence of the unmodified key and decoded modifiers.
+  struct Result
+  {
+    char sequence[MAX_SEQUENCE_LENGTH];
+    size_t length = 0;
+    KeyModifiers key_modifiers = KeyModifiers::NONE;
+  };
+
+  /// \brief Decode CSI sequence with modifier parameter.
+  /// \param sequence Pointer to the sequence of characters.
+  /// \param length Length of the sequence in bytes.
+  /// \param result Receives unmodified sequence and modifiers if sequence was decoded.
+  /// \return true if sequence is a CSI sequence with valid modifier parameter.
+  static bool decode(const char * sequence, size_t length, Result & result)
+  {
+    static constexpr char ESC = 27;
+    if (length < 6 || length > MAX_SEQUENCE_LENGTH || sequence[0] != ESC ||
+      sequence[1] != '[')
+    {
+      return false;
+    }
+    // Single pass: `<code> ; <mod> <final>`, where code consists of digits
+    size_t i = 2;
+    size_t code = 0;
+    size_t code_length = 0;
+    for (; i < length && is_digit(sequence[i]); i++, code_length++) {
+      code = code * 10 + static_cast<size_t>(sequence[i] - '0');
+    }
+    if (code_length == 0 || i == length || sequence[i] != ';') {
+      return false;
+    }
+    size_t modifier = 0;
+    size_t modifier_length = 0;
+    for (i++; i < length && is_digit(sequence[i]); i++, modifier_length++) {
+      modifier = modifier * 10 + static_cast<size_t>(sequence[i] - '0');
+    }
+    if (modifier_length == 0 || modifier_length > 2 || i + 1 != length ||
+      modifier < 1 || modifier > MODIFIERS_BY_PARAMETER_SIZE)
+    {
+      return false;
+    }
+    const char final_byte = sequence[i];
+    result.key_modifiers = static_cast<KeyModifiers>(MODIFIERS_BY_PARAMETER[modifier - 1]);
+    if (final_byte == '~') {
+      // `ESC [ <code> ~`
+      for (i = 0; i < code_length + 2; i++) {
+        result.sequence[i] = sequence[i];
+      }
+      result.sequence[i] = '~';
+      result.length = code_length + 3;
+      return true;
+    }
+    if (code != 1 || final_byte < 'A' || final_byte > 'Z') {
+      return false;
+    }
+    // F1..F4 are SS3 sequences `ESC O P`..`ESC O S`, the rest are `ESC [ <final>`
+    result.sequence[0] = ESC;
+    result.sequence[1] = final_byte >= 'P' && final_byte <= 'S' ? 'O' : '[';
+    result.sequence[2] = final_byte;
+    result.length = 3;
+    return true;
+  }
+
+private:
+  static constexpr bool is_digit(char c)
+  {
+    return c >= '0' && c <= '9';
+  }
+
+  static constexpr size_t MODIFIERS_BY_PARAMETER_SIZE = 16;
+
+  /// \brief KeyModifiers bitmask indexed by parameter - 1. Bits of Shift, Alt and Ctrl are the
+  /// same as in xterm, Meta is reported as Alt.
+  static constexpr uint8_t MODIFIERS_BY_PARAMETER[MODIFIERS_BY_PARAMETER_SIZE] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 2, 3, 2, 3, 6, 7, 6, 7
+  };
+  static_assert(
+    static_cast<uint8_t>(KeyModifiers::SHIFT) == 1 &&
+    static_cast<uint8_t>(KeyModifiers::ALT) == 2 &&
+    static_cast<uint8_t>(KeyModifiers::CTRL) == 4, "KeyModifiers should match xterm bitmask");
+};
+
+#endif  // KEYBOARD_HANDLER__CSI_MODIFIERS_DECODER_HPP_
@@ -0,0 +1,148 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__KEY_COMMAND_PARSER_HPP_
+#define KEYBOARD_HANDLER__KEY_COMMAND_PARSER_HPP_
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+/// \brief Incremental parser of the textual key press commands, e.g. `CTRL+a`, `SHIFT+F1` or
+/// `CURSOR_UP`.
+/// \details Commands are separated by whitespace. Each command consists of optional `CTRL+`,
+/// `ALT+` and `SHIFT+` modifier prefixes in any order followed by the key name as returned by
+/// enum_key_code_to_str(). Complete commands are parsed directly from the input buffer, command
+/// split between consecutive feed() calls is carried over in the small internal buffer.
+class KeyCommandParser
+{
+public:
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+  using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+  /// \brief Maximum length of the command, longer commands are reported as KeyCode::UNKNOWN.
+  static constexpr size_t MAX_COMMAND_LENGTH = 32;
+
+  /// \brief Split input into commands and parse them.
+  /// \param data Pointer to the bytes read out from input.
+  /// \param length Number of bytes in data.
+  /// \param on_key_press Callable with signature `void(KeyCode, KeyModifiers)` which will be
+  /// called for each complete command in order of arrival.
+  template<typename OnKeyPress>
+  void feed(const char * data, size_t length, OnKeyPress && on_key_press)
+  {
+    size_t i = 0;
+    while (i < length) {
+      if (is_separator(data[i])) {
+        flush(on_key_press);
+        i++;
+        continue;
+      }
+      size_t end = i + 1;
+      while (end < length && !is_separator(data[end])) {
+        end++;
+      }
+      if (end < length && pending_length_ == 0 && !pending_overflow_) {
+        auto key_code_and_modifiers = parse_command(std::string_view(data + i, end - i));
+        on_key_press(std::get<0>(key_code_and_modifiers), std::get<1>(key_code_and_modifiers));
+      } else {
+        // Command continues in the next chunk of data or started in the previous one
+        append(data + i, end - i);
+      }
+      i = end;
+    }
+  }
+
+  /// \brief Parse pending command, if any. Should be called at the end of input.
+  /// \param on_key_press Callable with signature `void(KeyCode, KeyModifiers)`.
+  template<typename OnKeyPress>
+  void flush(OnKeyPress && on_key_press)
+  {
+    if (pending_length_ == 0 && !pending_overflow_) {
+      return;
+    }
+    auto key_code_and_modifiers = pending_overflow_ ?
+      std::make_tuple(KeyCode::UNKNOWN, KeyModifiers::NONE) :
+      parse_command(std::string_view(pending_, pending_length_));
+    pending_length_ = 0;
+    pending_overflow_ = false;
+    on_key_press(std::get<0>(key_code_and_modifiers), std::get<1>(key_code_and_modifiers));
+  }
+
+  /// \brief Check if there is an incomplete command waiting for the rest of the bytes.
+  bool has_pending() const
+  {
+    return pending_length_ > 0 || pending_overflow_;
+  }
+
+  /// \brief Parse one command.
+  /// \param command Command without surrounding whitespace.
+  /// \return tuple key code and code modifiers mask. KeyCode::UNKNOWN if key name is unknown.
+  static std::tuple<KeyCode, KeyModifiers> parse_command(std::string_view command)
+  {
+    struct modifier_prefix
+    {
+      std::string_view prefix;
+      KeyModifiers modifier;
+    };
+    static constexpr modifier_prefix MODIFIER_PREFIXES[] = {
+      {"CTRL+", KeyModifiers::CTRL}, {"ALT+", KeyModifiers::ALT}, {"SHIFT+", KeyModifiers::SHIFT}};
+
+    KeyModifiers key_modifiers = KeyModifiers::NONE;
+    bool prefix_found = true;
+    while (prefix_found) {
+      prefix_found = false;
+      for (const auto & modifier_prefix : MODIFIER_PREFIXES) {
+        // Prefix alone is not stripped, so `CTRL++` means CTRL + PLUS
+        if (command.size() > modifier_prefix.prefix.size() &&
+          command.substr(0, modifier_prefix.prefix.size()) == modifier_prefix.prefix)
+        {
+          key_modifiers = key_modifiers | modifier_prefix.modifier;
+          command.remove_prefix(modifier_prefix.prefix.size());
+          prefix_found = true;
+        }
+      }
+    }
+    for (const auto & key_code_to_str : ENUM_KEY_TO_STR_MAP) {
+      if (key_code_to_str.inner_code != KeyCode::UNKNOWN && command == key_code_to_str.str) {
+        return std::make_tuple(key_code_to_str.inner_code, key_modifiers);
+      }
+    }
+    return std::make_tuple(KeyCode::UNKNOWN, KeyModifiers::NONE);
+  }
+
+private:
+  static bool is_separator(char c)
+  {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  void append(const char * data, size_t length)
+  {
+    if (pending_overflow_ || pending_length_ + length > MAX_COMMAND_LENGTH) {
+      pending_overflow_ = true;
+      return;
+    }
+    std::memcpy(pending_ + pending_length_, data, length);
+    pending_length_ += length;
+  }
+
+  char pending_[MAX_COMMAND_LENGTH];
+  size_t pending_length_ = 0;
+  bool pending_overflow_ = false;
+};
+
+#endif  // KEYBOARD_HANDLER__KEY_COMMAND_PARSER_HPP_
@@ -0,0 +1,232 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__KEY_EVENT_AWAITABLES_HPP_
+#define KEYBOARD_HANDLER__KEY_EVENT_AWAITABLES_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+#include "keyboard_handler/spsc_queue.hpp"
+
+/// \brief Awaitable for the next key press, returned by KeyboardHandlerBase::next_key().
+/// \details Implements C++20 awaiter interface without depending on `<coroutine>`, so the
+/// library itself stays C++17 and the awaiter works with any coroutine promise type. Awaiter
+/// lives in the coroutine frame along with its node in the keyboard handler list of waiters,
+/// suspending and resuming coroutine don't allocate memory.
+/// Coroutine is resumed on the dispatching thread: input thread, reactor thread, dispatcher
+/// thread or the thread which calls KeyboardHandlerUnixImpl::process_ready(). Suspended
+/// coroutine could be destroyed only when no key presses are dispatched concurrently, e.g. from
+/// the dispatching thread, and should be resumed or destroyed before keyboard handler.
+class KeyAwaiter
+{
+public:
+  using KeyEvent = KeyboardHandlerBase::KeyEvent;
+
+  KeyAwaiter(const KeyAwaiter &) = delete;
+  KeyAwaiter & operator=(const KeyAwaiter &) = delete;
+
+  /// \brief Unregister awaiter of the coroutine destroyed before key press.
+  ~KeyAwaiter()
+  {
+    handler_.remove_key_waiter(waiter_);
+  }
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+
+  /// \param coroutine Handle of the suspended coroutine, e.g. `std::coroutine_handle<P>`.
+  template<typename CoroutineHandle>
+  void await_suspend(CoroutineHandle coroutine)
+  {
+    waiter_.coroutine_address = coroutine.address();
+    waiter_.resume_fn = [](void * coroutine_address) {
+        CoroutineHandle::from_address(coroutine_address).resume();
+      };
+    // Coroutine could be resumed by dispatching thread even before add_key_waiter() returns,
+    // awaiter shouldn't be touched after it.
+    handler_.add_key_waiter(waiter_);
+  }
+
+  /// \return Key press which resumed the coroutine.
+  KeyEvent await_resume() const noexcept
+  {
+    return event_;
+  }
+
+private:
+  friend class KeyboardHandlerBase;
+
+  KeyAwaiter(
+    KeyboardHandlerBase & handler, bool match_key, KeyboardHandlerBase::KeyCode key_code,
+    KeyboardHandlerBase::KeyModifiers key_modifiers)
+  : handler_(handler)
+  {
+    waiter_.match_key = match_key;
+    waiter_.key_code = key_code;
+    waiter_.key_modifiers = key_modifiers;
+    waiter_.deliver_fn = &KeyAwaiter::deliver;
+    waiter_.owner = this;
+  }
+
+  static bool deliver(KeyboardHandlerBase::key_waiter & waiter, const KeyEvent & event)
+  {
+    static_cast<KeyAwaiter *>(waiter.owner)->event_ = event;
+    return true;
+  }
+
+  KeyboardHandlerBase & handler_;
+  KeyboardHandlerBase::key_waiter waiter_;
+  KeyEvent event_{};
+};
+
+/// \brief Async generator over key presses of any key combination, returned by
+/// KeyboardHandlerBase::key_events().
+/// \details Stream receives key presses from construction till destruction. Key presses which
+/// arrive while the consumer coroutine is not suspended in `co_await stream.next()` are kept in
+/// the bounded buffer allocated once in constructor. When buffer is full, newer key presses
+/// are dropped and counted, see get_overflow_count(). Key releases are not passed.
+/// Consumer coroutine is resumed on the dispatching thread the same way as with KeyAwaiter.
+/// Only one coroutine at a time could await the next key press. Stream should be destroyed
+/// before keyboard handler.
+/// \code
+/// auto stream = handler.key_events();
+/// for (;;) {
+///   KeyboardHandler::KeyEvent event = co_await stream.next();
+/// }
+/// \endcode
+class KeyEventStream
+{
+public:
+  using KeyEvent = KeyboardHandlerBase::KeyEvent;
+
+  /// \brief Awaitable for the next key press in the stream, returned by next().
+  class NextAwaiter
+  {
+public:
+    NextAwaiter(const NextAwaiter &) = delete;
+    NextAwaiter & operator=(const NextAwaiter &) = delete;
+
+    /// \brief Unregister awaiter of the coroutine destroyed before key press.
+    ~NextAwaiter()
+    {
+      std::lock_guard<std::mutex> lock(stream_.handler_.key_waiters_mutex_);
+      if (stream_.consumer_ == this) {
+        stream_.consumer_ = nullptr;
+      }
+    }
+
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    /// \return false if buffered key press is available and coroutine should not be suspended.
+    template<typename CoroutineHandle>
+    bool await_suspend(CoroutineHandle coroutine)
+    {
+      std::lock_guard<std::mutex> lock(stream_.handler_.key_waiters_mutex_);
+      if (stream_.events_.try_pop(event_)) {
+        return false;
+      }
+      coroutine_address_ = coroutine.address();
+      resume_fn_ = [](void * coroutine_address) {
+          CoroutineHandle::from_address(coroutine_address).resume();
+        };
+      stream_.consumer_ = this;
+      return true;
+    }
+
+    /// \return The oldest key press which wasn't returned yet.
+    KeyEvent await_resume() const noexcept
+    {
+      return event_;
+    }
+
+private:
+    friend class KeyEventStream;
+
+    explicit NextAwaiter(KeyEventStream & stream)
+    : stream_(stream) {}
+
+    KeyEventStream & stream_;
+    KeyEvent event_{};
+    void (* resume_fn_)(void * coroutine_address) = nullptr;
+    void * coroutine_address_ = nullptr;
+  };
+
+  /// \brief Constructor
+  /// \param handler Keyboard handler which dispatches key presses.
+  /// \param capacity Maximum number of buffered key presses.
+  /// \throw std::invalid_argument if capacity is 0.
+  KeyEventStream(KeyboardHandlerBase & handler, size_t capacity)
+  : handler_(handler), events_(capacity)
+  {
+    waiter_.persistent = true;
+    waiter_.deliver_fn = &KeyEventStream::deliver;
+    waiter_.owner = this;
+    handler_.add_key_waiter(waiter_);
+  }
+
+  KeyEventStream(const KeyEventStream &) = delete;
+  KeyEventStream & operator=(const KeyEventStream &) = delete;
+
+  ~KeyEventStream()
+  {
+    handler_.remove_key_waiter(waiter_);
+  }
+
+  /// \brief Awaitable for the next key press, `co_await stream.next()` evaluates to KeyEvent.
+  NextAwaiter next()
+  {
+    return NextAwaiter(*this);
+  }
+
+  /// \brief Number of key presses dropped because buffer was full.
+  size_t get_overflow_count() const
+  {
+    return overflow_count_.load(std::memory_order_relaxed);
+  }
+
+private:
+  static bool deliver(KeyboardHandlerBase::key_waiter & waiter, const KeyEvent & event)
+  {
+    auto & stream = *static_cast<KeyEventStream *>(waiter.owner);
+    if (stream.consumer_ == nullptr) {
+      if (!stream.events_.try_push(event)) {
+        stream.overflow_count_.fetch_add(1, std::memory_order_relaxed);
+      }
+      return false;
+    }
+    // Consumer is suspended only when buffer is empty, pass key press to it directly
+    stream.consumer_->event_ = event;
+    waiter.resume_fn = stream.consumer_->resume_fn_;
+    waiter.coroutine_address = stream.consumer_->coroutine_address_;
+    stream.consumer_ = nullptr;
+    return true;
+  }
+
+  KeyboardHandlerBase & handler_;
+  KeyboardHandlerBase::key_waiter waiter_;
+  /// \brief Buffered key presses, guarded by KeyboardHandlerBase::key_waiters_mutex_.
+  SpscQueue<KeyEvent> events_;
+  /// \brief Suspended consumer, guarded by KeyboardHandlerBase::key_waiters_mutex_.
+  NextAwaiter * consumer_ = nullptr;
+  std::atomic<size_t> overflow_count_{0};
+};
+
+#endif  // KEYBOARD_HANDLER__KEY_EVENT_AWAITABLES_HPP_
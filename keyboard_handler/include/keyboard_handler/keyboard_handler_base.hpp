@@ -15,14 +15,26 @@
 #ifndef KEYBOARD_HANDLER__KEYBOARD_HANDLER_BASE_HPP_
 #define KEYBOARD_HANDLER__KEYBOARD_HANDLER_BASE_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
-#include <unordered_map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "keyboard_handler/latency_histogram.hpp"
+#include "keyboard_handler/rate_limiter.hpp"
+#include "keyboard_handler/retired_objects.hpp"
 #include "keyboard_handler/visibility_control.hpp"
 
 // #define PRINT_DEBUG_INFO
 
+class KeyAwaiter;
+class KeyEventStream;
+
 class KeyboardHandlerBase
 {
 public:
@@ -40,6 +52,25 @@ public:
     CTRL  = 1 << 2
   };
 
+  /// \brief Type of the key event. Terminals report only presses, unless they support
+  /// progressive keyboard protocol, see KeyboardHandlerUnixImpl::enable_kitty_keyboard_protocol().
+  enum class KeyEventType : uint8_t
+  {
+    PRESS,
+    /// \brief Key press generated by autorepeat of the held key.
+    REPEAT,
+    RELEASE
+  };
+
+  /// \brief Key press combination along with the time when it was read out from the input.
+  struct KeyEvent
+  {
+    KeyCode key_code;
+    KeyModifiers key_modifiers;
+    std::chrono::steady_clock::time_point timestamp;
+    KeyEventType event_type = KeyEventType::PRESS;
+  };
+
   /// \brief Type for callback functions
   using callback_t = std::function<void (KeyCode, KeyModifiers)>;
   using callback_handle_t = uint64_t;
@@ -63,18 +94,130 @@ public:
     KeyboardHandlerBase::KeyCode key_code,
     KeyboardHandlerBase::KeyModifiers key_modifiers = KeyboardHandlerBase::KeyModifiers::NONE);
 
+  /// \brief Adding callable object as a rate limited handler for specified key press
+  /// combination.
+  /// \details Policy is enforced by keyboard handler on the dispatching thread. Leading edge
+  /// and token bucket callbacks are called synchronously with the key press or not called at
+  /// all. Trailing edge callback is called once no key press arrived during policy interval,
+  /// from the same thread as other callbacks.
+  /// \param callback Callable which will be called when key_code will be recognized.
+  /// \param key_code Value from enum which corresponds to some predefined key press combination.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  /// \param policy Rate limiting policy, e.g. RateLimitPolicy::leading_edge(1s).
+  /// \return Newly created callback handle or invalid_handle, same as add_key_press_callback.
+  /// Also returns invalid_handle if policy is invalid.
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_key_press_callback(
+    const callback_t & callback,
+    KeyboardHandlerBase::KeyCode key_code,
+    KeyboardHandlerBase::KeyModifiers key_modifiers,
+    const RateLimitPolicy & policy);
+
   /// \brief Delete callback from keyboard handler callback's list
   /// \param handle Callback's handle returned from #add_key_press_callback
   KEYBOARD_HANDLER_PUBLIC
   void delete_key_press_callback(const callback_handle_t & handle) noexcept;
 
-protected:
-  struct callback_data
+  /// \brief Callback along with the key press combination for batch registration.
+  struct KeyPressBinding
   {
-    callback_handle_t handle;
     callback_t callback;
+    KeyCode key_code;
+    KeyModifiers key_modifiers = KeyModifiers::NONE;
   };
 
+  /// \brief Add several callbacks as one atomic update.
+  /// \details Either all callbacks become visible to the dispatching thread at once or none of
+  /// them is added.
+  /// \param bindings Callbacks with key press combinations to add.
+  /// \return Handles of the newly added callbacks in the same order as bindings. Empty vector if
+  /// any of the callbacks is nullptr, any of the key press combinations is invalid or keyboard
+  /// handler wasn't successfully initialized.
+  KEYBOARD_HANDLER_PUBLIC
+  std::vector<callback_handle_t> add_key_press_callbacks(
+    const std::vector<KeyPressBinding> & bindings);
+
+  /// \brief Delete several callbacks as one atomic update.
+  /// \details All callbacks disappear for the dispatching thread at once. Invalid, stale and
+  /// duplicate handles are ignored.
+  /// \param handles Callback's handles returned from #add_key_press_callback or
+  /// #add_key_press_callbacks
+  KEYBOARD_HANDLER_PUBLIC
+  void delete_key_press_callbacks(const std::vector<callback_handle_t> & handles) noexcept;
+
+  /// \brief Type for callbacks which receive consecutive presses of the same key combination
+  /// coalesced into one call, e.g. autorepeat of the held key.
+  /// \details The last argument is the number of coalesced key presses, at least 1.
+  using repeat_callback_t = std::function<void (KeyCode, KeyModifiers, size_t)>;
+
+  /// \brief Type for callbacks notified when held key combination is not pressed anymore.
+  /// \details The last argument is the total number of key presses during the hold.
+  using hold_end_callback_t = std::function<void (KeyCode, KeyModifiers, size_t)>;
+
+  /// \brief Add callback which receives coalesced key presses.
+  /// \details Consecutive presses of the same key combination which arrive faster than they are
+  /// dispatched, e.g. read out from the input at once or waiting in the dispatch queue, and
+  /// within AutorepeatPolicy::hold_window from each other are passed to the callback in one
+  /// call. Coalescing never delays dispatching of the key presses.
+  /// \param callback Callable which will be called with number of coalesced key presses.
+  /// \param key_code Value from enum which corresponds to some predefined key press combination.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  /// \return Newly created callback handle or invalid_handle, same as add_key_press_callback.
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_key_repeat_callback(
+    const repeat_callback_t & callback,
+    KeyCode key_code,
+    KeyModifiers key_modifiers = KeyModifiers::NONE);
+
+  /// \brief Add callback which is called when hold of the key combination ended.
+  /// \details Hold ends when no press of the same key combination arrived within
+  /// AutorepeatPolicy::hold_window after the previous one, or when other key combination was
+  /// pressed.
+  /// \param callback Callable which will be called with total number of key presses in hold.
+  /// \param key_code Value from enum which corresponds to some predefined key press combination.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  /// \return Newly created callback handle or invalid_handle, same as add_key_press_callback.
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_key_hold_end_callback(
+    const hold_end_callback_t & callback,
+    KeyCode key_code,
+    KeyModifiers key_modifiers = KeyModifiers::NONE);
+
+  /// \brief Type for callbacks which receive key releases along with key presses.
+  using key_event_callback_t = std::function<void (KeyCode, KeyModifiers, KeyEventType)>;
+
+  /// \brief Add callback which receives presses, autorepeats and releases of the key.
+  /// \details Callbacks added with add_key_press_callback are called for presses and autorepeats
+  /// only, the same way for all terminals. Release events and distinction between presses and
+  /// autorepeats are available only when terminal reports them.
+  /// \param callback Callable which will be called with type of the key event.
+  /// \param key_code Value from enum which corresponds to some predefined key press combination.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  /// \return Newly created callback handle or invalid_handle, same as add_key_press_callback.
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_key_event_callback(
+    const key_event_callback_t & callback,
+    KeyCode key_code,
+    KeyModifiers key_modifiers = KeyModifiers::NONE);
+
+  /// \brief Type for callbacks which receive pasted text.
+  using paste_callback_t = std::function<void (std::string_view)>;
+
+  /// \brief Add callback which receives text pasted into terminal as a whole.
+  /// \details Pasted text is reported only by terminals in bracketed paste mode, see
+  /// KeyboardHandlerUnixImpl::enable_bracketed_paste(). Text is passed as is, without parsing
+  /// it into key presses, and is valid only during the callback call.
+  /// \param callback Callable which will be called once per paste.
+  /// \return Newly created callback handle or invalid_handle if callback is empty or keyboard
+  /// handler wasn't initialized. Callback could be deleted with delete_key_press_callback().
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_paste_callback(const paste_callback_t & callback);
+
+  /// \brief Key press combination, e.g. element of the key sequence.
   struct KeyAndModifiers
   {
     KeyCode key_code;
@@ -91,6 +234,220 @@ protected:
     }
   };
 
+  /// \brief Maximum number of key press combinations in the key sequence.
+  static constexpr size_t MAX_KEY_SEQUENCE_LENGTH = 16;
+
+  /// \brief Whether key presses of the key sequence are passed to the other callbacks.
+  enum class KeySequenceMode : uint8_t
+  {
+    /// \brief Key presses are held back while the sequence is typed and dropped once it's
+    /// completed. Held back key presses are dispatched as usual if the sequence is broken by
+    /// other key press or isn't continued within timeout.
+    SWALLOW_KEYS,
+    /// \brief Key presses are dispatched to the other callbacks as usual.
+    PASS_THROUGH_KEYS
+  };
+
+  /// \brief Add callable object as a handler for the sequence of key press combinations, e.g.
+  /// `g g`, `Ctrl+X Ctrl+S` or `5 0 Enter`.
+  /// \details Sequences are matched incrementally, with one lookup in the trie of registered
+  /// sequences per key press regardless of their number. Sequence is broken if the next key
+  /// press doesn't continue it or doesn't arrive within key sequence timeout. If sequence is a
+  /// prefix of the longer one, e.g. `g` and `g g`, its callback is called only once the longer
+  /// one is broken. Key presses of the prefix shared by several sequences are swallowed if any
+  /// of them swallows keys. Key releases don't affect matching. Key presses held back by the
+  /// broken sequence are dispatched without matching them again. Autorepeat is not coalesced
+  /// while any key sequence is registered.
+  /// \param callback Callable which will be called with the last key press combination of the
+  /// sequence.
+  /// \param sequence Key press combinations, from 1 to MAX_KEY_SEQUENCE_LENGTH.
+  /// \param mode Whether key presses of the sequence are passed to the other callbacks.
+  /// \return Newly created callback handle or invalid_handle, same as add_key_press_callback.
+  /// Also returns invalid_handle if sequence is empty or too long. Callback could be deleted
+  /// with delete_key_press_callback().
+  KEYBOARD_HANDLER_PUBLIC
+  callback_handle_t add_key_sequence_callback(
+    const callback_t & callback, const std::vector<KeyAndModifiers> & sequence,
+    KeySequenceMode mode = KeySequenceMode::SWALLOW_KEYS);
+
+  /// \brief Set maximum interval between consecutive key presses of the key sequence.
+  KEYBOARD_HANDLER_PUBLIC
+  void set_key_sequence_timeout(std::chrono::milliseconds timeout);
+
+  /// \brief Get maximum interval between consecutive key presses of the key sequence.
+  KEYBOARD_HANDLER_PUBLIC
+  std::chrono::milliseconds get_key_sequence_timeout() const;
+
+  /// \brief Autorepeat coalescing policy.
+  struct AutorepeatPolicy
+  {
+    /// \brief If true, callbacks added with add_key_press_callback are called once per
+    /// coalesced key presses, the same way as repeat callbacks. Otherwise they are called once
+    /// per each key press.
+    bool coalesce_key_press_callbacks = false;
+    /// \brief Maximum interval between consecutive presses of the same key combination which
+    /// belong to one hold. Terminals typically repeat held key every 30-50 ms, after initial
+    /// delay of 250-600 ms.
+    std::chrono::milliseconds hold_window{100};
+  };
+
+  /// \brief Set autorepeat coalescing policy for all key press combinations.
+  KEYBOARD_HANDLER_PUBLIC
+  void set_autorepeat_policy(const AutorepeatPolicy & policy);
+
+  /// \brief Get current autorepeat coalescing policy.
+  KEYBOARD_HANDLER_PUBLIC
+  AutorepeatPolicy get_autorepeat_policy() const;
+
+  /// \brief Latency of the key press processing stages, all measured from the moment when
+  /// read() returned bytes of the key press sequence.
+  struct LatencyStats
+  {
+    /// \brief false if library was built without KEYBOARD_HANDLER_ENABLE_LATENCY_STATS option,
+    /// histograms are empty in this case.
+    bool enabled = false;
+    /// \brief Till the key press sequence was parsed.
+    LatencyHistogram::Snapshot parse;
+    /// \brief Till the start of the callbacks invocation, includes time spent in the dispatch
+    /// queue in dispatcher thread mode.
+    LatencyHistogram::Snapshot callbacks_start;
+    /// \brief Till the end of the callbacks invocation.
+    LatencyHistogram::Snapshot callbacks_end;
+    /// \brief Duration of the callbacks invocation alone.
+    LatencyHistogram::Snapshot callbacks_duration;
+  };
+
+  /// \brief Get latency statistics collected since keyboard handler construction.
+  /// \details Statistics are collected only if library was built with
+  /// KEYBOARD_HANDLER_ENABLE_LATENCY_STATS CMake option, otherwise timestamps are not taken at
+  /// all and returned statistics are empty. Only Unix implementation records the parse stage.
+  KEYBOARD_HANDLER_PUBLIC
+  LatencyStats get_latency_stats() const;
+
+  /// \brief Awaitable for the next key press of any key combination.
+  /// \details `co_await handler.next_key()` suspends C++20 coroutine until the next key press or
+  /// autorepeat and evaluates to its KeyEvent. Coroutine is resumed directly from the
+  /// dispatching thread after the callbacks, without allocating memory. Key releases don't
+  /// resume it, coalesced key presses resume it once. See KeyAwaiter in
+  /// keyboard_handler/key_event_awaitables.hpp.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyAwaiter next_key();
+
+  /// \brief Awaitable for the next press of the specified key combination, see next_key().
+  /// \param key_code Value from enum which corresponds to some predefined key press combination.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyAwaiter next_key(KeyCode key_code, KeyModifiers key_modifiers = KeyModifiers::NONE);
+
+  /// \brief Async generator over key presses of any key combination.
+  /// \details `co_await stream.next()` evaluates to the next key press. Key presses which arrive
+  /// while the consumer coroutine is busy are buffered, so none is missed between two awaits.
+  /// See KeyEventStream in keyboard_handler/key_event_awaitables.hpp.
+  /// \param capacity Maximum number of buffered key presses, the newer ones are dropped and
+  /// counted when buffer is full.
+  /// \throw std::invalid_argument if capacity is 0.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyEventStream key_events(size_t capacity = 64);
+
+protected:
+  /// \brief Default constructor
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerBase();
+
+  enum class callback_kind : uint8_t
+  {
+    KEY_PRESS,
+    KEY_REPEAT,
+    HOLD_END,
+    KEY_EVENT,
+    PASTE
+  };
+
+  struct callback_data
+  {
+    callback_handle_t handle;
+    callback_t callback;
+    /// \brief Used instead of callback for KEY_REPEAT and HOLD_END callbacks.
+    repeat_callback_t repeat_callback = nullptr;
+    callback_kind kind = callback_kind::KEY_PRESS;
+    /// \brief State of the rate limited KEY_PRESS callback, shared by all snapshots.
+    std::shared_ptr<RateLimiter> rate_limiter = nullptr;
+    /// \brief Used instead of callback for KEY_EVENT callbacks.
+    key_event_callback_t event_callback = nullptr;
+    /// \brief Used instead of callback for PASTE callbacks.
+    paste_callback_t paste_callback = nullptr;
+  };
+
+  /// \brief Number of all possible combinations of the KeyModifiers bits.
+  static constexpr size_t KEY_MODIFIERS_COMBINATIONS = 8;
+
+  /// \brief Call all callbacks registered for the key press combination.
+  /// \param key_code Value from enum which corresponds to the pressed key.
+  /// \param key_modifiers Value from enum which corresponds to the key modifiers pressed along
+  /// side with key.
+  KEYBOARD_HANDLER_PUBLIC
+  void dispatch_key_press(KeyCode key_code, KeyModifiers key_modifiers);
+
+  /// \brief Call all callbacks registered for the key press combination coalesced repeat_count
+  /// times.
+  /// \details Repeat callbacks are called once, key press and key event callbacks are called
+  /// once or repeat_count times depending on AutorepeatPolicy::coalesce_key_press_callbacks.
+  /// Key releases are passed only to key event callbacks.
+  KEYBOARD_HANDLER_PUBLIC
+  void dispatch_key_presses(
+    KeyCode key_code, KeyModifiers key_modifiers, size_t repeat_count,
+    KeyEventType event_type = KeyEventType::PRESS);
+
+  /// \brief Call all callbacks registered for the key press combination, track holds if
+  /// autorepeat coalescing is enabled and record latency statistics relative to the event
+  /// timestamp, if enabled.
+  /// \param event Key press with the time when it was read out from the input.
+  /// \param repeat_count Number of coalesced key presses, see can_coalesce_key_presses().
+  KEYBOARD_HANDLER_PUBLIC
+  void dispatch_key_press(const KeyEvent & event, size_t repeat_count = 1);
+
+  /// \brief Call all paste callbacks.
+  /// \param text Pasted text, without bracketed paste markers.
+  KEYBOARD_HANDLER_PUBLIC
+  void dispatch_paste(std::string_view text);
+
+  /// \brief Check if key presses should be coalesced and holds should be tracked.
+  /// \return true if coalescing of key press callbacks is enabled or if any repeat or hold end
+  /// callback is registered.
+  KEYBOARD_HANDLER_PUBLIC
+  bool is_autorepeat_tracking_enabled() const;
+
+  /// \brief Check if check_deadlines() should be called when dispatching thread is idle.
+  /// \return true if holds are tracked or if any trailing edge callback is registered.
+  KEYBOARD_HANDLER_PUBLIC
+  bool is_deadline_tracking_enabled() const;
+
+  /// \brief Check if the next key press is a repeat of the previous one within hold window.
+  /// \details Key releases are never coalesced.
+  KEYBOARD_HANDLER_PUBLIC
+  bool can_coalesce_key_presses(const KeyEvent & previous, const KeyEvent & next) const;
+
+  /// \brief End current hold if no key press arrived within hold window and call trailing edge
+  /// callbacks which are due.
+  /// \details Should be called from the dispatching thread when it is idle.
+  /// \param now Current time.
+  /// \return Time of the nearest deadline if no more key presses arrive, or time_point::max()
+  /// if nothing is pending.
+  KEYBOARD_HANDLER_PUBLIC
+  std::chrono::steady_clock::time_point check_deadlines(
+    std::chrono::steady_clock::time_point now);
+
+  /// \brief Record time passed since the key press was read out till the end of its parsing.
+  /// \details No-op if latency statistics are disabled. Should be called from one thread.
+  /// \param read_time Time when the key press sequence was read out from the input.
+  KEYBOARD_HANDLER_PUBLIC
+  void record_parse_latency(std::chrono::steady_clock::time_point read_time);
+
+  /// \brief Get number of callbacks registered in keyboard handler.
+  KEYBOARD_HANDLER_PUBLIC
+  size_t get_callbacks_count() const;
+
   /// \brief Specialized hash function for `unordered_map` with KeyAndModifiers
   struct key_and_modifiers_hash_fn
   {
@@ -104,11 +461,386 @@ protected:
   };
 
   bool is_init_succeed_ = false;
+  /// \brief Serializes writers, never taken on dispatch path.
   std::mutex callbacks_mutex_;
-  std::unordered_multimap<KeyAndModifiers, callback_data, key_and_modifiers_hash_fn> callbacks_;
 
 private:
-  static callback_handle_t get_new_handle();
+  friend class KeyAwaiter;
+  friend class KeyEventStream;
+
+  /// \brief Node of the intrusive list of coroutines awaiting key press, lives in the awaiter
+  /// stored in the coroutine frame.
+  struct key_waiter
+  {
+    /// \brief If false, waiter receives key presses of any key combination.
+    bool match_key = false;
+    KeyCode key_code{};
+    KeyModifiers key_modifiers = KeyModifiers::NONE;
+    /// \brief If false, waiter is removed from the list once it receives a key press.
+    bool persistent = false;
+    /// \brief Pass key press to the waiter, called with key_waiters_mutex_ locked.
+    /// \return true if coroutine should be resumed by resume_fn once the mutex is released.
+    bool (* deliver_fn)(key_waiter & waiter, const KeyEvent & event) = nullptr;
+    /// \brief Awaiter which owns the node.
+    void * owner = nullptr;
+    /// \brief Resume suspended coroutine, could destroy the node.
+    void (* resume_fn)(void * coroutine_address) = nullptr;
+    void * coroutine_address = nullptr;
+    key_waiter * prev = nullptr;
+    key_waiter * next = nullptr;
+    /// \brief Link in the list of waiters to resume, local to one resume_key_waiters() call.
+    key_waiter * next_ready = nullptr;
+    bool linked = false;
+  };
+
+  /// \brief Add waiter to the list, key presses dispatched after that are delivered to it.
+  void add_key_waiter(key_waiter & waiter);
+
+  /// \brief Remove waiter from the list, no-op if waiter isn't in the list.
+  void remove_key_waiter(key_waiter & waiter) noexcept;
+
+  /// \brief Remove waiter which is in the list.
+  /// \details Should be called with key_waiters_mutex_ locked.
+  void unlink_key_waiter(key_waiter & waiter) noexcept;
+
+  /// \brief Deliver key press to the matching waiters and resume their coroutines.
+  /// \details Coroutines are resumed on the calling thread in order of suspension, after
+  /// key_waiters_mutex_ is released.
+  void resume_key_waiters(const KeyEvent & event);
+
+  /// \brief Guards list of waiters and state of their awaiters.
+  std::mutex key_waiters_mutex_;
+  /// \brief The most recently added waiter.
+  key_waiter * key_waiters_ = nullptr;
+  /// \brief Number of waiters in the list, allows to skip the mutex when there are none.
+  std::atomic<size_t> key_waiters_count_{0};
+
+  /// \brief Callback along with its key press combination.
+  struct key_callback
+  {
+    KeyCode key_code;
+    KeyModifiers key_modifiers;
+    callback_data data;
+  };
+
+  /// \brief Number of consecutive slots grouped in one callbacks_chunk.
+  static constexpr size_t CALLBACKS_CHUNK_SIZE = 32;
+
+  /// \brief Group of consecutive slots of the callbacks_table.
+  struct callbacks_chunk
+  {
+    std::shared_ptr<const std::vector<callback_data>> slots[CALLBACKS_CHUNK_SIZE];
+  };
+
+  /// \brief Key sequence of the callback as callbacks slots of its key press combinations.
+  /// \details Kept in the slot map entry of the callback, so its path in the trie is known
+  /// on delete without searching for it.
+  struct key_sequence_binding
+  {
+    std::vector<uint32_t> slots;
+    bool swallow_keys = false;
+  };
+
+  /// \brief Immutable trie of the registered key sequences.
+  /// \details Nodes are immutable and shared between consecutive tries like chunks of the
+  /// callbacks_table. Writers make a shallow copy of the trie and insert or remove one sequence
+  /// at a time, copying only the nodes on its path and the root chunk it starts in.
+  struct key_sequence_trie
+  {
+    struct node;
+
+    /// \brief Transition to the child node by key press combination in callbacks slot.
+    struct child
+    {
+      uint32_t slot;
+      std::shared_ptr<const node> target;
+    };
+
+    struct node
+    {
+      /// \brief Callbacks of the sequences which end at the node.
+      std::vector<callback_data> callbacks;
+      /// \brief Child nodes sorted by slot.
+      std::vector<child> children;
+      /// \brief Number of sequences passing through or ending at the node.
+      uint32_t sequences_count = 0;
+      /// \brief Number of sequences passing through or ending at the node which swallow keys.
+      uint32_t swallowing_sequences_count = 0;
+    };
+
+    /// \brief Children of the root node in CALLBACKS_CHUNK_SIZE consecutive callbacks slots.
+    struct root_chunk
+    {
+      std::shared_ptr<const node> children[CALLBACKS_CHUNK_SIZE];
+    };
+
+    /// \brief Constructor of the empty trie.
+    key_sequence_trie();
+
+    /// \brief Get child node of the parent node by key press combination in callbacks slot.
+    /// \param parent Parent node or nullptr for the root node.
+    /// \return Child node or nullptr if there is no such child.
+    const node * find_child(const node * parent, size_t slot) const
+    {
+      if (parent == nullptr) {
+        const auto & chunk = root_chunks[slot / CALLBACKS_CHUNK_SIZE];
+        return chunk ? chunk->children[slot % CALLBACKS_CHUNK_SIZE].get() : nullptr;
+      }
+      const auto & children = parent->children;
+      auto it = std::lower_bound(
+        children.begin(), children.end(), slot,
+        [](const child & transition, size_t key_slot) {return transition.slot < key_slot;});
+      return it != children.end() && it->slot == slot ? it->target.get() : nullptr;
+    }
+
+    /// \brief Add sequence nodes which don't exist yet and bind callback to the last one.
+    /// \details Trie is modified only after all copies of the nodes are made.
+    void insert(const key_sequence_binding & binding, const callback_data & data);
+
+    /// \brief Unbind callback from the sequence and drop nodes which aren't used by other
+    /// sequences anymore.
+    /// \details Sequence should be inserted to the trie. Trie is modified only after all copies
+    /// of the nodes are made.
+    void remove(const key_sequence_binding & binding, callback_handle_t handle);
+
+    /// \brief Children of the root node grouped like slots of the callbacks_table, since root
+    /// is looked up on each key press. nullptr for chunks without children.
+    std::vector<std::shared_ptr<const root_chunk>> root_chunks;
+    size_t sequences_count = 0;
+  };
+
+  /// \brief Immutable snapshot of the registered callbacks.
+  /// \details Flat table with one list of callbacks per each KeyCode and KeyModifiers
+  /// combination, see get_callbacks_slot(), grouped into chunks of CALLBACKS_CHUNK_SIZE slots.
+  /// Snapshot never changes after publishing, writers make a copy, modify it and publish
+  /// instead of the current one. Chunks and lists of callbacks which weren't modified are
+  /// shared between consecutive snapshots, so copy of the snapshot is shallow.
+  struct callbacks_table
+  {
+    std::vector<std::shared_ptr<const callbacks_chunk>> chunks;
+    size_t callbacks_count = 0;
+    /// \brief Number of KEY_REPEAT and HOLD_END callbacks.
+    size_t autorepeat_callbacks_count = 0;
+    /// \brief Callbacks with trailing edge policy, checked when dispatching thread is idle.
+    std::vector<key_callback> trailing_edge_callbacks;
+    /// \brief PASTE callbacks, not bound to any key press combination.
+    std::vector<callback_data> paste_callbacks;
+    /// \brief Registered key sequences or nullptr if there are none, shared between snapshots.
+    std::shared_ptr<const key_sequence_trie> key_sequences;
+  };
+
+  /// \brief Get list of callbacks in the slot of the snapshot.
+  /// \return nullptr if there are no callbacks in the slot.
+  static const std::vector<callback_data> * get_slot_callbacks(
+    const callbacks_table & table, size_t slot)
+  {
+    const auto & chunk = table.chunks[slot / CALLBACKS_CHUNK_SIZE];
+    return chunk ? chunk->slots[slot % CALLBACKS_CHUNK_SIZE].get() : nullptr;
+  }
+
+  /// \brief Chunks and lists of callbacks already copied during one writer update.
+  /// \details The first INLINE_SLOTS_COUNT modified slots are kept in the inline list, so
+  /// update of a few callbacks doesn't allocate index of all slots. Index by slot is built once
+  /// the inline list is full.
+  struct modified_callbacks
+  {
+    struct modified_slot
+    {
+      size_t slot;
+      callbacks_chunk * chunk;
+      std::vector<callback_data> * callbacks;
+    };
+
+    static constexpr size_t INLINE_SLOTS_COUNT = 8;
+    modified_slot inline_slots[INLINE_SLOTS_COUNT];
+    size_t inline_slots_count = 0;
+    /// \brief Copied chunks and lists by index, empty until inline list overflows.
+    std::vector<callbacks_chunk *> chunks;
+    std::vector<std::vector<callback_data> *> slots;
+    /// \brief All modified slots in order of modification, filled once inline list overflows.
+    std::vector<size_t> slot_indices;
+  };
+
+  /// \brief Get list of callbacks in the slot of the new snapshot for modification.
+  /// \details Chunk and list are copied on the first modification within one update, other
+  /// chunks and lists stay shared with the current snapshot.
+  static std::vector<callback_data> & modify_slot_callbacks(
+    callbacks_table & table, modified_callbacks & modified, size_t slot);
+
+  /// \brief Remove callbacks whose handles are marked as deleted from the modified lists and
+  /// update positions of the remaining ones, one pass per list.
+  /// \details Should be called with callbacks_mutex_ locked.
+  void compact_deleted_callbacks(modified_callbacks & modified) noexcept;
+
+  /// \brief Add callbacks of any kind as one atomic update, see add_key_press_callbacks().
+  std::vector<callback_handle_t> add_callbacks(std::vector<key_callback> && new_callbacks);
+
+  /// \brief Extend current hold with the key press or start the new one.
+  void track_hold(const KeyEvent & event, size_t repeat_count);
+
+  /// \brief Call HOLD_END callbacks for the current hold and reset it.
+  void end_hold();
+
+  /// \brief End current hold if no key press arrived within hold window.
+  /// \return Time when current hold expires, or time_point::max() if there is no hold.
+  std::chrono::steady_clock::time_point check_hold_end(std::chrono::steady_clock::time_point now);
+
+  /// \brief Call trailing edge callbacks which are due.
+  /// \return Time of the nearest deferred call, or time_point::max() if there is none.
+  std::chrono::steady_clock::time_point call_deferred_callbacks(
+    std::chrono::steady_clock::time_point now);
+
+  /// \brief Number of slots in callbacks_table, defined where KeyCode enum is complete.
+  static const size_t CALLBACKS_SLOTS_COUNT;
+  /// \brief Pseudo slot referred by handles of the PASTE callbacks.
+  static const size_t PASTE_CALLBACKS_SLOT;
+  /// \brief Pseudo slot referred by handles of the key sequence callbacks.
+  static const size_t KEY_SEQUENCE_CALLBACKS_SLOT;
+
+  /// \brief Replace current snapshot with the new one and retire the old snapshot.
+  /// \details Should be called with callbacks_mutex_ locked. Retired snapshots are destroyed
+  /// by whoever finds that there are no dispatching threads which could still use them: either
+  /// writer right after publishing or the last dispatching thread leaving the snapshot.
+  /// Writer never waits for dispatching threads.
+  void publish_callbacks_table(std::unique_ptr<const callbacks_table> new_table);
+
+  /// \brief Marks the calling thread as reading from the callbacks snapshot for the scope
+  /// lifetime, the last leaving reader reclaims retired snapshots.
+  using callbacks_reader_guard = RetiredObjects<const callbacks_table>::ReaderGuard;
+
+  /// \brief Snapshot currently used for dispatching, owned by callbacks_table_owner_.
+  std::atomic<const callbacks_table *> callbacks_table_{nullptr};
+  std::unique_ptr<const callbacks_table> callbacks_table_owner_;
+  /// \brief Snapshots replaced by writers which could still be in use by dispatching threads.
+  mutable RetiredObjects<const callbacks_table> retired_callbacks_tables_;
+
+  /// \brief Entry of the generational slot map which backs callback handles.
+  /// \details Handle consists of the entry index in the lower 32 bits and entry generation in
+  /// the upper 32 bits. Generation is incremented each time entry is released, so stale handles
+  /// referring to the reused entry are detected. Generation is never 0, so valid handle never
+  /// equals to the invalid_handle.
+  struct handle_slot
+  {
+    uint32_t generation = 1;
+    /// \brief Index of the slot in callbacks_table with callback referred by the handle.
+    size_t callbacks_slot = 0;
+    /// \brief Position of the callback in the list of its slot in the current snapshot.
+    size_t position = 0;
+    bool in_use = false;
+    /// \brief true while callback is being deleted by delete_key_press_callbacks().
+    bool deleted = false;
+    /// \brief Key sequence of the callback in KEY_SEQUENCE_CALLBACKS_SLOT.
+    std::unique_ptr<const key_sequence_binding> key_sequence;
+  };
+
+  /// \brief Issue new handle for callback stored in callbacks_slot at position.
+  /// \details Should be called with callbacks_mutex_ locked.
+  callback_handle_t get_new_handle(size_t callbacks_slot, size_t position = 0);
+
+  /// \brief Get slot map entry of the valid handle.
+  handle_slot & get_handle_slot(callback_handle_t handle)
+  {
+    return handle_slots_[static_cast<size_t>(handle & 0xffffffffu)];
+  }
+
+  /// \brief Find slot map entry referred by the handle.
+  /// \details Should be called with callbacks_mutex_ locked.
+  /// \return Pointer to the entry or nullptr if handle is invalid, stale or already released.
+  handle_slot * find_handle_slot(callback_handle_t handle);
+
+  /// \brief Release slot map entry referred by the valid handle and make the handle stale.
+  /// \details Should be called with callbacks_mutex_ locked.
+  void release_handle(callback_handle_t handle) noexcept;
+
+  /// \brief Slot map entries, guarded by callbacks_mutex_.
+  std::vector<handle_slot> handle_slots_;
+  /// \brief Indices of released entries in handle_slots_ available for reuse.
+  std::vector<uint32_t> free_handle_slots_;
+
+  std::atomic_bool coalesce_key_press_callbacks_{false};
+  /// \brief Copy of callbacks_table::autorepeat_callbacks_count of the current snapshot, allows
+  /// to check if holds should be tracked without entering the snapshot.
+  std::atomic<size_t> autorepeat_callbacks_count_{0};
+  /// \brief Size of callbacks_table::trailing_edge_callbacks of the current snapshot.
+  std::atomic<size_t> trailing_edge_callbacks_count_{0};
+  std::atomic<int64_t> hold_window_ns_{
+    std::chrono::nanoseconds(AutorepeatPolicy().hold_window).count()};
+  /// \brief Current hold. Mutex is uncontended unless key presses are dispatched from several
+  /// threads, e.g. during journal replay.
+  std::mutex hold_mutex_;
+  KeyCode hold_key_code_{};
+  KeyModifiers hold_key_modifiers_ = KeyModifiers::NONE;
+  size_t hold_repeat_count_ = 0;
+  std::chrono::steady_clock::time_point hold_last_press_time_;
+
+  /// \brief Advance matching of the key sequences by the key press.
+  /// \details Calls callbacks of the completed sequences and dispatches held back key presses
+  /// of the broken sequence.
+  /// \return false if key press is swallowed by the key sequence.
+  bool match_key_sequences(const KeyEvent & event);
+
+  /// \brief Complete or break pending key sequence if its timeout expired.
+  /// \return Time when pending key sequence expires, or time_point::max() if there is none.
+  std::chrono::steady_clock::time_point check_key_sequence_timeout(
+    std::chrono::steady_clock::time_point now);
+
+  /// \brief Pending key sequence taken out by reset_pending_key_sequence().
+  struct key_sequence_reset
+  {
+    /// \brief Keeps callbacks of the completed sequence alive.
+    std::shared_ptr<const key_sequence_trie> trie;
+    /// \brief Callbacks of the completed sequence or nullptr if sequence is broken.
+    const std::vector<callback_data> * completed = nullptr;
+    KeyAndModifiers last_key{};
+    /// \brief Held back key presses of the broken sequence.
+    KeyEvent held_keys[MAX_KEY_SEQUENCE_LENGTH] = {};
+    size_t held_keys_count = 0;
+  };
+
+  /// \brief Take out pending key sequence, if any, completing it if pending node ends one of
+  /// the sequences or breaking it otherwise.
+  /// \details Should be called with key_sequence_mutex_ locked.
+  /// \param can_complete false if pending sequence shouldn't be completed, e.g. because key
+  /// sequences were modified since it started.
+  key_sequence_reset reset_pending_key_sequence(bool can_complete);
+
+  /// \brief Call callbacks of the completed sequence or dispatch held back key presses.
+  /// \details Should be called without key_sequence_mutex_ locked.
+  void finish_key_sequence_reset(const key_sequence_reset & reset);
+
+  /// \brief Number of registered key sequences in the current snapshot.
+  std::atomic<size_t> key_sequences_count_{0};
+  std::atomic<int64_t> key_sequence_timeout_ns_{
+    std::chrono::nanoseconds(std::chrono::seconds(1)).count()};
+  /// \brief Pending key sequence. Mutex is uncontended unless key presses are dispatched from
+  /// several threads, e.g. during journal replay.
+  std::mutex key_sequence_mutex_;
+  /// \brief Trie which pending node belongs to, nullptr if no key sequence is pending.
+  std::shared_ptr<const key_sequence_trie> pending_key_sequence_trie_;
+  const key_sequence_trie::node * pending_key_sequence_node_ = nullptr;
+  /// \brief The last key press of the pending key sequence.
+  KeyAndModifiers pending_key_sequence_last_key_{};
+  std::chrono::steady_clock::time_point pending_key_sequence_deadline_;
+  /// \brief Swallowed key presses of the pending key sequence.
+  KeyEvent held_key_presses_[MAX_KEY_SEQUENCE_LENGTH] = {};
+  size_t held_key_presses_count_ = 0;
+
+  /// \brief Histograms backing LatencyStats.
+  struct latency_histograms
+  {
+    LatencyHistogram parse;
+    LatencyHistogram callbacks_start;
+    LatencyHistogram callbacks_end;
+    LatencyHistogram callbacks_duration;
+  };
+
+  /// \brief Allocated only if latency statistics are enabled, keeps class layout independent
+  /// from the build option.
+  std::unique_ptr<latency_histograms> latency_histograms_;
+
+  /// \brief Get index of the slot in callbacks_table for key press combination.
+  /// \return Slot index or CALLBACKS_SLOTS_COUNT if key code or key modifiers out of range.
+  static size_t get_callbacks_slot(KeyCode key_code, KeyModifiers key_modifiers);
 };
 
 enum class KeyboardHandlerBase::KeyCode: uint32_t
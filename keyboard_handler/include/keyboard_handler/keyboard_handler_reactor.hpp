@@ -0,0 +1,152 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__KEYBOARD_HANDLER_REACTOR_HPP_
+#define KEYBOARD_HANDLER__KEYBOARD_HANDLER_REACTOR_HPP_
+
+#ifndef _WIN32
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "keyboard_handler/visibility_control.hpp"
+
+class KeyboardHandlerUnixImpl;
+
+/// \brief Input thread shared by several keyboard handlers.
+/// \details By default each keyboard handler reads its terminal in its own input thread. Keyboard
+/// handlers constructed with the reactor register their terminals in the epoll instance of the
+/// reactor instead, so any number of terminals is served by one thread which sleeps while none of
+/// the terminals has input. Parsing and escape sequence timeouts are the same as in the own input
+/// thread.
+/// Callbacks of the keyboard handlers without dispatch queue are called from the reactor thread,
+/// so slow callback of one keyboard handler delays input of the others. Callbacks are called
+/// without the reactor lock held, so other keyboard handlers could be attached or destroyed
+/// meanwhile, including from the callbacks. Destruction of the keyboard handler waits only for
+/// the call of its own callbacks to finish.
+/// Keyboard handlers keep reference to the reactor, so reactor thread stops only after the last
+/// of them is destroyed.
+/// \note Reactor uses epoll and is available only on Linux, on other platforms constructor
+/// throws.
+class KeyboardHandlerReactor
+{
+public:
+  /// \brief Start reactor thread.
+  /// \throw std::runtime_error if epoll instance can't be created.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerReactor();
+
+  /// \brief Stop reactor thread.
+  KEYBOARD_HANDLER_PUBLIC
+  ~KeyboardHandlerReactor();
+
+  KeyboardHandlerReactor(const KeyboardHandlerReactor &) = delete;
+  KeyboardHandlerReactor & operator=(const KeyboardHandlerReactor &) = delete;
+
+  /// \brief Get process wide reactor, create it if there is none.
+  /// \details Reactor is shared by all callers and destroyed once the last reference to it is
+  /// released, next call creates a new one.
+  /// \throw std::runtime_error if reactor can't be created.
+  KEYBOARD_HANDLER_PUBLIC
+  static std::shared_ptr<KeyboardHandlerReactor> get_shared_instance();
+
+  /// \brief Number of keyboard handlers whose input is currently read by the reactor.
+  /// \details Keyboard handler is detached when its input ends or when it is destroyed.
+  KEYBOARD_HANDLER_PUBLIC
+  size_t get_attached_count() const;
+
+  /// \brief Id of the reactor thread, which is also the thread calling callbacks of the attached
+  /// keyboard handlers without dispatch queue.
+  KEYBOARD_HANDLER_PUBLIC
+  std::thread::id get_thread_id() const;
+
+private:
+  friend class KeyboardHandlerUnixImpl;
+
+  /// \brief Start reading input of the keyboard handler in the reactor thread.
+  /// \throw std::runtime_error if descriptor can't be added to the epoll instance, e.g. it is not
+  /// pollable or already read by the reactor.
+  void attach(KeyboardHandlerUnixImpl * keyboard_handler, int fd);
+
+  /// \brief Stop reading input of the keyboard handler. Once returned reactor thread doesn't use
+  /// keyboard handler anymore.
+  /// \return false if keyboard handler was already detached by the reactor because its input
+  /// ended.
+  bool detach(KeyboardHandlerUnixImpl * keyboard_handler);
+
+  struct attached_handler
+  {
+    KeyboardHandlerUnixImpl * keyboard_handler;
+    int fd;
+    /// \brief Time to call KeyboardHandlerUnixImpl::handle_input_timeout() if no input arrives.
+    std::chrono::steady_clock::time_point deadline;
+    /// \brief true while reactor thread calls the keyboard handler without mutex_ held, detach()
+    /// waits till it's reset.
+    bool in_flight = false;
+    /// \brief true if keyboard handler was detached from its own callback, entry is removed by
+    /// reactor thread once the call returns.
+    bool detached = false;
+  };
+
+  /// \brief Call function of the keyboard handler, catching exceptions the same way as input
+  /// thread of the keyboard handler does.
+  /// \return Value returned by function, false if it has thrown.
+  template<typename Function>
+  static bool call_handler(KeyboardHandlerUnixImpl & keyboard_handler, Function && function);
+
+  /// \brief Call function of the attached keyboard handler with mutex_ unlocked for the time of
+  /// the call. Keyboard handler is added to finished_handlers_ if function returns false.
+  /// \param lk Lock of mutex_, locked on entry and on return.
+  template<typename Function>
+  void call_attached_handler(
+    std::unique_lock<std::mutex> & lk, uint64_t registration_id, attached_handler & attached,
+    Function && function);
+
+  void reactor_thread_loop();
+  /// \brief Remove keyboard handlers collected in finished_handlers_ and finish their input.
+  /// \param lk Lock of mutex_, unlocked while input of the keyboard handler is finished.
+  void detach_finished_handlers(std::unique_lock<std::mutex> & lk);
+  void wake_up() noexcept;
+
+  /// \brief Value of epoll_event::data for the wake up descriptor, attached keyboard handlers
+  /// are identified by the registration number starting from 1.
+  static constexpr uint64_t WAKE_UP_ID = 0;
+
+  int epoll_fd_ = -1;
+  int wake_up_fd_ = -1;
+  /// \brief Attached keyboard handlers by registration number. Registration number is used
+  /// instead of pointer or descriptor in epoll events, so events which arrive for already
+  /// detached keyboard handler are ignored.
+  std::unordered_map<uint64_t, attached_handler> attached_handlers_;
+  uint64_t last_registration_id_ = WAKE_UP_ID;
+  std::vector<uint64_t> finished_handlers_;
+  /// \brief Guards attached_handlers_ and finished_handlers_. Released by the reactor thread
+  /// while it waits in epoll_wait() and while it calls keyboard handlers.
+  mutable std::mutex mutex_;
+  /// \brief Notified when reactor thread finishes the call of the keyboard handler.
+  std::condition_variable in_flight_cv_;
+  std::atomic_bool exit_{false};
+  std::thread reactor_thread_;
+  std::exception_ptr thread_exception_ptr_{nullptr};
+};
+
+#endif  // #ifndef _WIN32
+#endif  // KEYBOARD_HANDLER__KEYBOARD_HANDLER_REACTOR_HPP_
@@ -16,22 +16,39 @@
 #define KEYBOARD_HANDLER__KEYBOARD_HANDLER_UNIX_IMPL_HPP_
 
 #ifndef _WIN32
+#include <poll.h>
 #include <termios.h>
+#include <unistd.h>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <tuple>
+#include <vector>
 #include <stdexcept>
 #include "keyboard_handler/visibility_control.hpp"
 #include "keyboard_handler_base.hpp"
+#include "keyboard_handler_reactor.hpp"
+#include "key_command_parser.hpp"
+#include "keystroke_journal.hpp"
+#include "retired_objects.hpp"
+#include "spsc_queue.hpp"
+#include "terminal_sequence_tokenizer.hpp"
+#include "terminal_sequence_trie.hpp"
+#include "terminfo_key_map.hpp"
 
 /// \brief Unix (Posix) specific implementation of keyboard handler class.
+/// \details Modifiers of the cursor, editing and function keys, including several modifiers
+/// at once, are decoded from xterm CSI sequences, see CsiModifiersDecoder.
 /// \note Design and implementation limitations:
+/// Terminals send the same bytes for some key combinations unless progressive keyboard protocol
+/// is enabled, see enable_kitty_keyboard_protocol(). Without it:
 /// Can't correctly detect CTRL + 0..9 number keys.
-/// Can't correctly detect CTRL, ALT, SHIFT modifiers with F1..F12 and other control keys.
-/// Instead of CTRL + SHIFT + key will be detected only CTRL + key.
-/// Some keys might be incorrectly detected with multiple key modifiers pressed at the same time.
+/// Instead of CTRL + SHIFT + letter key will be detected only CTRL + letter key.
 class KeyboardHandlerUnixImpl : public KeyboardHandlerBase
 {
 public:
@@ -39,6 +56,7 @@ public:
   using tcgetattrFunction = std::function<int (int, struct termios *)>;
   using tcsetattrFunction = std::function<int (int, int, const struct termios *)>;
   using readFunction = std::function<ssize_t(int, void *, size_t)>;
+  using pollFunction = std::function<int (struct pollfd *, nfds_t, int)>;
   using signal_handler_type = void (*)(int);
 
   /// \brief Default constructor
@@ -49,15 +67,324 @@ public:
   /// \param install_signal_handler if true signal handler for SIGINT will be installed,
   /// otherwise not.
   /// \note In case if install_signal_handler is false caller code should call static
-  /// KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin() in case of process termination
-  /// caused by signal arrival.
+  /// KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin() or
+  /// KeyboardHandlerUnixImpl::restore_buffer_mode_for_all_terminals() in case of process
+  /// termination caused by signal arrival.
   KEYBOARD_HANDLER_PUBLIC
   explicit KeyboardHandlerUnixImpl(bool install_signal_handler);
 
+  /// \brief Constructor with option to call callbacks from the separate dispatcher thread.
+  /// \details When dispatch_queue_capacity is greater than 0, input thread only reads and parses
+  /// key presses and pushes them to the lock-free queue of the specified capacity. Callbacks are
+  /// called from the dedicated dispatcher thread, so slow callbacks don't prevent terminal input
+  /// from being drained. Key presses which don't fit into the full queue are dropped.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the input thread.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(bool install_signal_handler, size_t dispatch_queue_capacity);
+
+  /// \brief Constructor which reads key presses from the terminal device instead of stdin.
+  /// \details Device is opened for reading and closed in destructor. Useful when keyboard
+  /// handler should be controlled from the dedicated terminal, e.g. `/dev/pts/N`, while stdin and
+  /// stdout are busy with other traffic.
+  /// \param device_path Path to the terminal device.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the input thread.
+  /// \throw std::runtime_error if device can't be opened.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    const std::string & device_path, bool install_signal_handler,
+    size_t dispatch_queue_capacity = 0);
+
+  /// \brief Overload which prevents implicit conversion of the string literal to bool.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    const char * device_path, bool install_signal_handler, size_t dispatch_queue_capacity = 0);
+
+  /// \brief Constructor which reads key presses from the already opened terminal descriptor.
+  /// \param input_fd Descriptor of the terminal device. Caller keeps ownership and should keep
+  /// it open during lifetime of the keyboard handler.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the input thread.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    int input_fd, bool install_signal_handler, size_t dispatch_queue_capacity = 0);
+
+  /// \brief Constructor which reads key presses from the terminal device in the reactor thread
+  /// shared with other keyboard handlers, instead of the own input thread.
+  /// \details Device is opened for reading and closed in destructor.
+  /// \param device_path Path to the terminal device.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \param reactor Reactor to read the terminal in, e.g.
+  /// KeyboardHandlerReactor::get_shared_instance(). If nullptr the own input thread is started.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the reactor thread.
+  /// \throw std::runtime_error if device can't be opened or added to the reactor.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    const std::string & device_path, bool install_signal_handler,
+    std::shared_ptr<KeyboardHandlerReactor> reactor, size_t dispatch_queue_capacity = 0);
+
+  /// \brief Constructor which reads key presses from the already opened terminal descriptor in
+  /// the reactor thread shared with other keyboard handlers, instead of the own input thread.
+  /// \param input_fd Descriptor of the terminal device. Caller keeps ownership and should keep
+  /// it open during lifetime of the keyboard handler.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \param reactor Reactor to read the terminal in, e.g.
+  /// KeyboardHandlerReactor::get_shared_instance(). If nullptr the own input thread is started.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the reactor thread.
+  /// \throw std::runtime_error if descriptor can't be added to the reactor.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    int input_fd, bool install_signal_handler, std::shared_ptr<KeyboardHandlerReactor> reactor,
+    size_t dispatch_queue_capacity = 0);
+
+  /// \brief Format of the key presses in the command stream.
+  enum class CommandStreamFormat
+  {
+    /// \brief Bytes as they would be returned by terminal, e.g. `\x1b[A` for cursor up.
+    RAW,
+    /// \brief Whitespace separated commands like `a CTRL+a SHIFT+F1 CURSOR_UP`, see
+    /// KeyCommandParser.
+    TEXT
+  };
+
+  /// \brief Constructor which reads key presses from the pipe, FIFO or regular file.
+  /// \details Input is not required to be a terminal and its settings are not changed. Key
+  /// presses are dispatched as fast as they arrive, through the same dispatch path as terminal
+  /// input. Input thread stops at the end of the stream. Signal handler is not installed.
+  /// \param input_fd Descriptor to read commands from. Caller keeps ownership and should keep it
+  /// open during lifetime of the keyboard handler.
+  /// \param format Format of the key presses in the stream.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the input thread.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    int input_fd, CommandStreamFormat format, size_t dispatch_queue_capacity = 0);
+
+  /// \brief Constructor which opens the FIFO or regular file and reads key presses from it.
+  /// \details Opening FIFO doesn't wait for the writer.
+  /// \param path Path to the FIFO or regular file.
+  /// \param format Format of the key presses in the stream.
+  /// \param dispatch_queue_capacity Maximum number of key presses waiting for dispatching. If 0
+  /// callbacks will be called directly from the input thread.
+  /// \throw std::runtime_error if file can't be opened.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    const std::string & path, CommandStreamFormat format, size_t dispatch_queue_capacity = 0);
+
+  /// \brief Type of the tag which selects constructors of keyboard handler without input thread.
+  struct ExternalEventLoop
+  {
+    explicit ExternalEventLoop() = default;
+  };
+
+  /// \brief Tag which selects constructors of keyboard handler without input thread.
+  static constexpr ExternalEventLoop EXTERNAL_EVENT_LOOP{};
+
+  /// \brief Constructor for use within the event loop of the caller, e.g. rclcpp executor or
+  /// epoll loop, without own input thread.
+  /// \details Event loop should wait until get_input_fd() becomes readable or timeout returned by
+  /// process_ready() expires and call process_ready(), which reads, parses and dispatches key
+  /// presses inline. Callbacks are called from the thread calling process_ready().
+  /// \param input_fd Descriptor of the terminal device. Caller keeps ownership and should keep
+  /// it open during lifetime of the keyboard handler.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    ExternalEventLoop, int input_fd = STDIN_FILENO, bool install_signal_handler = false);
+
+  /// \brief Constructor which opens the terminal device for use within the event loop of the
+  /// caller, without own input thread.
+  /// \details Device is opened for reading and closed in destructor. See the constructor with
+  /// descriptor.
+  /// \param device_path Path to the terminal device.
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed,
+  /// otherwise not.
+  /// \throw std::runtime_error if device can't be opened.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    ExternalEventLoop, const std::string & device_path, bool install_signal_handler = false);
+
   /// \brief destructor
   KEYBOARD_HANDLER_PUBLIC
   virtual ~KeyboardHandlerUnixImpl();
 
+  /// \brief Statistics of the queue between input and dispatcher threads.
+  struct DispatchQueueStats
+  {
+    /// \brief Maximum number of key presses in the queue, 0 if queue is not used.
+    size_t capacity = 0;
+    /// \brief Number of key presses currently waiting for dispatching.
+    size_t depth = 0;
+    /// \brief Maximum depth of the queue observed since construction.
+    size_t high_water_mark = 0;
+    /// \brief Number of key presses dropped because queue was full.
+    size_t dropped_events = 0;
+  };
+
+  /// \brief Get statistics of the queue between input and dispatcher threads.
+  KEYBOARD_HANDLER_PUBLIC
+  DispatchQueueStats get_dispatch_queue_stats() const;
+
+  /// \brief Start queueing key presses for the pull API, see try_pop_event() and wait_event().
+  /// \details Every key press read from the input, including autorepeats and releases, is
+  /// pushed by the input thread to the bounded lock-free queue, in addition to calling the
+  /// callbacks registered for it. Key presses which don't fit into the full queue are dropped and
+  /// counted in EventQueueStats::overflow_count.
+  /// \param capacity Maximum number of key presses waiting to be taken from the queue.
+  /// \throw std::invalid_argument if capacity is 0.
+  /// \throw std::logic_error if event queue is already enabled.
+  KEYBOARD_HANDLER_PUBLIC
+  void enable_event_queue(size_t capacity = 1024);
+
+  /// \brief Take the oldest key press from the event queue without waiting.
+  /// \details Wait-free, doesn't allocate memory. Should be called from one thread at a time.
+  /// \param event Receives key code, modifiers, time when key press was read out and event type.
+  /// \return false if queue is empty.
+  /// \throw std::logic_error if event queue is not enabled.
+  KEYBOARD_HANDLER_PUBLIC
+  bool try_pop_event(KeyEvent & event);
+
+  /// \brief Take the oldest key press from the event queue, waiting for it if queue is empty.
+  /// \details Should be called from one thread at a time, the same as try_pop_event().
+  /// \param event Receives key code, modifiers, time when key press was read out and event type.
+  /// \param timeout Maximum time to wait.
+  /// \return false if no key press arrived during timeout.
+  /// \throw std::logic_error if event queue is not enabled.
+  KEYBOARD_HANDLER_PUBLIC
+  bool wait_event(KeyEvent & event, std::chrono::nanoseconds timeout);
+
+  /// \brief Statistics of the event queue of the pull API.
+  struct EventQueueStats
+  {
+    /// \brief Maximum number of key presses in the queue, 0 if queue is not enabled.
+    size_t capacity = 0;
+    /// \brief Number of key presses currently waiting to be taken.
+    size_t depth = 0;
+    /// \brief Number of key presses dropped because queue was full.
+    size_t overflow_count = 0;
+  };
+
+  /// \brief Get statistics of the event queue of the pull API.
+  KEYBOARD_HANDLER_PUBLIC
+  EventQueueStats get_event_queue_stats() const;
+
+  /// \brief Get descriptor which event loop of the caller should wait to become readable before
+  /// calling process_ready().
+  /// \return Descriptor of the input, -1 if keyboard handler wasn't constructed for the external
+  /// event loop, keyboard handling is disabled or input ended.
+  KEYBOARD_HANDLER_PUBLIC
+  int get_input_fd() const;
+
+  /// \brief Read all available input without blocking, parse it and call callbacks from the
+  /// calling thread.
+  /// \details Should be called when descriptor returned by get_input_fd() becomes readable or
+  /// timeout returned by the previous call expires, whichever happens first. Timeout is used to
+  /// deliver ESC key press, which can't be told apart from the beginning of the escape sequence
+  /// until next bytes arrive, and to notify about hold ends and deferred callbacks. Should be
+  /// called from one thread at a time. When input ends terminal settings are restored and
+  /// get_input_fd() returns -1.
+  /// \return Timeout in milliseconds after which process_ready() should be called even if
+  /// descriptor doesn't become readable, -1 to wait for the input without timeout.
+  /// \throw std::runtime_error if reading input failed. Exceptions thrown by callbacks are
+  /// propagated to the caller.
+  /// \throw std::logic_error if keyboard handler wasn't constructed for the external event loop.
+  KEYBOARD_HANDLER_PUBLIC
+  int process_ready();
+
+  /// \brief Start recording of all parsed key presses to the binary keystroke journal.
+  /// \details Records are written by the separate writer thread, input thread only pushes them
+  /// to the lock-free queue. Key presses which don't fit into the full queue are not recorded.
+  /// \param journal_path Path to the journal file, existing file will be truncated.
+  /// \param queue_capacity Maximum number of records waiting to be written to the file.
+  /// \throw std::runtime_error if journal file can't be created.
+  /// \throw std::logic_error if recording is already started.
+  KEYBOARD_HANDLER_PUBLIC
+  void start_recording(const std::string & journal_path, size_t queue_capacity = 4096);
+
+  /// \brief Stop recording, write all queued records and close the journal.
+  /// \details Key presses parsed concurrently with the call might be not recorded.
+  KEYBOARD_HANDLER_PUBLIC
+  void stop_recording();
+
+  /// \brief Replay speed for replay_journal() which doesn't wait between key presses.
+  static constexpr double REPLAY_AS_FAST_AS_POSSIBLE = 0.0;
+
+  /// \brief Dispatch key presses recorded in the journal.
+  /// \details Journal is mapped to memory. Key presses are dispatched from the calling thread,
+  /// directly to the callbacks and bypassing the dispatcher thread, preserving recorded
+  /// intervals between them scaled by speed. Blocks until all records are replayed.
+  /// \param journal_path Path to the journal file written by start_recording().
+  /// \param speed 1.0 to replay in real time, N to replay N times faster,
+  /// REPLAY_AS_FAST_AS_POSSIBLE to replay without delays.
+  /// \return Number of replayed key presses.
+  /// \throw std::runtime_error if journal can't be read.
+  KEYBOARD_HANDLER_PUBLIC
+  size_t replay_journal(const std::string & journal_path, double speed = 1.0);
+
+  /// \brief Ask terminal to report key events with progressive keyboard protocol, also known as
+  /// kitty keyboard protocol or CSI u.
+  /// \details Should be called right after construction. Terminals which support the protocol,
+  /// e.g. kitty, foot and WezTerm, report presses, autorepeats and releases of all keys
+  /// unambiguously, see add_key_event_callback(). Other terminals ignore the request and keep
+  /// reporting key presses as usual. Protocol is disabled when terminal settings are restored,
+  /// i.e. when the last keyboard handler reading from the terminal is destroyed or in the
+  /// signal handler.
+  /// \param output_fd Descriptor for writing to the same terminal which keyboard handler reads,
+  /// -1 to write to the descriptor keyboard handler reads from. Descriptor is duplicated, so the
+  /// caller could close it at any time.
+  /// \return false if keyboard handler doesn't read from terminal or request failed to write.
+  KEYBOARD_HANDLER_PUBLIC
+  bool enable_kitty_keyboard_protocol(int output_fd = -1);
+
+  /// \brief Check if terminal confirmed that progressive keyboard protocol is supported.
+  /// \details Becomes true once terminal replies to the request sent by
+  /// enable_kitty_keyboard_protocol().
+  KEYBOARD_HANDLER_PUBLIC
+  bool is_kitty_keyboard_protocol_active() const;
+
+  /// \brief Ask terminal to enclose pasted text in markers and pass it to the paste callbacks
+  /// as a whole, see add_paste_callback().
+  /// \details Without bracketed paste mode pasted text is indistinguishable from typing and
+  /// each character of it is dispatched as a separate key press. In bracketed paste mode text
+  /// isn't parsed into key presses at all. Paste callbacks are called from the input thread,
+  /// also when callbacks are called from the dispatcher thread. Bracketed paste mode is
+  /// disabled when terminal settings are restored, the same way as progressive keyboard
+  /// protocol. Pasted text longer than TerminalSequenceTokenizer::MAX_PASTE_SIZE is passed
+  /// truncated.
+  /// \param output_fd Descriptor for writing to the same terminal which keyboard handler reads,
+  /// -1 to write to the descriptor keyboard handler reads from. Descriptor is duplicated, so the
+  /// caller could close it at any time.
+  /// \return false if keyboard handler doesn't read from terminal or request failed to write.
+  KEYBOARD_HANDLER_PUBLIC
+  bool enable_bracketed_paste(int output_fd = -1);
+
+  /// \brief Recognize key sequences from the terminfo entry of the terminal in addition to the
+  /// built-in ones.
+  /// \details Built-in key map contains xterm sequences, many of which are different for
+  /// screen, tmux, rxvt or Linux console. Terminfo sequences take precedence where they conflict
+  /// with built-in ones, keys missing in terminfo are recognized by built-in sequences. Key map
+  /// is built from the compiled terminfo file and cached, see TerminfoKeyMap, so next calls for
+  /// the same terminfo entry only map the cached key map to memory. Key map is switched
+  /// atomically and could be loaded at any time.
+  /// \param term Terminal name, value of the TERM environment variable if empty.
+  /// \param cache_dir Directory for the precompiled key maps,
+  /// TerminfoKeyMap::get_default_cache_dir() if empty.
+  /// \return false if terminfo entry is not found or malformed, current key map stays in use.
+  KEYBOARD_HANDLER_PUBLIC
+  bool load_terminfo_key_map(const std::string & term = "", const std::string & cache_dir = "");
+
   /// \brief Translates specified key press combination to the corresponding registered sequence of
   /// characters returning by terminal in response to the pressing keyboard keys.
   /// \param key_code Value from enum which corresponds to some predefined key press combination.
@@ -69,6 +396,14 @@ public:
   KEYBOARD_HANDLER_PUBLIC
   static bool restore_buffer_mode_for_stdin();
 
+  /// \brief Restore original settings of all terminals switched to non-canonical mode by
+  /// keyboard handlers, including stdin.
+  /// \details Async-signal-safe as long as tcsetattr function is, intended for use from the
+  /// signal handlers.
+  /// \return false if settings of any of the terminals failed to restore.
+  KEYBOARD_HANDLER_PUBLIC
+  static bool restore_buffer_mode_for_all_terminals();
+
   KEYBOARD_HANDLER_PUBLIC
   static signal_handler_type get_old_sigint_handler();
 
@@ -87,12 +422,72 @@ protected:
     const tcsetattrFunction & tcsetattr_fn,
     bool install_signal_handler = true);
 
+  /// \brief Constructor with references to the system functions including poll(). Required for
+  /// unit tests.
+  /// \details Input thread blocks in poll_fn until stdin has data or until destructor wakes it up
+  /// via internal pipe. poll_fn receives two descriptors: stdin first and wake up pipe second.
+  /// \param read_fn Reference to the system read(int, void *, size_t) function
+  /// \param poll_fn Reference to the system poll(struct pollfd *, nfds_t, int) function
+  /// \param isatty_fn Reference to the system isatty(int) function
+  /// \param tcgetattr_fn Reference to the system tcgetattr(int, struct termios *) function
+  /// \param tcsetattr_fn Reference to the system tcsetattr(int, int, const struct termios *)
+  /// function
+  /// \param install_signal_handler if true signal handler for SIGINT will be installed.
+  /// \param dispatch_queue_capacity Capacity of the queue for dispatcher thread, if 0 callbacks
+  /// will be called directly from the input thread.
+  /// \param input_fd Descriptor to read key presses from.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    const readFunction & read_fn,
+    const pollFunction & poll_fn,
+    const isattyFunction & isatty_fn,
+    const tcgetattrFunction & tcgetattr_fn,
+    const tcsetattrFunction & tcsetattr_fn,
+    bool install_signal_handler = true,
+    size_t dispatch_queue_capacity = 0,
+    int input_fd = STDIN_FILENO);
+
+  /// \brief Constructor for use within the event loop of the caller with references to the
+  /// system functions. Required for unit tests.
+  /// \details process_ready() calls poll_fn with zero timeout and two descriptors: input_fd
+  /// first and -1 second. Signal handler is not installed.
+  /// \param read_fn Reference to the system read(int, void *, size_t) function
+  /// \param poll_fn Reference to the system poll(struct pollfd *, nfds_t, int) function
+  /// \param isatty_fn Reference to the system isatty(int) function
+  /// \param tcgetattr_fn Reference to the system tcgetattr(int, struct termios *) function
+  /// \param tcsetattr_fn Reference to the system tcsetattr(int, int, const struct termios *)
+  /// function
+  /// \param input_fd Descriptor to read key presses from.
+  KEYBOARD_HANDLER_PUBLIC
+  KeyboardHandlerUnixImpl(
+    ExternalEventLoop,
+    const readFunction & read_fn,
+    const pollFunction & poll_fn,
+    const isattyFunction & isatty_fn,
+    const tcgetattrFunction & tcgetattr_fn,
+    const tcsetattrFunction & tcsetattr_fn,
+    int input_fd = STDIN_FILENO);
+
   /// \brief Input parser
-  /// \param buff null terminated buffer read out from std::in after key press
-  /// \param read_bytes length of the buffer in bytes without null terminator
+  /// \param buff buffer with one key sequence read out from std::in after key press
+  /// \param read_bytes length of the key sequence in bytes
   /// \return tuple key code and code modifiers mask
   std::tuple<KeyCode, KeyModifiers> parse_input(const char * buff, ssize_t read_bytes);
 
+  /// \brief Input parser
+  /// \param input view on one key sequence read out from std::in after key press
+  /// \return tuple key code and code modifiers mask
+  /// \note Doesn't allocate memory, safe to use next to the real-time code.
+  std::tuple<KeyCode, KeyModifiers> parse_input(std::string_view input) const;
+
+  /// \brief Input parser which also decodes type of the key event.
+  /// \param input view on one key sequence read out from terminal
+  /// \param event_type receives type of the key event, KeyEventType::PRESS unless terminal
+  /// reports key events with progressive keyboard protocol
+  /// \return tuple key code and code modifiers mask
+  std::tuple<KeyCode, KeyModifiers> parse_input(
+    std::string_view input, KeyEventType & event_type) const;
+
   /// \brief Data type for mapping KeyCode enum value to the expecting sequence of characters
   /// returning by terminal.
   struct KeyMap
@@ -108,19 +503,245 @@ protected:
   /// \brief Length of DEFAULT_STATIC_KEY_MAP  measured in number of elements.
   static const size_t STATIC_KEY_MAP_LENGTH;
 
+  /// \brief Trie built at compile time from DEFAULT_STATIC_KEY_MAP.
+  static const TerminalSequenceTrie DEFAULT_STATIC_KEY_TRIE;
+
+  /// \brief Build lookup trie from the key map.
+  /// \param key_map Pointer to the key map.
+  /// \param length Length of the key map measured in number of elements.
+  /// \return Trie with all sequences from the key map.
+  /// \throw std::length_error if key map doesn't fit into the trie. When evaluated at compile
+  /// time it will cause compilation error.
+  static constexpr TerminalSequenceTrie build_key_trie(const KeyMap * key_map, size_t length)
+  {
+    TerminalSequenceTrie trie;
+    for (size_t i = 0; i < length; i++) {
+      if (!trie.insert(key_map[i].terminal_sequence, key_map[i].inner_code)) {
+        throw std::length_error("Key map doesn't fit into TerminalSequenceTrie");
+      }
+    }
+    return trie;
+  }
+
 private:
+  friend class KeyboardHandlerReactor;
+
+  /// \brief Common part of the constructors, switches input_fd_ to non-canonical mode and
+  /// starts threads or attaches to the reactor.
+  void init(
+    const readFunction & read_fn,
+    const pollFunction & poll_fn,
+    const isattyFunction & isatty_fn,
+    const tcgetattrFunction & tcgetattr_fn,
+    const tcsetattrFunction & tcsetattr_fn,
+    bool install_signal_handler,
+    size_t dispatch_queue_capacity);
+
   static void on_signal(int signal_number);
+  /// \brief Install on_signal() as SIGINT handler, unless already installed by another
+  /// keyboard handler.
+  /// \return false if signal handler can't be installed.
+  static bool install_sigint_handler();
+  /// \brief Restore SIGINT handler saved by install_sigint_handler() when the last keyboard
+  /// handler which installed it is destroyed.
+  static void uninstall_sigint_handler();
+  /// \brief Add descriptor to the ones written by on_signal() to wake up thread blocked in
+  /// poll() or epoll_wait().
+  /// \details Descriptor should accept 8 bytes writes, i.e. be a pipe or an eventfd.
+  /// \return false if there are too many registered descriptors.
+  static bool register_signal_wake_up_fd(int fd);
+  /// \brief Remove descriptor added by register_signal_wake_up_fd(), if any.
+  static void unregister_signal_wake_up_fd(int fd);
+
+  /// \brief Check if input should stop, because keyboard handler is being destroyed or SIGINT
+  /// was handled.
+  bool is_exit_requested() const;
+  /// \brief Prepare to wait for the input: dispatch key presses coalesced from the previous
+  /// read and determine how long to wait.
+  /// \return Timeout in milliseconds, -1 to wait until input arrives.
+  int prepare_to_wait_for_input();
+  /// \brief Read and handle input after waiting.
+  /// \param revents Events reported for the input descriptor by poll().
+  /// \param buffer Buffer to read input to.
+  /// \param buffer_size Size of the buffer in bytes.
+  /// \return false if input ended and nothing will be read anymore.
+  bool handle_input_events(short revents, char * buffer, size_t buffer_size);
+  /// \brief Handle expiration of the timeout returned by prepare_to_wait_for_input().
+  void handle_input_timeout();
+  /// \brief Dispatch remaining key presses and restore terminal settings once input stopped.
+  void finish_input() noexcept;
+  void handle_terminal_sequence(const char * sequence, size_t length);
+  void handle_paste(const char * text, size_t length);
+  void handle_key_press(
+    KeyCode pressed_key_code, KeyModifiers key_modifiers, std::string_view raw,
+    KeyEventType event_type = KeyEventType::PRESS);
+  /// \brief Dispatch key presses coalesced by the input thread, if any.
+  void dispatch_pending_key_presses();
+  void push_to_dispatch_queue(const KeyEvent & event);
+  void push_to_event_queue(SpscQueue<KeyEvent> & event_queue, const KeyEvent & event);
+  /// \brief Get event queue of the pull API.
+  /// \throw std::logic_error if event queue is not enabled.
+  SpscQueue<KeyEvent> & get_event_queue() const;
+  void dispatcher_thread_loop();
+  void stop_dispatcher_thread() noexcept;
+  void wake_up_input_thread() noexcept;
+  void close_wake_up_pipe() noexcept;
+
+  /// \brief Terminal settings saved before switching terminal to non-canonical mode.
+  /// \details Entry is active while fd is not -1. Several keyboard handlers reading from the
+  /// same descriptor share one entry, so the original settings are saved by the first one and
+  /// restored by the last one.
+  struct saved_terminal_settings
+  {
+    std::atomic_int fd{-1};
+    /// \brief Function used to change settings of the terminal, called to restore them.
+    tcsetattrFunction tcsetattr_fn;
+    /// \brief Own duplicate of the descriptor to write KittyKeyboardDecoder::DISABLE_SEQUENCE to
+    /// when settings are restored, -1 if progressive keyboard protocol wasn't enabled.
+    std::atomic_int keyboard_protocol_fd{-1};
+    /// \brief Own duplicate of the descriptor to write the bracketed paste mode reset to when
+    /// settings are restored, -1 if bracketed paste mode wasn't enabled.
+    std::atomic_int bracketed_paste_fd{-1};
+    struct termios settings;
+    size_t users_count = 0;
+  };
+
+  /// \brief Maximum number of terminals which could be used by keyboard handlers at once.
+  static constexpr size_t MAX_SAVED_TERMINALS = 32;
+
+  /// \brief Save settings of the terminal, unless already saved by another keyboard handler.
+  /// \return Index of the entry in saved_terminals_.
+  /// \throw std::runtime_error if tcgetattr_fn failed or too many terminals are in use.
+  static size_t save_terminal_settings(
+    int fd, const tcgetattrFunction & tcgetattr_fn, const tcsetattrFunction & tcsetattr_fn);
 
-  static struct termios old_term_settings_;
-  static tcsetattrFunction tcsetattr_fn_;
+  /// \brief Release entry of the saved settings and restore terminal if it was the last user.
+  /// \return false if terminal settings failed to restore.
+  static bool release_terminal_settings(size_t index);
+
+  /// \brief Write the sequence which enables terminal mode, unless the mode was already enabled
+  /// by another keyboard handler reading from the same terminal.
+  /// \param mode_fd Member of saved_terminal_settings where duplicate of output_fd is stored for
+  /// disabling the mode.
+  /// \param output_fd Descriptor to write the sequence to, -1 for input_fd_.
+  /// \return false if keyboard handler doesn't read from terminal or sequence failed to write.
+  bool enable_terminal_mode(
+    std::atomic_int saved_terminal_settings::* mode_fd, int output_fd, std::string_view sequence);
+
+  /// \brief Disable terminal modes enabled by enable_terminal_mode(), if any, and close their
+  /// descriptors.
+  /// \details Async-signal-safe.
+  static void disable_terminal_modes(saved_terminal_settings & saved_terminal);
+
+  static saved_terminal_settings saved_terminals_[MAX_SAVED_TERMINALS];
+  /// \brief Serializes saving and releasing of the terminal settings, never taken in signal
+  /// handler.
+  static std::mutex saved_terminals_mutex_;
   static signal_handler_type old_sigint_handler_;
+  /// \brief Number of keyboard handlers which installed SIGINT handler, guarded by
+  /// saved_terminals_mutex_.
+  static size_t sigint_handler_users_count_;
   bool install_signal_handler_ = false;
 
   std::thread key_handler_thread_;
-  static std::atomic_bool exit_;
-  const int stdin_fd_;
-  std::unordered_map<std::string, KeyCode> key_codes_map_;
+  /// \brief Set by destructor to stop the own input thread.
+  std::atomic_bool exit_{false};
+  /// \brief Number of SIGINT signals handled by on_signal(). Input of all keyboard handlers
+  /// initialized before the signal stops once it changes.
+  static std::atomic_size_t signal_count_;
+  /// \brief Value of signal_count_ when keyboard handler was initialized.
+  size_t init_signal_count_ = 0;
+  /// \brief Maximum number of descriptors woken up by on_signal() at once.
+  static constexpr size_t MAX_SIGNAL_WAKE_UP_FDS = 64;
+  /// \brief Wake up descriptor of the own input thread or reactor, written by on_signal().
+  /// \details Entry is free while fd is -1. Entries are changed under saved_terminals_mutex_.
+  struct signal_wake_up_entry
+  {
+    std::atomic_int fd{-1};
+  };
+  static signal_wake_up_entry signal_wake_up_fds_[MAX_SIGNAL_WAKE_UP_FDS];
+  const int input_fd_;
+  /// \brief true if input_fd_ was opened by keyboard handler and should be closed by it.
+  bool owns_input_fd_ = false;
+  /// \brief Reactor which reads input_fd_, nullptr if keyboard handler has the own input thread.
+  std::shared_ptr<KeyboardHandlerReactor> reactor_;
+  readFunction read_fn_;
+  /// \brief Used by process_ready(), the own input thread keeps its copy.
+  pollFunction poll_fn_;
+  /// \brief Index of the entry in saved_terminals_, MAX_SAVED_TERMINALS if terminal settings
+  /// weren't changed or already restored.
+  size_t saved_terminal_index_ = MAX_SAVED_TERMINALS;
+  /// \brief true if input is a command stream rather than terminal.
+  const bool command_stream_ = false;
+  const CommandStreamFormat command_stream_format_ = CommandStreamFormat::RAW;
+  /// \brief true if input is read by process_ready() called from the event loop of the caller.
+  const bool external_event_loop_ = false;
+  /// \brief true once input of the external event loop ended and finish_input() was called.
+  bool external_input_finished_ = false;
+  /// \brief Time when process_ready() should handle timeout if no input arrives.
+  std::chrono::steady_clock::time_point input_deadline_ =
+    std::chrono::steady_clock::time_point::max();
+  int wake_up_read_fd_ = -1;
+  int wake_up_write_fd_ = -1;
+  /// \brief Time to wait for the rest of incomplete sequence, e.g. after ESC.
+  static constexpr int ESCAPE_SEQUENCE_TIMEOUT_MS = 50;
+  /// \brief Size of the buffer for one read, large enough to drain command stream in few reads.
+  static constexpr size_t INPUT_BUFFER_SIZE = 4096;
+  TerminalSequenceTokenizer tokenizer_;
+  KeyCommandParser command_parser_;
+  /// \brief Time when the last read() returned, taken only if it's needed for the dispatch
+  /// queue, autorepeat coalescing or latency statistics.
+  std::chrono::steady_clock::time_point read_time_;
+  /// \brief true if consecutive key presses of the same combination read out at once should be
+  /// coalesced by the input thread, updated before each read.
+  bool coalesce_key_presses_ = false;
+  std::atomic_bool kitty_keyboard_protocol_active_{false};
+  /// \brief true if input thread should recognize pasted text, set by enable_bracketed_paste().
+  std::atomic_bool bracketed_paste_enabled_{false};
+  /// \brief Key press coalesced from the current read, dispatched once the read is handled or
+  /// other key combination is pressed.
+  KeyEvent pending_key_press_;
+  size_t pending_repeat_count_ = 0;
+  /// \brief Trie used for parsing, points either to DEFAULT_STATIC_KEY_TRIE or to the trie of
+  /// terminfo_key_map_.
+  std::atomic<const TerminalSequenceTrie *> key_codes_trie_{&DEFAULT_STATIC_KEY_TRIE};
+  std::unique_ptr<TerminfoKeyMap> terminfo_key_map_;
+  /// \brief Replaced key maps which input thread could still be parsing with.
+  mutable RetiredObjects<TerminfoKeyMap> retired_terminfo_key_maps_;
+  /// \brief Serializes load_terminfo_key_map().
+  std::mutex terminfo_key_maps_mutex_;
   std::exception_ptr thread_exception_ptr{nullptr};
+
+  /// \brief Queue between input and dispatcher threads, nullptr if callbacks are called
+  /// directly from the input thread.
+  std::unique_ptr<SpscQueue<KeyEvent>> dispatch_queue_;
+  std::thread dispatcher_thread_;
+  /// \brief Mutex and condition variable used only to put idle dispatcher thread to sleep.
+  std::mutex dispatcher_mutex_;
+  std::condition_variable dispatcher_cv_;
+  std::atomic_bool dispatcher_sleeping_{false};
+  bool dispatcher_exit_ = false;
+  std::atomic<size_t> dispatch_queue_high_water_mark_{0};
+  std::atomic<size_t> dispatch_queue_dropped_events_{0};
+  std::exception_ptr dispatcher_exception_ptr_{nullptr};
+
+  /// \brief Queue of the pull API, nullptr until enabled. Owned by event_queue_storage_.
+  std::atomic<SpscQueue<KeyEvent> *> event_queue_{nullptr};
+  std::unique_ptr<SpscQueue<KeyEvent>> event_queue_storage_;
+  /// \brief Serializes enable_event_queue(). Mutex and condition variable are also used to put
+  /// thread waiting in wait_event() to sleep.
+  std::mutex event_queue_mutex_;
+  std::condition_variable event_queue_cv_;
+  std::atomic_bool event_queue_waiting_{false};
+  std::atomic<size_t> event_queue_overflow_count_{0};
+
+  /// \brief Journal currently being recorded, nullptr if recording is not started.
+  std::atomic<KeystrokeJournalWriter *> journal_writer_{nullptr};
+  std::unique_ptr<KeystrokeJournalWriter> journal_writer_owner_;
+  /// \brief Stopped journal writers which input thread could still be recording to.
+  RetiredObjects<KeystrokeJournalWriter> retired_journal_writers_;
+  /// \brief Serializes start_recording() and stop_recording().
+  std::mutex journal_mutex_;
 };
 
 #endif  // #ifndef _WIN32
@@ -0,0 +1,177 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef KEYBOARD_HANDLER__KEYSTROKE_JOURNAL_HPP_
+#define KEYBOARD_HANDLER__KEYSTROKE_JOURNAL_HPP_
+
+#ifndef _WIN32
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+#include "keyboard_handler/spsc_queue.hpp"
+#include "keyboard_handler/visibility_control.hpp"
+
+/// \brief Layout of the binary keystroke journal.
+/// \details Journal starts with the 16 bytes header: 8 bytes magic, 4 bytes format version and
+/// 4 reserved bytes. Header is followed by records, each one is 16 bytes record header and raw
+/// bytes of the key press sequence as they were read from the input:
+/// - 8 bytes steady clock timestamp in nanoseconds,
+/// - 4 bytes key code,
+/// - 1 byte key modifiers,
+/// - 1 byte length of the raw bytes,
+/// - 1 byte key event type, 0 for key press,
+/// - 1 reserved byte.
+/// All numbers are in host byte order.
+struct KeystrokeJournalFormat
+{
+  static constexpr char MAGIC[8] = {'K', 'H', 'J', 'O', 'U', 'R', 'N', 'L'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t FILE_HEADER_SIZE = 16;
+  static constexpr size_t RECORD_HEADER_SIZE = 16;
+  /// \brief Longer raw sequences are truncated.
+  static constexpr size_t MAX_RAW_LENGTH = 32;
+};
+
+/// \brief Append-only writer of the binary keystroke journal.
+/// \details record() is wait-free and never touches the file, it only pushes key press to the
+/// lock-free queue. Records are written to the file in big chunks by the dedicated writer
+/// thread, so input thread is never blocked by the file system.
+class KeystrokeJournalWriter
+{
+public:
+  using KeyEvent = KeyboardHandlerBase::KeyEvent;
+
+  /// \brief Create journal file, truncate it if already exists, and start writer thread.
+  /// \param path Path to the journal file.
+  /// \param queue_capacity Maximum number of records waiting to be written to the file.
+  /// \throw std::runtime_error if file can't be created.
+  KEYBOARD_HANDLER_PUBLIC
+  explicit KeystrokeJournalWriter(const std::string & path, size_t queue_capacity = 4096);
+
+  /// \brief Write all queued records and close the file.
+  KEYBOARD_HANDLER_PUBLIC
+  ~KeystrokeJournalWriter();
+
+  KeystrokeJournalWriter(const KeystrokeJournalWriter &) = delete;
+  KeystrokeJournalWriter & operator=(const KeystrokeJournalWriter &) = delete;
+
+  /// \brief Queue key press for writing. Should be called from one thread at a time.
+  /// \param event Parsed key press with the time when it was read out from the input.
+  /// \param raw Raw bytes of the key press sequence, could be empty.
+  /// \return false if queue is full or writer is closed, record is dropped in this case.
+  KEYBOARD_HANDLER_PUBLIC
+  bool record(const KeyEvent & event, std::string_view raw) noexcept;
+
+  /// \brief Write all queued records, close the file and stop writer thread.
+  /// \details Records queued after close() are dropped. Safe to call several times.
+  KEYBOARD_HANDLER_PUBLIC
+  void close() noexcept;
+
+  /// \brief Number of records written to the file.
+  KEYBOARD_HANDLER_PUBLIC
+  size_t get_written_records_count() const;
+
+  /// \brief Number of records dropped because queue was full or writer was closed.
+  KEYBOARD_HANDLER_PUBLIC
+  size_t get_dropped_records_count() const;
+
+private:
+  struct journal_entry
+  {
+    KeyEvent event;
+    uint8_t raw_length;
+    char raw[KeystrokeJournalFormat::MAX_RAW_LENGTH];
+  };
+
+  void writer_thread_loop();
+  void append_to_buffer(const journal_entry & entry);
+  void write_buffer();
+
+  int fd_ = -1;
+  SpscQueue<journal_entry> queue_;
+  std::vector<char> buffer_;
+  std::thread writer_thread_;
+  /// \brief Mutex and condition variable used only to put idle writer thread to sleep.
+  std::mutex writer_mutex_;
+  std::condition_variable writer_cv_;
+  std::atomic_bool writer_sleeping_{false};
+  bool writer_exit_ = false;
+  std::atomic_bool closed_{false};
+  std::atomic<size_t> written_records_{0};
+  std::atomic<size_t> dropped_records_{0};
+  std::exception_ptr writer_exception_ptr_{nullptr};
+};
+
+/// \brief Reader of the binary keystroke journal, maps the whole journal to memory.
+class KeystrokeJournalReader
+{
+public:
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+  using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+  using KeyEventType = KeyboardHandlerBase::KeyEventType;
+
+  /// \brief Record of the journal.
+  struct Record
+  {
+    std::chrono::steady_clock::time_point timestamp;
+    KeyCode key_code;
+    KeyModifiers key_modifiers;
+    KeyEventType event_type;
+    /// \brief Raw bytes of the key press sequence, points to the mapped journal.
+    std::string_view raw;
+  };
+
+  /// \brief Map journal to memory and validate its header.
+  /// \param path Path to the journal file.
+  /// \throw std::runtime_error if file can't be mapped or it is not a keystroke journal.
+  KEYBOARD_HANDLER_PUBLIC
+  explicit KeystrokeJournalReader(const std::string & path);
+
+  KEYBOARD_HANDLER_PUBLIC
+  ~KeystrokeJournalReader();
+
+  KeystrokeJournalReader(const KeystrokeJournalReader &) = delete;
+  KeystrokeJournalReader & operator=(const KeystrokeJournalReader &) = delete;
+
+  /// \brief Read the next record.
+  /// \details Truncated record at the end of the journal, e.g. after crash of the recording
+  /// process, is treated as the end of the journal.
+  /// \param record Record to fill in.
+  /// \return false if there are no more records.
+  KEYBOARD_HANDLER_PUBLIC
+  bool next(Record & record);
+
+  /// \brief Start reading from the first record again.
+  KEYBOARD_HANDLER_PUBLIC
+  void rewind();
+
+private:
+  const char * data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = KeystrokeJournalFormat::FILE_HEADER_SIZE;
+};
+
+#endif  // #ifndef _WIN32
+#endif  // KEYBOARD_HANDLER__KEYSTROKE_JOURNAL_HPP_
@@ -0,0 +1,184 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__KITTY_KEYBOARD_DECODER_HPP_
+#define KEYBOARD_HANDLER__KITTY_KEYBOARD_DECODER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+/// \brief Decoder of the key events reported by terminals with progressive keyboard protocol,
+/// also known as kitty keyboard protocol or CSI u.
+/// See https://sw.kovidgoyal.net/kitty/keyboard-protocol/
+/// \details With the protocol enabled terminal reports every key as
+/// `ESC [ <key>[:<shifted key>] ; <modifiers>[:<event type>] <final>`, where final byte is `u`
+/// for keys identified by unicode code point, `~` or a letter for functional keys. Decoder
+/// translates the event to the sequence which legacy terminal would send for the same key
+/// without modifiers, so it could be looked up in the regular key map, along with modifiers and
+/// event type. Sequence is decoded in one pass without allocations.
+class KittyKeyboardDecoder
+{
+public:
+  using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+  using KeyEventType = KeyboardHandlerBase::KeyEventType;
+
+  /// \brief Disambiguate escape codes, report event types, report alternate keys and report
+  /// all keys as escape codes.
+  static constexpr unsigned PROTOCOL_FLAGS = 1 | 2 | 4 | 8;
+  /// \brief Push PROTOCOL_FLAGS to the terminal's stack of keyboard modes and query current
+  /// flags. Terminals which support the protocol reply with `ESC [ ? <flags> u`.
+  static constexpr char ENABLE_SEQUENCE[] = "\x1b[>15u\x1b[?u";
+  /// \brief Pop keyboard mode pushed by ENABLE_SEQUENCE.
+  static constexpr char DISABLE_SEQUENCE[] = "\x1b[<u";
+
+  /// \brief Maximum length of the legacy sequence for the decoded key.
+  static constexpr size_t MAX_LEGACY_SEQUENCE_LENGTH = 8;
+
+  /// \brief Legacy sequence of the unmodified key, modifiers and event type.
+  struct Result
+  {
+    /// \brief Legacy sequence, empty if key has no legacy representation, e.g. modifier keys.
+    char sequence[MAX_LEGACY_SEQUENCE_LENGTH];
+    size_t length = 0;
+    KeyModifiers key_modifiers = KeyModifiers::NONE;
+    KeyEventType event_type = KeyEventType::PRESS;
+  };
+
+  /// \brief Decode key event.
+  /// \param sequence Pointer to the sequence of characters.
+  /// \param length Length of the sequence in bytes.
+  /// \param result Receives decoded event.
+  /// \return true if sequence is a well formed key event of the protocol.
+  static bool decode(const char * sequence, size_t length, Result & result)
+  {
+    if (length < 4 || sequence[0] != ESC || sequence[1] != '[' || !is_digit(sequence[2])) {
+      return false;
+    }
+    // Up to 3 fields separated by ';' with up to 3 sub-fields separated by ':'. Only key,
+    // shifted key, modifiers and event type are used, associated text is ignored.
+    static constexpr size_t MAX_FIELDS = 3;
+    static constexpr uint32_t MAX_VALUE = 0x10FFFF;
+    uint32_t values[MAX_FIELDS][MAX_FIELDS] = {};
+    bool present[MAX_FIELDS][MAX_FIELDS] = {};
+    size_t key_end = 2;
+    size_t field = 0;
+    size_t sub_field = 0;
+    const size_t final_index = length - 1;
+    for (size_t i = 2; i < final_index; i++) {
+      const char c = sequence[i];
+      if (is_digit(c)) {
+        uint32_t & value = values[field][sub_field];
+        value = value * 10 + static_cast<uint32_t>(c - '0');
+        if (value > MAX_VALUE) {
+          return false;
+        }
+        present[field][sub_field] = true;
+        if (field == 0 && sub_field == 0) {
+          key_end = i + 1;
+        }
+      } else if (c == ':' && sub_field + 1 < MAX_FIELDS) {
+        sub_field++;
+      } else if (c == ';' && field + 1 < MAX_FIELDS) {
+        field++;
+        sub_field = 0;
+      } else {
+        return false;
+      }
+    }
+
+    const uint32_t modifiers = present[1][0] ? values[1][0] : 1;
+    const uint32_t event_type = present[1][1] ? values[1][1] : 1;
+    if (modifiers < 1 || modifiers > 256 || event_type < 1 || event_type > 3) {
+      return false;
+    }
+    // Bits of the modifiers: Shift, Alt, Ctrl, Super, Hyper, Meta, Caps Lock and Num Lock
+    const uint32_t modifiers_mask = modifiers - 1;
+    bool shift = (modifiers_mask & 1) != 0;
+    const bool alt = (modifiers_mask & (2 | 32)) != 0;
+    const bool ctrl = (modifiers_mask & 4) != 0;
+    result.event_type = static_cast<KeyEventType>(event_type - 1);
+    result.length = 0;
+
+    const char final_byte = sequence[final_index];
+    const uint32_t key = values[0][0];
+    if (final_byte == 'u') {
+      uint32_t code_point = key;
+      if (shift && present[0][1] && values[0][1] < 128) {
+        // Report shifted key the same way as legacy terminal, e.g. '!' instead of Shift+'1'.
+        // Shift of letters is restored by the regular parser from the upper case.
+        code_point = values[0][1];
+        shift = false;
+      }
+      if (code_point == '\r') {
+        code_point = '\n';
+      }
+      if (code_point < 128 && (code_point >= 32 || code_point == '\n' || code_point == '\t' ||
+        code_point == ESC))
+      {
+        result.sequence[result.length++] = static_cast<char>(code_point);
+      }
+    } else if (final_byte == '~') {
+      if (key >= 11 && key <= 14) {
+        // F1..F4 in the VT220 form
+        result.sequence[result.length++] = ESC;
+        result.sequence[result.length++] = 'O';
+        result.sequence[result.length++] = static_cast<char>('P' + key - 11);
+      } else if (key_end + 1 <= MAX_LEGACY_SEQUENCE_LENGTH) {
+        for (size_t i = 0; i < key_end; i++) {
+          result.sequence[result.length++] = sequence[i];
+        }
+        result.sequence[result.length++] = '~';
+      }
+    } else if (final_byte >= 'A' && final_byte <= 'Z' && key == 1) {
+      result.sequence[result.length++] = ESC;
+      result.sequence[result.length++] = final_byte >= 'P' && final_byte <= 'S' ? 'O' : '[';
+      result.sequence[result.length++] = final_byte;
+    } else {
+      return false;
+    }
+
+    result.key_modifiers = static_cast<KeyModifiers>(
+      (shift ? static_cast<uint32_t>(KeyModifiers::SHIFT) : 0) |
+      (alt ? static_cast<uint32_t>(KeyModifiers::ALT) : 0) |
+      (ctrl ? static_cast<uint32_t>(KeyModifiers::CTRL) : 0));
+    return true;
+  }
+
+  /// \brief Check if sequence is a reply to the query of the current keyboard mode flags.
+  static bool is_protocol_reply(const char * sequence, size_t length)
+  {
+    if (length < 5 || sequence[0] != ESC || sequence[1] != '[' || sequence[2] != '?' ||
+      sequence[length - 1] != 'u')
+    {
+      return false;
+    }
+    for (size_t i = 3; i < length - 1; i++) {
+      if (!is_digit(sequence[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  static constexpr char ESC = 27;
+
+  static constexpr bool is_digit(char c)
+  {
+    return c >= '0' && c <= '9';
+  }
+};
+
+#endif  // KEYBOARD_HANDLER__KITTY_KEYBOARD_DECODER_HPP_
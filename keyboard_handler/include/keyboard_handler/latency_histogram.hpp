@@ -0,0 +1,158 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__LATENCY_HISTOGRAM_HPP_
+#define KEYBOARD_HANDLER__LATENCY_HISTOGRAM_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/// \brief Lock-free log-linear histogram of durations measured in nanoseconds.
+/// \details Range of values is split into powers of two and each power of two is split into
+/// SUB_BUCKETS_COUNT linear buckets, so width of the bucket is within 1/SUB_BUCKETS_COUNT of
+/// its lower bound. Values below SUB_BUCKETS_COUNT * 2 are counted exactly. record() doesn't
+/// allocate memory and costs a few relaxed atomic increments. Both record() and snapshot() could
+/// be called concurrently from any thread, e.g. by the input thread and by the thread replaying
+/// keystroke journal.
+class LatencyHistogram
+{
+public:
+  static constexpr size_t SUB_BUCKET_BITS = 3;
+  static constexpr size_t SUB_BUCKETS_COUNT = 1 << SUB_BUCKET_BITS;
+  /// \brief Values greater than 2^MAX_VALUE_BITS ns (about 18 minutes) fall into the last bucket.
+  static constexpr size_t MAX_VALUE_BITS = 40;
+  static constexpr size_t BUCKETS_COUNT =
+    (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS_COUNT;
+
+  /// \brief Copy of the histogram state.
+  struct Snapshot
+  {
+    uint64_t count = 0;
+    uint64_t min_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t sum_ns = 0;
+    /// \brief Number of values per bucket, see get_bucket_lower_bound().
+    std::vector<uint64_t> buckets;
+
+    /// \brief Estimate value at the given percentile.
+    /// \param percent Percentile in range [0, 100].
+    /// \return Upper bound of the bucket which contains the percentile, clamped to max_ns. 0 if
+    /// histogram is empty.
+    uint64_t get_percentile(double percent) const
+    {
+      if (count == 0) {
+        return 0;
+      }
+      auto rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(count));
+      rank = rank == 0 ? 1 : (rank > count ? count : rank);
+      uint64_t accumulated = 0;
+      for (size_t i = 0; i < buckets.size(); i++) {
+        accumulated += buckets[i];
+        if (accumulated >= rank) {
+          uint64_t upper_bound = i + 1 < BUCKETS_COUNT ?
+            get_bucket_lower_bound(i + 1) - 1 : max_ns;
+          return upper_bound < max_ns ? upper_bound : max_ns;
+        }
+      }
+      return max_ns;
+    }
+  };
+
+  /// \brief Add duration to the histogram. Negative durations are counted as 0.
+  void record(std::chrono::nanoseconds duration) noexcept
+  {
+    const uint64_t value = duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+    buckets_[get_bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    while (value < min && !min_.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+    }
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+    // Published last, so readers which see the count see the rest of the sample
+    count_.fetch_add(1, std::memory_order_release);
+  }
+
+  /// \brief Take a copy of the histogram state.
+  /// \details Snapshot taken concurrently with record() might be off by the samples which are
+  /// being recorded at the moment.
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    snapshot.count = count_.load(std::memory_order_acquire);
+    if (snapshot.count != 0) {
+      snapshot.min_ns = min_.load(std::memory_order_relaxed);
+      snapshot.max_ns = max_.load(std::memory_order_relaxed);
+    }
+    snapshot.sum_ns = sum_.load(std::memory_order_relaxed);
+    snapshot.buckets.resize(BUCKETS_COUNT);
+    for (size_t i = 0; i < BUCKETS_COUNT; i++) {
+      snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+  /// \brief Get index of the bucket for value.
+  static constexpr size_t get_bucket_index(uint64_t value) noexcept
+  {
+    if (value < SUB_BUCKETS_COUNT) {
+      return static_cast<size_t>(value);
+    }
+    size_t msb = get_most_significant_bit(value);
+    if (msb >= MAX_VALUE_BITS) {
+      return BUCKETS_COUNT - 1;
+    }
+    size_t group = msb - SUB_BUCKET_BITS + 1;
+    size_t sub_bucket = static_cast<size_t>(value >> (msb - SUB_BUCKET_BITS)) &
+      (SUB_BUCKETS_COUNT - 1);
+    return group * SUB_BUCKETS_COUNT + sub_bucket;
+  }
+
+  /// \brief Get the smallest value which falls into the bucket.
+  static constexpr uint64_t get_bucket_lower_bound(size_t index) noexcept
+  {
+    size_t group = index / SUB_BUCKETS_COUNT;
+    uint64_t sub_bucket = index % SUB_BUCKETS_COUNT;
+    if (group == 0) {
+      return sub_bucket;
+    }
+    return (SUB_BUCKETS_COUNT + sub_bucket) << (group - 1);
+  }
+
+private:
+  static constexpr size_t get_most_significant_bit(uint64_t value) noexcept
+  {
+    size_t msb = 0;
+    for (size_t shift = 32; shift > 0; shift >>= 1) {
+      if (value >> shift) {
+        value >>= shift;
+        msb += shift;
+      }
+    }
+    return msb;
+  }
+
+  std::atomic<uint64_t> buckets_[BUCKETS_COUNT] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> min_{std::numeric_limits<uint64_t>::max()};
+  std::atomic<uint64_t> max_{0};
+};
+
+#endif  // KEYBOARD_HANDLER__LATENCY_HISTOGRAM_HPP_
@@ -0,0 +1,149 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__RATE_LIMITER_HPP_
+#define KEYBOARD_HANDLER__RATE_LIMITER_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/// \brief Policy limiting how often key press callback could be called.
+struct RateLimitPolicy
+{
+  enum class Kind : uint8_t
+  {
+    /// \brief Call on the first key press, then ignore key presses until interval has elapsed
+    /// since the last call.
+    LEADING_EDGE,
+    /// \brief Call once when no key press arrived during interval after the last one.
+    TRAILING_EDGE,
+    /// \brief Call if there is a token in the bucket. Bucket holds up to burst tokens and gets
+    /// one token each interval.
+    TOKEN_BUCKET
+  };
+
+  Kind kind = Kind::LEADING_EDGE;
+  std::chrono::nanoseconds interval{0};
+  size_t burst = 1;
+
+  /// \brief Throttle callback to at most one call per interval, the first key press wins.
+  static RateLimitPolicy leading_edge(std::chrono::nanoseconds interval)
+  {
+    return RateLimitPolicy{Kind::LEADING_EDGE, interval, 1};
+  }
+
+  /// \brief Debounce callback, the last key press wins after interval of silence.
+  static RateLimitPolicy trailing_edge(std::chrono::nanoseconds interval)
+  {
+    return RateLimitPolicy{Kind::TRAILING_EDGE, interval, 1};
+  }
+
+  /// \brief Allow at most calls_per_second calls on average, with bursts up to burst calls.
+  /// \details Policy is invalid if calls_per_second is 0.
+  static RateLimitPolicy token_bucket(size_t calls_per_second, size_t burst = 1)
+  {
+    std::chrono::nanoseconds interval{0};
+    if (calls_per_second > 0) {
+      interval = std::chrono::nanoseconds(std::chrono::seconds(1)) / calls_per_second;
+      interval = interval.count() > 0 ? interval : std::chrono::nanoseconds(1);
+    }
+    return RateLimitPolicy{Kind::TOKEN_BUCKET, interval, burst};
+  }
+
+  /// \brief Check if interval is positive and burst is not 0.
+  bool is_valid() const
+  {
+    return interval.count() > 0 && burst > 0;
+  }
+};
+
+/// \brief Enforces RateLimitPolicy using steady clock.
+/// \details Leading edge and token bucket are implemented as generic cell rate algorithm, which
+/// keeps only theoretical arrival time of the next call and doesn't need periodic refill.
+/// Leading edge is a token bucket with one token. All methods are thread-safe.
+class RateLimiter
+{
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  /// \brief Constructor
+  /// \param policy Valid rate limiting policy, see RateLimitPolicy::is_valid().
+  explicit RateLimiter(const RateLimitPolicy & policy)
+  : policy_(policy) {}
+
+  const RateLimitPolicy & get_policy() const
+  {
+    return policy_;
+  }
+
+  /// \brief Handle key press.
+  /// \param now Current time.
+  /// \return true if callback should be called right away. Always false for TRAILING_EDGE,
+  /// call is deferred till take_deferred_call() instead.
+  bool on_key_press(time_point now)
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (policy_.kind == RateLimitPolicy::Kind::TRAILING_EDGE) {
+      deferred_call_time_ = now + policy_.interval;
+      has_deferred_call_ = true;
+      return false;
+    }
+    if (next_call_time_ < now) {
+      next_call_time_ = now;
+    }
+    // Tokens available as long as the next call is not scheduled farther than burst - 1
+    // intervals ahead
+    const auto max_bursts = static_cast<size_t>(
+      std::chrono::nanoseconds::max().count() / policy_.interval.count());
+    const auto burst_tolerance = policy_.burst - 1 < max_bursts ?
+      policy_.interval * static_cast<int64_t>(policy_.burst - 1) :
+      std::chrono::nanoseconds::max();
+    if (next_call_time_ - now > burst_tolerance) {
+      return false;
+    }
+    next_call_time_ += policy_.interval;
+    return true;
+  }
+
+  /// \brief Check if deferred call of the TRAILING_EDGE policy is due.
+  /// \param now Current time.
+  /// \param next_deadline Lowered to time of the deferred call which is not due yet, not modified
+  /// otherwise. Could be shared between several rate limiters to find the earliest deadline.
+  /// \return true if callback should be called now.
+  bool take_deferred_call(time_point now, time_point & next_deadline)
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (!has_deferred_call_) {
+      return false;
+    }
+    if (now < deferred_call_time_) {
+      next_deadline = std::min(next_deadline, deferred_call_time_);
+      return false;
+    }
+    has_deferred_call_ = false;
+    return true;
+  }
+
+private:
+  const RateLimitPolicy policy_;
+  std::mutex mutex_;
+  time_point next_call_time_{};
+  time_point deferred_call_time_{};
+  bool has_deferred_call_ = false;
+};
+
+#endif  // KEYBOARD_HANDLER__RATE_LIMITER_HPP_
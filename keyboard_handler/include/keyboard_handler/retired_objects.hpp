@@ -0,0 +1,121 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__RETIRED_OBJECTS_HPP_
+#define KEYBOARD_HANDLER__RETIRED_OBJECTS_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/// \brief Objects which were published through atomic pointer and replaced, but could still be
+/// used by readers which loaded the pointer before replacement.
+/// \details Readers hold ReaderGuard while they load and use the published pointer. Writer
+/// replaces the published pointer first and then calls retire(), writer never waits for readers.
+/// Retired objects are destroyed as soon as there are no readers, either by retire() itself or
+/// by the last leaving reader. Used for callbacks table snapshots, journal writers and terminfo
+/// key maps. ReaderGuard doesn't allocate memory and takes the mutex only if there are retired
+/// objects.
+/// \tparam T Type of the published objects.
+template<typename T>
+class RetiredObjects
+{
+public:
+  /// \brief Marks reader of the published pointer for its lifetime.
+  class ReaderGuard
+  {
+public:
+    explicit ReaderGuard(RetiredObjects & retired_objects) noexcept
+    : retired_objects_(retired_objects)
+    {
+      // Should be ordered before loading the published pointer, see reclaim()
+      retired_objects_.readers_count_.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    ~ReaderGuard()
+    {
+      // Either the last reader sees retired objects or writer sees that there are no readers
+      if (retired_objects_.readers_count_.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+        retired_objects_.has_retired_objects_.load(std::memory_order_seq_cst))
+      {
+        retired_objects_.reclaim();
+      }
+    }
+
+    ReaderGuard(const ReaderGuard &) = delete;
+    ReaderGuard & operator=(const ReaderGuard &) = delete;
+
+private:
+    RetiredObjects & retired_objects_;
+  };
+
+  RetiredObjects() = default;
+  RetiredObjects(const RetiredObjects &) = delete;
+  RetiredObjects & operator=(const RetiredObjects &) = delete;
+
+  /// \brief Retire object which can't be loaded by new readers anymore.
+  /// \details Doesn't throw, so writer could make its other changes before retiring.
+  /// \param object Object to destroy once there are no readers which could still use it.
+  void retire(std::unique_ptr<T> object) noexcept
+  {
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      try {
+        retired_objects_.push_back(std::move(object));
+      } catch (const std::bad_alloc &) {
+        // Object is leaked rather than destroyed under the readers which could still use it
+        object.release();
+      }
+    }
+    has_retired_objects_.store(true, std::memory_order_seq_cst);
+    reclaim();
+  }
+
+  /// \brief Destroy retired objects if there are no readers.
+  void reclaim() noexcept
+  {
+    std::vector<std::unique_ptr<T>> reclaimed_objects;
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      // Readers increment counter before loading the published pointer. Objects were retired
+      // before the mutex was taken, if there are no readers now, none of them could observe
+      // the retired objects anymore.
+      if (readers_count_.load(std::memory_order_seq_cst) != 0) {
+        return;
+      }
+      reclaimed_objects.swap(retired_objects_);
+      has_retired_objects_.store(false, std::memory_order_relaxed);
+    }
+    // Objects are destroyed outside of the mutex
+  }
+
+  /// \brief Number of retired objects which are not destroyed yet.
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return retired_objects_.size();
+  }
+
+private:
+  std::vector<std::unique_ptr<T>> retired_objects_;
+  mutable std::mutex mutex_;
+  std::atomic_bool has_retired_objects_{false};
+  std::atomic<size_t> readers_count_{0};
+};
+
+#endif  // KEYBOARD_HANDLER__RETIRED_OBJECTS_HPP_
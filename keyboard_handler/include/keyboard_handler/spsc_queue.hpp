@@ -0,0 +1,160 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__SPSC_QUEUE_HPP_
+#define KEYBOARD_HANDLER__SPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/// \brief Bounded single producer single consumer lock-free queue.
+/// \details Both try_push() and try_pop() are wait-free and don't allocate memory. Storage is
+/// allocated once in constructor. Exactly one thread may push and exactly one other thread may
+/// pop at the same time. Producer and consumer indices live on separate cache lines, each side
+/// keeps cached copy of the other side index to avoid touching shared cache line on every call.
+/// \tparam T Type of the elements. Should be nothrow copy assignable.
+template<typename T>
+class SpscQueue
+{
+  static_assert(
+    std::is_nothrow_copy_assignable<T>::value, "SpscQueue element should be nothrow copyable");
+
+public:
+  /// \brief Largest supported capacity, storage size is rounded up to the power of two.
+  static constexpr size_t MAX_CAPACITY = (std::numeric_limits<size_t>::max() >> 1) + 1;
+
+  /// \brief Constructor
+  /// \param capacity Maximum number of elements in the queue.
+  /// \throw std::invalid_argument if capacity is 0 or greater than MAX_CAPACITY.
+  explicit SpscQueue(size_t capacity)
+  : capacity_(capacity)
+  {
+    if (capacity == 0) {
+      throw std::invalid_argument("SpscQueue capacity should be greater than 0");
+    }
+    if (capacity > MAX_CAPACITY) {
+      throw std::invalid_argument("SpscQueue capacity is too big");
+    }
+    size_t buffer_size = 1;
+    while (buffer_size < capacity) {
+      buffer_size <<= 1;
+    }
+    buffer_.resize(buffer_size);
+    mask_ = buffer_size - 1;
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue & operator=(const SpscQueue &) = delete;
+
+  /// \brief Add element to the end of the queue. Should be called only from producer thread.
+  /// \param value Element to add.
+  /// \return true if element was added, false if queue is full.
+  bool try_push(const T & value) noexcept
+  {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == capacity_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == capacity_) {
+        return false;
+      }
+    }
+    buffer_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// \brief Take element from the front of the queue. Should be called only from consumer thread.
+  /// \param value Reference to the variable which will receive element.
+  /// \return true if element was taken, false if queue is empty.
+  bool try_pop(T & value) noexcept
+  {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+    value = buffer_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// \brief Peek at the front element without taking it. Should be called only from consumer
+  /// thread.
+  /// \return Pointer to the front element valid until pop() or try_pop(), nullptr if queue is
+  /// empty.
+  const T * front() noexcept
+  {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return nullptr;
+      }
+    }
+    return &buffer_[head & mask_];
+  }
+
+  /// \brief Drop the front element. Should be called only from consumer thread after front()
+  /// returned non-null pointer.
+  void pop() noexcept
+  {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /// \brief Number of elements in the queue.
+  /// \details Could be called from any thread, value might be outdated by the time it's returned.
+  size_t size() const noexcept
+  {
+    const size_t head = head_.load(std::memory_order_acquire);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    return tail >= head ? tail - head : 0;
+  }
+
+  /// \brief Check if queue is empty. Could be called from any thread.
+  bool empty() const noexcept
+  {
+    return size() == 0;
+  }
+
+  /// \brief Maximum number of elements in the queue.
+  size_t capacity() const noexcept
+  {
+    return capacity_;
+  }
+
+private:
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+
+  const size_t capacity_;
+  size_t mask_ = 0;
+  std::vector<T> buffer_;
+
+  /// \brief Index of the next element to pop, written only by consumer.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_{0};
+  /// \brief Consumer's copy of tail_.
+  size_t cached_tail_ = 0;
+
+  /// \brief Index of the next element to push, written only by producer.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0};
+  /// \brief Producer's copy of head_.
+  size_t cached_head_ = 0;
+};
+
+#endif  // KEYBOARD_HANDLER__SPSC_QUEUE_HPP_
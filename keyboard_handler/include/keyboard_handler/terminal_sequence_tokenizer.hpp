@@ -0,0 +1,308 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TOKENIZER_HPP_
+#define KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TOKENIZER_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/// \brief Incremental tokenizer which splits byte stream read out from terminal to the separate
+/// sequences of characters, one sequence per pressed key combination.
+/// \details Terminal could return several key sequences in one read() call, for instance when
+/// keys pressed faster than input thread is reading them, or when input delivered over laggy
+/// connection. Also one key sequence could be split between two consecutive read() calls.
+/// Tokenizer recognizes boundaries of the following sequences:
+/// - Single ASCII characters and control characters.
+/// - UTF-8 encoded multibyte characters.
+/// - CSI sequences `ESC [ <parameters> <final byte>`, including Linux console `ESC [ [ <char>`.
+/// - SS3 sequences `ESC O <char>`.
+/// - ALT prefixed characters `ESC <char>`.
+///
+/// Complete sequences are passed to the caller without copying, directly from the input buffer.
+/// Incomplete sequence at the end of the input is carried over to the next feed() call in the
+/// small internal buffer. Lone ESC is ambiguous since it could be beginning of the escape
+/// sequence, it will stay pending until next feed() or flush() call.
+///
+/// Optionally tokenizer recognizes text pasted in terminal bracketed paste mode, i.e. enclosed
+/// between PASTE_START and PASTE_END, and passes it as a whole instead of splitting into
+/// sequences. Pasted text which was read out at once is passed without copying, text which
+/// spans several reads is accumulated in the internal buffer up to MAX_PASTE_SIZE bytes.
+class TerminalSequenceTokenizer
+{
+public:
+  /// \brief Maximum length of the sequence which tokenizer could carry over between reads.
+  /// Longer malformed sequences will be split into chunks of this size.
+  static constexpr size_t MAX_SEQUENCE_LENGTH = 32;
+  /// \brief Sequence which terminal sends before pasted text in bracketed paste mode.
+  static constexpr std::string_view PASTE_START = "\x1b[200~";
+  /// \brief Sequence which terminal sends after pasted text in bracketed paste mode.
+  static constexpr std::string_view PASTE_END = "\x1b[201~";
+  /// \brief Maximum length of the pasted text passed to the caller. Longer text is passed
+  /// truncated as soon as it exceeds the limit, the rest of it is dropped up to PASTE_END.
+  static constexpr size_t MAX_PASTE_SIZE = 1024 * 1024;
+
+  /// \brief Split input bytes into sequences.
+  /// \param data Pointer to the bytes read out from terminal.
+  /// \param length Number of bytes in data.
+  /// \param on_sequence Callable with signature `void(const char * sequence, size_t length)`
+  /// which will be called for each complete sequence in order of arrival.
+  template<typename OnSequence>
+  void feed(const char * data, size_t length, OnSequence && on_sequence)
+  {
+    feed_sequences<false>(data, length, on_sequence);
+  }
+
+  /// \brief Split input bytes into sequences, passing bracketed paste as a whole.
+  /// \param data Pointer to the bytes read out from terminal.
+  /// \param length Number of bytes in data.
+  /// \param on_sequence Callable with signature `void(const char * sequence, size_t length)`
+  /// which will be called for each complete sequence in order of arrival.
+  /// \param on_paste Callable with signature `void(const char * text, size_t length)` which
+  /// will be called once per paste with the text between PASTE_START and PASTE_END, at most
+  /// MAX_PASTE_SIZE bytes of it. Text is valid only during the call.
+  template<typename OnSequence, typename OnPaste>
+  void feed(const char * data, size_t length, OnSequence && on_sequence, OnPaste && on_paste)
+  {
+    while (length > 0) {
+      size_t consumed = in_paste_ ?
+        feed_paste(data, length, on_paste) : feed_sequences<true>(data, length, on_sequence);
+      data += consumed;
+      length -= consumed;
+    }
+  }
+
+  /// \brief Pass pending incomplete sequence, if any, to the caller as is.
+  /// \details Should be called when no more data arrived during some timeout after last feed()
+  /// call. For instance to deliver ESC key press. Doesn't affect unfinished paste, which
+  /// waits for PASTE_END regardless of timeouts.
+  /// \param on_sequence Callable with signature `void(const char * sequence, size_t length)`.
+  template<typename OnSequence>
+  void flush(OnSequence && on_sequence)
+  {
+    if (pending_length_ > 0) {
+      size_t length = pending_length_;
+      pending_length_ = 0;
+      on_sequence(static_cast<const char *>(pending_), length);
+    }
+  }
+
+  /// \brief Check if there is an incomplete sequence waiting for the rest of the bytes.
+  bool has_pending() const
+  {
+    return pending_length_ > 0;
+  }
+
+  /// \brief Check if PASTE_START was received and PASTE_END is not yet.
+  bool is_in_paste() const
+  {
+    return in_paste_;
+  }
+
+  /// \brief Drop pending incomplete sequence and unfinished paste.
+  void reset()
+  {
+    pending_length_ = 0;
+    in_paste_ = false;
+    paste_truncated_ = false;
+    paste_buffer_.clear();
+  }
+
+  /// \brief Determine length of the first sequence in the buffer.
+  /// \param data Pointer to the buffer.
+  /// \param length Number of available bytes in buffer, should be greater than 0.
+  /// \return Length of the first complete sequence in bytes, or 0 if more bytes needed to
+  /// determine the end of the sequence.
+  static size_t get_sequence_length(const char * data, size_t length)
+  {
+    static constexpr unsigned char ESC = 27;
+    const auto * bytes = reinterpret_cast<const unsigned char *>(data);
+    if (bytes[0] != ESC) {
+      return get_character_length(bytes, length);
+    }
+    if (length < 2) {
+      return 0;
+    }
+    switch (bytes[1]) {
+      case '[':
+        return get_csi_sequence_length(bytes, length);
+      case 'O':  // SS3
+        return length < 3 ? 0 : 3;
+      case ESC:
+        return 1;
+      default:
+        {
+          size_t char_length = get_character_length(bytes + 1, length - 1);
+          return char_length == 0 ? 0 : char_length + 1;
+        }
+    }
+  }
+
+private:
+  /// \brief Split input bytes into sequences until the beginning of the paste.
+  /// \return Number of consumed bytes, less than length only if paste started.
+  template<bool DetectPaste, typename OnSequence>
+  size_t feed_sequences(const char * data, size_t length, OnSequence & on_sequence)
+  {
+    size_t consumed = 0;
+    // Complete sequence started in the previous chunk of data
+    size_t appended = 0;
+    while (pending_length_ > 0 && consumed < length) {
+      pending_[pending_length_++] = data[consumed++];
+      appended++;
+      size_t sequence_length = get_sequence_length(pending_, pending_length_);
+      if (sequence_length != 0) {
+        const bool paste_start = DetectPaste && is_paste_start(pending_, sequence_length);
+        if (!paste_start) {
+          on_sequence(static_cast<const char *>(pending_), sequence_length);
+        }
+        size_t leftover = pending_length_ - sequence_length;
+        if (leftover <= appended) {
+          // Rest of the bytes still available in input data, parse them from there
+          consumed -= leftover;
+          pending_length_ = 0;
+        } else if (paste_start) {
+          paste_buffer_.assign(pending_ + sequence_length, leftover);
+          pending_length_ = 0;
+        } else {
+          std::memmove(pending_, pending_ + sequence_length, leftover);
+          pending_length_ = leftover;
+          appended = 0;
+        }
+        if (paste_start) {
+          in_paste_ = true;
+          return consumed;
+        }
+      }
+    }
+
+    while (consumed < length) {
+      size_t available = std::min(length - consumed, MAX_SEQUENCE_LENGTH);
+      size_t sequence_length = get_sequence_length(data + consumed, available);
+      if (sequence_length == 0) {
+        // Incomplete sequence at the end of the data, carry it over to the next feed() call
+        std::memcpy(pending_, data + consumed, available);
+        pending_length_ = available;
+        break;
+      }
+      if (DetectPaste && is_paste_start(data + consumed, sequence_length)) {
+        in_paste_ = true;
+        return consumed + sequence_length;
+      }
+      on_sequence(data + consumed, sequence_length);
+      consumed += sequence_length;
+    }
+    return length;
+  }
+
+  /// \brief Collect pasted text until PASTE_END.
+  /// \return Number of consumed bytes, less than length only if paste ended.
+  template<typename OnPaste>
+  size_t feed_paste(const char * data, size_t length, OnPaste & on_paste)
+  {
+    if (paste_buffer_.empty() && !paste_truncated_) {
+      // Paste started in this chunk of data, pass it as is if it ends here as well
+      size_t end = std::string_view(data, length).find(PASTE_END);
+      if (end != std::string_view::npos && end <= MAX_PASTE_SIZE) {
+        in_paste_ = false;
+        on_paste(data, end);
+        return end + PASTE_END.size();
+      }
+    }
+    size_t previous_size = paste_buffer_.size();
+    paste_buffer_.append(data, length);
+    // PASTE_END could be split between chunks of data
+    size_t search_from = previous_size < PASTE_END.size() ? 0 :
+      previous_size - PASTE_END.size() + 1;
+    size_t end = std::string_view(paste_buffer_).find(PASTE_END, search_from);
+    if (end == std::string_view::npos) {
+      if (!paste_truncated_ && paste_buffer_.size() >= MAX_PASTE_SIZE + PASTE_END.size()) {
+        // Text is longer than the limit even if the last bytes are beginning of PASTE_END
+        paste_truncated_ = true;
+        on_paste(static_cast<const char *>(paste_buffer_.data()), MAX_PASTE_SIZE);
+      }
+      if (paste_truncated_) {
+        // Only the bytes which could be beginning of PASTE_END are kept to find the end
+        size_t kept = std::min(paste_buffer_.size(), PASTE_END.size() - 1);
+        paste_buffer_.erase(0, paste_buffer_.size() - kept);
+      }
+      return length;
+    }
+    in_paste_ = false;
+    if (!paste_truncated_) {
+      on_paste(static_cast<const char *>(paste_buffer_.data()), std::min(end, MAX_PASTE_SIZE));
+    }
+    paste_truncated_ = false;
+    paste_buffer_.clear();
+    return end + PASTE_END.size() - previous_size;
+  }
+
+  static bool is_paste_start(const char * sequence, size_t length)
+  {
+    return std::string_view(sequence, length) == PASTE_START;
+  }
+
+  static size_t get_character_length(const unsigned char * bytes, size_t length)
+  {
+    size_t char_length = 1;
+    if (bytes[0] >= 0xF0 && bytes[0] <= 0xF7) {
+      char_length = 4;
+    } else if (bytes[0] >= 0xE0) {
+      char_length = bytes[0] <= 0xEF ? 3 : 1;
+    } else if (bytes[0] >= 0xC0) {
+      char_length = 2;
+    }
+    for (size_t i = 1; i < char_length; i++) {
+      if (i == length) {
+        return 0;
+      }
+      if ((bytes[i] & 0xC0) != 0x80) {
+        return i;  // Malformed UTF-8 character, split it before unexpected byte
+      }
+    }
+    return char_length;
+  }
+
+  static size_t get_csi_sequence_length(const unsigned char * bytes, size_t length)
+  {
+    size_t i = 2;
+    if (length > 2 && bytes[2] == '[') {
+      // Linux console F1..F5 keys `ESC [ [ A`..`ESC [ [ E`
+      return length < 4 ? 0 : 4;
+    }
+    for (; i < length; i++) {
+      if (bytes[i] >= 0x40 && bytes[i] <= 0x7E) {
+        return i + 1;  // Final byte
+      }
+      if (bytes[i] < 0x20 || bytes[i] > 0x3F) {
+        return i;  // Malformed sequence, split it before unexpected byte
+      }
+    }
+    return length >= MAX_SEQUENCE_LENGTH ? length : 0;
+  }
+
+  char pending_[MAX_SEQUENCE_LENGTH];
+  size_t pending_length_ = 0;
+  bool in_paste_ = false;
+  /// \brief true if text of the current paste exceeded MAX_PASTE_SIZE and was already passed.
+  bool paste_truncated_ = false;
+  /// \brief Text of the paste which spans several chunks of data, capacity is kept for reuse.
+  /// Once paste is truncated, only the last bytes which could be beginning of PASTE_END.
+  std::string paste_buffer_;
+};
+
+#endif  // KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TOKENIZER_HPP_
@@ -0,0 +1,219 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TRIE_HPP_
+#define KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TRIE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+/// \brief Compact byte indexed trie for matching sequences of characters returning by terminal
+/// to the KeyCode enum values.
+/// \details All operations are constexpr, which allows to build the trie for statically defined
+/// key map at compile time. Only nodes which have children own a row of transitions indexed by
+/// the next byte of the sequence, leaf nodes store just a key code and refer to the shared empty
+/// row without transitions. Matching is a single pass over input bytes with one indexed load per
+/// byte, without hashing and string construction.
+/// The class is trivially copyable and could be stored as is.
+class TerminalSequenceTrie
+{
+public:
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+
+  /// \brief Maximum number of nodes in trie, including root.
+  static constexpr size_t MAX_NODES = 256;
+  /// \brief Maximum number of nodes which have children, including root.
+  static constexpr size_t MAX_BRANCH_NODES = 63;
+  /// \brief Terminal sequences consist of 7 bit characters, any other byte will not match.
+  static constexpr size_t ALPHABET_SIZE = 128;
+
+  constexpr TerminalSequenceTrie() = default;
+
+  /// \brief Add terminal sequence to the trie.
+  /// \param sequence Pointer to the sequence of characters.
+  /// \param length Length of the sequence in bytes.
+  /// \param key_code Key code which should be returned for the sequence.
+  /// \return true if sequence was added or already present in trie. false if sequence is empty,
+  /// contains 8 bit characters or trie capacity exceeded.
+  constexpr bool insert(const char * sequence, size_t length, KeyCode key_code)
+  {
+    return add(sequence, length, key_code, false);
+  }
+
+  /// \brief Add terminal sequence to the trie or replace key code of the already present one.
+  /// \return false if sequence is empty, contains 8 bit characters or trie capacity exceeded.
+  constexpr bool insert_or_assign(const char * sequence, size_t length, KeyCode key_code)
+  {
+    return add(sequence, length, key_code, true);
+  }
+
+  /// \brief Add null terminated terminal sequence to the trie.
+  constexpr bool insert(const char * sequence, KeyCode key_code)
+  {
+    size_t length = 0;
+    while (sequence[length] != '\0') {
+      length++;
+    }
+    return insert(sequence, length, key_code);
+  }
+
+  /// \brief Find key code for the terminal sequence.
+  /// \param sequence Pointer to the sequence of characters.
+  /// \param length Length of the sequence in bytes.
+  /// \return Key code if the whole sequence matches one of the added sequences, otherwise
+  /// KeyCode::UNKNOWN.
+  constexpr KeyCode find(const char * sequence, size_t length) const
+  {
+    size_t node = 0;
+    for (size_t i = 0; i < length; i++) {
+      auto byte = static_cast<unsigned char>(sequence[i]);
+      if (byte >= ALPHABET_SIZE) {
+        return KeyCode::UNKNOWN;
+      }
+      node = rows_[node_row_[node]][byte];
+      if (node == 0) {
+        return KeyCode::UNKNOWN;
+      }
+    }
+    return static_cast<KeyCode>(node_value_[node]);
+  }
+
+  /// \brief Find terminal sequence for the key code.
+  /// \details Walks over the whole trie, not intended for use on hot path.
+  /// \param key_code Key code to search for.
+  /// \return The shortest terminal sequence corresponding to the key code or empty string if
+  /// key code not found.
+  std::string find_sequence(KeyCode key_code) const
+  {
+    std::string sequence;
+    std::string shortest_sequence;
+    find_sequence(0, key_code, sequence, shortest_sequence);
+    return shortest_sequence;
+  }
+
+  /// \brief Number of nodes in trie, including root.
+  constexpr size_t nodes_count() const
+  {
+    return nodes_count_;
+  }
+
+  /// \brief Check that trie is consistent, e.g. after loading it from the file.
+  /// \details Valid trie could be safely searched: all indices are in range, children always
+  /// have greater indices than parents, so there are no cycles.
+  constexpr bool is_valid() const
+  {
+    if (nodes_count_ == 0 || nodes_count_ > MAX_NODES || rows_count_ == 0 ||
+      rows_count_ > MAX_BRANCH_NODES + 1)
+    {
+      return false;
+    }
+    for (size_t byte = 0; byte < ALPHABET_SIZE; byte++) {
+      if (rows_[EMPTY_ROW][byte] != 0) {
+        return false;
+      }
+    }
+    for (size_t node = 0; node < MAX_NODES; node++) {
+      if (node_row_[node] >= rows_count_ ||
+        node_value_[node] >= static_cast<uint8_t>(KeyCode::END_OF_KEY_CODE_ENUM))
+      {
+        return false;
+      }
+      for (size_t byte = 0; byte < ALPHABET_SIZE; byte++) {
+        size_t next_node = rows_[node_row_[node]][byte];
+        if (next_node != 0 && (next_node <= node || next_node >= nodes_count_)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  constexpr bool add(const char * sequence, size_t length, KeyCode key_code, bool replace)
+  {
+    if (length == 0) {
+      return false;
+    }
+    size_t node = 0;
+    for (size_t i = 0; i < length; i++) {
+      auto byte = static_cast<unsigned char>(sequence[i]);
+      if (byte >= ALPHABET_SIZE) {
+        return false;
+      }
+      if (node_row_[node] == EMPTY_ROW) {
+        if (rows_count_ == MAX_BRANCH_NODES + 1) {
+          return false;
+        }
+        node_row_[node] = static_cast<uint8_t>(rows_count_++);
+      }
+      uint8_t & next_node = rows_[node_row_[node]][byte];
+      if (next_node == 0) {
+        if (nodes_count_ == MAX_NODES) {
+          return false;
+        }
+        next_node = static_cast<uint8_t>(nodes_count_++);
+      }
+      node = next_node;
+    }
+    // Unless replaced, the first added sequence wins, the same way as for
+    // std::unordered_map::emplace
+    if (replace || node_value_[node] == static_cast<uint8_t>(KeyCode::UNKNOWN)) {
+      node_value_[node] = static_cast<uint8_t>(key_code);
+    }
+    return true;
+  }
+
+  void find_sequence(
+    size_t node, KeyCode key_code, std::string & sequence, std::string & shortest_sequence) const
+  {
+    if (!sequence.empty() && node_value_[node] == static_cast<uint8_t>(key_code) &&
+      (shortest_sequence.empty() || sequence.size() < shortest_sequence.size()))
+    {
+      shortest_sequence = sequence;
+    }
+    if (node_row_[node] == EMPTY_ROW) {
+      return;
+    }
+    for (size_t byte = 0; byte < ALPHABET_SIZE; byte++) {
+      uint8_t next_node = rows_[node_row_[node]][byte];
+      if (next_node != 0) {
+        sequence.push_back(static_cast<char>(byte));
+        find_sequence(next_node, key_code, sequence, shortest_sequence);
+        sequence.pop_back();
+      }
+    }
+  }
+
+  static_assert(MAX_NODES <= 256, "Node index should fit into uint8_t");
+  static_assert(MAX_BRANCH_NODES < 256, "Row index should fit into uint8_t");
+  static_assert(
+    static_cast<size_t>(KeyCode::END_OF_KEY_CODE_ENUM) <= 256, "KeyCode should fit into uint8_t");
+
+  /// \brief Row without transitions shared by all leaf nodes.
+  static constexpr uint8_t EMPTY_ROW = 0;
+
+  /// \brief Transitions for nodes with children. Value 0 means no transition, since root node
+  /// can't be a child.
+  uint8_t rows_[MAX_BRANCH_NODES + 1][ALPHABET_SIZE] = {};
+  /// \brief Index of the row with transitions for each node.
+  uint8_t node_row_[MAX_NODES] = {};
+  /// \brief Key code for each node, KeyCode::UNKNOWN for intermediate nodes.
+  uint8_t node_value_[MAX_NODES] = {};
+  size_t nodes_count_ = 1;
+  size_t rows_count_ = 1;
+};
+
+#endif  // KEYBOARD_HANDLER__TERMINAL_SEQUENCE_TRIE_HPP_
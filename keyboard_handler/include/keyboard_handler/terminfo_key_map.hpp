@@ -0,0 +1,132 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYBOARD_HANDLER__TERMINFO_KEY_MAP_HPP_
+#define KEYBOARD_HANDLER__TERMINFO_KEY_MAP_HPP_
+
+#ifndef _WIN32
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "keyboard_handler/keyboard_handler_base.hpp"
+#include "keyboard_handler/terminal_sequence_trie.hpp"
+#include "keyboard_handler/visibility_control.hpp"
+
+/// \brief Layout of the precompiled key map cache file.
+/// \details File starts with the 32 bytes header: 8 bytes magic, 4 bytes format version,
+/// 4 bytes size of the trie, 8 bytes hash of the terminfo file and 8 bytes hash of the fallback
+/// trie. Header is followed by the TerminalSequenceTrie as is, so the file could be mapped to
+/// memory and used without copying. All numbers are in host byte order.
+struct TerminfoKeyMapCacheFormat
+{
+  static constexpr char MAGIC[8] = {'K', 'H', 'T', 'I', 'N', 'F', 'O', 'C'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t HEADER_SIZE = 32;
+};
+
+/// \brief Key map built from the compiled terminfo entry of the terminal.
+/// \details Compiled terminfo format, see term(5), is parsed directly without ncurses. Key
+/// sequences from terminfo are added on top of the fallback trie, replacing conflicting
+/// sequences, since terminal sends some keys differently depending on keypad transmit mode
+/// and fallback sequences are still valid for them.
+/// Built trie is stored in the cache directory in a file named after hash of the terminfo file
+/// contents. Next time the same terminfo file is loaded, cache file is mapped to memory instead
+/// of parsing terminfo and building the trie again.
+class TerminfoKeyMap
+{
+public:
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+
+  /// \brief Key sequence defined in terminfo.
+  struct KeySequence
+  {
+    KeyCode key_code;
+    std::string sequence;
+  };
+
+  /// \brief Load key map for the terminfo file, from the cache if possible.
+  /// \param terminfo_path Path to the compiled terminfo file, see find_terminfo_file().
+  /// \param fallback_trie Sequences which are used for keys not defined in terminfo.
+  /// \param cache_dir Directory for the precompiled key maps, created if doesn't exist. Cache
+  /// is not used if empty. Failures to read or write cache are not reported, key map is built
+  /// from terminfo instead.
+  /// \throw std::runtime_error if terminfo file can't be read or is malformed.
+  KEYBOARD_HANDLER_PUBLIC
+  TerminfoKeyMap(
+    const std::string & terminfo_path, const TerminalSequenceTrie & fallback_trie,
+    const std::string & cache_dir);
+
+  KEYBOARD_HANDLER_PUBLIC
+  ~TerminfoKeyMap();
+
+  TerminfoKeyMap(const TerminfoKeyMap &) = delete;
+  TerminfoKeyMap & operator=(const TerminfoKeyMap &) = delete;
+
+  /// \brief Trie with sequences from terminfo and fallback trie.
+  KEYBOARD_HANDLER_PUBLIC
+  const TerminalSequenceTrie & get_trie() const;
+
+  /// \brief Check if trie was mapped from the cache rather than built from terminfo.
+  KEYBOARD_HANDLER_PUBLIC
+  bool is_loaded_from_cache() const;
+
+  /// \brief Find compiled terminfo file for the terminal name.
+  /// \details Searches the same directories as ncurses: $TERMINFO, ~/.terminfo,
+  /// $TERMINFO_DIRS and the system directories, in both `x/xterm` and `78/xterm` layouts.
+  /// \param term Terminal name, e.g. value of the TERM environment variable.
+  /// \return Path to the file or empty string if not found.
+  KEYBOARD_HANDLER_PUBLIC
+  static std::string find_terminfo_file(const std::string & term);
+
+  /// \brief Get default cache directory, `$XDG_CACHE_HOME/keyboard_handler` or
+  /// `~/.cache/keyboard_handler`.
+  /// \return Path to the directory or empty string if home directory is unknown.
+  KEYBOARD_HANDLER_PUBLIC
+  static std::string get_default_cache_dir();
+
+  /// \brief Extract key sequences from the compiled terminfo entry.
+  /// \details Both legacy format with 16 bit numbers and format with 32 bit numbers are
+  /// supported, extended capabilities are ignored.
+  /// \param data Pointer to the contents of the compiled terminfo file.
+  /// \param length Size of the data in bytes.
+  /// \param key_sequences Receives sequences of all keys defined in terminfo.
+  /// \return false if data is not a valid compiled terminfo entry.
+  KEYBOARD_HANDLER_PUBLIC
+  static bool parse_key_sequences(
+    const char * data, size_t length, std::vector<KeySequence> & key_sequences);
+
+  /// \brief 64 bit FNV-1a hash.
+  KEYBOARD_HANDLER_PUBLIC
+  static uint64_t hash(const void * data, size_t length);
+
+private:
+  /// \brief Map cache file and check that it matches the terminfo file and fallback trie.
+  /// \return false if cache file doesn't exist, is stale or is malformed.
+  bool map_cache(const std::string & cache_path, uint64_t terminfo_hash, uint64_t fallback_hash);
+
+  /// \brief Atomically replace cache file with the built trie, ignoring errors.
+  void write_cache(
+    const std::string & cache_dir, const std::string & cache_path, uint64_t terminfo_hash,
+    uint64_t fallback_hash) const;
+
+  const TerminalSequenceTrie * trie_ = nullptr;
+  /// \brief Trie built from terminfo, unused if trie was mapped from the cache.
+  TerminalSequenceTrie built_trie_;
+  const char * mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+};
+
+#endif  // #ifndef _WIN32
+#endif  // KEYBOARD_HANDLER__TERMINFO_KEY_MAP_HPP_
@@ -13,6 +13,7 @@
 // limitations under the License.
 #ifndef _WIN32
 #include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+#include "keyboard_handler/terminal_sequence_trie.hpp"
 
 /// Note that key code sequences translated by the terminal could be differ for different terminal
 /// emulators. Please refer to the
@@ -53,23 +54,12 @@ static constexpr char F10[] = {27, 91, 50, 49, 126, '\0'};
 static constexpr char F11[] = {27, 91, 50, 51, 126, '\0'};
 static constexpr char F12[] = {27, 91, 50, 52, 126, '\0'};
 
-// static constexpr char SHIFT_F1[]  = {27, 91, 49, 59, 50, 80, '\0'};
-// static constexpr char SHIFT_F2[]  = {27, 91, 49, 59, 50, 81, '\0'};
-// static constexpr char SHIFT_F3[]  = {27, 91, 49, 59, 50, 82, '\0'};
-// static constexpr char SHIFT_F4[]  = {27, 91, 49, 59, 50, 83, '\0'};
-// static constexpr char SHIFT_F5[]  = {27, 91, 49, 53, 59, 50, 126, '\0'};
-// Example: The same value for SHIFT_F5[] when numbers replaced by chars
-// static constexpr char SHIFT_F5[] = {27, 91, '1', '5', ';', '2', '~', '\0'};
-// static constexpr char SHIFT_F6[]  = {27, 91, 49, 55, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F7[]  = {27, 91, 49, 56, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F8[]  = {27, 91, 49, 57, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F9[]  = {27, 91, 50, 48, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F10[] = {27, 91, 50, 49, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F11[] = {27, 91, 50, 51, 59, 50, 126, '\0'};
-// static constexpr char SHIFT_F12[] = {27, 91, 50, 52, 59, 50, 126, '\0'};
+// Keys with modifiers, e.g. SHIFT_F1 {27, 91, 49, 59, 50, 80} or
+// SHIFT_F5 {27, 91, '1', '5', ';', '2', '~'}, are not listed here. Modifier parameter is decoded
+// by CsiModifiersDecoder and the rest of the sequence is looked up as unmodified key.
 }  // namespace xterm_seq
 
-const KeyboardHandlerUnixImpl::KeyMap KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP[]  = {
+constexpr KeyboardHandlerUnixImpl::KeyMap KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP[] = {
   {KeyCode::CURSOR_UP,    xterm_seq::CURSOR_UP},
   {KeyCode::CURSOR_DOWN,  xterm_seq::CURSOR_DOWN},
   {KeyCode::CURSOR_RIGHT, xterm_seq::CURSOR_ONE_STEP_RIGHT},
@@ -172,7 +162,11 @@ const KeyboardHandlerUnixImpl::KeyMap KeyboardHandlerUnixImpl::DEFAULT_STATIC_KE
 };
 /* *INDENT-ON* */
 
-const size_t KeyboardHandlerUnixImpl::STATIC_KEY_MAP_LENGTH =
+constexpr size_t KeyboardHandlerUnixImpl::STATIC_KEY_MAP_LENGTH =
   sizeof(KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP) / sizeof(KeyboardHandlerUnixImpl::KeyMap);
 
+constexpr TerminalSequenceTrie KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_TRIE =
+  KeyboardHandlerUnixImpl::build_key_trie(
+  KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP, KeyboardHandlerUnixImpl::STATIC_KEY_MAP_LENGTH);
+
 #endif  // #ifndef _WIN32
@@ -12,28 +12,979 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 #include "keyboard_handler/keyboard_handler_base.hpp"
+#include "keyboard_handler/key_event_awaitables.hpp"
 
 KEYBOARD_HANDLER_PUBLIC
 constexpr KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::invalid_handle;
 
+constexpr size_t KeyboardHandlerBase::MAX_KEY_SEQUENCE_LENGTH;
+
+constexpr size_t KeyboardHandlerBase::CALLBACKS_SLOTS_COUNT =
+  static_cast<size_t>(KeyCode::END_OF_KEY_CODE_ENUM) * KEY_MODIFIERS_COMBINATIONS;
+
+constexpr size_t KeyboardHandlerBase::PASTE_CALLBACKS_SLOT = CALLBACKS_SLOTS_COUNT;
+
+constexpr size_t KeyboardHandlerBase::KEY_SEQUENCE_CALLBACKS_SLOT = CALLBACKS_SLOTS_COUNT + 1;
+
+constexpr size_t KeyboardHandlerBase::CALLBACKS_CHUNK_SIZE;
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::KeyboardHandlerBase()
+{
+  auto table = std::make_unique<callbacks_table>();
+  table->chunks.resize((CALLBACKS_SLOTS_COUNT + CALLBACKS_CHUNK_SIZE - 1) / CALLBACKS_CHUNK_SIZE);
+  callbacks_table_owner_ = std::move(table);
+  callbacks_table_.store(callbacks_table_owner_.get());
+#ifdef KEYBOARD_HANDLER_ENABLE_LATENCY_STATS
+  latency_histograms_ = std::make_unique<latency_histograms>();
+#endif
+}
+
 KEYBOARD_HANDLER_PUBLIC
 KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_press_callback(
   const callback_t & callback, KeyboardHandlerBase::KeyCode key_code,
   KeyboardHandlerBase::KeyModifiers key_modifiers)
 {
-  if (callback == nullptr || !is_init_succeed_) {
+  auto handles = add_key_press_callbacks({KeyPressBinding{callback, key_code, key_modifiers}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_press_callback(
+  const callback_t & callback, KeyCode key_code, KeyModifiers key_modifiers,
+  const RateLimitPolicy & policy)
+{
+  if (!policy.is_valid()) {
+    return invalid_handle;
+  }
+  callback_data data{invalid_handle, callback};
+  data.rate_limiter = std::make_shared<RateLimiter>(policy);
+  auto handles = add_callbacks({key_callback{key_code, key_modifiers, std::move(data)}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::vector<KeyboardHandlerBase::callback_handle_t> KeyboardHandlerBase::add_key_press_callbacks(
+  const std::vector<KeyPressBinding> & bindings)
+{
+  std::vector<key_callback> new_callbacks;
+  new_callbacks.reserve(bindings.size());
+  for (const auto & binding : bindings) {
+    new_callbacks.push_back(
+      key_callback{binding.key_code, binding.key_modifiers,
+        callback_data{invalid_handle, binding.callback}});
+  }
+  return add_callbacks(std::move(new_callbacks));
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_repeat_callback(
+  const repeat_callback_t & callback, KeyCode key_code, KeyModifiers key_modifiers)
+{
+  auto handles = add_callbacks(
+    {key_callback{key_code, key_modifiers,
+        callback_data{invalid_handle, nullptr, callback, callback_kind::KEY_REPEAT}}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_hold_end_callback(
+  const hold_end_callback_t & callback, KeyCode key_code, KeyModifiers key_modifiers)
+{
+  auto handles = add_callbacks(
+    {key_callback{key_code, key_modifiers,
+        callback_data{invalid_handle, nullptr, callback, callback_kind::HOLD_END}}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_event_callback(
+  const key_event_callback_t & callback, KeyCode key_code, KeyModifiers key_modifiers)
+{
+  callback_data data{invalid_handle, nullptr};
+  data.event_callback = callback;
+  data.kind = callback_kind::KEY_EVENT;
+  auto handles = add_callbacks({key_callback{key_code, key_modifiers, std::move(data)}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_paste_callback(
+  const paste_callback_t & callback)
+{
+  callback_data data{invalid_handle, nullptr};
+  data.paste_callback = callback;
+  data.kind = callback_kind::PASTE;
+  auto handles = add_callbacks(
+    {key_callback{KeyCode::UNKNOWN, KeyModifiers::NONE, std::move(data)}});
+  return handles.empty() ? invalid_handle : handles.front();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::add_key_sequence_callback(
+  const callback_t & callback, const std::vector<KeyAndModifiers> & sequence,
+  KeySequenceMode mode)
+{
+  if (!is_init_succeed_ || callback == nullptr || sequence.empty() ||
+    sequence.size() > MAX_KEY_SEQUENCE_LENGTH)
+  {
     return invalid_handle;
   }
+  for (const auto & key : sequence) {
+    if (get_callbacks_slot(key.key_code, key.key_modifiers) == CALLBACKS_SLOTS_COUNT) {
+      return invalid_handle;
+    }
+  }
+
+  auto binding = std::make_unique<key_sequence_binding>();
+  binding->slots.reserve(sequence.size());
+  for (const auto & key : sequence) {
+    binding->slots.push_back(
+      static_cast<uint32_t>(get_callbacks_slot(key.key_code, key.key_modifiers)));
+  }
+  binding->swallow_keys = mode == KeySequenceMode::SWALLOW_KEYS;
+
+  std::lock_guard<std::mutex> lk(callbacks_mutex_);
+  callback_handle_t handle = get_new_handle(KEY_SEQUENCE_CALLBACKS_SLOT);
+  try {
+    auto new_table = std::make_unique<callbacks_table>(*callbacks_table_owner_);
+    // Copy of the trie is shallow, insert() copies only the nodes on the sequence path
+    auto key_sequences = new_table->key_sequences ?
+      std::make_shared<key_sequence_trie>(*new_table->key_sequences) :
+      std::make_shared<key_sequence_trie>();
+    key_sequences->insert(*binding, callback_data{handle, callback});
+    new_table->key_sequences = std::move(key_sequences);
+    new_table->callbacks_count++;
+    publish_callbacks_table(std::move(new_table));
+    get_handle_slot(handle).key_sequence = std::move(binding);
+  } catch (...) {
+    release_handle(handle);
+    throw;
+  }
+  return handle;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::set_key_sequence_timeout(std::chrono::milliseconds timeout)
+{
+  key_sequence_timeout_ns_.store(
+    std::chrono::nanoseconds(timeout).count(), std::memory_order_relaxed);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::chrono::milliseconds KeyboardHandlerBase::get_key_sequence_timeout() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::nanoseconds(key_sequence_timeout_ns_.load(std::memory_order_relaxed)));
+}
+
+std::vector<KeyboardHandlerBase::callback_handle_t> KeyboardHandlerBase::add_callbacks(
+  std::vector<key_callback> && new_callbacks)
+{
+  std::vector<callback_handle_t> new_handles;
+  if (!is_init_succeed_) {
+    return new_handles;
+  }
+  size_t new_autorepeat_callbacks_count = 0;
+  for (const auto & new_callback : new_callbacks) {
+    const auto & data = new_callback.data;
+    bool is_empty = false;
+    switch (data.kind) {
+      case callback_kind::KEY_PRESS:
+        is_empty = data.callback == nullptr;
+        break;
+      case callback_kind::KEY_REPEAT:
+      case callback_kind::HOLD_END:
+        is_empty = data.repeat_callback == nullptr;
+        new_autorepeat_callbacks_count++;
+        break;
+      case callback_kind::KEY_EVENT:
+        is_empty = data.event_callback == nullptr;
+        break;
+      case callback_kind::PASTE:
+        if (data.paste_callback == nullptr) {
+          return new_handles;
+        }
+        continue;  // Not bound to key press combination
+    }
+    if (is_empty ||
+      get_callbacks_slot(new_callback.key_code, new_callback.key_modifiers) ==
+      CALLBACKS_SLOTS_COUNT)
+    {
+      return new_handles;
+    }
+  }
+  new_handles.reserve(new_callbacks.size());
+
   std::lock_guard<std::mutex> lk(callbacks_mutex_);
-  callback_handle_t new_handle = get_new_handle();
-  callbacks_.emplace(
-    KeyAndModifiers{key_code, key_modifiers},
-    callback_data{new_handle, callback});
-  return new_handle;
+  try {
+    auto new_table = std::make_unique<callbacks_table>(*callbacks_table_owner_);
+    modified_callbacks modified;
+    for (auto & new_callback : new_callbacks) {
+      if (new_callback.data.kind == callback_kind::PASTE) {
+        new_handles.push_back(get_new_handle(PASTE_CALLBACKS_SLOT));
+        new_callback.data.handle = new_handles.back();
+        new_table->paste_callbacks.push_back(std::move(new_callback.data));
+        continue;
+      }
+      size_t slot = get_callbacks_slot(new_callback.key_code, new_callback.key_modifiers);
+      auto & callbacks = modify_slot_callbacks(*new_table, modified, slot);
+      new_handles.push_back(get_new_handle(slot, callbacks.size()));
+      new_callback.data.handle = new_handles.back();
+      const auto & rate_limiter = new_callback.data.rate_limiter;
+      if (rate_limiter &&
+        rate_limiter->get_policy().kind == RateLimitPolicy::Kind::TRAILING_EDGE)
+      {
+        new_table->trailing_edge_callbacks.push_back(new_callback);
+      }
+      callbacks.push_back(std::move(new_callback.data));
+    }
+    new_table->callbacks_count += new_callbacks.size();
+    new_table->autorepeat_callbacks_count += new_autorepeat_callbacks_count;
+    publish_callbacks_table(std::move(new_table));
+  } catch (...) {
+    for (auto handle : new_handles) {
+      release_handle(handle);
+    }
+    throw;
+  }
+  return new_handles;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::dispatch_key_press(KeyCode key_code, KeyModifiers key_modifiers)
+{
+  if (key_sequences_count_.load(std::memory_order_relaxed) != 0 ||
+    key_waiters_count_.load(std::memory_order_acquire) != 0)
+  {
+    // Key sequences and awaiters need time of the key press
+    dispatch_key_press(KeyEvent{key_code, key_modifiers, std::chrono::steady_clock::now()});
+    return;
+  }
+  dispatch_key_presses(key_code, key_modifiers, 1);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::dispatch_key_presses(
+  KeyCode key_code, KeyModifiers key_modifiers, size_t repeat_count, KeyEventType event_type)
+{
+  size_t slot = get_callbacks_slot(key_code, key_modifiers);
+  if (slot == CALLBACKS_SLOTS_COUNT) {
+    return;
+  }
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const callbacks_table * table = callbacks_table_.load(std::memory_order_seq_cst);
+  const auto * callbacks = get_slot_callbacks(*table, slot);
+  if (callbacks == nullptr) {
+    return;
+  }
+  const size_t key_press_calls_count =
+    repeat_count > 1 && coalesce_key_press_callbacks_.load(std::memory_order_relaxed) ?
+    1 : repeat_count;
+  std::chrono::steady_clock::time_point now{};
+  // Callbacks are free to add and delete callbacks, snapshot will stay alive until we are done
+  for (const auto & data : *callbacks) {
+    if (event_type == KeyEventType::RELEASE) {
+      if (data.kind == callback_kind::KEY_EVENT) {
+        data.event_callback(key_code, key_modifiers, event_type);
+      }
+      continue;
+    }
+    switch (data.kind) {
+      case callback_kind::KEY_PRESS:
+        if (data.rate_limiter) {
+          if (now == std::chrono::steady_clock::time_point{}) {
+            now = std::chrono::steady_clock::now();
+          }
+          for (size_t i = 0; i < key_press_calls_count; i++) {
+            if (data.rate_limiter->on_key_press(now)) {
+              data.callback(key_code, key_modifiers);
+            }
+          }
+          break;
+        }
+        for (size_t i = 0; i < key_press_calls_count; i++) {
+          data.callback(key_code, key_modifiers);
+        }
+        break;
+      case callback_kind::KEY_REPEAT:
+        data.repeat_callback(key_code, key_modifiers, repeat_count);
+        break;
+      case callback_kind::HOLD_END:
+        break;
+      case callback_kind::KEY_EVENT:
+        for (size_t i = 0; i < key_press_calls_count; i++) {
+          data.event_callback(key_code, key_modifiers, event_type);
+        }
+        break;
+      case callback_kind::PASTE:
+        break;
+    }
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::dispatch_key_press(const KeyEvent & event, size_t repeat_count)
+{
+  if (key_sequences_count_.load(std::memory_order_relaxed) != 0 &&
+    !match_key_sequences(event))
+  {
+    return;
+  }
+#ifdef KEYBOARD_HANDLER_ENABLE_LATENCY_STATS
+  auto callbacks_start = std::chrono::steady_clock::now();
+#endif
+  if (is_autorepeat_tracking_enabled()) {
+    track_hold(event, repeat_count);
+  }
+  dispatch_key_presses(event.key_code, event.key_modifiers, repeat_count, event.event_type);
+#ifdef KEYBOARD_HANDLER_ENABLE_LATENCY_STATS
+  auto callbacks_end = std::chrono::steady_clock::now();
+  latency_histograms_->callbacks_start.record(callbacks_start - event.timestamp);
+  latency_histograms_->callbacks_end.record(callbacks_end - event.timestamp);
+  latency_histograms_->callbacks_duration.record(callbacks_end - callbacks_start);
+#endif
+  if (key_waiters_count_.load(std::memory_order_acquire) != 0) {
+    resume_key_waiters(event);
+  }
+}
+
+bool KeyboardHandlerBase::match_key_sequences(const KeyEvent & event)
+{
+  if (event.event_type == KeyEventType::RELEASE) {
+    return true;
+  }
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const callbacks_table * table = callbacks_table_.load(std::memory_order_seq_cst);
+  const key_sequence_trie * trie = table->key_sequences.get();
+  const size_t slot = get_callbacks_slot(event.key_code, event.key_modifiers);
+  using trie_node_t = key_sequence_trie::node;
+  auto find_child = [trie, slot](const trie_node_t * parent) -> const trie_node_t * {
+      if (trie == nullptr || slot == CALLBACKS_SLOTS_COUNT) {
+        return nullptr;
+      }
+      return trie->find_child(parent, slot);
+    };
+
+  key_sequence_reset reset;
+  const std::vector<callback_data> * completed = nullptr;
+  bool dispatch = true;
+  {
+    std::lock_guard<std::mutex> lk(key_sequence_mutex_);
+    const trie_node_t * node = nullptr;
+    if (pending_key_sequence_trie_) {
+      const bool is_trie_modified = pending_key_sequence_trie_.get() != trie;
+      if (!is_trie_modified &&
+        std::chrono::steady_clock::now() <= pending_key_sequence_deadline_)
+      {
+        node = find_child(pending_key_sequence_node_);
+      }
+      if (node == nullptr) {
+        // Key press doesn't continue pending sequence, it could start a new one
+        reset = reset_pending_key_sequence(!is_trie_modified);
+      }
+    }
+    if (node == nullptr) {
+      node = find_child(nullptr);
+    }
+    if (node != nullptr) {
+      const auto & trie_node = *node;
+      dispatch = trie_node.swallowing_sequences_count == 0;
+      if (!trie_node.children.empty()) {
+        if (!pending_key_sequence_trie_) {
+          pending_key_sequence_trie_ = table->key_sequences;
+        }
+        pending_key_sequence_node_ = node;
+        pending_key_sequence_last_key_ = {event.key_code, event.key_modifiers};
+        pending_key_sequence_deadline_ = std::chrono::steady_clock::now() +
+          std::chrono::nanoseconds(key_sequence_timeout_ns_.load(std::memory_order_relaxed));
+        if (!dispatch) {
+          // Pending node is shallower than MAX_KEY_SEQUENCE_LENGTH, so there is always room
+          held_key_presses_[held_key_presses_count_++] = event;
+        }
+      } else {
+        // Held back key presses are consumed by the completed sequence, trie is kept alive by
+        // reader guard
+        completed = &trie_node.callbacks;
+        pending_key_sequence_trie_.reset();
+        pending_key_sequence_node_ = nullptr;
+        held_key_presses_count_ = 0;
+      }
+    }
+  }
+  finish_key_sequence_reset(reset);
+  if (completed != nullptr) {
+    for (const auto & data : *completed) {
+      data.callback(event.key_code, event.key_modifiers);
+    }
+  }
+  return dispatch;
+}
+
+std::chrono::steady_clock::time_point KeyboardHandlerBase::check_key_sequence_timeout(
+  std::chrono::steady_clock::time_point now)
+{
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const callbacks_table * table = callbacks_table_.load(std::memory_order_seq_cst);
+  std::unique_lock<std::mutex> lk(key_sequence_mutex_);
+  if (!pending_key_sequence_trie_) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  if (now <= pending_key_sequence_deadline_) {
+    return pending_key_sequence_deadline_;
+  }
+  auto reset = reset_pending_key_sequence(
+    pending_key_sequence_trie_ == table->key_sequences);
+  lk.unlock();
+  finish_key_sequence_reset(reset);
+  return std::chrono::steady_clock::time_point::max();
+}
+
+KeyboardHandlerBase::key_sequence_reset KeyboardHandlerBase::reset_pending_key_sequence(
+  bool can_complete)
+{
+  key_sequence_reset reset;
+  if (!pending_key_sequence_trie_) {
+    return reset;
+  }
+  const auto & node = *pending_key_sequence_node_;
+  if (can_complete && !node.callbacks.empty()) {
+    reset.completed = &node.callbacks;
+    reset.last_key = pending_key_sequence_last_key_;
+  } else {
+    std::copy_n(held_key_presses_, held_key_presses_count_, reset.held_keys);
+    reset.held_keys_count = held_key_presses_count_;
+  }
+  reset.trie = std::move(pending_key_sequence_trie_);
+  pending_key_sequence_trie_.reset();
+  pending_key_sequence_node_ = nullptr;
+  held_key_presses_count_ = 0;
+  return reset;
+}
+
+void KeyboardHandlerBase::finish_key_sequence_reset(const key_sequence_reset & reset)
+{
+  if (reset.completed != nullptr) {
+    for (const auto & data : *reset.completed) {
+      data.callback(reset.last_key.key_code, reset.last_key.key_modifiers);
+    }
+    return;
+  }
+  // Held back key presses are dispatched as is, without matching them again
+  for (size_t i = 0; i < reset.held_keys_count; i++) {
+    const KeyEvent & event = reset.held_keys[i];
+    dispatch_key_presses(event.key_code, event.key_modifiers, 1, event.event_type);
+    if (key_waiters_count_.load(std::memory_order_acquire) != 0) {
+      resume_key_waiters(event);
+    }
+  }
+}
+
+KeyboardHandlerBase::key_sequence_trie::key_sequence_trie()
+: root_chunks((CALLBACKS_SLOTS_COUNT + CALLBACKS_CHUNK_SIZE - 1) / CALLBACKS_CHUNK_SIZE)
+{
+}
+
+namespace
+{
+/// \brief Replace or add child of the node, or remove it if target is nullptr.
+template<typename NodeT, typename ChildT>
+void set_trie_child(NodeT & node, uint32_t slot, std::shared_ptr<const NodeT> target)
+{
+  auto & children = node.children;
+  auto it = std::lower_bound(
+    children.begin(), children.end(), slot,
+    [](const ChildT & transition, uint32_t key_slot) {return transition.slot < key_slot;});
+  if (it != children.end() && it->slot == slot) {
+    if (target) {
+      it->target = std::move(target);
+    } else {
+      children.erase(it);
+    }
+  } else if (target) {
+    children.insert(it, ChildT{slot, std::move(target)});
+  }
+}
+}  // namespace
+
+void KeyboardHandlerBase::key_sequence_trie::insert(
+  const key_sequence_binding & binding, const callback_data & data)
+{
+  const auto & slots = binding.slots;
+  const size_t length = slots.size();
+  // Copies of the nodes on the sequence path, nodes which don't exist yet are created
+  std::shared_ptr<node> path[MAX_KEY_SEQUENCE_LENGTH];
+  const node * original = nullptr;
+  for (size_t i = 0; i < length; i++) {
+    original = i == 0 || original != nullptr ? find_child(original, slots[i]) : nullptr;
+    path[i] = original != nullptr ? std::make_shared<node>(*original) : std::make_shared<node>();
+    path[i]->sequences_count++;
+    if (binding.swallow_keys) {
+      path[i]->swallowing_sequences_count++;
+    }
+  }
+  path[length - 1]->callbacks.push_back(data);
+  for (size_t i = length - 1; i > 0; i--) {
+    set_trie_child<node, child>(*path[i - 1], slots[i], std::move(path[i]));
+  }
+  const size_t chunk_index = slots[0] / CALLBACKS_CHUNK_SIZE;
+  auto chunk = root_chunks[chunk_index] ?
+    std::make_shared<root_chunk>(*root_chunks[chunk_index]) : std::make_shared<root_chunk>();
+  chunk->children[slots[0] % CALLBACKS_CHUNK_SIZE] = std::move(path[0]);
+  root_chunks[chunk_index] = std::move(chunk);
+  sequences_count++;
+}
+
+void KeyboardHandlerBase::key_sequence_trie::remove(
+  const key_sequence_binding & binding, callback_handle_t handle)
+{
+  const auto & slots = binding.slots;
+  const size_t length = slots.size();
+  // Copies of the nodes on the sequence path which are still used by other sequences. Counts
+  // don't grow along the path, so nodes left without sequences are the tail of the path.
+  std::shared_ptr<node> path[MAX_KEY_SEQUENCE_LENGTH];
+  const node * original = nullptr;
+  for (size_t i = 0; i < length; i++) {
+    original = find_child(original, slots[i]);
+    if (original->sequences_count == 1) {
+      break;
+    }
+    path[i] = std::make_shared<node>(*original);
+    path[i]->sequences_count--;
+    if (binding.swallow_keys) {
+      path[i]->swallowing_sequences_count--;
+    }
+  }
+  if (path[length - 1]) {
+    auto & callbacks = path[length - 1]->callbacks;
+    callbacks.erase(
+      std::find_if(
+        callbacks.begin(), callbacks.end(),
+        [handle](const callback_data & data) {return data.handle == handle;}));
+  }
+  for (size_t i = length - 1; i > 0; i--) {
+    if (path[i - 1]) {
+      set_trie_child<node, child>(*path[i - 1], slots[i], std::move(path[i]));
+    }
+  }
+  const size_t chunk_index = slots[0] / CALLBACKS_CHUNK_SIZE;
+  auto chunk = std::make_shared<root_chunk>(*root_chunks[chunk_index]);
+  chunk->children[slots[0] % CALLBACKS_CHUNK_SIZE] = std::move(path[0]);
+  root_chunks[chunk_index] = std::move(chunk);
+  sequences_count--;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyAwaiter KeyboardHandlerBase::next_key()
+{
+  return KeyAwaiter(*this, false, KeyCode::UNKNOWN, KeyModifiers::NONE);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyAwaiter KeyboardHandlerBase::next_key(KeyCode key_code, KeyModifiers key_modifiers)
+{
+  return KeyAwaiter(*this, true, key_code, key_modifiers);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyEventStream KeyboardHandlerBase::key_events(size_t capacity)
+{
+  return KeyEventStream(*this, capacity);
+}
+
+void KeyboardHandlerBase::add_key_waiter(key_waiter & waiter)
+{
+  std::lock_guard<std::mutex> lock(key_waiters_mutex_);
+  if (waiter.linked) {
+    return;
+  }
+  waiter.prev = nullptr;
+  waiter.next = key_waiters_;
+  if (key_waiters_ != nullptr) {
+    key_waiters_->prev = &waiter;
+  }
+  key_waiters_ = &waiter;
+  waiter.linked = true;
+  key_waiters_count_.fetch_add(1, std::memory_order_release);
+}
+
+void KeyboardHandlerBase::remove_key_waiter(key_waiter & waiter) noexcept
+{
+  std::lock_guard<std::mutex> lock(key_waiters_mutex_);
+  if (waiter.linked) {
+    unlink_key_waiter(waiter);
+  }
+}
+
+void KeyboardHandlerBase::unlink_key_waiter(key_waiter & waiter) noexcept
+{
+  if (waiter.prev != nullptr) {
+    waiter.prev->next = waiter.next;
+  } else {
+    key_waiters_ = waiter.next;
+  }
+  if (waiter.next != nullptr) {
+    waiter.next->prev = waiter.prev;
+  }
+  waiter.prev = nullptr;
+  waiter.next = nullptr;
+  waiter.linked = false;
+  key_waiters_count_.fetch_sub(1, std::memory_order_release);
+}
+
+void KeyboardHandlerBase::resume_key_waiters(const KeyEvent & event)
+{
+  if (event.event_type == KeyEventType::RELEASE) {
+    return;
+  }
+  key_waiter * ready = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(key_waiters_mutex_);
+    key_waiter * waiter = key_waiters_;
+    while (waiter != nullptr) {
+      key_waiter * next = waiter->next;
+      if (!waiter->match_key ||
+        (waiter->key_code == event.key_code && waiter->key_modifiers == event.key_modifiers))
+      {
+        if (!waiter->persistent) {
+          unlink_key_waiter(*waiter);
+        }
+        // List goes from the newest waiter to the oldest one, prepending reverses the order
+        if (waiter->deliver_fn(*waiter, event)) {
+          waiter->next_ready = ready;
+          ready = waiter;
+        }
+      }
+      waiter = next;
+    }
+  }
+  while (ready != nullptr) {
+    key_waiter * waiter = ready;
+    ready = waiter->next_ready;
+    // Resumed coroutine is free to destroy the node and to await the next key press
+    waiter->resume_fn(waiter->coroutine_address);
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::dispatch_paste(std::string_view text)
+{
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const callbacks_table * table = callbacks_table_.load(std::memory_order_seq_cst);
+  for (const auto & data : table->paste_callbacks) {
+    data.paste_callback(text);
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::set_autorepeat_policy(const AutorepeatPolicy & policy)
+{
+  hold_window_ns_.store(
+    std::chrono::nanoseconds(policy.hold_window).count(), std::memory_order_relaxed);
+  coalesce_key_press_callbacks_.store(
+    policy.coalesce_key_press_callbacks, std::memory_order_relaxed);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::AutorepeatPolicy KeyboardHandlerBase::get_autorepeat_policy() const
+{
+  AutorepeatPolicy policy;
+  policy.coalesce_key_press_callbacks =
+    coalesce_key_press_callbacks_.load(std::memory_order_relaxed);
+  policy.hold_window = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::nanoseconds(hold_window_ns_.load(std::memory_order_relaxed)));
+  return policy;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerBase::is_autorepeat_tracking_enabled() const
+{
+  return coalesce_key_press_callbacks_.load(std::memory_order_relaxed) ||
+         autorepeat_callbacks_count_.load(std::memory_order_relaxed) > 0;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerBase::is_deadline_tracking_enabled() const
+{
+  return is_autorepeat_tracking_enabled() ||
+         trailing_edge_callbacks_count_.load(std::memory_order_relaxed) > 0 ||
+         key_sequences_count_.load(std::memory_order_relaxed) > 0;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerBase::can_coalesce_key_presses(
+  const KeyEvent & previous, const KeyEvent & next) const
+{
+  // Coalesced key presses would break key sequences of the repeated key, e.g. `g g`
+  return key_sequences_count_.load(std::memory_order_relaxed) == 0 &&
+         previous.key_code == next.key_code && previous.key_modifiers == next.key_modifiers &&
+         previous.event_type == next.event_type && next.event_type != KeyEventType::RELEASE &&
+         next.timestamp - previous.timestamp <=
+         std::chrono::nanoseconds(hold_window_ns_.load(std::memory_order_relaxed));
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::chrono::steady_clock::time_point KeyboardHandlerBase::check_deadlines(
+  std::chrono::steady_clock::time_point now)
+{
+  auto next_deadline = check_hold_end(now);
+  if (trailing_edge_callbacks_count_.load(std::memory_order_relaxed) > 0) {
+    next_deadline = std::min(next_deadline, call_deferred_callbacks(now));
+  }
+  if (key_sequences_count_.load(std::memory_order_relaxed) > 0) {
+    next_deadline = std::min(next_deadline, check_key_sequence_timeout(now));
+  }
+  return next_deadline;
+}
+
+std::chrono::steady_clock::time_point KeyboardHandlerBase::call_deferred_callbacks(
+  std::chrono::steady_clock::time_point now)
+{
+  auto next_deadline = std::chrono::steady_clock::time_point::max();
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const callbacks_table * table = callbacks_table_.load(std::memory_order_seq_cst);
+  for (const auto & deferred : table->trailing_edge_callbacks) {
+    if (deferred.data.rate_limiter->take_deferred_call(now, next_deadline)) {
+      deferred.data.callback(deferred.key_code, deferred.key_modifiers);
+    }
+  }
+  return next_deadline;
+}
+
+std::chrono::steady_clock::time_point KeyboardHandlerBase::check_hold_end(
+  std::chrono::steady_clock::time_point now)
+{
+  std::unique_lock<std::mutex> lk(hold_mutex_);
+  if (hold_repeat_count_ == 0) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  auto hold_end_time = hold_last_press_time_ +
+    std::chrono::nanoseconds(hold_window_ns_.load(std::memory_order_relaxed));
+  if (now <= hold_end_time) {
+    return hold_end_time;
+  }
+  lk.unlock();
+  end_hold();
+  return std::chrono::steady_clock::time_point::max();
+}
+
+void KeyboardHandlerBase::track_hold(const KeyEvent & event, size_t repeat_count)
+{
+  {
+    std::lock_guard<std::mutex> lk(hold_mutex_);
+    const bool is_held_key = hold_repeat_count_ > 0 && hold_key_code_ == event.key_code &&
+      hold_key_modifiers_ == event.key_modifiers;
+    if (event.event_type == KeyEventType::RELEASE) {
+      if (!is_held_key) {
+        return;
+      }
+      // Terminal reported release of the held key, no need to wait till hold window expires
+    } else if (hold_repeat_count_ == 0 ||
+      (is_held_key && event.timestamp - hold_last_press_time_ <=
+      std::chrono::nanoseconds(hold_window_ns_.load(std::memory_order_relaxed))))
+    {
+      hold_key_code_ = event.key_code;
+      hold_key_modifiers_ = event.key_modifiers;
+      hold_repeat_count_ += repeat_count;
+      hold_last_press_time_ = event.timestamp;
+      return;
+    }
+  }
+  // Held key was released or other key combination was pressed, previous hold is over
+  end_hold();
+  if (event.event_type == KeyEventType::RELEASE) {
+    return;
+  }
+  std::lock_guard<std::mutex> lk(hold_mutex_);
+  hold_key_code_ = event.key_code;
+  hold_key_modifiers_ = event.key_modifiers;
+  hold_repeat_count_ = repeat_count;
+  hold_last_press_time_ = event.timestamp;
+}
+
+void KeyboardHandlerBase::end_hold()
+{
+  KeyCode key_code;
+  KeyModifiers key_modifiers;
+  size_t repeat_count;
+  {
+    std::lock_guard<std::mutex> lk(hold_mutex_);
+    key_code = hold_key_code_;
+    key_modifiers = hold_key_modifiers_;
+    repeat_count = hold_repeat_count_;
+    hold_repeat_count_ = 0;
+  }
+  if (repeat_count == 0) {
+    return;
+  }
+  size_t slot = get_callbacks_slot(key_code, key_modifiers);
+  if (slot == CALLBACKS_SLOTS_COUNT) {
+    return;
+  }
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  const auto * callbacks =
+    get_slot_callbacks(*callbacks_table_.load(std::memory_order_seq_cst), slot);
+  if (callbacks == nullptr) {
+    return;
+  }
+  for (const auto & data : *callbacks) {
+    if (data.kind == callback_kind::HOLD_END) {
+      data.repeat_callback(key_code, key_modifiers, repeat_count);
+    }
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::record_parse_latency(std::chrono::steady_clock::time_point read_time)
+{
+#ifdef KEYBOARD_HANDLER_ENABLE_LATENCY_STATS
+  latency_histograms_->parse.record(std::chrono::steady_clock::now() - read_time);
+#else
+  (void)read_time;
+#endif
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerBase::LatencyStats KeyboardHandlerBase::get_latency_stats() const
+{
+  LatencyStats stats;
+  if (latency_histograms_) {
+    stats.enabled = true;
+    stats.parse = latency_histograms_->parse.snapshot();
+    stats.callbacks_start = latency_histograms_->callbacks_start.snapshot();
+    stats.callbacks_end = latency_histograms_->callbacks_end.snapshot();
+    stats.callbacks_duration = latency_histograms_->callbacks_duration.snapshot();
+  }
+  return stats;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+size_t KeyboardHandlerBase::get_callbacks_count() const
+{
+  callbacks_reader_guard reader_guard(retired_callbacks_tables_);
+  return callbacks_table_.load(std::memory_order_seq_cst)->callbacks_count;
+}
+
+void KeyboardHandlerBase::publish_callbacks_table(std::unique_ptr<const callbacks_table> new_table)
+{
+  // Old snapshot should be retired only after it can't be loaded by new readers
+  callbacks_table_.store(new_table.get(), std::memory_order_seq_cst);
+  std::unique_ptr<const callbacks_table> old_table = std::move(callbacks_table_owner_);
+  callbacks_table_owner_ = std::move(new_table);
+  autorepeat_callbacks_count_.store(
+    callbacks_table_owner_->autorepeat_callbacks_count, std::memory_order_relaxed);
+  trailing_edge_callbacks_count_.store(
+    callbacks_table_owner_->trailing_edge_callbacks.size(), std::memory_order_relaxed);
+  key_sequences_count_.store(
+    callbacks_table_owner_->key_sequences ?
+    callbacks_table_owner_->key_sequences->sequences_count : 0, std::memory_order_relaxed);
+  retired_callbacks_tables_.retire(std::move(old_table));
+}
+
+std::vector<KeyboardHandlerBase::callback_data> & KeyboardHandlerBase::modify_slot_callbacks(
+  callbacks_table & table, modified_callbacks & modified, size_t slot)
+{
+  const size_t chunk_index = slot / CALLBACKS_CHUNK_SIZE;
+  callbacks_chunk * chunk = nullptr;
+  if (modified.slots.empty()) {
+    for (size_t i = 0; i < modified.inline_slots_count; i++) {
+      const auto & modified_slot = modified.inline_slots[i];
+      if (modified_slot.slot == slot) {
+        return *modified_slot.callbacks;
+      }
+      if (modified_slot.slot / CALLBACKS_CHUNK_SIZE == chunk_index) {
+        chunk = modified_slot.chunk;
+      }
+    }
+    if (modified.inline_slots_count == modified_callbacks::INLINE_SLOTS_COUNT) {
+      modified.chunks.resize(table.chunks.size(), nullptr);
+      modified.slots.resize(CALLBACKS_SLOTS_COUNT, nullptr);
+      for (const auto & modified_slot : modified.inline_slots) {
+        modified.chunks[modified_slot.slot / CALLBACKS_CHUNK_SIZE] = modified_slot.chunk;
+        modified.slots[modified_slot.slot] = modified_slot.callbacks;
+        modified.slot_indices.push_back(modified_slot.slot);
+      }
+    }
+  }
+  if (!modified.slots.empty()) {
+    if (modified.slots[slot] != nullptr) {
+      return *modified.slots[slot];
+    }
+    chunk = modified.chunks[chunk_index];
+  }
+  if (chunk == nullptr) {
+    const auto & old_chunk = table.chunks[chunk_index];
+    auto new_chunk = old_chunk ?
+      std::make_shared<callbacks_chunk>(*old_chunk) : std::make_shared<callbacks_chunk>();
+    chunk = new_chunk.get();
+    table.chunks[chunk_index] = std::move(new_chunk);
+  }
+  auto & callbacks = chunk->slots[slot % CALLBACKS_CHUNK_SIZE];
+  auto new_callbacks = callbacks ?
+    std::make_shared<std::vector<callback_data>>(*callbacks) :
+    std::make_shared<std::vector<callback_data>>();
+  std::vector<callback_data> * modified_callbacks = new_callbacks.get();
+  if (modified.slots.empty()) {
+    modified.inline_slots[modified.inline_slots_count++] = {slot, chunk, modified_callbacks};
+  } else {
+    modified.slot_indices.push_back(slot);
+    modified.chunks[chunk_index] = chunk;
+    modified.slots[slot] = modified_callbacks;
+  }
+  callbacks = std::move(new_callbacks);
+  return *modified_callbacks;
+}
+
+void KeyboardHandlerBase::compact_deleted_callbacks(modified_callbacks & modified) noexcept
+{
+  auto compact = [this](std::vector<callback_data> & callbacks) {
+      size_t position = 0;
+      for (auto & data : callbacks) {
+        handle_slot & entry = get_handle_slot(data.handle);
+        if (entry.deleted) {
+          continue;
+        }
+        if (entry.position != position) {
+          callbacks[position] = std::move(data);
+          entry.position = position;
+        }
+        position++;
+      }
+      callbacks.resize(position);
+    };
+  if (modified.slots.empty()) {
+    for (size_t i = 0; i < modified.inline_slots_count; i++) {
+      compact(*modified.inline_slots[i].callbacks);
+    }
+  } else {
+    for (size_t slot : modified.slot_indices) {
+      compact(*modified.slots[slot]);
+    }
+  }
+}
+
+size_t KeyboardHandlerBase::get_callbacks_slot(KeyCode key_code, KeyModifiers key_modifiers)
+{
+  auto key_index = static_cast<size_t>(key_code);
+  auto modifiers_index = static_cast<size_t>(key_modifiers);
+  if (key_index >= static_cast<size_t>(KeyCode::END_OF_KEY_CODE_ENUM) ||
+    modifiers_index >= KEY_MODIFIERS_COMBINATIONS)
+  {
+    return CALLBACKS_SLOTS_COUNT;
+  }
+  return key_index * KEY_MODIFIERS_COMBINATIONS + modifiers_index;
 }
 
 KEYBOARD_HANDLER_PUBLIC
@@ -115,18 +1066,149 @@ std::string enum_key_modifiers_to_str(KeyboardHandlerBase::KeyModifiers key_modi
 
 KEYBOARD_HANDLER_PUBLIC
 void KeyboardHandlerBase::delete_key_press_callback(const callback_handle_t & handle) noexcept
+{
+  try {
+    delete_key_press_callbacks({handle});
+  } catch (const std::exception & e) {
+    std::cerr << "Can't delete callback: " << e.what() << std::endl;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerBase::delete_key_press_callbacks(
+  const std::vector<callback_handle_t> & handles) noexcept
 {
   std::lock_guard<std::mutex> lk(callbacks_mutex_);
-  for (auto it = callbacks_.begin(); it != callbacks_.end(); ++it) {
-    if (it->second.handle == handle) {
-      callbacks_.erase(it);
+  std::vector<callback_handle_t> deleted_handles;
+  try {
+    auto new_table = std::make_unique<callbacks_table>(*callbacks_table_owner_);
+    std::shared_ptr<key_sequence_trie> key_sequences;
+    modified_callbacks modified;
+    for (auto handle : handles) {
+      handle_slot * entry = find_handle_slot(handle);
+      if (entry == nullptr) {
+        continue;
+      }
+      const size_t slot = entry->callbacks_slot;
+      if (slot == KEY_SEQUENCE_CALLBACKS_SLOT) {
+        if (entry->deleted) {
+          continue;  // Duplicate handle
+        }
+        if (!key_sequences) {
+          key_sequences = std::make_shared<key_sequence_trie>(*new_table->key_sequences);
+        }
+        // Path of the sequence is kept in the entry, only the nodes on it are copied
+        key_sequences->remove(*entry->key_sequence, handle);
+        deleted_handles.push_back(handle);
+        entry->deleted = true;
+        continue;
+      }
+      if (slot == PASTE_CALLBACKS_SLOT) {
+        auto & paste_callbacks = new_table->paste_callbacks;
+        auto it = std::find_if(
+          paste_callbacks.begin(), paste_callbacks.end(),
+          [handle](const callback_data & data) {return data.handle == handle;});
+        if (it == paste_callbacks.end()) {
+          continue;  // Duplicate handle
+        }
+        paste_callbacks.erase(it);
+        deleted_handles.push_back(handle);
+        continue;
+      }
+      if (entry->deleted) {
+        continue;  // Duplicate handle
+      }
+      // Position stays valid till compaction, deleted callbacks are only marked meanwhile
+      const auto & data = modify_slot_callbacks(*new_table, modified, slot)[entry->position];
+      if (data.kind == callback_kind::KEY_REPEAT || data.kind == callback_kind::HOLD_END) {
+        new_table->autorepeat_callbacks_count--;
+      }
+      if (data.rate_limiter &&
+        data.rate_limiter->get_policy().kind == RateLimitPolicy::Kind::TRAILING_EDGE)
+      {
+        auto & trailing_edge_callbacks = new_table->trailing_edge_callbacks;
+        trailing_edge_callbacks.erase(
+          std::remove_if(
+            trailing_edge_callbacks.begin(), trailing_edge_callbacks.end(),
+            [handle](const key_callback & deferred) {return deferred.data.handle == handle;}),
+          trailing_edge_callbacks.end());
+      }
+      deleted_handles.push_back(handle);
+      entry->deleted = true;
+    }
+    if (deleted_handles.empty()) {
       return;
     }
+    compact_deleted_callbacks(modified);
+    if (key_sequences) {
+      if (key_sequences->sequences_count == 0) {
+        key_sequences.reset();
+      }
+      new_table->key_sequences = std::move(key_sequences);
+    }
+    new_table->callbacks_count -= deleted_handles.size();
+    publish_callbacks_table(std::move(new_table));
+    for (auto handle : deleted_handles) {
+      release_handle(handle);
+    }
+  } catch (const std::exception & e) {
+    // Nothing is published before the last allocation, callbacks stay registered
+    for (auto handle : deleted_handles) {
+      get_handle_slot(handle).deleted = false;
+    }
+    std::cerr << "Can't delete callbacks: " << e.what() << std::endl;
   }
 }
 
-KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::get_new_handle()
+KeyboardHandlerBase::callback_handle_t KeyboardHandlerBase::get_new_handle(
+  size_t callbacks_slot, size_t position)
 {
-  static std::atomic<callback_handle_t> handle_count{0};
-  return handle_count.fetch_add(1, std::memory_order_relaxed) + 1;
+  uint32_t index = 0;
+  if (free_handle_slots_.empty()) {
+    if (handle_slots_.size() > std::numeric_limits<uint32_t>::max()) {
+      throw std::length_error("Too many callbacks registered in keyboard handler");
+    }
+    handle_slots_.emplace_back();
+    index = static_cast<uint32_t>(handle_slots_.size() - 1);
+  } else {
+    index = free_handle_slots_.back();
+    free_handle_slots_.pop_back();
+  }
+  handle_slot & entry = handle_slots_[index];
+  entry.callbacks_slot = callbacks_slot;
+  entry.position = position;
+  entry.in_use = true;
+  return (static_cast<callback_handle_t>(entry.generation) << 32) | index;
+}
+
+KeyboardHandlerBase::handle_slot * KeyboardHandlerBase::find_handle_slot(
+  callback_handle_t handle)
+{
+  const auto index = static_cast<size_t>(handle & std::numeric_limits<uint32_t>::max());
+  const auto generation = static_cast<uint32_t>(handle >> 32);
+  if (index >= handle_slots_.size()) {
+    return nullptr;
+  }
+  handle_slot & entry = handle_slots_[index];
+  if (!entry.in_use || entry.generation != generation) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+void KeyboardHandlerBase::release_handle(callback_handle_t handle) noexcept
+{
+  const auto index = static_cast<uint32_t>(handle & std::numeric_limits<uint32_t>::max());
+  handle_slot & entry = handle_slots_[index];
+  entry.in_use = false;
+  entry.deleted = false;
+  entry.key_sequence.reset();
+  // Generation 0 is reserved to never produce invalid_handle
+  entry.generation = entry.generation == std::numeric_limits<uint32_t>::max() ?
+    1 : entry.generation + 1;
+  try {
+    free_handle_slots_.push_back(index);
+  } catch (const std::bad_alloc &) {
+    // Entry will not be reused, but handle is stale anyway
+  }
 }
@@ -0,0 +1,377 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "keyboard_handler/keyboard_handler_reactor.hpp"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+
+KEYBOARD_HANDLER_PUBLIC
+std::shared_ptr<KeyboardHandlerReactor> KeyboardHandlerReactor::get_shared_instance()
+{
+  static std::mutex shared_instance_mutex;
+  static std::weak_ptr<KeyboardHandlerReactor> shared_instance;
+  std::lock_guard<std::mutex> lk(shared_instance_mutex);
+  auto reactor = shared_instance.lock();
+  if (!reactor) {
+    reactor = std::make_shared<KeyboardHandlerReactor>();
+    shared_instance = reactor;
+  }
+  return reactor;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+size_t KeyboardHandlerReactor::get_attached_count() const
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  return attached_handlers_.size();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::thread::id KeyboardHandlerReactor::get_thread_id() const
+{
+  return reactor_thread_.get_id();
+}
+
+template<typename Function>
+bool KeyboardHandlerReactor::call_handler(
+  KeyboardHandlerUnixImpl & keyboard_handler, Function && function)
+{
+  try {
+    return function();
+  } catch (...) {
+    keyboard_handler.thread_exception_ptr = std::current_exception();
+    return false;
+  }
+}
+
+template<typename Function>
+void KeyboardHandlerReactor::call_attached_handler(
+  std::unique_lock<std::mutex> & lk, uint64_t registration_id, attached_handler & attached,
+  Function && function)
+{
+  // Entry isn't removed from attached_handlers_ while it's in flight, see detach()
+  attached.in_flight = true;
+  lk.unlock();
+  bool input_open = call_handler(*attached.keyboard_handler, std::forward<Function>(function));
+  lk.lock();
+  attached.in_flight = false;
+  if (attached.detached) {
+    attached_handlers_.erase(registration_id);
+  } else if (!input_open) {
+    finished_handlers_.push_back(registration_id);
+  }
+  in_flight_cv_.notify_all();
+}
+
+void KeyboardHandlerReactor::detach_finished_handlers(std::unique_lock<std::mutex> & lk)
+{
+  std::vector<uint64_t> finished_handlers;
+  finished_handlers.swap(finished_handlers_);
+  for (uint64_t registration_id : finished_handlers) {
+    auto it = attached_handlers_.find(registration_id);
+    if (it == attached_handlers_.end() || it->second.detached) {
+      continue;
+    }
+#ifdef __linux__
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+#endif
+    // Keyboard handler stays attached till its input is finished, so detach() waits for it
+    auto & attached = it->second;
+    attached.in_flight = true;
+    lk.unlock();
+    attached.keyboard_handler->finish_input();
+    lk.lock();
+    attached_handlers_.erase(registration_id);
+    in_flight_cv_.notify_all();
+  }
+}
+
+#ifdef __linux__
+namespace
+{
+short to_poll_events(uint32_t epoll_events)
+{
+  short revents = 0;
+  if ((epoll_events & EPOLLIN) != 0) {
+    revents |= POLLIN;
+  }
+  if ((epoll_events & EPOLLHUP) != 0) {
+    revents |= POLLHUP;
+  }
+  if ((epoll_events & EPOLLERR) != 0) {
+    revents |= POLLERR;
+  }
+  return revents;
+}
+}  // namespace
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerReactor::KeyboardHandlerReactor()
+{
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    throw std::runtime_error("Error in epoll_create1(). errno = " + std::to_string(errno));
+  }
+  // Used to wake up reactor thread blocked in epoll_wait() when we need to exit
+  wake_up_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = WAKE_UP_ID;
+  if (wake_up_fd_ == -1 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_up_fd_, &event) == -1) {
+    int error = errno;
+    if (wake_up_fd_ != -1) {
+      close(wake_up_fd_);
+    }
+    close(epoll_fd_);
+    throw std::runtime_error("Error in eventfd(). errno = " + std::to_string(error));
+  }
+  // Let SIGINT handler stop input of the attached keyboard handlers right away
+  if (!KeyboardHandlerUnixImpl::register_signal_wake_up_fd(wake_up_fd_)) {
+    std::cerr << "Too many keyboard handlers, reactor will notice SIGINT only after the next "
+      "key press." << std::endl;
+  }
+  try {
+    reactor_thread_ = std::thread(&KeyboardHandlerReactor::reactor_thread_loop, this);
+  } catch (...) {
+    KeyboardHandlerUnixImpl::unregister_signal_wake_up_fd(wake_up_fd_);
+    close(wake_up_fd_);
+    close(epoll_fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerReactor::~KeyboardHandlerReactor()
+{
+  exit_ = true;
+  wake_up();
+  if (reactor_thread_.joinable()) {
+    reactor_thread_.join();
+  }
+  KeyboardHandlerUnixImpl::unregister_signal_wake_up_fd(wake_up_fd_);
+  close(wake_up_fd_);
+  close(epoll_fd_);
+  try {
+    if (thread_exception_ptr_ != nullptr) {
+      std::rethrow_exception(thread_exception_ptr_);
+    }
+  } catch (const std::exception & e) {
+    std::cerr << "Caught exception: \"" << e.what() << "\"\n";
+  } catch (...) {
+    std::cerr << "Caught unknown exception" << std::endl;
+  }
+}
+
+void KeyboardHandlerReactor::attach(KeyboardHandlerUnixImpl * keyboard_handler, int fd)
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  uint64_t registration_id = last_registration_id_ + 1;
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = registration_id;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+    throw std::runtime_error("Error in epoll_ctl(). errno = " + std::to_string(errno));
+  }
+  last_registration_id_ = registration_id;
+  attached_handlers_.emplace(
+    registration_id,
+    attached_handler{keyboard_handler, fd, std::chrono::steady_clock::time_point::max()});
+  // Let reactor thread take timeouts of the new keyboard handler into account
+  wake_up();
+}
+
+bool KeyboardHandlerReactor::detach(KeyboardHandlerUnixImpl * keyboard_handler)
+{
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto find_handler = [this, keyboard_handler]() {
+      return std::find_if(
+        attached_handlers_.begin(), attached_handlers_.end(),
+        [keyboard_handler](const auto & entry) {
+          return entry.second.keyboard_handler == keyboard_handler && !entry.second.detached;
+        });
+    };
+  auto it = find_handler();
+  if (it != attached_handlers_.end() && it->second.in_flight) {
+    if (std::this_thread::get_id() == reactor_thread_.get_id()) {
+      // Detached from its own callback, reactor thread removes it once the callback returns
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+      it->second.detached = true;
+      return true;
+    }
+    // Wait only for the call of this keyboard handler, the others are not blocked
+    in_flight_cv_.wait(
+      lk, [&it, &find_handler, this]() {
+        it = find_handler();
+        return it == attached_handlers_.end() || !it->second.in_flight;
+      });
+  }
+  if (it == attached_handlers_.end()) {
+    return false;
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+  attached_handlers_.erase(it);
+  return true;
+}
+
+void KeyboardHandlerReactor::wake_up() noexcept
+{
+  const uint64_t wake_up_value = 1;
+  if (write(wake_up_fd_, &wake_up_value, sizeof(wake_up_value)) == -1 && errno != EAGAIN) {
+    std::cerr << "Error in write() to wake up eventfd. errno = " << errno << std::endl;
+  }
+}
+
+void KeyboardHandlerReactor::reactor_thread_loop()
+{
+  using std::chrono::steady_clock;
+  static constexpr int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  char buffer[KeyboardHandlerUnixImpl::INPUT_BUFFER_SIZE];
+  // Keyboard handlers are called without mutex_ held, so they are iterated by registration
+  // number and looked up again before each call
+  std::vector<uint64_t> registration_ids;
+  try {
+    std::unique_lock<std::mutex> lk(mutex_);
+    while (!exit_.load()) {
+      // The same steps as in the own input thread of the keyboard handler, for each of them
+      auto now = steady_clock::now();
+      registration_ids.clear();
+      for (const auto & entry : attached_handlers_) {
+        registration_ids.push_back(entry.first);
+      }
+      for (uint64_t registration_id : registration_ids) {
+        auto it = attached_handlers_.find(registration_id);
+        if (it == attached_handlers_.end()) {
+          continue;  // Detached while previous keyboard handler was called
+        }
+        auto & attached = it->second;
+        call_attached_handler(
+          lk, registration_id, attached, [&attached, now]() {
+            int timeout = attached.keyboard_handler->prepare_to_wait_for_input();
+            attached.deadline = timeout < 0 ? steady_clock::time_point::max() :
+              now + std::chrono::milliseconds(timeout);
+            return !attached.keyboard_handler->is_exit_requested();
+          });
+      }
+      detach_finished_handlers(lk);
+
+      auto nearest_deadline = steady_clock::time_point::max();
+      for (const auto & entry : attached_handlers_) {
+        nearest_deadline = std::min(nearest_deadline, entry.second.deadline);
+      }
+      int timeout = -1;
+      if (nearest_deadline != steady_clock::time_point::max()) {
+        timeout = static_cast<int>(
+          std::max(
+            std::chrono::ceil<std::chrono::milliseconds>(nearest_deadline - now).count(),
+            std::chrono::milliseconds::rep{0}));
+      }
+      lk.unlock();
+      int ready = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+      int error = errno;
+      lk.lock();
+      if (ready < 0) {
+        if (error == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Error in epoll_wait(). errno = " + std::to_string(error));
+      }
+
+      for (int i = 0; i < ready; i++) {
+        if (events[i].data.u64 == WAKE_UP_ID) {
+          uint64_t wake_up_value;
+          ssize_t ret = read(wake_up_fd_, &wake_up_value, sizeof(wake_up_value));
+          (void)ret;
+          continue;
+        }
+        auto it = attached_handlers_.find(events[i].data.u64);
+        if (it == attached_handlers_.end() || it->second.detached) {
+          continue;  // Detached while reactor thread was waiting
+        }
+        auto & attached = it->second;
+        short revents = to_poll_events(events[i].events);
+        attached.deadline = steady_clock::time_point::max();
+        call_attached_handler(
+          lk, it->first, attached, [&attached, revents, &buffer]() {
+            return attached.keyboard_handler->handle_input_events(
+              revents, buffer, sizeof(buffer));
+          });
+      }
+
+      now = steady_clock::now();
+      for (uint64_t registration_id : registration_ids) {
+        auto it = attached_handlers_.find(registration_id);
+        if (it == attached_handlers_.end() || it->second.detached ||
+          it->second.deadline > now)
+        {
+          continue;
+        }
+        auto & attached = it->second;
+        call_attached_handler(
+          lk, registration_id, attached, [&attached]() {
+            attached.keyboard_handler->handle_input_timeout();
+            return true;
+          });
+      }
+      detach_finished_handlers(lk);
+    }
+  } catch (...) {
+    thread_exception_ptr_ = std::current_exception();
+  }
+}
+
+#else  // #ifdef __linux__
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerReactor::KeyboardHandlerReactor()
+{
+  throw std::runtime_error("KeyboardHandlerReactor requires epoll, not available on this OS.");
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerReactor::~KeyboardHandlerReactor() = default;
+
+void KeyboardHandlerReactor::attach(KeyboardHandlerUnixImpl *, int)
+{
+  throw std::runtime_error("KeyboardHandlerReactor requires epoll, not available on this OS.");
+}
+
+bool KeyboardHandlerReactor::detach(KeyboardHandlerUnixImpl *)
+{
+  return false;
+}
+
+void KeyboardHandlerReactor::wake_up() noexcept {}
+
+void KeyboardHandlerReactor::reactor_thread_loop() {}
+
+#endif  // #ifdef __linux__
+#endif  // #ifndef _WIN32
@@ -13,34 +13,57 @@
 // limitations under the License.
 
 #ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
 #include <csignal>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include "keyboard_handler/csi_modifiers_decoder.hpp"
 #include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+#include "keyboard_handler/kitty_keyboard_decoder.hpp"
 
-std::atomic_bool KeyboardHandlerUnixImpl::exit_{false};
-struct termios KeyboardHandlerUnixImpl::old_term_settings_ = {};
-KeyboardHandlerUnixImpl::tcsetattrFunction KeyboardHandlerUnixImpl::tcsetattr_fn_ = tcsetattr;
+std::atomic_size_t KeyboardHandlerUnixImpl::signal_count_{0};
+KeyboardHandlerUnixImpl::signal_wake_up_entry
+KeyboardHandlerUnixImpl::signal_wake_up_fds_[KeyboardHandlerUnixImpl::MAX_SIGNAL_WAKE_UP_FDS];
+KeyboardHandlerUnixImpl::saved_terminal_settings
+KeyboardHandlerUnixImpl::saved_terminals_[KeyboardHandlerUnixImpl::MAX_SAVED_TERMINALS];
+std::mutex KeyboardHandlerUnixImpl::saved_terminals_mutex_;
 KeyboardHandlerUnixImpl::signal_handler_type KeyboardHandlerUnixImpl::old_sigint_handler_ =
   SIG_DFL;
+size_t KeyboardHandlerUnixImpl::sigint_handler_users_count_ = 0;
 
 void KeyboardHandlerUnixImpl::on_signal(int signal_number)
 {
   auto old_sigint_handler = KeyboardHandlerUnixImpl::get_old_sigint_handler();
   // Restore buffer mode for stdin
   if (old_sigint_handler == SIG_DFL) {
-    if (KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin()) {
+    if (KeyboardHandlerUnixImpl::restore_buffer_mode_for_all_terminals()) {
       _exit(EXIT_SUCCESS);
     } else {
       _exit(EXIT_FAILURE);
     }
   } else {
-    exit_ = true;
-    KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin();
+    signal_count_.fetch_add(1);
+    // write() is async-signal-safe, use it to wake up input threads blocked in poll() and
+    // reactors blocked in epoll_wait()
+    for (auto & entry : signal_wake_up_fds_) {
+      int wake_up_fd = entry.fd.load();
+      if (wake_up_fd != -1) {
+        const uint64_t wake_up_value = 1;
+        ssize_t ret = write(wake_up_fd, &wake_up_value, sizeof(wake_up_value));
+        (void)ret;
+      }
+    }
+    KeyboardHandlerUnixImpl::restore_buffer_mode_for_all_terminals();
   }
 
   if ((old_sigint_handler != SIG_ERR) &&
@@ -51,69 +74,442 @@ void KeyboardHandlerUnixImpl::on_signal(int signal_number)
   }
 }
 
+namespace
+{
+/// \brief Replacement for poll() which unconditionally reports stdin as ready for reading.
+/// \details Used when read function provided without poll function, in this case read function
+/// is responsible for blocking or returning 0 by timeout.
+int stdin_always_ready_poll(struct pollfd * fds, nfds_t /* nfds */, int /* timeout */)
+{
+  fds[0].revents = POLLIN;
+  fds[1].revents = 0;
+  return 1;
+}
+
+int open_terminal_device(const std::string & device_path)
+{
+  // Opened for writing too, so terminal modes could be enabled through the same descriptor
+  int fd = open(device_path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (fd == -1 && errno == EACCES) {
+    fd = open(device_path.c_str(), O_RDONLY | O_NOCTTY | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    throw std::runtime_error(
+            "Error in open(\"" + device_path + "\"). errno = " + std::to_string(errno));
+  }
+  return fd;
+}
+
+int open_command_stream(const std::string & path)
+{
+  // Don't block in open() until writer opens FIFO, poll() will wait for the data instead
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(
+            "Error in open(\"" + path + "\"). errno = " + std::to_string(errno));
+  }
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    int error = errno;
+    close(fd);
+    throw std::runtime_error("Error in fcntl(). errno = " + std::to_string(error));
+  }
+  return fd;
+}
+
+/// \brief DEC private mode 2004, makes terminal to enclose pasted text in
+/// TerminalSequenceTokenizer::PASTE_START and TerminalSequenceTokenizer::PASTE_END.
+constexpr std::string_view ENABLE_BRACKETED_PASTE_SEQUENCE = "\x1b[?2004h";
+constexpr std::string_view DISABLE_BRACKETED_PASTE_SEQUENCE = "\x1b[?2004l";
+
+#ifdef KEYBOARD_HANDLER_ENABLE_LATENCY_STATS
+constexpr bool LATENCY_STATS_ENABLED = true;
+#else
+constexpr bool LATENCY_STATS_ENABLED = false;
+#endif
+}  // namespace
+
 KEYBOARD_HANDLER_PUBLIC
 KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl()
-: KeyboardHandlerUnixImpl(read, isatty, tcgetattr, tcsetattr) {}
+: KeyboardHandlerUnixImpl(read, poll, isatty, tcgetattr, tcsetattr) {}
 
 KEYBOARD_HANDLER_PUBLIC
 KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(bool install_signal_handler)
-: KeyboardHandlerUnixImpl(read, isatty, tcgetattr, tcsetattr, install_signal_handler) {}
+: KeyboardHandlerUnixImpl(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler) {}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  bool install_signal_handler, size_t dispatch_queue_capacity)
+: KeyboardHandlerUnixImpl(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler,
+    dispatch_queue_capacity) {}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  const std::string & device_path, bool install_signal_handler, size_t dispatch_queue_capacity)
+: input_fd_(open_terminal_device(device_path)), owns_input_fd_(true)
+{
+  try {
+    init(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler, dispatch_queue_capacity);
+  } catch (...) {
+    close(input_fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  const char * device_path, bool install_signal_handler, size_t dispatch_queue_capacity)
+: KeyboardHandlerUnixImpl(std::string(device_path), install_signal_handler,
+    dispatch_queue_capacity) {}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  int input_fd, bool install_signal_handler, size_t dispatch_queue_capacity)
+: KeyboardHandlerUnixImpl(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler,
+    dispatch_queue_capacity, input_fd) {}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  const std::string & device_path, bool install_signal_handler,
+  std::shared_ptr<KeyboardHandlerReactor> reactor, size_t dispatch_queue_capacity)
+: input_fd_(open_terminal_device(device_path)), owns_input_fd_(true), reactor_(std::move(reactor))
+{
+  try {
+    init(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler, dispatch_queue_capacity);
+  } catch (...) {
+    close(input_fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  int input_fd, bool install_signal_handler, std::shared_ptr<KeyboardHandlerReactor> reactor,
+  size_t dispatch_queue_capacity)
+: input_fd_(input_fd), reactor_(std::move(reactor))
+{
+  init(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler, dispatch_queue_capacity);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  int input_fd, CommandStreamFormat format, size_t dispatch_queue_capacity)
+: input_fd_(input_fd), command_stream_(true), command_stream_format_(format)
+{
+  init(read, poll, isatty, tcgetattr, tcsetattr, false, dispatch_queue_capacity);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  const std::string & path, CommandStreamFormat format, size_t dispatch_queue_capacity)
+: input_fd_(open_command_stream(path)), owns_input_fd_(true), command_stream_(true),
+  command_stream_format_(format)
+{
+  try {
+    init(read, poll, isatty, tcgetattr, tcsetattr, false, dispatch_queue_capacity);
+  } catch (...) {
+    close(input_fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  ExternalEventLoop, int input_fd, bool install_signal_handler)
+: input_fd_(input_fd), external_event_loop_(true)
+{
+  init(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler, 0);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  ExternalEventLoop, const std::string & device_path, bool install_signal_handler)
+: input_fd_(open_terminal_device(device_path)), owns_input_fd_(true), external_event_loop_(true)
+{
+  try {
+    init(read, poll, isatty, tcgetattr, tcsetattr, install_signal_handler, 0);
+  } catch (...) {
+    close(input_fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  ExternalEventLoop,
+  const readFunction & read_fn,
+  const pollFunction & poll_fn,
+  const isattyFunction & isatty_fn,
+  const tcgetattrFunction & tcgetattr_fn,
+  const tcsetattrFunction & tcsetattr_fn,
+  int input_fd)
+: input_fd_(input_fd), external_event_loop_(true)
+{
+  init(read_fn, poll_fn, isatty_fn, tcgetattr_fn, tcsetattr_fn, false, 0);
+}
 
 std::tuple<KeyboardHandlerBase::KeyCode, KeyboardHandlerBase::KeyModifiers>
 KeyboardHandlerUnixImpl::parse_input(const char * buff, ssize_t read_bytes)
+{
+  return parse_input(std::string_view(buff, static_cast<size_t>(read_bytes)));
+}
+
+std::tuple<KeyboardHandlerBase::KeyCode, KeyboardHandlerBase::KeyModifiers>
+KeyboardHandlerUnixImpl::parse_input(std::string_view input, KeyEventType & event_type) const
+{
+  event_type = KeyEventType::PRESS;
+  auto key_code_and_modifiers = parse_input(input);
+  KittyKeyboardDecoder::Result key_event;
+  if (std::get<0>(key_code_and_modifiers) == KeyCode::UNKNOWN &&
+    KittyKeyboardDecoder::decode(input.data(), input.size(), key_event))
+  {
+    event_type = key_event.event_type;
+    key_code_and_modifiers = parse_input(std::string_view(key_event.sequence, key_event.length));
+    if (std::get<0>(key_code_and_modifiers) != KeyCode::UNKNOWN) {
+      std::get<1>(key_code_and_modifiers) =
+        std::get<1>(key_code_and_modifiers) | key_event.key_modifiers;
+    }
+  }
+  return key_code_and_modifiers;
+}
+
+std::tuple<KeyboardHandlerBase::KeyCode, KeyboardHandlerBase::KeyModifiers>
+KeyboardHandlerUnixImpl::parse_input(std::string_view input) const
 {
 #ifdef PRINT_DEBUG_INFO
-  std::cout << "Read " << read_bytes << " bytes: ";
-  if (read_bytes > 1) {
+  std::cout << "Read " << input.size() << " bytes: ";
+  if (input.size() > 1) {
     std::cout << "[] = {";
-    for (ssize_t i = 0; i < read_bytes; ++i) {
-      std::cout << static_cast<int>(buff[i]) << ", ";
+    for (char c : input) {
+      std::cout << static_cast<int>(c) << ", ";
     }
     std::cout << "'\\0'};";
   } else {
-    std::cout << " : " << static_cast<int>(buff[0]) << " : '" << buff[0] << "'";
+    std::cout << " : " << static_cast<int>(input[0]) << " : '" << input[0] << "'";
   }
   std::cout << std::endl;
 #endif
   KeyCode pressed_key_code = KeyCode::UNKNOWN;
   KeyModifiers key_modifiers = KeyModifiers::NONE;
+  RetiredObjects<TerminfoKeyMap>::ReaderGuard reader_guard(retired_terminfo_key_maps_);
+  const TerminalSequenceTrie * key_codes_trie = key_codes_trie_.load(std::memory_order_seq_cst);
 
-  std::string buff_to_search = buff;
-  ssize_t bytes_in_keycode = read_bytes;
+  const char * sequence = input.data();
+  size_t sequence_length = input.size();
 
-  if (read_bytes == 2 && buff[0] == 27) {
+  if (sequence_length == 2 && sequence[0] == 27) {
     key_modifiers = KeyModifiers::ALT;
-    buff_to_search = buff[1];
-    bytes_in_keycode = 1;
+    sequence++;
+    sequence_length = 1;
   }
 
-  if (bytes_in_keycode == 1 && buff_to_search[0] >= 'A' && buff_to_search[0] <= 'Z') {
-    char original_key_code = buff_to_search[0];
-    original_key_code += 32;
-    buff_to_search = original_key_code;
-    key_modifiers = key_modifiers | KeyModifiers::SHIFT;
+  if (sequence_length != 1) {
+    pressed_key_code = key_codes_trie->find(sequence, sequence_length);
+    CsiModifiersDecoder::Result unmodified;
+    if (pressed_key_code == KeyCode::UNKNOWN &&
+      CsiModifiersDecoder::decode(sequence, sequence_length, unmodified))
+    {
+      // Modified cursor, editing or function key, e.g. Ctrl+Right `ESC [ 1 ; 5 C`
+      pressed_key_code = key_codes_trie->find(unmodified.sequence, unmodified.length);
+      if (pressed_key_code != KeyCode::UNKNOWN) {
+        key_modifiers = key_modifiers | unmodified.key_modifiers;
+      }
+    }
+    return std::make_tuple(pressed_key_code, key_modifiers);
   }
 
-  auto key_map_it = key_codes_map_.find(buff_to_search);
-  if (key_map_it != key_codes_map_.end()) {
-    pressed_key_code = key_map_it->second;
+  char key_char = sequence[0];
+  if (key_char >= 'A' && key_char <= 'Z') {
+    key_char += 32;
+    key_modifiers = key_modifiers | KeyModifiers::SHIFT;
   }
 
-  // first search in key_codes_map_
-  if (pressed_key_code == KeyCode::UNKNOWN && bytes_in_keycode == 1 &&
-    static_cast<signed char>(buff_to_search[0]) >= 0 && buff_to_search[0] <= 26)
+  pressed_key_code = key_codes_trie->find(&key_char, 1);
+
+  // first search in key_codes_trie_
+  if (pressed_key_code == KeyCode::UNKNOWN &&
+    static_cast<signed char>(key_char) >= 0 && key_char <= 26)
   {
-    char original_key_code = buff_to_search[0];
-    original_key_code += 96;    // small chars
-    buff_to_search = original_key_code;
+    key_char += 96;    // small chars
     key_modifiers = key_modifiers | KeyModifiers::CTRL;
+    pressed_key_code = key_codes_trie->find(&key_char, 1);
+  }
+  return std::make_tuple(pressed_key_code, key_modifiers);
+}
 
-    auto key_map_it = key_codes_map_.find(buff_to_search);
-    if (key_map_it != key_codes_map_.end()) {
-      pressed_key_code = key_map_it->second;
+void KeyboardHandlerUnixImpl::handle_terminal_sequence(const char * sequence, size_t length)
+{
+  if (KittyKeyboardDecoder::is_protocol_reply(sequence, length)) {
+    kitty_keyboard_protocol_active_.store(true, std::memory_order_relaxed);
+    return;
+  }
+  KeyEventType event_type;
+  auto key_code_and_modifiers = parse_input(std::string_view(sequence, length), event_type);
+  handle_key_press(
+    std::get<0>(key_code_and_modifiers), std::get<1>(key_code_and_modifiers),
+    std::string_view(sequence, length), event_type);
+}
+
+void KeyboardHandlerUnixImpl::handle_paste(const char * text, size_t length)
+{
+  // Keep order of the key presses typed before paste
+  dispatch_pending_key_presses();
+  dispatch_paste(std::string_view(text, length));
+}
+
+void KeyboardHandlerUnixImpl::handle_key_press(
+  KeyCode pressed_key_code, KeyModifiers key_modifiers, std::string_view raw,
+  KeyEventType event_type)
+{
+#ifdef PRINT_DEBUG_INFO
+  auto modifiers_str = enum_key_modifiers_to_str(key_modifiers);
+  std::cout << "pressed key: " << modifiers_str;
+  if (!modifiers_str.empty()) {
+    std::cout << " + ";
+  }
+  std::cout << "'" << enum_key_code_to_str(pressed_key_code) << "'" << std::endl;
+#endif
+  if (LATENCY_STATS_ENABLED) {
+    record_parse_latency(read_time_);
+  }
+  SpscQueue<KeyEvent> * event_queue = event_queue_.load(std::memory_order_acquire);
+  if (event_queue != nullptr) {
+    push_to_event_queue(
+      *event_queue, KeyEvent{pressed_key_code, key_modifiers, read_time_, event_type});
+  }
+  if (journal_writer_.load(std::memory_order_relaxed) != nullptr) {
+    RetiredObjects<KeystrokeJournalWriter>::ReaderGuard reader_guard(retired_journal_writers_);
+    KeystrokeJournalWriter * journal_writer = journal_writer_.load(std::memory_order_seq_cst);
+    if (journal_writer != nullptr) {
+      journal_writer->record(
+        KeyEvent{pressed_key_code, key_modifiers, read_time_, event_type}, raw);
     }
   }
-  return std::make_tuple(pressed_key_code, key_modifiers);
+  if (dispatch_queue_) {
+    push_to_dispatch_queue(KeyEvent{pressed_key_code, key_modifiers, read_time_, event_type});
+  } else if (coalesce_key_presses_) {
+    KeyEvent event{pressed_key_code, key_modifiers, read_time_, event_type};
+    if (pending_repeat_count_ > 0 && can_coalesce_key_presses(pending_key_press_, event)) {
+      pending_repeat_count_++;
+      pending_key_press_.timestamp = event.timestamp;
+    } else {
+      dispatch_pending_key_presses();
+      pending_key_press_ = event;
+      pending_repeat_count_ = 1;
+    }
+  } else if (LATENCY_STATS_ENABLED || event_type != KeyEventType::PRESS) {
+    dispatch_key_press(KeyEvent{pressed_key_code, key_modifiers, read_time_, event_type});
+  } else {
+    dispatch_key_press(pressed_key_code, key_modifiers);
+  }
+}
+
+void KeyboardHandlerUnixImpl::dispatch_pending_key_presses()
+{
+  if (pending_repeat_count_ > 0) {
+    size_t repeat_count = pending_repeat_count_;
+    pending_repeat_count_ = 0;
+    dispatch_key_press(pending_key_press_, repeat_count);
+  }
+}
+
+void KeyboardHandlerUnixImpl::push_to_dispatch_queue(const KeyEvent & event)
+{
+  if (!dispatch_queue_->try_push(event)) {
+    dispatch_queue_dropped_events_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  size_t depth = dispatch_queue_->size();
+  if (depth > dispatch_queue_high_water_mark_.load(std::memory_order_relaxed)) {
+    // Only input thread updates high water mark, no need for compare and swap
+    dispatch_queue_high_water_mark_.store(depth, std::memory_order_relaxed);
+  }
+  // Pairs with the fence in dispatcher_thread_loop(), either dispatcher sees the new event or we
+  // see that dispatcher is going to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (dispatcher_sleeping_.load(std::memory_order_relaxed)) {
+    {
+      std::lock_guard<std::mutex> lk(dispatcher_mutex_);
+    }
+    dispatcher_cv_.notify_one();
+  }
+}
+
+void KeyboardHandlerUnixImpl::push_to_event_queue(
+  SpscQueue<KeyEvent> & event_queue, const KeyEvent & event)
+{
+  if (!event_queue.try_push(event)) {
+    event_queue_overflow_count_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // Pairs with the fence in wait_event(), either waiting thread sees the new event or we see
+  // that it is going to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (event_queue_waiting_.load(std::memory_order_relaxed)) {
+    {
+      std::lock_guard<std::mutex> lk(event_queue_mutex_);
+    }
+    event_queue_cv_.notify_one();
+  }
+}
+
+void KeyboardHandlerUnixImpl::dispatcher_thread_loop()
+{
+  try {
+    KeyEvent event;
+    while (true) {
+      if (dispatch_queue_->try_pop(event)) {
+        size_t repeat_count = 1;
+        if (is_autorepeat_tracking_enabled()) {
+          // Merge repeats of the same key combination which are already waiting in the queue
+          const KeyEvent * next_event = nullptr;
+          while ((next_event = dispatch_queue_->front()) != nullptr &&
+            can_coalesce_key_presses(event, *next_event))
+          {
+            event.timestamp = next_event->timestamp;
+            dispatch_queue_->pop();
+            repeat_count++;
+          }
+        }
+        dispatch_key_press(event, repeat_count);
+        continue;
+      }
+      auto deadline = std::chrono::steady_clock::time_point::max();
+      if (is_deadline_tracking_enabled()) {
+        deadline = check_deadlines(std::chrono::steady_clock::now());
+      }
+      std::unique_lock<std::mutex> lk(dispatcher_mutex_);
+      dispatcher_sleeping_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (dispatch_queue_->empty()) {
+        // Deliver all pending key presses before exit
+        if (dispatcher_exit_) {
+          break;
+        }
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+          dispatcher_cv_.wait(lk);
+        } else {
+          dispatcher_cv_.wait_until(lk, deadline);
+        }
+      }
+      dispatcher_sleeping_.store(false, std::memory_order_relaxed);
+    }
+  } catch (...) {
+    dispatcher_exception_ptr_ = std::current_exception();
+  }
+}
+
+void KeyboardHandlerUnixImpl::stop_dispatcher_thread() noexcept
+{
+  if (!dispatcher_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(dispatcher_mutex_);
+    dispatcher_exit_ = true;
+  }
+  dispatcher_cv_.notify_one();
+  dispatcher_thread_.join();
 }
 
 KEYBOARD_HANDLER_PUBLIC
@@ -123,11 +519,40 @@ KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
   const tcgetattrFunction & tcgetattr_fn,
   const tcsetattrFunction & tcsetattr_fn,
   bool install_signal_handler)
-: stdin_fd_(fileno(stdin))
+: KeyboardHandlerUnixImpl(read_fn, stdin_always_ready_poll, isatty_fn, tcgetattr_fn,
+    tcsetattr_fn, install_signal_handler) {}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
+  const readFunction & read_fn,
+  const pollFunction & poll_fn,
+  const isattyFunction & isatty_fn,
+  const tcgetattrFunction & tcgetattr_fn,
+  const tcsetattrFunction & tcsetattr_fn,
+  bool install_signal_handler,
+  size_t dispatch_queue_capacity,
+  int input_fd)
+: input_fd_(input_fd)
+{
+  init(read_fn, poll_fn, isatty_fn, tcgetattr_fn, tcsetattr_fn, install_signal_handler,
+    dispatch_queue_capacity);
+}
+
+void KeyboardHandlerUnixImpl::init(
+  const readFunction & read_fn,
+  const pollFunction & poll_fn,
+  const isattyFunction & isatty_fn,
+  const tcgetattrFunction & tcgetattr_fn,
+  const tcsetattrFunction & tcsetattr_fn,
+  bool install_signal_handler,
+  size_t dispatch_queue_capacity)
 {
   if (read_fn == nullptr) {
     throw std::invalid_argument("KeyboardHandlerUnixImpl read_fn must be non-empty.");
   }
+  if (poll_fn == nullptr) {
+    throw std::invalid_argument("KeyboardHandlerUnixImpl poll_fn must be non-empty.");
+  }
   if (isatty_fn == nullptr) {
     throw std::invalid_argument("KeyboardHandlerUnixImpl isatty_fn must be non-empty.");
   }
@@ -137,132 +562,568 @@ KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl(
   if (tcsetattr_fn == nullptr) {
     throw std::invalid_argument("KeyboardHandlerUnixImpl tcsetattr_fn must be non-empty.");
   }
-  tcsetattr_fn_ = tcsetattr_fn;
+  read_fn_ = read_fn;
+  poll_fn_ = poll_fn;
 
-  for (size_t i = 0; i < STATIC_KEY_MAP_LENGTH; i++) {
-    key_codes_map_.emplace(
-      DEFAULT_STATIC_KEY_MAP[i].terminal_sequence,
-      DEFAULT_STATIC_KEY_MAP[i].inner_code);
-  }
-
-  // Check if we can handle key press from std input
-  if (!isatty_fn(stdin_fd_)) {
-    // If stdin is not a real terminal (redirected to text file or pipe ) can't do much here
+  // Check if we can handle key press from the input
+  if (!command_stream_ && !isatty_fn(input_fd_)) {
+    // If input is not a real terminal (redirected to text file or pipe ) can't do much here
     // with keyboard handling.
-    std::cerr << "stdin is not a terminal device. Keyboard handling disabled.";
+    std::cerr << (input_fd_ == STDIN_FILENO ? "stdin" : "Input") <<
+      " is not a terminal device. Keyboard handling disabled.";
     return;
   }
 
-  struct termios new_term_settings;
-  if (tcgetattr_fn(stdin_fd_, &old_term_settings_) == -1) {
-    throw std::runtime_error("Error in tcgetattr(). errno = " + std::to_string(errno));
+  if (dispatch_queue_capacity > 0) {
+    // Allocate before touching the terminal, nothing to undo if it fails
+    dispatch_queue_ = std::make_unique<SpscQueue<KeyEvent>>(dispatch_queue_capacity);
   }
+  if (!command_stream_) {
+    saved_terminal_index_ = save_terminal_settings(input_fd_, tcgetattr_fn, tcsetattr_fn);
+  }
+  // Undo changes made so far if initialization fails
+  auto rollback = [this]() {
+      if (install_signal_handler_) {
+        uninstall_sigint_handler();
+        install_signal_handler_ = false;
+      }
+      close_wake_up_pipe();
+      release_terminal_settings(saved_terminal_index_);
+      saved_terminal_index_ = MAX_SAVED_TERMINALS;
+    };
 
-  if (install_signal_handler) {
-    // Setup signal handler to return
-    old_sigint_handler_ = std::signal(SIGINT, KeyboardHandlerUnixImpl::on_signal);
-    // terminal in original (buffered) mode in case of abnormal program termination.
-    if (old_sigint_handler_ == SIG_ERR) {
-      throw std::runtime_error("Error. Can't install SIGINT handler");
-    }
+  // Setup signal handler to return terminal in original (buffered) mode in case of abnormal
+  // program termination.
+  if (install_signal_handler && !install_sigint_handler()) {
+    rollback();
+    throw std::runtime_error("Error. Can't install SIGINT handler");
   }
   install_signal_handler_ = install_signal_handler;
 
-  new_term_settings = old_term_settings_;
-  // Set stdin to unbuffered mode for reading directly from the stdin.
-  // Disable canonical input and disable echo.
-  new_term_settings.c_lflag &= ~(ICANON | ECHO);
-  new_term_settings.c_cc[VMIN] = 0;   // 0 means purely timeout driven readout
-  new_term_settings.c_cc[VTIME] = 1;  // Wait maximum for 0.1 sec since start of the read() call.
+  if (!reactor_ && !external_event_loop_) {
+    // Pipe used to wake up input thread blocked in poll() when we need to exit
+    int wake_up_pipe[2];
+    if (pipe(wake_up_pipe) == -1) {
+      int error = errno;
+      rollback();
+      throw std::runtime_error("Error in pipe(). errno = " + std::to_string(error));
+    }
+    wake_up_read_fd_ = wake_up_pipe[0];
+    wake_up_write_fd_ = wake_up_pipe[1];
+    fcntl(wake_up_read_fd_, F_SETFD, FD_CLOEXEC);
+    fcntl(wake_up_write_fd_, F_SETFD, FD_CLOEXEC);
+    // Writing to the pipe should never block, one pending byte is enough to wake up.
+    fcntl(wake_up_write_fd_, F_SETFL, O_NONBLOCK);
+  }
 
-  if (tcsetattr_fn_(stdin_fd_, TCSANOW, &new_term_settings) == -1) {
-    throw std::runtime_error("Error in tcsetattr(). errno = " + std::to_string(errno));
+  if (!command_stream_) {
+    struct termios new_term_settings = saved_terminals_[saved_terminal_index_].settings;
+    // Set stdin to unbuffered mode for reading directly from the stdin.
+    // Disable canonical input and disable echo.
+    new_term_settings.c_lflag &= ~(ICANON | ECHO);
+    new_term_settings.c_cc[VMIN] = 1;   // read() returns as soon as at least one byte is available
+    new_term_settings.c_cc[VTIME] = 0;  // No inter-byte timeout, we are waiting in poll()
+    if (tcsetattr_fn(input_fd_, TCSANOW, &new_term_settings) == -1) {
+      int error = errno;
+      rollback();
+      throw std::runtime_error("Error in tcsetattr(). errno = " + std::to_string(error));
+    }
+  }
+  if (dispatch_queue_) {
+    try {
+      dispatcher_thread_ = std::thread(&KeyboardHandlerUnixImpl::dispatcher_thread_loop, this);
+    } catch (...) {
+      rollback();
+      throw;
+    }
+  }
+  // Signals handled before don't stop this keyboard handler
+  init_signal_count_ = signal_count_.load();
+  if (wake_up_write_fd_ != -1 && !register_signal_wake_up_fd(wake_up_write_fd_)) {
+    std::cerr << "Too many keyboard handlers, input thread will notice SIGINT only after the "
+      "next key press." << std::endl;
   }
   is_init_succeed_ = true;
 
-  key_handler_thread_ = std::thread(
-    [this, read_fn] {
-      try {
-        static constexpr size_t BUFF_LEN = 10;
-        char buff[BUFF_LEN] = {0};
-        do {
-          ssize_t read_bytes = read_fn(stdin_fd_, buff, BUFF_LEN);
-          if (read_bytes < 0 && errno != EAGAIN) {
-            throw std::runtime_error("Error in read(). errno = " + std::to_string(errno));
-          }
+  if (reactor_) {
+    try {
+      reactor_->attach(this, input_fd_);
+    } catch (...) {
+      is_init_succeed_ = false;
+      stop_dispatcher_thread();
+      rollback();
+      throw;
+    }
+    return;
+  }
+  if (external_event_loop_) {
+    return;  // Input is read by process_ready()
+  }
 
-          if (read_bytes == 0) {
-            // Do nothing. 0 means read() returned by timeout.
-          } else {  // read_bytes > 0
-            buff[std::min(BUFF_LEN - 1, static_cast<size_t>(read_bytes))] = '\0';
+  try {
+    key_handler_thread_ = std::thread(
+      [this, poll_fn] {
+        try {
+          char buff[INPUT_BUFFER_SIZE];
+          bool input_open = true;
+          do {
+            int timeout = prepare_to_wait_for_input();
+            struct pollfd fds[2] = {{input_fd_, POLLIN, 0}, {wake_up_read_fd_, POLLIN, 0}};
+            int ready = poll_fn(fds, 2, timeout);
+            if (ready < 0) {
+              if (errno == EINTR) {
+                continue;
+              }
+              throw std::runtime_error("Error in poll(). errno = " + std::to_string(errno));
+            }
+            if (ready == 0) {
+              handle_input_timeout();
+              continue;
+            }
+            if (fds[1].revents != 0) {
+              break;  // Woken up by destructor or signal handler
+            }
+            input_open = handle_input_events(fds[0].revents, buff, INPUT_BUFFER_SIZE);
+          } while (input_open && !is_exit_requested());
+        } catch (...) {
+          thread_exception_ptr = std::current_exception();
+        }
+        finish_input();
+      });
+  } catch (...) {
+    is_init_succeed_ = false;
+    stop_dispatcher_thread();
+    rollback();
+    throw;
+  }
+}
 
-            auto key_code_and_modifiers = parse_input(buff, read_bytes);
+bool KeyboardHandlerUnixImpl::is_exit_requested() const
+{
+  return exit_.load() || signal_count_.load() != init_signal_count_;
+}
 
-            KeyCode pressed_key_code = std::get<0>(key_code_and_modifiers);
-            KeyModifiers key_modifiers = std::get<1>(key_code_and_modifiers);
+int KeyboardHandlerUnixImpl::prepare_to_wait_for_input()
+{
+  // Key presses coalesced from the previous read, if any
+  dispatch_pending_key_presses();
+  // Block without timeout until input has data or until we are woken up to exit.
+  // If incomplete sequence is pending, wait for the rest of it only for a short time.
+  int timeout = tokenizer_.has_pending() ? ESCAPE_SEQUENCE_TIMEOUT_MS : -1;
+  if (!dispatch_queue_ && is_deadline_tracking_enabled()) {
+    // Wake up when the current hold expires or deferred callback is due
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = check_deadlines(now);
+    if (deadline != std::chrono::steady_clock::time_point::max()) {
+      auto deadline_timeout = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline - now).count() + 1;
+      timeout = timeout < 0 ? static_cast<int>(deadline_timeout) :
+        std::min(timeout, static_cast<int>(deadline_timeout));
+    }
+  }
+  return timeout;
+}
 
-#ifdef PRINT_DEBUG_INFO
-            auto modifiers_str = enum_key_modifiers_to_str(key_modifiers);
-            std::cout << "pressed key: " << modifiers_str;
-            if (!modifiers_str.empty()) {
-              std::cout << " + ";
-            }
-            std::cout << "'" << enum_key_code_to_str(pressed_key_code) << "'" << std::endl;
-#endif
-            std::lock_guard<std::mutex> lk(callbacks_mutex_);
-            auto range = callbacks_.equal_range(KeyAndModifiers{pressed_key_code, key_modifiers});
-            for (auto it = range.first; it != range.second; ++it) {
-              it->second.callback(pressed_key_code, key_modifiers);
-            }
-          }
-        } while (!exit_.load());
+void KeyboardHandlerUnixImpl::handle_input_timeout()
+{
+  // Callbacks could be registered while we were waiting
+  coalesce_key_presses_ = !dispatch_queue_ && is_autorepeat_tracking_enabled();
+  // Pending sequence is not a beginning of the longer one. e.g. ESC key.
+  tokenizer_.flush(
+    [this](const char * sequence, size_t length) {
+      handle_terminal_sequence(sequence, length);
+    });
+}
+
+bool KeyboardHandlerUnixImpl::handle_input_events(
+  short revents, char * buffer, size_t buffer_size)
+{
+  auto on_sequence = [this](const char * sequence, size_t length) {
+      handle_terminal_sequence(sequence, length);
+    };
+  auto on_paste = [this](const char * text, size_t length) {
+      handle_paste(text, length);
+    };
+  auto on_command = [this](KeyCode key_code, KeyModifiers key_modifiers) {
+      handle_key_press(key_code, key_modifiers, std::string_view());
+    };
+  // Callbacks could be registered while we were waiting
+  coalesce_key_presses_ = !dispatch_queue_ && is_autorepeat_tracking_enabled();
+  if ((revents & POLLIN) == 0) {
+    if ((revents & (POLLHUP | POLLERR | POLLNVAL)) != 0) {
+      // Terminal was closed or hung up, nothing to read anymore
+      tokenizer_.flush(on_sequence);
+      command_parser_.flush(on_command);
+      return false;
+    }
+    return true;
+  }
+
+  ssize_t read_bytes = read_fn_(input_fd_, buffer, buffer_size);
+  if (dispatch_queue_ || coalesce_key_presses_ || LATENCY_STATS_ENABLED ||
+    journal_writer_.load(std::memory_order_relaxed) != nullptr ||
+    event_queue_.load(std::memory_order_relaxed) != nullptr)
+  {
+    read_time_ = std::chrono::steady_clock::now();
+  }
+  if (read_bytes < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      throw std::runtime_error("Error in read(). errno = " + std::to_string(errno));
+    }
+    // Retry on the next wake up, incomplete sequence is left for the escape sequence timeout
+    return true;
+  }
+
+  if (read_bytes == 0) {
+    if (command_stream_ || (revents & POLLHUP) != 0) {
+      // End of input, deliver the last incomplete sequence or command if any
+      tokenizer_.flush(on_sequence);
+      command_parser_.flush(on_command);
+      return false;
+    }
+    // read() returned by timeout, e.g. read function used without poll function.
+    tokenizer_.flush(on_sequence);
+  } else if (command_stream_ && command_stream_format_ == CommandStreamFormat::TEXT) {
+    command_parser_.feed(buffer, static_cast<size_t>(read_bytes), on_command);
+  } else {
+    // One read could contain several key sequences or only part of the sequence.
+    if (bracketed_paste_enabled_.load(std::memory_order_relaxed)) {
+      tokenizer_.feed(buffer, static_cast<size_t>(read_bytes), on_sequence, on_paste);
+    } else {
+      tokenizer_.feed(buffer, static_cast<size_t>(read_bytes), on_sequence);
+    }
+  }
+  return true;
+}
+
+void KeyboardHandlerUnixImpl::finish_input() noexcept
+{
+  if (thread_exception_ptr == nullptr) {
+    try {
+      dispatch_pending_key_presses();
+    } catch (...) {
+      thread_exception_ptr = std::current_exception();
+    }
+  }
+
+  // Restore buffer mode for the terminal
+  bool restored = release_terminal_settings(saved_terminal_index_);
+  saved_terminal_index_ = MAX_SAVED_TERMINALS;
+  if (!restored) {
+    if (thread_exception_ptr == nullptr) {
+      try {
+        throw std::runtime_error(
+          "Error in tcsetattr old_term_settings. errno = " + std::to_string(errno));
       } catch (...) {
         thread_exception_ptr = std::current_exception();
       }
-
-      // Restore buffer mode for stdin
-      if (!restore_buffer_mode_for_stdin()) {
-        if (thread_exception_ptr == nullptr) {
-          try {
-            throw std::runtime_error(
-              "Error in tcsetattr old_term_settings. errno = " + std::to_string(errno));
-          } catch (...) {
-            thread_exception_ptr = std::current_exception();
-          }
-        } else {
-          std::cerr <<
-            "Error in tcsetattr old_term_settings. errno = " + std::to_string(errno) << std::endl;
-        }
-      }
-    });
+    } else {
+      std::cerr <<
+        "Error in tcsetattr old_term_settings. errno = " + std::to_string(errno) << std::endl;
+    }
+  }
 }
 
-KeyboardHandlerUnixImpl::~KeyboardHandlerUnixImpl()
+bool KeyboardHandlerUnixImpl::install_sigint_handler()
 {
-  if (install_signal_handler_) {
-    signal_handler_type old_sigint_handler = std::signal(SIGINT, old_sigint_handler_);
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  if (sigint_handler_users_count_ == 0) {
+    // Keyboard handlers installed later share the handler, otherwise on_signal() would be
+    // called recursively as the old handler of itself
+    signal_handler_type old_sigint_handler =
+      std::signal(SIGINT, KeyboardHandlerUnixImpl::on_signal);
     if (old_sigint_handler == SIG_ERR) {
-      std::cerr << "Error. Can't install old SIGINT handler" << std::endl;
+      return false;
     }
-    if (old_sigint_handler != KeyboardHandlerUnixImpl::on_signal) {
-      std::cerr << "Error. Can't return old SIGINT handler, someone override our signal handler" <<
-        std::endl;
-      std::signal(SIGINT, old_sigint_handler);  // return overridden signal handler
+    old_sigint_handler_ = old_sigint_handler;
+  }
+  sigint_handler_users_count_++;
+  return true;
+}
+
+void KeyboardHandlerUnixImpl::uninstall_sigint_handler()
+{
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  if (--sigint_handler_users_count_ > 0) {
+    return;
+  }
+  signal_handler_type old_sigint_handler = std::signal(SIGINT, old_sigint_handler_);
+  if (old_sigint_handler == SIG_ERR) {
+    std::cerr << "Error. Can't install old SIGINT handler" << std::endl;
+  }
+  if (old_sigint_handler != KeyboardHandlerUnixImpl::on_signal) {
+    std::cerr << "Error. Can't return old SIGINT handler, someone override our signal handler" <<
+      std::endl;
+    std::signal(SIGINT, old_sigint_handler);  // return overridden signal handler
+  }
+}
+
+bool KeyboardHandlerUnixImpl::register_signal_wake_up_fd(int fd)
+{
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  for (auto & entry : signal_wake_up_fds_) {
+    if (entry.fd.load(std::memory_order_relaxed) == -1) {
+      entry.fd.store(fd);
+      return true;
     }
   }
+  return false;
+}
+
+void KeyboardHandlerUnixImpl::unregister_signal_wake_up_fd(int fd)
+{
+  if (fd == -1) {
+    return;
+  }
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  for (auto & entry : signal_wake_up_fds_) {
+    if (entry.fd.load(std::memory_order_relaxed) == fd) {
+      entry.fd.store(-1);
+      return;
+    }
+  }
+}
+
+KeyboardHandlerUnixImpl::~KeyboardHandlerUnixImpl()
+{
+  if (install_signal_handler_) {
+    uninstall_sigint_handler();
+  }
   exit_ = true;
+  wake_up_input_thread();
   if (key_handler_thread_.joinable()) {
     key_handler_thread_.join();
   }
+  if ((reactor_ && reactor_->detach(this)) ||
+    (external_event_loop_ && !external_input_finished_))
+  {
+    finish_input();
+  }
+  close_wake_up_pipe();
+  if (owns_input_fd_) {
+    close(input_fd_);
+  }
+  // Input thread is stopped, nothing will be pushed to the queue anymore
+  stop_dispatcher_thread();
 
-  try {
+  for (const auto & exception_ptr : {thread_exception_ptr, dispatcher_exception_ptr_}) {
+    try {
+      if (exception_ptr != nullptr) {
+        std::rethrow_exception(exception_ptr);
+      }
+    } catch (const std::exception & e) {
+      std::cerr << "Caught exception: \"" << e.what() << "\"\n";
+    } catch (...) {
+      std::cerr << "Caught unknown exception" << std::endl;
+    }
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerUnixImpl::enable_event_queue(size_t capacity)
+{
+  std::lock_guard<std::mutex> lk(event_queue_mutex_);
+  if (event_queue_storage_) {
+    throw std::logic_error("Event queue is already enabled.");
+  }
+  event_queue_storage_ = std::make_unique<SpscQueue<KeyEvent>>(capacity);
+  event_queue_.store(event_queue_storage_.get(), std::memory_order_release);
+}
+
+SpscQueue<KeyboardHandlerBase::KeyEvent> & KeyboardHandlerUnixImpl::get_event_queue() const
+{
+  SpscQueue<KeyEvent> * event_queue = event_queue_.load(std::memory_order_acquire);
+  if (event_queue == nullptr) {
+    throw std::logic_error("Event queue is not enabled.");
+  }
+  return *event_queue;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::try_pop_event(KeyEvent & event)
+{
+  return get_event_queue().try_pop(event);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::wait_event(KeyEvent & event, std::chrono::nanoseconds timeout)
+{
+  using std::chrono::steady_clock;
+  SpscQueue<KeyEvent> & event_queue = get_event_queue();
+  if (event_queue.try_pop(event)) {
+    return true;
+  }
+  auto now = steady_clock::now();
+  auto deadline = timeout < steady_clock::time_point::max() - now ?
+    now + std::chrono::duration_cast<steady_clock::duration>(timeout) :
+    steady_clock::time_point::max();
+  std::unique_lock<std::mutex> lk(event_queue_mutex_);
+  event_queue_waiting_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool popped = event_queue.try_pop(event);
+  while (!popped && event_queue_cv_.wait_until(lk, deadline) == std::cv_status::no_timeout) {
+    popped = event_queue.try_pop(event);
+  }
+  if (!popped) {
+    popped = event_queue.try_pop(event);  // Event could arrive right at the deadline
+  }
+  event_queue_waiting_.store(false, std::memory_order_relaxed);
+  return popped;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::EventQueueStats KeyboardHandlerUnixImpl::get_event_queue_stats() const
+{
+  EventQueueStats stats;
+  SpscQueue<KeyEvent> * event_queue = event_queue_.load(std::memory_order_acquire);
+  if (event_queue != nullptr) {
+    stats.capacity = event_queue->capacity();
+    stats.depth = event_queue->size();
+    stats.overflow_count = event_queue_overflow_count_.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+int KeyboardHandlerUnixImpl::get_input_fd() const
+{
+  if (!external_event_loop_ || !is_init_succeed_ || external_input_finished_) {
+    return -1;
+  }
+  return input_fd_;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+int KeyboardHandlerUnixImpl::process_ready()
+{
+  if (!external_event_loop_) {
+    throw std::logic_error("Keyboard handler wasn't constructed for the external event loop.");
+  }
+  if (!is_init_succeed_ || external_input_finished_) {
+    return -1;
+  }
+  char buffer[INPUT_BUFFER_SIZE];
+  bool input_open = true;
+  bool input_handled = false;
+  // Drain all available input, input descriptor is polled instead of being switched to
+  // non-blocking mode, since its file status flags are shared with other users of the terminal.
+  while (input_open && !is_exit_requested()) {
+    // There is no wake up pipe, the second descriptor is ignored by poll()
+    struct pollfd fds[2] = {{input_fd_, POLLIN, 0}, {-1, POLLIN, 0}};
+    int ready = poll_fn_(fds, 2, 0);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Error in poll(). errno = " + std::to_string(errno));
+    }
+    if (ready == 0) {
+      break;
+    }
+    input_handled = true;
+    input_open = handle_input_events(fds[0].revents, buffer, INPUT_BUFFER_SIZE);
+  }
+  if (!input_handled && std::chrono::steady_clock::now() >= input_deadline_) {
+    handle_input_timeout();
+  }
+  if (!input_open || is_exit_requested()) {
+    external_input_finished_ = true;
+    finish_input();
     if (thread_exception_ptr != nullptr) {
-      std::rethrow_exception(thread_exception_ptr);
+      std::exception_ptr exception_ptr = thread_exception_ptr;
+      thread_exception_ptr = nullptr;
+      std::rethrow_exception(exception_ptr);
     }
-  } catch (const std::exception & e) {
-    std::cerr << "Caught exception: \"" << e.what() << "\"\n";
-  } catch (...) {
-    std::cerr << "Caught unknown exception" << std::endl;
+    return -1;
+  }
+  int timeout = prepare_to_wait_for_input();
+  input_deadline_ = timeout < 0 ? std::chrono::steady_clock::time_point::max() :
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  return timeout;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerUnixImpl::start_recording(
+  const std::string & journal_path, size_t queue_capacity)
+{
+  std::lock_guard<std::mutex> lk(journal_mutex_);
+  if (journal_writer_.load(std::memory_order_relaxed) != nullptr) {
+    throw std::logic_error("Keystroke journal is already being recorded.");
+  }
+  journal_writer_owner_ = std::make_unique<KeystrokeJournalWriter>(journal_path, queue_capacity);
+  journal_writer_.store(journal_writer_owner_.get(), std::memory_order_release);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeyboardHandlerUnixImpl::stop_recording()
+{
+  std::lock_guard<std::mutex> lk(journal_mutex_);
+  if (journal_writer_.exchange(nullptr, std::memory_order_seq_cst) != nullptr) {
+    journal_writer_owner_->close();
+    // Input thread might still be pushing to the closed writer, destroy it once nobody can
+    retired_journal_writers_.retire(std::move(journal_writer_owner_));
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+size_t KeyboardHandlerUnixImpl::replay_journal(const std::string & journal_path, double speed)
+{
+  using std::chrono::steady_clock;
+  KeystrokeJournalReader journal(journal_path);
+  KeystrokeJournalReader::Record record;
+  size_t replayed_records = 0;
+  steady_clock::time_point first_record_time;
+  steady_clock::time_point replay_start_time;
+  while (journal.next(record)) {
+    if (replayed_records == 0) {
+      first_record_time = record.timestamp;
+      replay_start_time = steady_clock::now();
+    } else if (speed > 0.0) {
+      auto offset = std::chrono::duration_cast<steady_clock::duration>(
+        (record.timestamp - first_record_time) / speed);
+      std::this_thread::sleep_until(replay_start_time + offset);
+    }
+    dispatch_key_press(
+      KeyEvent{record.key_code, record.key_modifiers, steady_clock::now(), record.event_type});
+    replayed_records++;
+  }
+  return replayed_records;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeyboardHandlerUnixImpl::DispatchQueueStats KeyboardHandlerUnixImpl::get_dispatch_queue_stats()
+const
+{
+  DispatchQueueStats stats;
+  if (dispatch_queue_) {
+    stats.capacity = dispatch_queue_->capacity();
+    stats.depth = dispatch_queue_->size();
+    stats.high_water_mark = dispatch_queue_high_water_mark_.load(std::memory_order_relaxed);
+    stats.dropped_events = dispatch_queue_dropped_events_.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+void KeyboardHandlerUnixImpl::wake_up_input_thread() noexcept
+{
+  if (wake_up_write_fd_ != -1) {
+    const char wake_up_byte = 0;
+    if (write(wake_up_write_fd_, &wake_up_byte, 1) == -1 && errno != EAGAIN) {
+      std::cerr << "Error in write() to wake up pipe. errno = " << errno << std::endl;
+    }
+  }
+}
+
+void KeyboardHandlerUnixImpl::close_wake_up_pipe() noexcept
+{
+  if (wake_up_read_fd_ != -1) {
+    close(wake_up_read_fd_);
+    wake_up_read_fd_ = -1;
+  }
+  if (wake_up_write_fd_ != -1) {
+    unregister_signal_wake_up_fd(wake_up_write_fd_);
+    close(wake_up_write_fd_);
+    wake_up_write_fd_ = -1;
   }
 }
 
@@ -270,23 +1131,189 @@ KEYBOARD_HANDLER_PUBLIC
 std::string
 KeyboardHandlerUnixImpl::get_terminal_sequence(KeyboardHandlerUnixImpl::KeyCode key_code)
 {
-  std::string ret_str{};
-  for (const auto & it : key_codes_map_) {
-    if (it.second == key_code) {
-      return it.first;
-    }
+  RetiredObjects<TerminfoKeyMap>::ReaderGuard reader_guard(retired_terminfo_key_maps_);
+  return key_codes_trie_.load(std::memory_order_seq_cst)->find_sequence(key_code);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::load_terminfo_key_map(
+  const std::string & term, const std::string & cache_dir)
+{
+  std::string term_name = term;
+  if (term_name.empty()) {
+    const char * term_env = std::getenv("TERM");
+    term_name = term_env != nullptr ? term_env : "";
   }
-  return ret_str;
+  std::string terminfo_path = TerminfoKeyMap::find_terminfo_file(term_name);
+  if (terminfo_path.empty()) {
+    return false;
+  }
+  std::unique_ptr<TerminfoKeyMap> key_map;
+  try {
+    key_map = std::make_unique<TerminfoKeyMap>(
+      terminfo_path, DEFAULT_STATIC_KEY_TRIE,
+      cache_dir.empty() ? TerminfoKeyMap::get_default_cache_dir() : cache_dir);
+  } catch (const std::exception & e) {
+    std::cerr << "Can't load key map from terminfo: " << e.what() << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lk(terminfo_key_maps_mutex_);
+  // Previous key map should be retired only after it can't be loaded by new readers
+  key_codes_trie_.store(&key_map->get_trie(), std::memory_order_seq_cst);
+  terminfo_key_map_.swap(key_map);
+  if (key_map) {
+    retired_terminfo_key_maps_.retire(std::move(key_map));
+  }
+  return true;
 }
 
-bool KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin()
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::enable_kitty_keyboard_protocol(int output_fd)
 {
-  if (tcsetattr_fn_(fileno(stdin), TCSANOW, &old_term_settings_) == -1) {
+  return enable_terminal_mode(
+    &saved_terminal_settings::keyboard_protocol_fd, output_fd,
+    KittyKeyboardDecoder::ENABLE_SEQUENCE);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::is_kitty_keyboard_protocol_active() const
+{
+  return kitty_keyboard_protocol_active_.load(std::memory_order_relaxed);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeyboardHandlerUnixImpl::enable_bracketed_paste(int output_fd)
+{
+  if (!enable_terminal_mode(
+      &saved_terminal_settings::bracketed_paste_fd, output_fd, ENABLE_BRACKETED_PASTE_SEQUENCE))
+  {
     return false;
   }
+  bracketed_paste_enabled_.store(true, std::memory_order_relaxed);
   return true;
 }
 
+bool KeyboardHandlerUnixImpl::enable_terminal_mode(
+  std::atomic_int saved_terminal_settings::* mode_fd, int output_fd, std::string_view sequence)
+{
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  if (saved_terminal_index_ >= MAX_SAVED_TERMINALS) {
+    return false;
+  }
+  auto & saved_terminal = saved_terminals_[saved_terminal_index_];
+  if ((saved_terminal.*mode_fd).load(std::memory_order_relaxed) != -1) {
+    return true;  // Already enabled by another keyboard handler reading from the same terminal
+  }
+  // Mode is disabled when the last user releases the terminal or in the signal handler, possibly
+  // after the caller closed its descriptor, so the duplicate is owned by the saved settings
+  int owned_fd = fcntl(output_fd == -1 ? input_fd_ : output_fd, F_DUPFD_CLOEXEC, 0);
+  if (owned_fd == -1) {
+    return false;
+  }
+  if (write(owned_fd, sequence.data(), sequence.size()) !=
+    static_cast<ssize_t>(sequence.size()))
+  {
+    close(owned_fd);
+    return false;
+  }
+  (saved_terminal.*mode_fd).store(owned_fd, std::memory_order_release);
+  return true;
+}
+
+void KeyboardHandlerUnixImpl::disable_terminal_modes(saved_terminal_settings & saved_terminal)
+{
+  // write() and close() are async-signal-safe
+  int output_fd = saved_terminal.keyboard_protocol_fd.exchange(-1);
+  if (output_fd != -1) {
+    ssize_t ret = write(
+      output_fd, KittyKeyboardDecoder::DISABLE_SEQUENCE,
+      sizeof(KittyKeyboardDecoder::DISABLE_SEQUENCE) - 1);
+    (void)ret;
+    close(output_fd);
+  }
+  output_fd = saved_terminal.bracketed_paste_fd.exchange(-1);
+  if (output_fd != -1) {
+    ssize_t ret = write(
+      output_fd, DISABLE_BRACKETED_PASTE_SEQUENCE.data(), DISABLE_BRACKETED_PASTE_SEQUENCE.size());
+    (void)ret;
+    close(output_fd);
+  }
+}
+
+bool KeyboardHandlerUnixImpl::restore_buffer_mode_for_stdin()
+{
+  for (auto & saved_terminal : saved_terminals_) {
+    if (saved_terminal.fd.load(std::memory_order_acquire) == STDIN_FILENO) {
+      disable_terminal_modes(saved_terminal);
+      return saved_terminal.tcsetattr_fn(STDIN_FILENO, TCSANOW, &saved_terminal.settings) != -1;
+    }
+  }
+  return true;
+}
+
+bool KeyboardHandlerUnixImpl::restore_buffer_mode_for_all_terminals()
+{
+  bool restored = true;
+  for (auto & saved_terminal : saved_terminals_) {
+    int fd = saved_terminal.fd.load(std::memory_order_acquire);
+    if (fd == -1) {
+      continue;
+    }
+    disable_terminal_modes(saved_terminal);
+    if (saved_terminal.tcsetattr_fn(fd, TCSANOW, &saved_terminal.settings) == -1) {
+      restored = false;
+    }
+  }
+  return restored;
+}
+
+size_t KeyboardHandlerUnixImpl::save_terminal_settings(
+  int fd, const tcgetattrFunction & tcgetattr_fn, const tcsetattrFunction & tcsetattr_fn)
+{
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  size_t free_index = MAX_SAVED_TERMINALS;
+  for (size_t i = 0; i < MAX_SAVED_TERMINALS; i++) {
+    int saved_fd = saved_terminals_[i].fd.load(std::memory_order_relaxed);
+    if (saved_fd == fd) {
+      // Terminal is already in non-canonical mode, original settings are saved by another user
+      saved_terminals_[i].users_count++;
+      return i;
+    }
+    if (saved_fd == -1 && free_index == MAX_SAVED_TERMINALS) {
+      free_index = i;
+    }
+  }
+  if (free_index == MAX_SAVED_TERMINALS) {
+    throw std::runtime_error("Too many terminals are used by keyboard handlers.");
+  }
+  auto & saved_terminal = saved_terminals_[free_index];
+  if (tcgetattr_fn(fd, &saved_terminal.settings) == -1) {
+    throw std::runtime_error("Error in tcgetattr(). errno = " + std::to_string(errno));
+  }
+  saved_terminal.tcsetattr_fn = tcsetattr_fn;
+  saved_terminal.users_count = 1;
+  // Publish settings for restore_buffer_mode_for_all_terminals() called from signal handler
+  saved_terminal.fd.store(fd, std::memory_order_release);
+  return free_index;
+}
+
+bool KeyboardHandlerUnixImpl::release_terminal_settings(size_t index)
+{
+  if (index >= MAX_SAVED_TERMINALS) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lk(saved_terminals_mutex_);
+  auto & saved_terminal = saved_terminals_[index];
+  if (--saved_terminal.users_count > 0) {
+    return true;
+  }
+  int fd = saved_terminal.fd.load(std::memory_order_relaxed);
+  disable_terminal_modes(saved_terminal);
+  bool restored = saved_terminal.tcsetattr_fn(fd, TCSANOW, &saved_terminal.settings) != -1;
+  saved_terminal.fd.store(-1, std::memory_order_release);
+  return restored;
+}
+
 KeyboardHandlerUnixImpl::signal_handler_type KeyboardHandlerUnixImpl::get_old_sigint_handler()
 {
   return old_sigint_handler_;
@@ -17,6 +17,7 @@
 #include <io.h>
 #include <stdio.h>
 #include <windows.h>
+#include <chrono>
 #include <exception>
 #include <iostream>
 #include <tuple>
@@ -96,13 +97,16 @@ KeyboardHandlerWindowsImpl::KeyboardHandlerWindowsImpl(
             }
             std::cout << "'" << enum_key_code_to_str(pressed_key_code) << "'" << std::endl;
 #endif
-            std::lock_guard<std::mutex> lk(callbacks_mutex_);
-            auto range = callbacks_.equal_range(KeyAndModifiers{pressed_key_code, key_modifiers});
-            for (auto it = range.first; it != range.second; ++it) {
-              it->second.callback(pressed_key_code, key_modifiers);
+            if (is_autorepeat_tracking_enabled()) {
+              dispatch_key_press(
+                KeyEvent{pressed_key_code, key_modifiers, std::chrono::steady_clock::now()});
+            } else {
+              dispatch_key_press(pressed_key_code, key_modifiers);
             }
             // Wait for 0.1 sec to yield processor resources for another threads
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          } else if (is_deadline_tracking_enabled()) {
+            check_deadlines(std::chrono::steady_clock::now());
           }
         } while (!exit_.load());
       } catch (...) {
@@ -0,0 +1,286 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include "keyboard_handler/keystroke_journal.hpp"
+
+namespace
+{
+/// \brief Records are accumulated in buffer and written to the file when it's full or when
+/// there is nothing more to write for now.
+constexpr size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+void write_all(int fd, const char * data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Error in write() to journal. errno = " + std::to_string(errno));
+    }
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+}
+}  // namespace
+
+KEYBOARD_HANDLER_PUBLIC
+KeystrokeJournalWriter::KeystrokeJournalWriter(const std::string & path, size_t queue_capacity)
+: queue_(queue_capacity)
+{
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    throw std::runtime_error(
+            "Error in open(\"" + path + "\"). errno = " + std::to_string(errno));
+  }
+  buffer_.reserve(WRITE_BUFFER_SIZE);
+  char file_header[KeystrokeJournalFormat::FILE_HEADER_SIZE] = {};
+  std::memcpy(file_header, KeystrokeJournalFormat::MAGIC, sizeof(KeystrokeJournalFormat::MAGIC));
+  std::memcpy(
+    file_header + sizeof(KeystrokeJournalFormat::MAGIC), &KeystrokeJournalFormat::VERSION,
+    sizeof(KeystrokeJournalFormat::VERSION));
+  try {
+    write_all(fd_, file_header, sizeof(file_header));
+    writer_thread_ = std::thread(&KeystrokeJournalWriter::writer_thread_loop, this);
+  } catch (...) {
+    ::close(fd_);
+    throw;
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeystrokeJournalWriter::~KeystrokeJournalWriter()
+{
+  close();
+  if (writer_exception_ptr_ != nullptr) {
+    try {
+      std::rethrow_exception(writer_exception_ptr_);
+    } catch (const std::exception & e) {
+      std::cerr << "Caught exception: \"" << e.what() << "\"\n";
+    } catch (...) {
+      std::cerr << "Caught unknown exception" << std::endl;
+    }
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeystrokeJournalWriter::record(const KeyEvent & event, std::string_view raw) noexcept
+{
+  if (closed_.load(std::memory_order_relaxed)) {
+    dropped_records_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  journal_entry entry;
+  entry.event = event;
+  entry.raw_length = static_cast<uint8_t>(
+    std::min(raw.size(), KeystrokeJournalFormat::MAX_RAW_LENGTH));
+  std::memcpy(entry.raw, raw.data(), entry.raw_length);
+  if (!queue_.try_push(entry)) {
+    dropped_records_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  // Pairs with the fence in writer_thread_loop(), either writer sees the new entry or we see
+  // that writer is going to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (writer_sleeping_.load(std::memory_order_relaxed)) {
+    {
+      std::lock_guard<std::mutex> lk(writer_mutex_);
+    }
+    writer_cv_.notify_one();
+  }
+  return true;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeystrokeJournalWriter::close() noexcept
+{
+  if (closed_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(writer_mutex_);
+    writer_exit_ = true;
+  }
+  writer_cv_.notify_one();
+  writer_thread_.join();
+  ::close(fd_);
+  fd_ = -1;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+size_t KeystrokeJournalWriter::get_written_records_count() const
+{
+  return written_records_.load(std::memory_order_relaxed);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+size_t KeystrokeJournalWriter::get_dropped_records_count() const
+{
+  return dropped_records_.load(std::memory_order_relaxed);
+}
+
+void KeystrokeJournalWriter::writer_thread_loop()
+{
+  try {
+    journal_entry entry;
+    while (true) {
+      if (queue_.try_pop(entry)) {
+        append_to_buffer(entry);
+        continue;
+      }
+      // Nothing more to write for now, don't keep records in memory while idle
+      write_buffer();
+      std::unique_lock<std::mutex> lk(writer_mutex_);
+      writer_sleeping_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (queue_.empty()) {
+        // Write all queued records before exit
+        if (writer_exit_) {
+          break;
+        }
+        writer_cv_.wait(lk);
+      }
+      writer_sleeping_.store(false, std::memory_order_relaxed);
+    }
+  } catch (...) {
+    writer_exception_ptr_ = std::current_exception();
+  }
+}
+
+void KeystrokeJournalWriter::append_to_buffer(const journal_entry & entry)
+{
+  if (buffer_.size() + KeystrokeJournalFormat::RECORD_HEADER_SIZE + entry.raw_length >
+    WRITE_BUFFER_SIZE)
+  {
+    write_buffer();
+  }
+  char record_header[KeystrokeJournalFormat::RECORD_HEADER_SIZE] = {};
+  int64_t timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    entry.event.timestamp.time_since_epoch()).count();
+  auto key_code = static_cast<uint32_t>(entry.event.key_code);
+  auto key_modifiers = static_cast<uint8_t>(entry.event.key_modifiers);
+  auto event_type = static_cast<uint8_t>(entry.event.event_type);
+  std::memcpy(record_header, &timestamp_ns, sizeof(timestamp_ns));
+  std::memcpy(record_header + 8, &key_code, sizeof(key_code));
+  std::memcpy(record_header + 12, &key_modifiers, sizeof(key_modifiers));
+  std::memcpy(record_header + 13, &entry.raw_length, sizeof(entry.raw_length));
+  std::memcpy(record_header + 14, &event_type, sizeof(event_type));
+  buffer_.insert(buffer_.end(), record_header, record_header + sizeof(record_header));
+  buffer_.insert(buffer_.end(), entry.raw, entry.raw + entry.raw_length);
+  written_records_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void KeystrokeJournalWriter::write_buffer()
+{
+  if (!buffer_.empty()) {
+    write_all(fd_, buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeystrokeJournalReader::KeystrokeJournalReader(const std::string & path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(
+            "Error in open(\"" + path + "\"). errno = " + std::to_string(errno));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    int error = errno;
+    ::close(fd);
+    throw std::runtime_error("Error in fstat(). errno = " + std::to_string(error));
+  }
+  size_ = static_cast<size_t>(file_stat.st_size);
+  if (size_ < KeystrokeJournalFormat::FILE_HEADER_SIZE) {
+    ::close(fd);
+    throw std::runtime_error("\"" + path + "\" is not a keystroke journal.");
+  }
+  void * data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  // Mapping stays valid after closing the descriptor
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Error in mmap(). errno = " + std::to_string(errno));
+  }
+  data_ = static_cast<const char *>(data);
+
+  uint32_t version = 0;
+  std::memcpy(&version, data_ + sizeof(KeystrokeJournalFormat::MAGIC), sizeof(version));
+  if (std::memcmp(data_, KeystrokeJournalFormat::MAGIC, sizeof(KeystrokeJournalFormat::MAGIC)) !=
+    0 || version != KeystrokeJournalFormat::VERSION)
+  {
+    munmap(const_cast<char *>(data_), size_);
+    throw std::runtime_error(
+            "\"" + path + "\" is not a keystroke journal or has unsupported version.");
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+KeystrokeJournalReader::~KeystrokeJournalReader()
+{
+  munmap(const_cast<char *>(data_), size_);
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool KeystrokeJournalReader::next(Record & record)
+{
+  if (size_ - offset_ < KeystrokeJournalFormat::RECORD_HEADER_SIZE) {
+    return false;
+  }
+  const char * record_header = data_ + offset_;
+  int64_t timestamp_ns = 0;
+  uint32_t key_code = 0;
+  uint8_t key_modifiers = 0;
+  uint8_t raw_length = 0;
+  uint8_t event_type = 0;
+  std::memcpy(&timestamp_ns, record_header, sizeof(timestamp_ns));
+  std::memcpy(&key_code, record_header + 8, sizeof(key_code));
+  std::memcpy(&key_modifiers, record_header + 12, sizeof(key_modifiers));
+  std::memcpy(&raw_length, record_header + 13, sizeof(raw_length));
+  std::memcpy(&event_type, record_header + 14, sizeof(event_type));
+  if (size_ - offset_ - KeystrokeJournalFormat::RECORD_HEADER_SIZE < raw_length) {
+    return false;
+  }
+  record.timestamp = std::chrono::steady_clock::time_point(
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::nanoseconds(timestamp_ns)));
+  record.key_code = static_cast<KeyCode>(key_code);
+  record.key_modifiers = static_cast<KeyModifiers>(key_modifiers);
+  record.event_type = static_cast<KeyEventType>(event_type);
+  record.raw = std::string_view(
+    record_header + KeystrokeJournalFormat::RECORD_HEADER_SIZE, raw_length);
+  offset_ += KeystrokeJournalFormat::RECORD_HEADER_SIZE + raw_length;
+  return true;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+void KeystrokeJournalReader::rewind()
+{
+  offset_ = KeystrokeJournalFormat::FILE_HEADER_SIZE;
+}
+#endif  // #ifndef _WIN32
@@ -0,0 +1,405 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "keyboard_handler/terminfo_key_map.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+
+/// \brief Magic number of the legacy compiled terminfo format with 16 bit numbers.
+constexpr int LEGACY_MAGIC = 0432;
+/// \brief Magic number of the compiled terminfo format with 32 bit numbers.
+constexpr int NUMBERS_32BIT_MAGIC = 01036;
+constexpr size_t TERMINFO_HEADER_SIZE = 12;
+/// \brief Compiled terminfo entries are limited to 32 KB by ncurses, anything bigger is not
+/// terminfo.
+constexpr size_t MAX_TERMINFO_SIZE = 32 * 1024;
+
+/// \brief Index of the key capability in the table of predefined string capabilities, the
+/// same order as in term.h.
+struct KeyCapability
+{
+  KeyCode key_code;
+  size_t index;
+};
+
+constexpr KeyCapability KEY_CAPABILITIES[] = {
+  {KeyCode::BACK_SPACE, 55},    // kbs
+  {KeyCode::DELETE_KEY, 59},    // kdch1
+  {KeyCode::CURSOR_DOWN, 61},   // kcud1
+  {KeyCode::F1, 66},            // kf1
+  {KeyCode::F10, 67},           // kf10
+  {KeyCode::F2, 68},            // kf2
+  {KeyCode::F3, 69},            // kf3
+  {KeyCode::F4, 70},            // kf4
+  {KeyCode::F5, 71},            // kf5
+  {KeyCode::F6, 72},            // kf6
+  {KeyCode::F7, 73},            // kf7
+  {KeyCode::F8, 74},            // kf8
+  {KeyCode::F9, 75},            // kf9
+  {KeyCode::HOME, 76},          // khome
+  {KeyCode::INSERT, 77},        // kich1
+  {KeyCode::CURSOR_LEFT, 79},   // kcub1
+  {KeyCode::PG_DOWN, 81},       // knp
+  {KeyCode::PG_UP, 82},         // kpp
+  {KeyCode::CURSOR_RIGHT, 83},  // kcuf1
+  {KeyCode::CURSOR_UP, 87},     // kcuu1
+  {KeyCode::END, 164},          // kend
+  {KeyCode::F11, 216},          // kf11
+  {KeyCode::F12, 217},          // kf12
+};
+
+/// \brief Numbers in compiled terminfo are little endian regardless of the host.
+int read_int16(const char * data)
+{
+  auto low = static_cast<unsigned char>(data[0]);
+  auto high = static_cast<unsigned char>(data[1]);
+  return static_cast<int16_t>(static_cast<uint16_t>(low | (high << 8)));
+}
+
+std::string read_file(const std::string & path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(
+            "Error in open(\"" + path + "\"). errno = " + std::to_string(errno));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || file_stat.st_size < 0 ||
+    static_cast<size_t>(file_stat.st_size) > MAX_TERMINFO_SIZE)
+  {
+    close(fd);
+    throw std::runtime_error("\"" + path + "\" is not a compiled terminfo file.");
+  }
+  std::string contents(static_cast<size_t>(file_stat.st_size), '\0');
+  size_t length = 0;
+  while (length < contents.size()) {
+    ssize_t read_bytes = read(fd, &contents[length], contents.size() - length);
+    if (read_bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read_bytes <= 0) {
+      int error = errno;
+      close(fd);
+      throw std::runtime_error(
+              "Error in read(\"" + path + "\"). errno = " + std::to_string(error));
+    }
+    length += static_cast<size_t>(read_bytes);
+  }
+  close(fd);
+  return contents;
+}
+
+bool write_all(int fd, const char * data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+struct cache_header
+{
+  char magic[sizeof(TerminfoKeyMapCacheFormat::MAGIC)];
+  uint32_t version;
+  uint32_t trie_size;
+  uint64_t terminfo_hash;
+  uint64_t fallback_hash;
+};
+static_assert(
+  sizeof(cache_header) == TerminfoKeyMapCacheFormat::HEADER_SIZE, "Unexpected cache header size");
+static_assert(
+  TerminfoKeyMapCacheFormat::HEADER_SIZE % alignof(TerminalSequenceTrie) == 0,
+  "Trie should be aligned in the mapped cache file");
+}  // namespace
+
+constexpr char TerminfoKeyMapCacheFormat::MAGIC[8];
+
+KEYBOARD_HANDLER_PUBLIC
+TerminfoKeyMap::TerminfoKeyMap(
+  const std::string & terminfo_path, const TerminalSequenceTrie & fallback_trie,
+  const std::string & cache_dir)
+{
+  const std::string terminfo = read_file(terminfo_path);
+  const uint64_t terminfo_hash = hash(terminfo.data(), terminfo.size());
+  const uint64_t fallback_hash = hash(&fallback_trie, sizeof(fallback_trie));
+  std::string cache_path;
+  if (!cache_dir.empty()) {
+    char file_name[32];
+    std::snprintf(
+      file_name, sizeof(file_name), "terminfo-%016llx.bin",
+      static_cast<unsigned long long>(terminfo_hash));  // NOLINT(runtime/int)
+    cache_path = cache_dir + "/" + file_name;
+    if (map_cache(cache_path, terminfo_hash, fallback_hash)) {
+      return;
+    }
+  }
+
+  std::vector<KeySequence> key_sequences;
+  if (!parse_key_sequences(terminfo.data(), terminfo.size(), key_sequences)) {
+    throw std::runtime_error("\"" + terminfo_path + "\" is not a compiled terminfo file.");
+  }
+  built_trie_ = fallback_trie;
+  for (const auto & key_sequence : key_sequences) {
+    // Sequences which don't fit into the trie are skipped, fallback sequences stay in use
+    built_trie_.insert_or_assign(
+      key_sequence.sequence.data(), key_sequence.sequence.size(), key_sequence.key_code);
+  }
+  trie_ = &built_trie_;
+  if (!cache_path.empty()) {
+    write_cache(cache_dir, cache_path, terminfo_hash, fallback_hash);
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+TerminfoKeyMap::~TerminfoKeyMap()
+{
+  if (mapping_ != nullptr) {
+    munmap(const_cast<char *>(mapping_), mapping_size_);
+  }
+}
+
+KEYBOARD_HANDLER_PUBLIC
+const TerminalSequenceTrie & TerminfoKeyMap::get_trie() const
+{
+  return *trie_;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool TerminfoKeyMap::is_loaded_from_cache() const
+{
+  return mapping_ != nullptr;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::string TerminfoKeyMap::find_terminfo_file(const std::string & term)
+{
+  if (term.empty() || term[0] == '.' || term.find('/') != std::string::npos) {
+    return std::string();
+  }
+  static const char * const SYSTEM_DIRS[] = {
+    "/etc/terminfo", "/lib/terminfo", "/usr/share/terminfo", "/usr/lib/terminfo"};
+  std::vector<std::string> dirs;
+  if (const char * terminfo = std::getenv("TERMINFO")) {
+    dirs.emplace_back(terminfo);
+  }
+  if (const char * home = std::getenv("HOME")) {
+    dirs.push_back(std::string(home) + "/.terminfo");
+  }
+  if (const char * terminfo_dirs = std::getenv("TERMINFO_DIRS")) {
+    std::string list(terminfo_dirs);
+    size_t begin = 0;
+    while (begin <= list.size()) {
+      size_t end = list.find(':', begin);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      if (end == begin) {
+        // Empty element stands for the system directories
+        dirs.insert(dirs.end(), std::begin(SYSTEM_DIRS), std::end(SYSTEM_DIRS));
+      } else {
+        dirs.push_back(list.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+  }
+  dirs.insert(dirs.end(), std::begin(SYSTEM_DIRS), std::end(SYSTEM_DIRS));
+
+  char hex_subdir[3];
+  std::snprintf(hex_subdir, sizeof(hex_subdir), "%02x", static_cast<unsigned char>(term[0]));
+  for (const auto & dir : dirs) {
+    for (const std::string & subdir : {std::string(1, term[0]), std::string(hex_subdir)}) {
+      std::string path = dir + "/" + subdir + "/" + term;
+      if (access(path.c_str(), R_OK) == 0) {
+        return path;
+      }
+    }
+  }
+  return std::string();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+std::string TerminfoKeyMap::get_default_cache_dir()
+{
+  const char * cache_home = std::getenv("XDG_CACHE_HOME");
+  if (cache_home != nullptr && cache_home[0] == '/') {
+    return std::string(cache_home) + "/keyboard_handler";
+  }
+  const char * home = std::getenv("HOME");
+  if (home != nullptr && home[0] == '/') {
+    return std::string(home) + "/.cache/keyboard_handler";
+  }
+  return std::string();
+}
+
+KEYBOARD_HANDLER_PUBLIC
+bool TerminfoKeyMap::parse_key_sequences(
+  const char * data, size_t length, std::vector<KeySequence> & key_sequences)
+{
+  if (length < TERMINFO_HEADER_SIZE) {
+    return false;
+  }
+  const int magic = read_int16(data);
+  if (magic != LEGACY_MAGIC && magic != NUMBERS_32BIT_MAGIC) {
+    return false;
+  }
+  const int names_size = read_int16(data + 2);
+  const int booleans_count = read_int16(data + 4);
+  const int numbers_count = read_int16(data + 6);
+  const int strings_count = read_int16(data + 8);
+  const int string_table_size = read_int16(data + 10);
+  if (names_size < 0 || booleans_count < 0 || numbers_count < 0 || strings_count < 0 ||
+    string_table_size < 0)
+  {
+    return false;
+  }
+  size_t offset = TERMINFO_HEADER_SIZE + static_cast<size_t>(names_size) +
+    static_cast<size_t>(booleans_count);
+  // Numbers start at even offset
+  offset += offset % 2;
+  offset += static_cast<size_t>(numbers_count) * (magic == LEGACY_MAGIC ? 2 : 4);
+  const size_t string_offsets = offset;
+  const size_t string_table = string_offsets + static_cast<size_t>(strings_count) * 2;
+  const auto table_size = static_cast<size_t>(string_table_size);
+  if (string_table + table_size > length) {
+    return false;
+  }
+
+  key_sequences.clear();
+  for (const auto & capability : KEY_CAPABILITIES) {
+    if (capability.index >= static_cast<size_t>(strings_count)) {
+      continue;
+    }
+    // Negative offset means that capability is absent or cancelled
+    const int string_offset = read_int16(data + string_offsets + capability.index * 2);
+    if (string_offset < 0 || static_cast<size_t>(string_offset) >= table_size) {
+      continue;
+    }
+    const char * sequence = data + string_table + string_offset;
+    const size_t max_length = table_size - static_cast<size_t>(string_offset);
+    const size_t sequence_length = strnlen(sequence, max_length);
+    if (sequence_length == 0 || sequence_length == max_length) {
+      continue;  // Empty or not null terminated
+    }
+    key_sequences.push_back(KeySequence{capability.key_code, {sequence, sequence_length}});
+  }
+  return true;
+}
+
+KEYBOARD_HANDLER_PUBLIC
+uint64_t TerminfoKeyMap::hash(const void * data, size_t length)
+{
+  const auto * bytes = static_cast<const unsigned char *>(data);
+  uint64_t value = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    value ^= bytes[i];
+    value *= 1099511628211ULL;
+  }
+  return value;
+}
+
+bool TerminfoKeyMap::map_cache(
+  const std::string & cache_path, uint64_t terminfo_hash, uint64_t fallback_hash)
+{
+  int fd = open(cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  const size_t expected_size = TerminfoKeyMapCacheFormat::HEADER_SIZE +
+    sizeof(TerminalSequenceTrie);
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || static_cast<size_t>(file_stat.st_size) != expected_size) {
+    close(fd);
+    return false;
+  }
+  void * data = mmap(nullptr, expected_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // Mapping stays valid after closing the descriptor
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  const auto * mapping = static_cast<const char *>(data);
+  cache_header header;
+  std::memcpy(&header, mapping, sizeof(header));
+  const auto * trie = reinterpret_cast<const TerminalSequenceTrie *>(
+    mapping + TerminfoKeyMapCacheFormat::HEADER_SIZE);
+  if (std::memcmp(header.magic, TerminfoKeyMapCacheFormat::MAGIC, sizeof(header.magic)) != 0 ||
+    header.version != TerminfoKeyMapCacheFormat::VERSION ||
+    header.trie_size != sizeof(TerminalSequenceTrie) ||
+    header.terminfo_hash != terminfo_hash || header.fallback_hash != fallback_hash ||
+    !trie->is_valid())
+  {
+    munmap(data, expected_size);
+    return false;
+  }
+  mapping_ = mapping;
+  mapping_size_ = expected_size;
+  trie_ = trie;
+  return true;
+}
+
+void TerminfoKeyMap::write_cache(
+  const std::string & cache_dir, const std::string & cache_path, uint64_t terminfo_hash,
+  uint64_t fallback_hash) const
+{
+  // Create parent directory as well, e.g. ~/.cache might not exist yet
+  size_t parent_end = cache_dir.find_last_of('/');
+  if (parent_end != std::string::npos && parent_end > 0) {
+    mkdir(cache_dir.substr(0, parent_end).c_str(), 0755);
+  }
+  mkdir(cache_dir.c_str(), 0755);
+
+  cache_header header{};
+  std::memcpy(header.magic, TerminfoKeyMapCacheFormat::MAGIC, sizeof(header.magic));
+  header.version = TerminfoKeyMapCacheFormat::VERSION;
+  header.trie_size = sizeof(TerminalSequenceTrie);
+  header.terminfo_hash = terminfo_hash;
+  header.fallback_hash = fallback_hash;
+
+  // Readers never observe partially written file, concurrent writers write the same contents
+  const std::string temp_path = cache_path + ".tmp." + std::to_string(getpid());
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+  bool written = write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header)) &&
+    write_all(fd, reinterpret_cast<const char *>(&built_trie_), sizeof(built_trie_));
+  close(fd);
+  if (!written || rename(temp_path.c_str(), cache_path.c_str()) == -1) {
+    unlink(temp_path.c_str());
+  }
+}
+
+#endif  // #ifndef _WIN32
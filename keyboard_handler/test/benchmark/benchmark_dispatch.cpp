@@ -0,0 +1,258 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/keyboard_handler_base.hpp"
+#include "keyboard_handler/latency_histogram.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+constexpr size_t KEY_CODES_COUNT = static_cast<size_t>(KeyCode::END_OF_KEY_CODE_ENUM);
+constexpr size_t KEY_MODIFIERS_COUNT = 8;
+
+/// \brief Keyboard handler without platform specific input thread.
+class BenchmarkKeyboardHandler : public KeyboardHandlerBase
+{
+public:
+  BenchmarkKeyboardHandler()
+  {
+    is_init_succeed_ = true;
+  }
+
+  using KeyboardHandlerBase::dispatch_key_press;
+  using KeyboardHandlerBase::KeyAndModifiers;
+  using KeyboardHandlerBase::key_and_modifiers_hash_fn;
+  using KeyboardHandlerBase::callback_data;
+};
+
+/// \brief Key press combination for the i-th registered callback. Callbacks spread evenly over
+/// all key codes and key modifiers.
+BenchmarkKeyboardHandler::KeyAndModifiers get_key_and_modifiers(size_t i)
+{
+  return {
+    static_cast<KeyCode>(i % KEY_CODES_COUNT),
+    static_cast<KeyModifiers>((i / KEY_CODES_COUNT) % KEY_MODIFIERS_COUNT)};
+}
+}  // namespace
+
+static void BM_dispatch_flat_table(benchmark::State & state)
+{
+  const auto callbacks_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  size_t calls = 0;
+  auto callback = [&calls](KeyCode, KeyModifiers) {calls++;};
+  for (size_t i = 0; i < callbacks_count; i++) {
+    auto key = get_key_and_modifiers(i);
+    keyboard_handler.add_key_press_callback(callback, key.key_code, key.key_modifiers);
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key = get_key_and_modifiers(i++ % callbacks_count);
+    keyboard_handler.dispatch_key_press(key.key_code, key.key_modifiers);
+  }
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_dispatch_flat_table)->Arg(1)->Arg(10)->Arg(1000);
+
+/// \brief Dispatch of the timestamped key press, records latency statistics if library was
+/// built with KEYBOARD_HANDLER_ENABLE_LATENCY_STATS, otherwise should match flat table.
+static void BM_dispatch_key_event(benchmark::State & state)
+{
+  BenchmarkKeyboardHandler keyboard_handler;
+  size_t calls = 0;
+  keyboard_handler.add_key_press_callback([&calls](KeyCode, KeyModifiers) {calls++;}, KeyCode::A);
+  const KeyboardHandlerBase::KeyEvent event{
+    KeyCode::A, KeyModifiers::NONE, std::chrono::steady_clock::now()};
+
+  for (auto _ : state) {
+    keyboard_handler.dispatch_key_press(event);
+  }
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+  state.SetLabel(keyboard_handler.get_latency_stats().enabled ? "stats on" : "stats off");
+}
+BENCHMARK(BM_dispatch_key_event);
+
+/// \brief Dispatch of the key presses which alternately start and complete one of the
+/// registered two key sequences, should not depend on the number of sequences.
+static void BM_dispatch_key_sequences(benchmark::State & state)
+{
+  const auto sequences_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  size_t calls = 0;
+  auto callback = [&calls](KeyCode, KeyModifiers) {calls++;};
+  for (size_t i = 0; i < sequences_count; i++) {
+    keyboard_handler.add_key_sequence_callback(
+      callback, {get_key_and_modifiers(2 * i), get_key_and_modifiers(2 * i + 1)},
+      KeyboardHandlerBase::KeySequenceMode::PASS_THROUGH_KEYS);
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key = get_key_and_modifiers(i++ % (2 * sequences_count));
+    keyboard_handler.dispatch_key_press(
+      KeyboardHandlerBase::KeyEvent{key.key_code, key.key_modifiers, {}});
+  }
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_dispatch_key_sequences)->Arg(1)->Arg(10)->Arg(400);
+
+static void BM_latency_histogram_record(benchmark::State & state)
+{
+  LatencyHistogram histogram;
+  int64_t i = 0;
+  for (auto _ : state) {
+    // Spread values over many buckets
+    histogram.record(std::chrono::nanoseconds((i++ * 7919) % 10000000));
+  }
+  benchmark::DoNotOptimize(histogram.snapshot().count);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_latency_histogram_record);
+
+/// \brief Dispatch the same way as it was done before introduction of the flat table.
+static void BM_dispatch_unordered_multimap(benchmark::State & state)
+{
+  using KeyAndModifiers = BenchmarkKeyboardHandler::KeyAndModifiers;
+  const auto callbacks_count = static_cast<size_t>(state.range(0));
+  std::mutex callbacks_mutex;
+  std::unordered_multimap<KeyAndModifiers, BenchmarkKeyboardHandler::callback_data,
+    BenchmarkKeyboardHandler::key_and_modifiers_hash_fn> callbacks;
+  size_t calls = 0;
+  auto callback = [&calls](KeyCode, KeyModifiers) {calls++;};
+  for (size_t i = 0; i < callbacks_count; i++) {
+    callbacks.emplace(
+      get_key_and_modifiers(i), BenchmarkKeyboardHandler::callback_data{i, callback});
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key = get_key_and_modifiers(i++ % callbacks_count);
+    std::lock_guard<std::mutex> lk(callbacks_mutex);
+    auto range = callbacks.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      it->second.callback(key.key_code, key.key_modifiers);
+    }
+  }
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_dispatch_unordered_multimap)->Arg(1)->Arg(10)->Arg(1000);
+
+/// \brief Dispatch while another thread keeps adding and deleting callbacks.
+static void BM_dispatch_with_concurrent_registration(benchmark::State & state)
+{
+  const auto callbacks_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  size_t calls = 0;
+  auto callback = [&calls](KeyCode, KeyModifiers) {calls++;};
+  for (size_t i = 0; i < callbacks_count; i++) {
+    auto key = get_key_and_modifiers(i);
+    keyboard_handler.add_key_press_callback(callback, key.key_code, key.key_modifiers);
+  }
+
+  std::atomic_bool running{true};
+  std::thread writer([&keyboard_handler, &running]() {
+      while (running.load()) {
+        auto handle = keyboard_handler.add_key_press_callback(
+          [](KeyCode, KeyModifiers) {}, KeyCode::F12, KeyModifiers::CTRL);
+        keyboard_handler.delete_key_press_callback(handle);
+      }
+    });
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key = get_key_and_modifiers(i++ % callbacks_count);
+    keyboard_handler.dispatch_key_press(key.key_code, key.key_modifiers);
+  }
+  running = false;
+  writer.join();
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_dispatch_with_concurrent_registration)->Arg(1)->Arg(10)->Arg(1000);
+
+/// \brief Register given number of callbacks and delete them in registration order.
+static void BM_add_and_delete_callbacks(benchmark::State & state)
+{
+  const auto callbacks_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  auto callback = [](KeyCode, KeyModifiers) {};
+  std::vector<KeyboardHandlerBase::callback_handle_t> handles(callbacks_count);
+  for (auto _ : state) {
+    for (size_t i = 0; i < callbacks_count; i++) {
+      auto key = get_key_and_modifiers(i);
+      handles[i] = keyboard_handler.add_key_press_callback(
+        callback, key.key_code, key.key_modifiers);
+    }
+    for (auto handle : handles) {
+      keyboard_handler.delete_key_press_callback(handle);
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * callbacks_count));
+}
+BENCHMARK(BM_add_and_delete_callbacks)->Arg(10)->Arg(100)->Arg(1000);
+
+/// \brief The same as BM_add_and_delete_callbacks, but with one batch update for all callbacks.
+static void BM_add_and_delete_callbacks_batch(benchmark::State & state)
+{
+  const auto callbacks_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  auto callback = [](KeyCode, KeyModifiers) {};
+  std::vector<KeyboardHandlerBase::KeyPressBinding> bindings;
+  for (size_t i = 0; i < callbacks_count; i++) {
+    auto key = get_key_and_modifiers(i);
+    bindings.push_back({callback, key.key_code, key.key_modifiers});
+  }
+  for (auto _ : state) {
+    auto handles = keyboard_handler.add_key_press_callbacks(bindings);
+    keyboard_handler.delete_key_press_callbacks(handles);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * callbacks_count));
+}
+BENCHMARK(BM_add_and_delete_callbacks_batch)->Arg(10)->Arg(100)->Arg(1000);
+
+/// \brief Register given number of two key sequences and delete them in registration order,
+/// should not depend on the number of sequences registered already.
+static void BM_add_and_delete_key_sequences(benchmark::State & state)
+{
+  const auto sequences_count = static_cast<size_t>(state.range(0));
+  BenchmarkKeyboardHandler keyboard_handler;
+  auto callback = [](KeyCode, KeyModifiers) {};
+  std::vector<KeyboardHandlerBase::callback_handle_t> handles(sequences_count);
+  for (auto _ : state) {
+    for (size_t i = 0; i < sequences_count; i++) {
+      handles[i] = keyboard_handler.add_key_sequence_callback(
+        callback, {get_key_and_modifiers(2 * i), get_key_and_modifiers(2 * i + 1)},
+        KeyboardHandlerBase::KeySequenceMode::PASS_THROUGH_KEYS);
+    }
+    for (auto handle : handles) {
+      keyboard_handler.delete_key_press_callback(handle);
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * sequences_count));
+}
+BENCHMARK(BM_add_and_delete_key_sequences)->Arg(10)->Arg(100)->Arg(400);
@@ -0,0 +1,46 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+static void BM_enum_key_code_to_str(benchmark::State & state)
+{
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+  const auto key_codes_count = static_cast<size_t>(KeyCode::END_OF_KEY_CODE_ENUM);
+  size_t i = 0;
+  for (auto _ : state) {
+    auto str = enum_key_code_to_str(static_cast<KeyCode>(i++ % key_codes_count));
+    benchmark::DoNotOptimize(str);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_enum_key_code_to_str);
+
+static void BM_enum_str_to_key_code(benchmark::State & state)
+{
+  std::vector<std::string> strings;
+  for (const auto & it : ENUM_KEY_TO_STR_MAP) {
+    strings.emplace_back(it.str);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key_code = enum_str_to_key_code(strings[i++ % strings.size()]);
+    benchmark::DoNotOptimize(key_code);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_enum_str_to_key_code);
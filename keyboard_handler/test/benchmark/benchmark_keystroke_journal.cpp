@@ -0,0 +1,130 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef _WIN32
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+#include "keyboard_handler/keystroke_journal.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+int isatty_stub(int) {return 1;}
+
+int tcgetattr_stub(int, struct termios *) {return 0;}
+
+int tcsetattr_stub(int, int, const struct termios *) {return 0;}
+
+/// \brief Keyboard handler with input thread which never receives any input.
+class IdleKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  IdleKeyboardHandler()
+  : KeyboardHandlerUnixImpl(
+      [](int, void *, size_t) -> ssize_t {return 0;},
+      [](struct pollfd * fds, nfds_t nfds, int timeout) {return poll(fds + 1, nfds - 1, timeout);},
+      isatty_stub, tcgetattr_stub, tcsetattr_stub, false)
+  {}
+};
+
+/// \brief Temporary journal file removed on destruction.
+class TemporaryJournal
+{
+public:
+  TemporaryJournal()
+  {
+    int fd = mkstemp(path_);
+    if (fd == -1) {
+      throw std::runtime_error("Can't create temporary file");
+    }
+    close(fd);
+  }
+
+  ~TemporaryJournal()
+  {
+    unlink(path_);
+  }
+
+  const char * path() const
+  {
+    return path_;
+  }
+
+private:
+  char path_[64] = "/tmp/keyboard_handler_benchmark_journal_XXXXXX";
+};
+}  // namespace
+
+/// \brief Cost of recording on the input thread, file is written by the writer thread.
+static void BM_journal_record(benchmark::State & state)
+{
+  TemporaryJournal journal;
+  KeystrokeJournalWriter writer(journal.path(), 1 << 16);
+  const KeyboardHandlerBase::KeyEvent event{
+    KeyCode::CURSOR_UP, KeyModifiers::NONE, std::chrono::steady_clock::now()};
+  for (auto _ : state) {
+    if (!writer.record(event, "\x1b[A")) {
+      state.PauseTiming();
+      // Let writer thread to catch up instead of measuring dropped records
+      while (writer.get_written_records_count() + writer.get_dropped_records_count() <
+        static_cast<size_t>(state.iterations()))
+      {
+        std::this_thread::yield();
+      }
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_journal_record);
+
+/// \brief Replay of the journal with the given number of records as fast as possible.
+static void BM_journal_replay(benchmark::State & state)
+{
+  const auto records_count = static_cast<size_t>(state.range(0));
+  TemporaryJournal journal;
+  {
+    KeystrokeJournalWriter writer(journal.path(), records_count);
+    for (size_t i = 0; i < records_count; i++) {
+      writer.record(
+        {i % 2 ? KeyCode::CURSOR_LEFT : KeyCode::CURSOR_RIGHT, KeyModifiers::NONE,
+          std::chrono::steady_clock::now()}, i % 2 ? "\x1b[D" : "\x1b[C");
+    }
+  }
+  IdleKeyboardHandler keyboard_handler;
+  size_t calls = 0;
+  auto callback = [&calls](KeyCode, KeyModifiers) {calls++;};
+  keyboard_handler.add_key_press_callback(callback, KeyCode::CURSOR_LEFT);
+  keyboard_handler.add_key_press_callback(callback, KeyCode::CURSOR_RIGHT);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      keyboard_handler.replay_journal(
+        journal.path(), KeyboardHandlerUnixImpl::REPLAY_AS_FAST_AS_POSSIBLE));
+  }
+  benchmark::DoNotOptimize(calls);
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * records_count));
+}
+BENCHMARK(BM_journal_replay)->Arg(100)->Arg(10000);
+#endif  // #ifndef _WIN32
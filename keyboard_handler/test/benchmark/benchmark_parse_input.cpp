@@ -0,0 +1,251 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/key_command_parser.hpp"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+int isatty_stub(int) {return 1;}
+
+int tcgetattr_stub(int, struct termios *) {return 0;}
+
+int tcsetattr_stub(int, int, const struct termios *) {return 0;}
+
+/// \brief Keyboard handler which reads terminal input from the pipe instead of stdin.
+/// \details Both read and poll go through the injectable system functions, so benchmarks run
+/// without real terminal.
+class HeadlessKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  explicit HeadlessKeyboardHandler(int input_fd)
+  : KeyboardHandlerUnixImpl(
+      [input_fd](int, void * buff, size_t n_bytes) {return read(input_fd, buff, n_bytes);},
+      [input_fd](struct pollfd * fds, nfds_t nfds, int timeout) {
+        fds[0].fd = input_fd;
+        return poll(fds, nfds, timeout);
+      },
+      isatty_stub, tcgetattr_stub, tcsetattr_stub, false)
+  {}
+
+  using KeyboardHandlerUnixImpl::parse_input;
+};
+
+/// \brief Pipe emulating terminal input.
+class InputPipe
+{
+public:
+  InputPipe()
+  {
+    int fds[2];
+    if (pipe(fds) == -1) {
+      throw std::runtime_error("Can't create pipe");
+    }
+    read_fd = fds[0];
+    write_fd = fds[1];
+  }
+
+  ~InputPipe()
+  {
+    close(read_fd);
+    close(write_fd);
+  }
+
+  void write_all(std::string_view data) const
+  {
+    while (!data.empty()) {
+      ssize_t written = write(write_fd, data.data(), data.size());
+      if (written <= 0) {
+        throw std::runtime_error("Can't write to pipe");
+      }
+      data.remove_prefix(static_cast<size_t>(written));
+    }
+  }
+
+  int read_fd = -1;
+  int write_fd = -1;
+};
+
+void BM_parse_input(benchmark::State & state, const std::vector<std::string> & sequences)
+{
+  InputPipe input;
+  HeadlessKeyboardHandler keyboard_handler(input.read_fd);
+  size_t i = 0;
+  for (auto _ : state) {
+    auto key_code_and_modifiers = keyboard_handler.parse_input(sequences[i++ % sequences.size()]);
+    benchmark::DoNotOptimize(key_code_and_modifiers);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+}  // namespace
+
+BENCHMARK_CAPTURE(BM_parse_input, ascii, {"a", "z", "5", "/", " ", "Z"});
+BENCHMARK_CAPTURE(BM_parse_input, alt, {"\x1b" "a", "\x1b" "z", "\x1b" "5", "\x1b" "Z"});
+BENCHMARK_CAPTURE(BM_parse_input, ctrl, {"\x01", "\x03", "\x1a", "\x0b"});
+BENCHMARK_CAPTURE(
+  BM_parse_input, csi, {"\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[3~", "\x1b[5~", "\x1b[6~"});
+BENCHMARK_CAPTURE(
+  BM_parse_input, f_keys, {"\x1bOP", "\x1bOQ", "\x1bOR", "\x1bOS", "\x1b[15~", "\x1b[17~",
+    "\x1b[18~", "\x1b[19~", "\x1b[20~", "\x1b[21~", "\x1b[23~", "\x1b[24~"});
+BENCHMARK_CAPTURE(
+  BM_parse_input, csi_modifiers, {"\x1b[1;5C", "\x1b[1;2A", "\x1b[1;7H", "\x1b[1;2P",
+    "\x1b[15;2~", "\x1b[3;5~", "\x1b[24;8~"});
+
+/// \brief Whole path from read() to the callback, input written to the pipe in chunks of
+/// the given number of key presses.
+static void BM_read_parse_and_dispatch(benchmark::State & state)
+{
+  static const std::vector<std::string> sequences = {
+    "a", "Z", "\x1b" "b", "\x01", "\x1b[A", "\x1b[3~", "\x1bOP", "\x1b[24~"};
+  const auto keys_per_write = static_cast<size_t>(state.range(0));
+  std::string chunk;
+  for (size_t i = 0; i < keys_per_write; i++) {
+    chunk += sequences[i % sequences.size()];
+  }
+
+  InputPipe input;
+  HeadlessKeyboardHandler keyboard_handler(input.read_fd);
+  std::atomic<size_t> dispatched_keys{0};
+  auto callback = [&dispatched_keys](KeyCode, KeyModifiers) {
+      dispatched_keys.fetch_add(1, std::memory_order_release);
+    };
+  for (const auto & sequence : sequences) {
+    auto key_code_and_modifiers = keyboard_handler.parse_input(sequence);
+    keyboard_handler.add_key_press_callback(
+      callback, std::get<0>(key_code_and_modifiers), std::get<1>(key_code_and_modifiers));
+  }
+
+  size_t expected_keys = 0;
+  for (auto _ : state) {
+    input.write_all(chunk);
+    expected_keys += keys_per_write;
+    while (dispatched_keys.load(std::memory_order_acquire) < expected_keys) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * keys_per_write));
+}
+BENCHMARK(BM_read_parse_and_dispatch)->Arg(1)->Arg(16)->Arg(64)->UseRealTime();
+
+/// \brief Whole path from read() to the key press taken from the event queue of the pull API,
+/// counterpart of BM_read_parse_and_dispatch with one key press per write.
+static void BM_read_parse_and_pull(benchmark::State & state)
+{
+  InputPipe input;
+  HeadlessKeyboardHandler keyboard_handler(input.read_fd);
+  keyboard_handler.enable_event_queue();
+  KeyboardHandlerBase::KeyEvent event;
+  for (auto _ : state) {
+    input.write_all("\x1b[A");
+    while (!keyboard_handler.wait_event(event, std::chrono::seconds(1))) {
+    }
+    benchmark::DoNotOptimize(event);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_read_parse_and_pull)->UseRealTime();
+
+/// \brief Tokenizing of 2 KB of pasted text read out at once, split into sequences when
+/// range is 0 or passed as one bracketed paste when range is 1.
+static void BM_tokenize_paste(benchmark::State & state)
+{
+  const bool bracketed_paste = state.range(0) != 0;
+  std::string text;
+  while (text.size() < 2048) {
+    text += "let x = a[i] + 1;\n";
+  }
+  std::string input = text;
+  if (bracketed_paste) {
+    input = std::string(TerminalSequenceTokenizer::PASTE_START) + text +
+      std::string(TerminalSequenceTokenizer::PASTE_END);
+  }
+  TerminalSequenceTokenizer tokenizer;
+  size_t events = 0;
+  auto on_sequence = [&events](const char *, size_t) {events++;};
+  auto on_paste = [&events](const char *, size_t) {events++;};
+  for (auto _ : state) {
+    if (bracketed_paste) {
+      tokenizer.feed(input.data(), input.size(), on_sequence, on_paste);
+    } else {
+      tokenizer.feed(input.data(), input.size(), on_sequence);
+    }
+    benchmark::DoNotOptimize(events);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_tokenize_paste)->Arg(0)->Arg(1);
+/// \brief Events per second in command stream mode, input written to the pipe in chunks of
+/// 256 key presses.
+static void BM_command_stream(
+  benchmark::State & state, KeyboardHandlerUnixImpl::CommandStreamFormat format)
+{
+  using CommandStreamFormat = KeyboardHandlerUnixImpl::CommandStreamFormat;
+  static const std::vector<std::string> raw_sequences = {
+    "a", "Z", "\x1b" "b", "\x01", "\x1b[A", "\x1b[3~", "\x1bOP", "\x1b[24~"};
+  static const std::vector<std::string> text_commands = {
+    "a", "SHIFT+z", "ALT+b", "CTRL+a", "CURSOR_UP", "DELETE_KEY", "F1", "F12"};
+  constexpr size_t keys_per_write = 256;
+  const auto & commands = format == CommandStreamFormat::RAW ? raw_sequences : text_commands;
+  std::string chunk;
+  for (size_t i = 0; i < keys_per_write; i++) {
+    chunk += commands[i % commands.size()];
+    if (format == CommandStreamFormat::TEXT) {
+      chunk += "\n";
+    }
+  }
+
+  InputPipe input;
+  KeyboardHandlerUnixImpl keyboard_handler(input.read_fd, format);
+  std::atomic<size_t> dispatched_keys{0};
+  auto callback = [&dispatched_keys](KeyCode, KeyModifiers) {
+      dispatched_keys.fetch_add(1, std::memory_order_release);
+    };
+  for (const auto & command : text_commands) {
+    auto key_code_and_modifiers = KeyCommandParser::parse_command(command);
+    keyboard_handler.add_key_press_callback(
+      callback, std::get<0>(key_code_and_modifiers), std::get<1>(key_code_and_modifiers));
+  }
+
+  size_t expected_keys = 0;
+  for (auto _ : state) {
+    input.write_all(chunk);
+    expected_keys += keys_per_write;
+    while (dispatched_keys.load(std::memory_order_acquire) < expected_keys) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * keys_per_write));
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * chunk.size()));
+}
+BENCHMARK_CAPTURE(
+  BM_command_stream, raw, KeyboardHandlerUnixImpl::CommandStreamFormat::RAW)->UseRealTime();
+BENCHMARK_CAPTURE(
+  BM_command_stream, text, KeyboardHandlerUnixImpl::CommandStreamFormat::TEXT)->UseRealTime();
+#endif  // #ifndef _WIN32
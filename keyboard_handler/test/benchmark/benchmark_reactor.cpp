@@ -0,0 +1,164 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/keyboard_handler_reactor.hpp"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+
+/// \brief Master side of the pseudo terminal, emulates keyboard of the terminal.
+class PseudoTerminal
+{
+public:
+  PseudoTerminal()
+  {
+    master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd_ == -1 || grantpt(master_fd_) == -1 || unlockpt(master_fd_) == -1) {
+      throw std::runtime_error("Can't open pseudo terminal");
+    }
+    slave_path_ = ptsname(master_fd_);
+  }
+
+  ~PseudoTerminal()
+  {
+    close(master_fd_);
+  }
+
+  void press_key(char key) const
+  {
+    if (write(master_fd_, &key, 1) != 1) {
+      throw std::runtime_error("Can't write to pseudo terminal");
+    }
+  }
+
+  const std::string & slave_path() const
+  {
+    return slave_path_;
+  }
+
+private:
+  int master_fd_ = -1;
+  std::string slave_path_;
+};
+
+size_t get_threads_count()
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0) {
+      return std::stoul(line.substr(8));
+    }
+  }
+  return 0;
+}
+}  // namespace
+
+/// \brief How terminals are read in BM_key_press_on_each_terminal.
+enum InputMode : int64_t
+{
+  OWN_INPUT_THREADS = 0,
+  SHARED_REACTOR = 1,
+  EXTERNAL_EVENT_LOOP = 2
+};
+
+/// \brief One key press on each of N terminals per iteration, terminals read either by the own
+/// input thread of each keyboard handler, by the shared reactor thread or by the benchmark
+/// thread itself calling process_ready(). Process CPU time includes input threads, "threads"
+/// counter is the number of threads started by handlers.
+static void BM_key_press_on_each_terminal(benchmark::State & state)
+{
+  const auto terminals_count = static_cast<size_t>(state.range(0));
+  const auto input_mode = static_cast<InputMode>(state.range(1));
+  const size_t threads_before = get_threads_count();
+  std::shared_ptr<KeyboardHandlerReactor> reactor;
+  if (input_mode == SHARED_REACTOR) {
+    reactor = KeyboardHandlerReactor::get_shared_instance();
+  }
+  std::vector<std::unique_ptr<PseudoTerminal>> terminals;
+  std::vector<std::unique_ptr<KeyboardHandlerUnixImpl>> handlers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t dispatched_keys = 0;
+  auto callback = [&](KeyCode, KeyModifiers) {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        dispatched_keys++;
+      }
+      cv.notify_one();
+    };
+  for (size_t i = 0; i < terminals_count; i++) {
+    terminals.push_back(std::make_unique<PseudoTerminal>());
+    if (input_mode == EXTERNAL_EVENT_LOOP) {
+      handlers.push_back(
+        std::make_unique<KeyboardHandlerUnixImpl>(
+          KeyboardHandlerUnixImpl::EXTERNAL_EVENT_LOOP, terminals[i]->slave_path()));
+    } else {
+      handlers.push_back(
+        std::make_unique<KeyboardHandlerUnixImpl>(terminals[i]->slave_path(), false, reactor));
+    }
+    handlers[i]->add_key_press_callback(callback, KeyCode::A);
+  }
+  state.counters["threads"] = static_cast<double>(get_threads_count() - threads_before);
+  std::vector<struct pollfd> fds;
+  for (const auto & handler : handlers) {
+    fds.push_back({handler->get_input_fd(), POLLIN, 0});
+  }
+
+  size_t expected_keys = 0;
+  for (auto _ : state) {
+    for (const auto & terminal : terminals) {
+      terminal->press_key('a');
+    }
+    expected_keys += terminals_count;
+    if (input_mode == EXTERNAL_EVENT_LOOP) {
+      // Callbacks are called from this thread, no need to lock the mutex for the check
+      while (dispatched_keys < expected_keys) {
+        poll(fds.data(), fds.size(), -1);
+        for (size_t i = 0; i < fds.size(); i++) {
+          if (fds[i].revents != 0) {
+            handlers[i]->process_ready();
+          }
+        }
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.wait(lk, [&]() {return dispatched_keys >= expected_keys;});
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * terminals_count));
+  handlers.clear();
+}
+BENCHMARK(BM_key_press_on_each_terminal)
+->ArgNames({"terminals", "input_mode"})
+->ArgsProduct({{1, 4, 16}, {OWN_INPUT_THREADS, SHARED_REACTOR, EXTERNAL_EVENT_LOOP}})
+->MeasureProcessCPUTime()->UseRealTime();
+#endif  // #ifndef _WIN32
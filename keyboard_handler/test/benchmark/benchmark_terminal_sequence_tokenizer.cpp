@@ -0,0 +1,65 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/terminal_sequence_tokenizer.hpp"
+
+namespace
+{
+/// \brief Generate stream of the mixed key sequences with total size about size_in_bytes.
+std::string generate_mixed_sequences(size_t size_in_bytes)
+{
+  static const std::vector<std::string> sequences = {
+    "a", "Z", "5", " ", "\n", "\x7f", "\x01", "\x1b" "b", "\x1b" "\x0b",
+    "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[3~", "\x1b[15~", "\x1b[24~", "\x1bOP",
+    "\x1b[1;5C", "\x1b[1;2P", "\xd0\x96", "\xe2\x82\xac"};
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<size_t> distribution(0, sequences.size() - 1);
+  std::string stream;
+  stream.reserve(size_in_bytes + 8);
+  while (stream.size() < size_in_bytes) {
+    stream += sequences[distribution(generator)];
+  }
+  return stream;
+}
+}  // namespace
+
+static void BM_tokenize_mixed_sequences(benchmark::State & state)
+{
+  static const std::string stream = generate_mixed_sequences(4 * 1024 * 1024);
+  const size_t chunk_size = static_cast<size_t>(state.range(0));
+  TerminalSequenceTokenizer tokenizer;
+  size_t sequences_count = 0;
+  auto on_sequence = [&sequences_count](const char * sequence, size_t length) {
+      benchmark::DoNotOptimize(sequence);
+      benchmark::DoNotOptimize(length);
+      sequences_count++;
+    };
+
+  for (auto _ : state) {
+    for (size_t pos = 0; pos < stream.size(); pos += chunk_size) {
+      tokenizer.feed(
+        stream.data() + pos, std::min(chunk_size, stream.size() - pos), on_sequence);
+    }
+    tokenizer.flush(on_sequence);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * stream.size()));
+  state.SetItemsProcessed(static_cast<int64_t>(sequences_count));
+}
+// Chunk sizes emulate bytes returned by one read() call
+BENCHMARK(BM_tokenize_mixed_sequences)->Arg(1)->Arg(3)->Arg(10)->Arg(256)->Arg(64 * 1024);
@@ -0,0 +1,80 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "benchmark/benchmark.h"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+#include "keyboard_handler/terminal_sequence_trie.hpp"
+
+namespace
+{
+class KeyMapAccessor : public KeyboardHandlerUnixImpl
+{
+public:
+  using KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP;
+  using KeyboardHandlerUnixImpl::STATIC_KEY_MAP_LENGTH;
+  using KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_TRIE;
+};
+
+std::vector<std::string> get_sequences(bool multibyte)
+{
+  std::vector<std::string> sequences;
+  for (size_t i = 0; i < KeyMapAccessor::STATIC_KEY_MAP_LENGTH; i++) {
+    std::string sequence = KeyMapAccessor::DEFAULT_STATIC_KEY_MAP[i].terminal_sequence;
+    if ((sequence.size() > 1) == multibyte) {
+      sequences.push_back(sequence);
+    }
+  }
+  return sequences;
+}
+}  // namespace
+
+/// Lookup the same way as it was done before introduction of TerminalSequenceTrie
+static void BM_unordered_map_lookup(benchmark::State & state)
+{
+  std::unordered_map<std::string, KeyboardHandlerBase::KeyCode> key_codes_map;
+  for (size_t i = 0; i < KeyMapAccessor::STATIC_KEY_MAP_LENGTH; i++) {
+    key_codes_map.emplace(
+      KeyMapAccessor::DEFAULT_STATIC_KEY_MAP[i].terminal_sequence,
+      KeyMapAccessor::DEFAULT_STATIC_KEY_MAP[i].inner_code);
+  }
+  const auto sequences = get_sequences(state.range(0) != 0);
+  for (auto _ : state) {
+    for (const auto & sequence : sequences) {
+      std::string buff_to_search(sequence.data(), sequence.size());
+      auto it = key_codes_map.find(buff_to_search);
+      benchmark::DoNotOptimize(it);
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * sequences.size()));
+}
+BENCHMARK(BM_unordered_map_lookup)->ArgName("multibyte")->Arg(0)->Arg(1);
+
+static void BM_trie_lookup(benchmark::State & state)
+{
+  const TerminalSequenceTrie & trie = KeyMapAccessor::DEFAULT_STATIC_KEY_TRIE;
+  const auto sequences = get_sequences(state.range(0) != 0);
+  for (auto _ : state) {
+    for (const auto & sequence : sequences) {
+      auto key_code = trie.find(sequence.data(), sequence.size());
+      benchmark::DoNotOptimize(key_code);
+    }
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * sequences.size()));
+}
+BENCHMARK(BM_trie_lookup)->ArgName("multibyte")->Arg(0)->Arg(1);
+#endif  // #ifndef _WIN32
@@ -0,0 +1,189 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include "gmock/gmock.h"
+#include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+
+// Counting replacement for global operator new. Counts allocations only on threads where
+// g_count_allocations was set.
+namespace
+{
+thread_local bool g_count_allocations = false;
+std::atomic<size_t> g_allocations_count{0};
+}  // namespace
+
+void * operator new(std::size_t size)
+{
+  if (g_count_allocations) {
+    g_allocations_count++;
+  }
+  void * ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+// GCC doesn't know that replaced operator new allocates with malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void * ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void * ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace
+{
+constexpr size_t NUMBER_OF_KEYS = 1000000;  // Multiple of the number of key sequences
+
+int isatty_mock(int) {return 1;}
+
+int tcgetattr_mock(int, struct termios *) {return 0;}
+
+int tcsetattr_mock(int, int, const struct termios *) {return 0;}
+
+/// Mixed key sequences: ASCII, SHIFT, CTRL, ALT, CSI, SS3 and unknown sequences
+const std::vector<std::string> & get_key_sequences()
+{
+  static const std::vector<std::string> key_sequences = {
+    "a", "E", "\x0b", "\x1b" "k", "\x1b" "\x0b", "\x1b[A", "\x1b[D", "\x1b[3~", "\x1b[15~",
+    "\x1bOP", "\x1b[24~", " ", "\n", "\x7f", "5", "\x1b[99~"};
+  return key_sequences;
+}
+
+class AllocationsTestKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  explicit AllocationsTestKeyboardHandler(const readFunction & read_fn)
+  : KeyboardHandlerUnixImpl(read_fn, isatty_mock, tcgetattr_mock, tcsetattr_mock, false) {}
+
+  using KeyboardHandlerUnixImpl::parse_input;
+};
+}  // namespace
+
+TEST(KeyboardHandlerAllocationsTest, parse_input_does_not_allocate) {
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+  AllocationsTestKeyboardHandler keyboard_handler([](int, void *, size_t) -> ssize_t {return 0;});
+  std::vector<std::string_view> key_sequences(
+    get_key_sequences().begin(), get_key_sequences().end());
+  size_t unknown_keys = 0;
+
+  g_allocations_count = 0;
+  g_count_allocations = true;
+  for (size_t i = 0; i < NUMBER_OF_KEYS; i++) {
+    auto key_code_and_modifiers = keyboard_handler.parse_input(
+      key_sequences[i % key_sequences.size()]);
+    if (std::get<0>(key_code_and_modifiers) == KeyCode::UNKNOWN) {
+      unknown_keys++;
+    }
+  }
+  g_count_allocations = false;
+
+  EXPECT_EQ(g_allocations_count.load(), 0U);
+  EXPECT_EQ(unknown_keys, NUMBER_OF_KEYS / key_sequences.size());
+}
+
+TEST(KeyboardHandlerAllocationsTest, read_parse_and_dispatch_does_not_allocate) {
+  using KeyCode = KeyboardHandlerBase::KeyCode;
+  using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+  std::string input;
+  for (size_t i = 0; i < NUMBER_OF_KEYS; i++) {
+    input += get_key_sequences()[i % get_key_sequences().size()];
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool all_keys_processed = false;
+  bool start_reading = false;
+  bool stop_reading = false;
+  size_t read_position = 0;
+  size_t allocations_count = 0;
+  // Allocations counted on input thread since the first read() returned and till all callbacks
+  // for the returned data were called, i.e. next read() call after the end of the data.
+  auto read_fn = [&](int, void * buff, size_t n_bytes) -> ssize_t {
+      if (read_position == 0) {
+        // Don't miss key presses before all callbacks are registered
+        {
+          std::unique_lock<std::mutex> lk(mutex);
+          cv.wait(lk, [&start_reading]() {return start_reading;});
+        }
+        g_allocations_count = 0;
+        g_count_allocations = true;
+      }
+      if (read_position < input.size()) {
+        size_t bytes_to_copy = std::min(n_bytes, input.size() - read_position);
+        std::memcpy(buff, input.data() + read_position, bytes_to_copy);
+        read_position += bytes_to_copy;
+        return static_cast<ssize_t>(bytes_to_copy);
+      }
+      std::unique_lock<std::mutex> lk(mutex);
+      if (!all_keys_processed) {
+        g_count_allocations = false;
+        allocations_count = g_allocations_count.load();
+        all_keys_processed = true;
+        cv.notify_all();
+      }
+      cv.wait(lk, [&stop_reading]() {return stop_reading;});
+      return 0;
+    };
+
+  size_t callbacks_count = 0;
+  auto callback = [&callbacks_count](KeyCode, KeyModifiers) {callbacks_count++;};
+  {
+    AllocationsTestKeyboardHandler keyboard_handler(read_fn);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::A);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::E, KeyModifiers::SHIFT);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::K, KeyModifiers::CTRL);
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::K, KeyModifiers::CTRL | KeyModifiers::ALT);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::CURSOR_UP);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::F1);
+    keyboard_handler.add_key_press_callback(callback, KeyCode::F12);
+
+    std::unique_lock<std::mutex> lk(mutex);
+    start_reading = true;
+    cv.notify_all();
+    EXPECT_TRUE(
+      cv.wait_for(
+        lk, std::chrono::seconds(60), [&all_keys_processed]() {return all_keys_processed;}));
+    stop_reading = true;
+    cv.notify_all();
+  }
+
+  EXPECT_EQ(allocations_count, 0U);
+  EXPECT_EQ(callbacks_count, 7 * (NUMBER_OF_KEYS / get_key_sequences().size()));
+}
+#endif  // #ifndef _WIN32
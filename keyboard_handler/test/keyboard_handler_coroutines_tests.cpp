@@ -0,0 +1,217 @@
+// Copyright 2021 Apex.AI, Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Awaitables are C++17 compatible, but coroutines themselves need C++20
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#include <thread>
+#include <vector>
+#include "gmock/gmock.h"
+#include "keyboard_handler/key_event_awaitables.hpp"
+#include "keyboard_handler/keyboard_handler_base.hpp"
+
+namespace
+{
+using KeyCode = KeyboardHandlerBase::KeyCode;
+using KeyModifiers = KeyboardHandlerBase::KeyModifiers;
+using KeyEvent = KeyboardHandlerBase::KeyEvent;
+using KeyEventType = KeyboardHandlerBase::KeyEventType;
+
+/// \brief Keyboard handler without platform specific input thread.
+class CoroutinesTestKeyboardHandler : public KeyboardHandlerBase
+{
+public:
+  CoroutinesTestKeyboardHandler()
+  {
+    is_init_succeed_ = true;
+  }
+
+  using KeyboardHandlerBase::dispatch_key_press;
+};
+
+/// \brief Coroutine which starts eagerly and could be destroyed while suspended.
+struct Task
+{
+  struct promise_type
+  {
+    Task get_return_object()
+    {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_never initial_suspend() noexcept {return {};}
+    std::suspend_always final_suspend() noexcept {return {};}
+    void return_void() {}
+    void unhandled_exception() {std::terminate();}
+  };
+
+  explicit Task(std::coroutine_handle<promise_type> coroutine)
+  : coroutine_(coroutine) {}
+
+  Task(const Task &) = delete;
+  Task & operator=(const Task &) = delete;
+
+  ~Task()
+  {
+    coroutine_.destroy();
+  }
+
+  bool is_done() const
+  {
+    return coroutine_.done();
+  }
+
+private:
+  std::coroutine_handle<promise_type> coroutine_;
+};
+
+Task await_key(
+  KeyboardHandlerBase & handler, KeyCode key_code, KeyModifiers key_modifiers,
+  std::vector<KeyEvent> & events, std::vector<std::thread::id> & thread_ids)
+{
+  events.push_back(co_await handler.next_key(key_code, key_modifiers));
+  thread_ids.push_back(std::this_thread::get_id());
+}
+
+Task await_any_keys(KeyboardHandlerBase & handler, size_t count, std::vector<KeyEvent> & events)
+{
+  for (size_t i = 0; i < count; i++) {
+    events.push_back(co_await handler.next_key());
+  }
+}
+
+Task consume_stream(KeyEventStream & stream, size_t count, std::vector<KeyEvent> & events)
+{
+  for (size_t i = 0; i < count; i++) {
+    events.push_back(co_await stream.next());
+  }
+}
+}  // namespace
+
+TEST(KeyboardHandlerCoroutinesTest, next_key_resumes_on_matching_key_press) {
+  CoroutinesTestKeyboardHandler handler;
+  std::vector<KeyEvent> events;
+  std::vector<std::thread::id> thread_ids;
+  Task task = await_key(handler, KeyCode::Q, KeyModifiers::CTRL, events, thread_ids);
+  EXPECT_FALSE(task.is_done());
+
+  handler.dispatch_key_press(KeyCode::Q, KeyModifiers::NONE);
+  handler.dispatch_key_press(KeyCode::A, KeyModifiers::CTRL);
+  handler.dispatch_key_press(
+    {KeyCode::Q, KeyModifiers::CTRL, std::chrono::steady_clock::now(), KeyEventType::RELEASE});
+  EXPECT_FALSE(task.is_done());
+
+  const auto timestamp = std::chrono::steady_clock::now();
+  std::thread dispatching_thread([&handler, timestamp]() {
+      handler.dispatch_key_press({KeyCode::Q, KeyModifiers::CTRL, timestamp});
+    });
+  const auto dispatching_thread_id = dispatching_thread.get_id();
+  dispatching_thread.join();
+  ASSERT_TRUE(task.is_done());
+  ASSERT_EQ(events.size(), 1U);
+  EXPECT_EQ(events[0].key_code, KeyCode::Q);
+  EXPECT_EQ(events[0].key_modifiers, KeyModifiers::CTRL);
+  EXPECT_EQ(events[0].timestamp, timestamp);
+  ASSERT_EQ(thread_ids.size(), 1U);
+  EXPECT_EQ(thread_ids[0], dispatching_thread_id);
+}
+
+TEST(KeyboardHandlerCoroutinesTest, next_key_resumes_on_any_key_press) {
+  CoroutinesTestKeyboardHandler handler;
+  std::vector<KeyEvent> events;
+  Task task = await_any_keys(handler, 3, events);
+  handler.dispatch_key_press(KeyCode::A, KeyModifiers::NONE);
+  handler.dispatch_key_press(KeyCode::B, KeyModifiers::SHIFT);
+  EXPECT_FALSE(task.is_done());
+  handler.dispatch_key_press(KeyCode::C, KeyModifiers::ALT);
+  ASSERT_TRUE(task.is_done());
+  ASSERT_EQ(events.size(), 3U);
+  EXPECT_EQ(events[0].key_code, KeyCode::A);
+  EXPECT_EQ(events[1].key_code, KeyCode::B);
+  EXPECT_EQ(events[1].key_modifiers, KeyModifiers::SHIFT);
+  EXPECT_EQ(events[2].key_code, KeyCode::C);
+  EXPECT_EQ(events[2].key_modifiers, KeyModifiers::ALT);
+}
+
+TEST(KeyboardHandlerCoroutinesTest, coroutines_resumed_in_order_of_suspension) {
+  CoroutinesTestKeyboardHandler handler;
+  std::vector<KeyEvent> events;
+  std::vector<std::thread::id> thread_ids;
+  Task first = await_key(handler, KeyCode::X, KeyModifiers::NONE, events, thread_ids);
+  Task second = await_key(handler, KeyCode::X, KeyModifiers::NONE, events, thread_ids);
+  Task other = await_key(handler, KeyCode::Y, KeyModifiers::NONE, events, thread_ids);
+  handler.dispatch_key_press(KeyCode::X, KeyModifiers::NONE);
+  EXPECT_TRUE(first.is_done());
+  EXPECT_TRUE(second.is_done());
+  EXPECT_FALSE(other.is_done());
+  EXPECT_EQ(events.size(), 2U);
+}
+
+TEST(KeyboardHandlerCoroutinesTest, destroyed_coroutine_is_not_resumed) {
+  CoroutinesTestKeyboardHandler handler;
+  std::vector<KeyEvent> events;
+  std::vector<std::thread::id> thread_ids;
+  {
+    Task task = await_key(handler, KeyCode::X, KeyModifiers::NONE, events, thread_ids);
+  }
+  handler.dispatch_key_press(KeyCode::X, KeyModifiers::NONE);
+  EXPECT_TRUE(events.empty());
+}
+
+TEST(KeyboardHandlerCoroutinesTest, key_events_stream_buffers_key_presses) {
+  CoroutinesTestKeyboardHandler handler;
+  auto stream = handler.key_events(2);
+  // Key presses which arrive before consumer started awaiting are buffered
+  handler.dispatch_key_press(KeyCode::A, KeyModifiers::NONE);
+  handler.dispatch_key_press(KeyCode::B, KeyModifiers::NONE);
+  handler.dispatch_key_press(KeyCode::C, KeyModifiers::NONE);
+  EXPECT_EQ(stream.get_overflow_count(), 1U);
+
+  std::vector<KeyEvent> events;
+  Task task = consume_stream(stream, 4, events);
+  ASSERT_EQ(events.size(), 2U);
+  EXPECT_EQ(events[0].key_code, KeyCode::A);
+  EXPECT_EQ(events[1].key_code, KeyCode::B);
+  EXPECT_FALSE(task.is_done());
+
+  // Suspended consumer receives key presses directly
+  handler.dispatch_key_press(
+    {KeyCode::D, KeyModifiers::NONE, std::chrono::steady_clock::now(), KeyEventType::RELEASE});
+  handler.dispatch_key_press(KeyCode::D, KeyModifiers::NONE);
+  handler.dispatch_key_press(KeyCode::E, KeyModifiers::CTRL);
+  ASSERT_TRUE(task.is_done());
+  ASSERT_EQ(events.size(), 4U);
+  EXPECT_EQ(events[2].key_code, KeyCode::D);
+  EXPECT_EQ(events[2].event_type, KeyEventType::PRESS);
+  EXPECT_EQ(events[3].key_code, KeyCode::E);
+  EXPECT_EQ(events[3].key_modifiers, KeyModifiers::CTRL);
+  EXPECT_EQ(stream.get_overflow_count(), 1U);
+}
+
+TEST(KeyboardHandlerCoroutinesTest, key_events_stream_consumer_destroyed_while_suspended) {
+  CoroutinesTestKeyboardHandler handler;
+  auto stream = handler.key_events();
+  std::vector<KeyEvent> events;
+  {
+    Task task = consume_stream(stream, 1, events);
+  }
+  handler.dispatch_key_press(KeyCode::A, KeyModifiers::NONE);
+  EXPECT_TRUE(events.empty());
+
+  Task task = consume_stream(stream, 1, events);
+  EXPECT_TRUE(task.is_done());
+  ASSERT_EQ(events.size(), 1U);
+  EXPECT_EQ(events[0].key_code, KeyCode::A);
+}
+#endif  // defined(__cpp_impl_coroutine)
@@ -13,18 +13,43 @@
 // limitations under the License.
 
 #ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
 #include <algorithm>
 #include <condition_variable>
 #include <csignal>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <tuple>
+#include <vector>
 #include "gmock/gmock.h"
 #include "fake_recorder.hpp"
 #include "fake_player.hpp"
+#include "keyboard_handler/csi_modifiers_decoder.hpp"
+#include "keyboard_handler/key_command_parser.hpp"
+#include "keyboard_handler/kitty_keyboard_decoder.hpp"
+#include "keyboard_handler/keyboard_handler_reactor.hpp"
 #include "keyboard_handler/keyboard_handler_unix_impl.hpp"
+#include "keyboard_handler/keystroke_journal.hpp"
+#include "keyboard_handler/latency_histogram.hpp"
+#include "keyboard_handler/rate_limiter.hpp"
+#include "keyboard_handler/retired_objects.hpp"
+#include "keyboard_handler/spsc_queue.hpp"
+#include "keyboard_handler/terminal_sequence_tokenizer.hpp"
+#include "keyboard_handler/terminal_sequence_trie.hpp"
+#include "keyboard_handler/terminfo_key_map.hpp"
 
 using ::testing::Return;
 using ::testing::Eq;
@@ -48,14 +73,33 @@ public:
   ssize_t read(int fd, void * buff_ptr, size_t n_bytes)
   {
     std::unique_lock<std::mutex> lk(read_fn_mutex_);
-    if (wait_on_read_) {
+    // Like on the real terminal, input reported by poll() stays available for reading
+    if (wait_on_read_ && !input_reported_) {
       cv_read_.wait(lk, [this]() {return unblock_read_;});
       unblock_read_ = false;
     }
+    input_reported_ = false;
     strncpy(static_cast<char *>(buff_ptr), read_returning_str_value_.c_str(), n_bytes);
     return read_returning_str_value_.length();
   }
 
+  /// \brief Report input as ready, unless read() would block. In that case wait only for the
+  /// wake up descriptor.
+  int poll(struct pollfd * fds, nfds_t nfds, int timeout)
+  {
+    {
+      std::lock_guard<std::mutex> lk(read_fn_mutex_);
+      if (!wait_on_read_ || unblock_read_) {
+        input_reported_ = true;
+        fds[0].revents = POLLIN;
+        fds[1].revents = 0;
+        return 1;
+      }
+    }
+    fds[0].revents = 0;
+    return ::poll(fds + 1, nfds - 1, timeout);
+  }
+
   void read_will_return_once(const std::string & str)
   {
     {
@@ -105,6 +149,7 @@ private:
   // By default read will block and wait
   bool wait_on_read_{true};
   bool unblock_read_{false};
+  bool input_reported_{false};
   std::string read_returning_str_value_{};
 };
 
@@ -134,7 +179,7 @@ public:
   }
   size_t get_number_of_registered_callbacks() const
   {
-    return callbacks_.size();
+    return get_callbacks_count();
   }
 
   std::tuple<KeyCode, KeyModifiers> parse_input_mock(const char * buff, ssize_t read_bytes)
@@ -142,12 +187,62 @@ public:
     return parse_input(buff, read_bytes - 1);  // -1 to strip out null terminator
   }
 
+  void dispatch_key_press_mock(KeyCode key_code, KeyModifiers key_modifiers = KeyModifiers::NONE)
+  {
+    dispatch_key_press(key_code, key_modifiers);
+  }
+
   bool unblock_read_fn_on_destruction_{true};
 
 private:
   std::weak_ptr<MockSystemCalls> system_calls_stub_;
 };
 
+class PollingKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  PollingKeyboardHandler(
+    const readFunction & read_fn, const pollFunction & poll_fn,
+    size_t dispatch_queue_capacity = 0, bool install_signal_handler = false)
+  : KeyboardHandlerUnixImpl(read_fn, poll_fn, isatty_mock, tcgetattr_mock, tcsetattr_mock,
+      install_signal_handler, dispatch_queue_capacity) {}
+
+  using KeyboardHandlerUnixImpl::is_deadline_tracking_enabled;
+};
+
+class DispatcherKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  DispatcherKeyboardHandler(
+    const readFunction & read_fn, const pollFunction & poll_fn,
+    const tcsetattrFunction & tcsetattr_fn, size_t dispatch_queue_capacity)
+  : KeyboardHandlerUnixImpl(read_fn, poll_fn, isatty_mock, tcgetattr_mock, tcsetattr_fn,
+      false, dispatch_queue_capacity) {}
+};
+
+class ExternalEventLoopKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  ExternalEventLoopKeyboardHandler(const readFunction & read_fn, const pollFunction & poll_fn)
+  : KeyboardHandlerUnixImpl(EXTERNAL_EVENT_LOOP, read_fn, poll_fn, isatty_mock, tcgetattr_mock,
+      tcsetattr_mock) {}
+};
+
+class TerminalKeyboardHandler : public KeyboardHandlerUnixImpl
+{
+public:
+  using KeyboardHandlerUnixImpl::KeyboardHandlerUnixImpl;
+  using KeyboardHandlerUnixImpl::is_autorepeat_tracking_enabled;
+};
+
+class KeyMapAccessor : public KeyboardHandlerUnixImpl
+{
+public:
+  using KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_MAP;
+  using KeyboardHandlerUnixImpl::STATIC_KEY_MAP_LENGTH;
+  using KeyboardHandlerUnixImpl::DEFAULT_STATIC_KEY_TRIE;
+};
+
 class MockPlayer : public FakePlayer
 {
 public:
@@ -233,6 +328,121 @@ TEST_F(KeyboardHandlerUnixTest, unregister_callback) {
   g_system_calls_stub->read_will_repeatedly_return(terminal_seq);
 }
 
+TEST_F(KeyboardHandlerUnixTest, stale_handles_do_not_delete_reused_callbacks) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  auto callback = [](KeyCode, KeyboardHandler::KeyModifiers) {};
+
+  auto first_handle = keyboard_handler.add_key_press_callback(callback, KeyCode::A);
+  keyboard_handler.delete_key_press_callback(first_handle);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 0U);
+
+  // New callback reuses released handle entry, but gets a different handle
+  auto second_handle = keyboard_handler.add_key_press_callback(callback, KeyCode::B);
+  EXPECT_NE(second_handle, KeyboardHandler::invalid_handle);
+  EXPECT_NE(second_handle, first_handle);
+  keyboard_handler.delete_key_press_callback(first_handle);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 1U);
+
+  // Handles which were never issued are ignored
+  keyboard_handler.delete_key_press_callback(KeyboardHandler::invalid_handle);
+  keyboard_handler.delete_key_press_callback(second_handle + 1);
+  keyboard_handler.delete_key_press_callback(second_handle + (1ULL << 32));
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 1U);
+
+  std::vector<KeyboardHandler::callback_handle_t> handles;
+  for (size_t i = 0; i < 100; i++) {
+    handles.push_back(keyboard_handler.add_key_press_callback(callback, KeyCode::C));
+  }
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 101U);
+  for (auto handle : handles) {
+    keyboard_handler.delete_key_press_callback(handle);
+  }
+  keyboard_handler.delete_key_press_callback(second_handle);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 0U);
+}
+
+TEST_F(KeyboardHandlerUnixTest, batch_registration_is_all_or_nothing) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  auto callback = [](KeyCode, KeyModifiers) {};
+
+  // One invalid binding rejects the whole batch
+  auto handles = keyboard_handler.add_key_press_callbacks(
+    {{callback, KeyCode::A}, {nullptr, KeyCode::B}, {callback, KeyCode::C}});
+  EXPECT_TRUE(handles.empty());
+  handles = keyboard_handler.add_key_press_callbacks(
+    {{callback, KeyCode::A}, {callback, KeyCode::END_OF_KEY_CODE_ENUM}});
+  EXPECT_TRUE(handles.empty());
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 0U);
+
+  handles = keyboard_handler.add_key_press_callbacks(
+    {{callback, KeyCode::A}, {callback, KeyCode::A, KeyModifiers::CTRL}, {callback, KeyCode::A},
+      {callback, KeyCode::B}});
+  ASSERT_EQ(handles.size(), 4U);
+  EXPECT_EQ(std::count(handles.begin(), handles.end(), KeyboardHandler::invalid_handle), 0);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 4U);
+
+  // Duplicate and stale handles are ignored
+  keyboard_handler.delete_key_press_callback(handles[3]);
+  keyboard_handler.delete_key_press_callbacks({handles[0], handles[0], handles[3], handles[1]});
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 1U);
+  keyboard_handler.delete_key_press_callbacks(handles);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 0U);
+}
+
+TEST_F(KeyboardHandlerUnixTest, deleted_callbacks_keep_order_of_remaining_ones) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  std::vector<int> calls;
+  // Callbacks on more keys than fit into the inline list of modified slots
+  const std::vector<KeyCode> key_codes = {
+    KeyCode::A, KeyCode::B, KeyCode::C, KeyCode::D, KeyCode::E, KeyCode::F, KeyCode::G,
+    KeyCode::H, KeyCode::I, KeyCode::J, KeyCode::K, KeyCode::L};
+  std::vector<KeyboardHandler::KeyPressBinding> bindings;
+  for (int i = 0; i < 10; i++) {
+    for (KeyCode key_code : key_codes) {
+      bindings.push_back({[&calls, i](KeyCode, KeyModifiers) {calls.push_back(i);}, key_code});
+    }
+  }
+  auto handles = keyboard_handler.add_key_press_callbacks(bindings);
+  ASSERT_EQ(handles.size(), bindings.size());
+  auto get_calls = [&](KeyCode key_code) {
+      calls.clear();
+      keyboard_handler.dispatch_key_press_mock(key_code);
+      return calls;
+    };
+
+  // Single deletes from the middle, the front and the back
+  keyboard_handler.delete_key_press_callback(handles[5 * key_codes.size()]);
+  keyboard_handler.delete_key_press_callback(handles[0]);
+  keyboard_handler.delete_key_press_callback(handles[9 * key_codes.size()]);
+  EXPECT_EQ(get_calls(KeyCode::A), std::vector<int>({1, 2, 3, 4, 6, 7, 8}));
+  EXPECT_EQ(get_calls(KeyCode::B), std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+
+  // Batch delete of every other callback on all keys at once
+  std::vector<KeyboardHandler::callback_handle_t> batch;
+  for (size_t i = 0; i < handles.size(); i++) {
+    if ((i / key_codes.size()) % 2 == 1) {
+      batch.push_back(handles[i]);
+    }
+  }
+  batch.push_back(batch.front());
+  keyboard_handler.delete_key_press_callbacks(batch);
+  for (KeyCode key_code : key_codes) {
+    EXPECT_EQ(
+      get_calls(key_code),
+      key_code == KeyCode::A ? std::vector<int>({2, 4, 6, 8}) : std::vector<int>({0, 2, 4, 6, 8}));
+  }
+  // Positions of the remaining callbacks are updated by the batch delete
+  keyboard_handler.delete_key_press_callback(handles[4 * key_codes.size() + 1]);
+  EXPECT_EQ(get_calls(KeyCode::B), std::vector<int>({0, 2, 6, 8}));
+  keyboard_handler.delete_key_press_callbacks(handles);
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 0U);
+}
+
 TEST_F(KeyboardHandlerUnixTest, stdin_is_not_a_terminal_device) {
   auto isatty_fail = [](int fd) -> int {return 0;};
   MockKeyboardHandler keyboard_handler(read_fn_, isatty_fail);
@@ -269,6 +479,510 @@ TEST_F(KeyboardHandlerUnixTest, check_input_parser) {
   EXPECT_EQ(pressed_key_modifiers, expected_key_modifiers);
 }
 
+TEST_F(KeyboardHandlerUnixTest, parse_xterm_modified_keys) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  const std::vector<std::pair<std::string, std::tuple<KeyCode, KeyModifiers>>> test_cases = {
+    {"\x1b[1;5C", {KeyCode::CURSOR_RIGHT, KeyModifiers::CTRL}},
+    {"\x1b[1;2A", {KeyCode::CURSOR_UP, KeyModifiers::SHIFT}},
+    {"\x1b[1;7H", {KeyCode::HOME, KeyModifiers::CTRL | KeyModifiers::ALT}},
+    {"\x1b[1;3F", {KeyCode::END, KeyModifiers::ALT}},
+    {"\x1b[1;2P", {KeyCode::F1, KeyModifiers::SHIFT}},
+    {"\x1b[1;8S", {KeyCode::F4, KeyModifiers::SHIFT | KeyModifiers::ALT | KeyModifiers::CTRL}},
+    {"\x1b[15;2~", {KeyCode::F5, KeyModifiers::SHIFT}},
+    {"\x1b[24;6~", {KeyCode::F12, KeyModifiers::SHIFT | KeyModifiers::CTRL}},
+    {"\x1b[3;5~", {KeyCode::DELETE_KEY, KeyModifiers::CTRL}},
+    {"\x1b[5;1~", {KeyCode::PG_UP, KeyModifiers::NONE}},
+    {"\x1b[1;5X", {KeyCode::UNKNOWN, KeyModifiers::NONE}},
+    {"\x1b[99;5~", {KeyCode::UNKNOWN, KeyModifiers::NONE}}};
+  for (const auto & test_case : test_cases) {
+    const std::string & sequence = test_case.first;
+    EXPECT_EQ(
+      keyboard_handler.parse_input_mock(sequence.c_str(), sequence.size() + 1), test_case.second) <<
+      sequence.substr(1);
+  }
+}
+
+TEST(CsiModifiersDecoderTest, decode_modifier_parameter) {
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  CsiModifiersDecoder::Result result;
+  auto decode = [&result](const std::string & sequence) {
+      return CsiModifiersDecoder::decode(sequence.data(), sequence.size(), result);
+    };
+  ASSERT_TRUE(decode("\x1b[1;5C"));
+  EXPECT_EQ(std::string(result.sequence, result.length), "\x1b[C");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::CTRL);
+  ASSERT_TRUE(decode("\x1b[1;2Q"));
+  EXPECT_EQ(std::string(result.sequence, result.length), "\x1bOQ");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::SHIFT);
+  ASSERT_TRUE(decode("\x1b[21;4~"));
+  EXPECT_EQ(std::string(result.sequence, result.length), "\x1b[21~");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::SHIFT | KeyModifiers::ALT);
+  // Meta is reported as Alt
+  ASSERT_TRUE(decode("\x1b[1;9D"));
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::ALT);
+  ASSERT_TRUE(decode("\x1b[1;16D"));
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::SHIFT | KeyModifiers::ALT | KeyModifiers::CTRL);
+
+  EXPECT_FALSE(decode("\x1b[C"));
+  EXPECT_FALSE(decode("\x1b[15~"));
+  EXPECT_FALSE(decode("\x1b[1;0C"));
+  EXPECT_FALSE(decode("\x1b[1;17C"));
+  EXPECT_FALSE(decode("\x1b[2;5C"));
+  EXPECT_FALSE(decode("\x1b[;5C"));
+  EXPECT_FALSE(decode("\x1b[1;5;1C"));
+  EXPECT_FALSE(decode("\x1bO1;5C"));
+}
+
+TEST_F(KeyboardHandlerUnixTest, multiple_key_sequences_in_one_read) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  std::mutex pressed_keys_mutex;
+  std::condition_variable pressed_keys_cv;
+  std::vector<std::pair<KeyCode, KeyModifiers>> pressed_keys;
+  auto callback = [&](KeyCode key_code, KeyModifiers key_modifiers) {
+      {
+        std::lock_guard<std::mutex> lk(pressed_keys_mutex);
+        pressed_keys.emplace_back(key_code, key_modifiers);
+      }
+      pressed_keys_cv.notify_all();
+    };
+
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  keyboard_handler.add_key_press_callback(callback, KeyCode::CURSOR_UP);
+  keyboard_handler.add_key_press_callback(callback, KeyCode::CURSOR_DOWN);
+  keyboard_handler.add_key_press_callback(callback, KeyCode::E, KeyModifiers::SHIFT);
+  const std::string terminal_seq =
+    keyboard_handler.get_terminal_sequence(KeyCode::CURSOR_UP) +
+    keyboard_handler.get_terminal_sequence(KeyCode::CURSOR_DOWN) + "E";
+  g_system_calls_stub->read_will_return_once(terminal_seq);
+  {
+    std::unique_lock<std::mutex> lk(pressed_keys_mutex);
+    EXPECT_TRUE(
+      pressed_keys_cv.wait_for(
+        lk, std::chrono::seconds(5), [&pressed_keys]() {return pressed_keys.size() >= 3;}));
+  }
+  g_system_calls_stub->read_will_repeatedly_return("");
+
+  std::lock_guard<std::mutex> lk(pressed_keys_mutex);
+  const std::vector<std::pair<KeyCode, KeyModifiers>> expected_keys = {
+    {KeyCode::CURSOR_UP, KeyModifiers::NONE},
+    {KeyCode::CURSOR_DOWN, KeyModifiers::NONE},
+    {KeyCode::E, KeyModifiers::SHIFT}};
+  EXPECT_EQ(pressed_keys, expected_keys);
+}
+
+TEST_F(KeyboardHandlerUnixTest, latency_stats_of_key_press_stages) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  std::mutex callback_mutex;
+  std::condition_variable callback_cv;
+  size_t callback_calls = 0;
+  auto callback = [&](KeyCode, KeyModifiers) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      {
+        std::lock_guard<std::mutex> lk(callback_mutex);
+        callback_calls++;
+      }
+      callback_cv.notify_all();
+    };
+
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  keyboard_handler.add_key_press_callback(callback, KeyCode::A);
+  g_system_calls_stub->read_will_return_once("a");
+  {
+    std::unique_lock<std::mutex> lk(callback_mutex);
+    ASSERT_TRUE(
+      callback_cv.wait_for(lk, std::chrono::seconds(5), [&]() {return callback_calls > 0;}));
+  }
+  g_system_calls_stub->read_will_repeatedly_return("");
+
+  auto stats = keyboard_handler.get_latency_stats();
+  if (!stats.enabled) {
+    EXPECT_EQ(stats.parse.count, 0U);
+    EXPECT_EQ(stats.callbacks_start.count, 0U);
+    EXPECT_EQ(stats.callbacks_end.count, 0U);
+    EXPECT_EQ(stats.callbacks_duration.count, 0U);
+    return;
+  }
+  // Callback might return before its duration is recorded
+  for (int i = 0; i < 100 && keyboard_handler.get_latency_stats().callbacks_end.count == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  stats = keyboard_handler.get_latency_stats();
+  EXPECT_EQ(stats.parse.count, 1U);
+  EXPECT_EQ(stats.callbacks_start.count, 1U);
+  EXPECT_EQ(stats.callbacks_end.count, 1U);
+  EXPECT_EQ(stats.callbacks_duration.count, 1U);
+  EXPECT_GE(stats.callbacks_duration.min_ns, 1000000U);
+  EXPECT_LE(stats.parse.max_ns, stats.callbacks_start.min_ns);
+  EXPECT_GE(stats.callbacks_end.min_ns, stats.callbacks_duration.max_ns);
+}
+
+TEST(LatencyHistogramTest, log_linear_buckets_and_percentiles) {
+  for (uint64_t value = 0; value < 16; value++) {
+    EXPECT_EQ(LatencyHistogram::get_bucket_index(value), value);
+    EXPECT_EQ(LatencyHistogram::get_bucket_lower_bound(value), value);
+  }
+  // Each power of two split into 8 buckets
+  EXPECT_EQ(LatencyHistogram::get_bucket_index(16), 16U);
+  EXPECT_EQ(LatencyHistogram::get_bucket_index(17), 16U);
+  EXPECT_EQ(LatencyHistogram::get_bucket_index(18), 17U);
+  EXPECT_EQ(LatencyHistogram::get_bucket_index(31), 23U);
+  EXPECT_EQ(LatencyHistogram::get_bucket_index(32), 24U);
+  EXPECT_EQ(LatencyHistogram::get_bucket_lower_bound(24), 32U);
+  for (size_t i = 1; i < LatencyHistogram::BUCKETS_COUNT; i++) {
+    uint64_t lower_bound = LatencyHistogram::get_bucket_lower_bound(i);
+    EXPECT_EQ(LatencyHistogram::get_bucket_index(lower_bound), i);
+    EXPECT_EQ(LatencyHistogram::get_bucket_index(lower_bound - 1), i - 1);
+  }
+  EXPECT_EQ(
+    LatencyHistogram::get_bucket_index(std::numeric_limits<uint64_t>::max()),
+    LatencyHistogram::BUCKETS_COUNT - 1);
+
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.snapshot().get_percentile(50), 0U);
+  for (int64_t i = 1; i <= 1000; i++) {
+    histogram.record(std::chrono::microseconds(i));
+  }
+  histogram.record(std::chrono::nanoseconds(-1));
+  auto snapshot = histogram.snapshot();
+  EXPECT_EQ(snapshot.count, 1001U);
+  EXPECT_EQ(snapshot.min_ns, 0U);
+  EXPECT_EQ(snapshot.max_ns, 1000000U);
+  EXPECT_EQ(snapshot.sum_ns, 500500000U);
+  EXPECT_EQ(snapshot.get_percentile(100), 1000000U);
+  // Buckets are at most 12.5% wide
+  auto p50 = snapshot.get_percentile(50);
+  EXPECT_GE(p50, 500000U);
+  EXPECT_LE(p50, 500000U * 9 / 8);
+  auto p99 = snapshot.get_percentile(99);
+  EXPECT_GE(p99, 990000U);
+  EXPECT_LE(p99, 1000000U);
+}
+
+TEST(LatencyHistogramTest, concurrent_records) {
+  LatencyHistogram histogram;
+  constexpr int64_t records_per_thread = 100000;
+  std::vector<std::thread> threads;
+  for (int64_t thread_index = 0; thread_index < 4; thread_index++) {
+    threads.emplace_back(
+      [&histogram, thread_index]() {
+        for (int64_t i = 1; i <= records_per_thread; i++) {
+          histogram.record(std::chrono::nanoseconds(thread_index * records_per_thread + i));
+        }
+      });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  constexpr uint64_t records_count = 4 * records_per_thread;
+  auto snapshot = histogram.snapshot();
+  EXPECT_EQ(snapshot.count, records_count);
+  EXPECT_EQ(snapshot.min_ns, 1U);
+  EXPECT_EQ(snapshot.max_ns, records_count);
+  EXPECT_EQ(snapshot.sum_ns, records_count * (records_count + 1) / 2);
+  uint64_t buckets_sum = 0;
+  for (uint64_t bucket : snapshot.buckets) {
+    buckets_sum += bucket;
+  }
+  EXPECT_EQ(buckets_sum, records_count);
+}
+
+TEST(KeyCommandParserTest, parse_commands) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = std::tuple<KeyCode, KeyModifiers>;
+  EXPECT_EQ(KeyCommandParser::parse_command("a"), KeyPress(KeyCode::A, KeyModifiers::NONE));
+  EXPECT_EQ(KeyCommandParser::parse_command("CTRL+a"), KeyPress(KeyCode::A, KeyModifiers::CTRL));
+  EXPECT_EQ(
+    KeyCommandParser::parse_command("SHIFT+ALT+CURSOR_UP"),
+    KeyPress(KeyCode::CURSOR_UP, KeyModifiers::SHIFT | KeyModifiers::ALT));
+  EXPECT_EQ(KeyCommandParser::parse_command("CTRL++"), KeyPress(KeyCode::PLUS, KeyModifiers::CTRL));
+  EXPECT_EQ(KeyCommandParser::parse_command("+"), KeyPress(KeyCode::PLUS, KeyModifiers::NONE));
+  EXPECT_EQ(
+    KeyCommandParser::parse_command("CTRL+"), KeyPress(KeyCode::UNKNOWN, KeyModifiers::NONE));
+  EXPECT_EQ(
+    KeyCommandParser::parse_command("UNKNOWN"), KeyPress(KeyCode::UNKNOWN, KeyModifiers::NONE));
+  EXPECT_EQ(
+    KeyCommandParser::parse_command("ctrl+a"), KeyPress(KeyCode::UNKNOWN, KeyModifiers::NONE));
+
+  KeyCommandParser parser;
+  std::vector<KeyPress> key_presses;
+  auto on_key_press = [&key_presses](KeyCode key_code, KeyModifiers key_modifiers) {
+      key_presses.emplace_back(key_code, key_modifiers);
+    };
+  auto feed = [&parser, &on_key_press](const std::string & data) {
+      parser.feed(data.data(), data.size(), on_key_press);
+    };
+  feed("  F1\nCTR");
+  feed("L+b\t");
+  feed(std::string(KeyCommandParser::MAX_COMMAND_LENGTH + 1, 'a'));
+  feed(" SHIFT+");
+  EXPECT_TRUE(parser.has_pending());
+  feed("F12");
+  parser.flush(on_key_press);
+  EXPECT_FALSE(parser.has_pending());
+  const std::vector<KeyPress> expected_key_presses = {
+    {KeyCode::F1, KeyModifiers::NONE},
+    {KeyCode::B, KeyModifiers::CTRL},
+    {KeyCode::UNKNOWN, KeyModifiers::NONE},
+    {KeyCode::F12, KeyModifiers::SHIFT}};
+  EXPECT_EQ(key_presses, expected_key_presses);
+}
+
+TEST(SpscQueueTest, bounded_capacity_and_wrap_around) {
+  EXPECT_THROW(SpscQueue<int>(0), std::invalid_argument);
+  EXPECT_THROW(SpscQueue<int>(SpscQueue<int>::MAX_CAPACITY + 1), std::invalid_argument);
+
+  SpscQueue<int> queue(3);
+  EXPECT_EQ(queue.capacity(), 3U);
+  int value = 0;
+  EXPECT_FALSE(queue.try_pop(value));
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(queue.try_push(i * 3));
+    EXPECT_TRUE(queue.try_push(i * 3 + 1));
+    EXPECT_TRUE(queue.try_push(i * 3 + 2));
+    EXPECT_FALSE(queue.try_push(-1));
+    EXPECT_EQ(queue.size(), 3U);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_TRUE(queue.try_pop(value));
+      EXPECT_EQ(value, i * 3 + j);
+    }
+    EXPECT_TRUE(queue.empty());
+  }
+
+  EXPECT_EQ(queue.front(), nullptr);
+  EXPECT_TRUE(queue.try_push(7));
+  ASSERT_NE(queue.front(), nullptr);
+  EXPECT_EQ(*queue.front(), 7);
+  queue.pop();
+  EXPECT_EQ(queue.front(), nullptr);
+}
+
+TEST(RetiredObjectsTest, reclaims_once_no_readers_left) {
+  struct counted_object
+  {
+    explicit counted_object(size_t & destroyed)
+    : destroyed_(destroyed) {}
+    ~counted_object() {destroyed_++;}
+    size_t & destroyed_;
+  };
+  size_t destroyed = 0;
+  RetiredObjects<counted_object> retired_objects;
+  retired_objects.retire(std::make_unique<counted_object>(destroyed));
+  EXPECT_EQ(destroyed, 1U);
+  {
+    RetiredObjects<counted_object>::ReaderGuard reader_guard(retired_objects);
+    {
+      RetiredObjects<counted_object>::ReaderGuard nested_reader_guard(retired_objects);
+      retired_objects.retire(std::make_unique<counted_object>(destroyed));
+      retired_objects.retire(std::make_unique<counted_object>(destroyed));
+    }
+    EXPECT_EQ(destroyed, 1U);
+    EXPECT_EQ(retired_objects.size(), 2U);
+  }
+  // The last leaving reader destroys retired objects
+  EXPECT_EQ(destroyed, 3U);
+  EXPECT_EQ(retired_objects.size(), 0U);
+}
+
+TEST(TerminalSequenceTokenizerTest, split_sequences) {
+  TerminalSequenceTokenizer tokenizer;
+  std::vector<std::string> sequences;
+  auto on_sequence = [&sequences](const char * sequence, size_t length) {
+      sequences.emplace_back(sequence, length);
+    };
+  const std::string input =
+    "a\x1b[A\x1b[15~\x1bOP\x1b"  "b\x1b\x1b[1;5C\xd0\x96\n\x1b[[A\x1b";
+  const std::vector<std::string> expected = {
+    "a", "\x1b[A", "\x1b[15~", "\x1bOP", "\x1b" "b", "\x1b", "\x1b[1;5C", "\xd0\x96", "\n",
+    "\x1b[[A"};
+
+  // Feed input with all possible chunk sizes to check that sequences carried over between reads
+  for (size_t chunk_size = 1; chunk_size <= input.size(); chunk_size++) {
+    sequences.clear();
+    for (size_t pos = 0; pos < input.size(); pos += chunk_size) {
+      tokenizer.feed(
+        input.data() + pos, std::min(chunk_size, input.size() - pos), on_sequence);
+    }
+    EXPECT_EQ(sequences, expected) << "chunk size = " << chunk_size;
+    // Lone ESC at the end stays pending until flush
+    EXPECT_TRUE(tokenizer.has_pending());
+    tokenizer.flush(on_sequence);
+    EXPECT_FALSE(tokenizer.has_pending());
+    ASSERT_FALSE(sequences.empty());
+    EXPECT_EQ(sequences.back(), "\x1b");
+  }
+}
+
+TEST(TerminalSequenceTokenizerTest, malformed_sequences) {
+  TerminalSequenceTokenizer tokenizer;
+  std::vector<std::string> sequences;
+  auto on_sequence = [&sequences](const char * sequence, size_t length) {
+      sequences.emplace_back(sequence, length);
+    };
+  // CSI interrupted by control character and truncated UTF-8 character
+  const std::string input = "\x1b[1\x01\xd0" "a";
+  tokenizer.feed(input.data(), input.size(), on_sequence);
+  const std::vector<std::string> expected = {"\x1b[1", "\x01", "\xd0", "a"};
+  EXPECT_EQ(sequences, expected);
+
+  // Too long CSI sequence should not overflow internal buffer
+  sequences.clear();
+  const std::string long_csi =
+    "\x1b[" + std::string(TerminalSequenceTokenizer::MAX_SEQUENCE_LENGTH * 2, '1') + "~";
+  for (char c : long_csi) {
+    tokenizer.feed(&c, 1, on_sequence);
+  }
+  tokenizer.flush(on_sequence);
+  size_t total_length = 0;
+  for (const auto & sequence : sequences) {
+    EXPECT_LE(sequence.size(), TerminalSequenceTokenizer::MAX_SEQUENCE_LENGTH);
+    total_length += sequence.size();
+  }
+  EXPECT_EQ(total_length, long_csi.size());
+}
+
+TEST(TerminalSequenceTokenizerTest, bracketed_paste) {
+  TerminalSequenceTokenizer tokenizer;
+  std::vector<std::string> sequences;
+  std::vector<std::string> pastes;
+  auto on_sequence = [&sequences](const char * sequence, size_t length) {
+      sequences.emplace_back(sequence, length);
+    };
+  auto on_paste = [&pastes](const char * text, size_t length) {
+      pastes.emplace_back(text, length);
+    };
+  const std::string paste_start(TerminalSequenceTokenizer::PASTE_START);
+  const std::string paste_end(TerminalSequenceTokenizer::PASTE_END);
+  // Pasted text might contain anything but the end marker, including escape sequences
+  const std::string input = "a" + paste_start + "x\x1b[Ay\x1b[201\x1b" + paste_end + "\x1b[B" +
+    paste_start + paste_end + "b";
+  const std::vector<std::string> expected_sequences = {"a", "\x1b[B", "b"};
+  const std::vector<std::string> expected_pastes = {"x\x1b[Ay\x1b[201\x1b", ""};
+
+  for (size_t chunk_size = 1; chunk_size <= input.size(); chunk_size++) {
+    sequences.clear();
+    pastes.clear();
+    for (size_t pos = 0; pos < input.size(); pos += chunk_size) {
+      tokenizer.feed(
+        input.data() + pos, std::min(chunk_size, input.size() - pos), on_sequence, on_paste);
+    }
+    EXPECT_EQ(sequences, expected_sequences) << "chunk size = " << chunk_size;
+    EXPECT_EQ(pastes, expected_pastes) << "chunk size = " << chunk_size;
+    EXPECT_FALSE(tokenizer.is_in_paste());
+  }
+
+  // Paste read out at once is passed directly from the input
+  const char * paste_text = nullptr;
+  tokenizer.feed(
+    input.data(), input.size(), on_sequence, [&paste_text](const char * text, size_t) {
+      if (paste_text == nullptr) {
+        paste_text = text;
+      }
+    });
+  EXPECT_EQ(paste_text, input.data() + 1 + paste_start.size());
+
+  // Unfinished paste waits for the end marker regardless of flush
+  pastes.clear();
+  tokenizer.feed(paste_start.data(), paste_start.size(), on_sequence, on_paste);
+  tokenizer.feed("text", 4, on_sequence, on_paste);
+  tokenizer.flush(on_sequence);
+  EXPECT_TRUE(tokenizer.is_in_paste());
+  EXPECT_TRUE(pastes.empty());
+  tokenizer.reset();
+  EXPECT_FALSE(tokenizer.is_in_paste());
+
+  // Markers are ordinary sequences unless paste is expected
+  sequences.clear();
+  tokenizer.feed(paste_start.data(), paste_start.size(), on_sequence);
+  EXPECT_EQ(sequences, std::vector<std::string>{paste_start});
+}
+
+TEST(TerminalSequenceTokenizerTest, bracketed_paste_over_size_limit) {
+  TerminalSequenceTokenizer tokenizer;
+  std::vector<std::string> sequences;
+  std::vector<std::string> pastes;
+  auto on_sequence = [&sequences](const char * sequence, size_t length) {
+      sequences.emplace_back(sequence, length);
+    };
+  auto on_paste = [&pastes](const char * text, size_t length) {
+      pastes.emplace_back(text, length);
+    };
+  const std::string paste_start(TerminalSequenceTokenizer::PASTE_START);
+  const std::string paste_end(TerminalSequenceTokenizer::PASTE_END);
+  const size_t max_size = TerminalSequenceTokenizer::MAX_PASTE_SIZE;
+  const std::string text(max_size, 't');
+  const std::vector<std::string> inputs = {
+    paste_start + text + paste_end + "a",
+    paste_start + text + "x" + paste_end + "a",
+    paste_start + text + std::string(3 * max_size, 'x') + paste_end + "a"};
+  const std::vector<std::string> expected_sequences = {"a"};
+  const std::vector<std::string> expected_pastes = {text};
+
+  for (const auto & input : inputs) {
+    // Odd chunk size to split the end marker between chunks
+    for (size_t chunk_size : {size_t(4093), input.size()}) {
+      sequences.clear();
+      pastes.clear();
+      for (size_t pos = 0; pos < input.size(); pos += chunk_size) {
+        tokenizer.feed(
+          input.data() + pos, std::min(chunk_size, input.size() - pos), on_sequence, on_paste);
+        // Buffered text doesn't grow beyond the limit
+        EXPECT_LE(pastes.size(), 1U);
+      }
+      EXPECT_EQ(sequences, expected_sequences) << "chunk size = " << chunk_size;
+      EXPECT_EQ(pastes, expected_pastes) << "chunk size = " << chunk_size;
+      EXPECT_FALSE(tokenizer.is_in_paste());
+    }
+  }
+
+  // Truncated text is passed before the end marker arrives
+  pastes.clear();
+  tokenizer.feed(paste_start.data(), paste_start.size(), on_sequence, on_paste);
+  for (size_t i = 0; i <= max_size / 4096 + 1; i++) {
+    tokenizer.feed(text.data(), 4096, on_sequence, on_paste);
+  }
+  EXPECT_EQ(pastes, expected_pastes);
+  EXPECT_TRUE(tokenizer.is_in_paste());
+  tokenizer.reset();
+  EXPECT_FALSE(tokenizer.is_in_paste());
+}
+
+TEST_F(KeyboardHandlerUnixTest, default_key_map_compiled_to_trie) {
+  const TerminalSequenceTrie & trie = KeyMapAccessor::DEFAULT_STATIC_KEY_TRIE;
+  for (size_t i = 0; i < KeyMapAccessor::STATIC_KEY_MAP_LENGTH; i++) {
+    const auto & key_map = KeyMapAccessor::DEFAULT_STATIC_KEY_MAP[i];
+    const std::string sequence = key_map.terminal_sequence;
+    EXPECT_EQ(trie.find(sequence.data(), sequence.size()), key_map.inner_code) <<
+      "Terminal sequence for " << enum_key_code_to_str(key_map.inner_code);
+    EXPECT_EQ(trie.find_sequence(key_map.inner_code), sequence);
+  }
+  // Prefixes, extensions and 8 bit characters should not match
+  EXPECT_EQ(trie.find("\x1b[", 2), KeyboardHandler::KeyCode::UNKNOWN);
+  EXPECT_EQ(trie.find("\x1b[AA", 4), KeyboardHandler::KeyCode::UNKNOWN);
+  EXPECT_EQ(trie.find("\xd0\x96", 2), KeyboardHandler::KeyCode::UNKNOWN);
+  EXPECT_EQ(trie.find("", 0), KeyboardHandler::KeyCode::UNKNOWN);
+}
+
+TEST(TerminalSequenceTrieTest, build_at_compile_time) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  constexpr TerminalSequenceTrie trie = []() {
+      TerminalSequenceTrie trie;
+      trie.insert("\x1b[A", KeyCode::CURSOR_UP);
+      trie.insert("\x1b[B", KeyCode::CURSOR_DOWN);
+      trie.insert("a", KeyCode::A);
+      return trie;
+    }();
+  static_assert(trie.find("\x1b[A", 3) == KeyCode::CURSOR_UP, "Should match at compile time");
+  static_assert(trie.find("\x1b[B", 3) == KeyCode::CURSOR_DOWN, "Should match at compile time");
+  static_assert(trie.find("\x1b[C", 3) == KeyCode::UNKNOWN, "Should not match");
+  static_assert(trie.nodes_count() == 6, "root, ESC, [, A, B and a");
+  EXPECT_EQ(trie.find("a", 1), KeyCode::A);
+}
+
 TEST_F(KeyboardHandlerUnixTest, weak_ptr_in_callbacks) {
   auto recorder = FakeRecorder::create();
   std::shared_ptr<FakePlayer> player_shared_ptr(new FakePlayer());
@@ -379,6 +1093,240 @@ TEST_F(KeyboardHandlerUnixTest, class_member_as_callback) {
   g_system_calls_stub->read_will_return_once(terminal_seq);
 }
 
+TEST_F(KeyboardHandlerUnixTest, add_and_delete_callbacks_from_callback) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  std::mutex calls_mutex;
+  std::condition_variable calls_cv;
+  size_t first_callback_calls = 0;
+  size_t second_callback_calls = 0;
+
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  auto second_callback = [&](KeyCode, KeyModifiers) {
+      {
+        std::lock_guard<std::mutex> lk(calls_mutex);
+        second_callback_calls++;
+      }
+      calls_cv.notify_all();
+    };
+  KeyboardHandler::callback_handle_t first_handle = KeyboardHandler::invalid_handle;
+  auto first_callback = [&](KeyCode key_code, KeyModifiers key_modifiers) {
+      // Used to deadlock on the mutex held by dispatching thread
+      keyboard_handler.delete_key_press_callback(first_handle);
+      keyboard_handler.add_key_press_callback(second_callback, key_code, key_modifiers);
+      {
+        std::lock_guard<std::mutex> lk(calls_mutex);
+        first_callback_calls++;
+      }
+      calls_cv.notify_all();
+    };
+  first_handle = keyboard_handler.add_key_press_callback(
+    first_callback, KeyCode::E, KeyModifiers::SHIFT);
+
+  g_system_calls_stub->read_will_return_once("E");
+  {
+    std::unique_lock<std::mutex> lk(calls_mutex);
+    EXPECT_TRUE(
+      calls_cv.wait_for(
+        lk, std::chrono::seconds(5), [&first_callback_calls]() {return first_callback_calls > 0;}));
+    // Callback added during dispatch shouldn't be called for the same key press
+    EXPECT_EQ(second_callback_calls, 0U);
+  }
+  EXPECT_EQ(keyboard_handler.get_number_of_registered_callbacks(), 1U);
+
+  g_system_calls_stub->read_will_return_once("E");
+  {
+    std::unique_lock<std::mutex> lk(calls_mutex);
+    EXPECT_TRUE(
+      calls_cv.wait_for(
+        lk, std::chrono::seconds(5),
+        [&second_callback_calls]() {return second_callback_calls > 0;}));
+    EXPECT_EQ(first_callback_calls, 1U);
+  }
+}
+
+TEST_F(KeyboardHandlerUnixTest, running_callback_does_not_block_callbacks_registration) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  std::promise<void> callback_started;
+  std::promise<void> release_callback;
+  std::shared_future<void> callback_released(release_callback.get_future());
+  std::atomic_bool callback_called{false};
+  auto blocking_callback = [&](KeyCode, KeyModifiers) {
+      // Mock read returns the same key once again on destruction
+      if (!callback_called.exchange(true)) {
+        callback_started.set_value();
+      }
+      callback_released.wait();
+    };
+
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  keyboard_handler.add_key_press_callback(blocking_callback, KeyCode::E, KeyModifiers::SHIFT);
+  g_system_calls_stub->read_will_return_once("E");
+  ASSERT_EQ(
+    callback_started.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+  auto registration = std::async(
+    std::launch::async, [&keyboard_handler]() {
+      auto handle = keyboard_handler.add_key_press_callback(
+        [](KeyCode, KeyModifiers) {}, KeyCode::E, KeyModifiers::SHIFT);
+      keyboard_handler.delete_key_press_callback(handle);
+      return keyboard_handler.get_number_of_registered_callbacks();
+    });
+  EXPECT_EQ(registration.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  release_callback.set_value();
+  EXPECT_EQ(registration.get(), 1U);
+}
+
+TEST_F(KeyboardHandlerUnixTest, no_wake_ups_when_idle) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<int> poll_timeouts;
+  size_t wake_ups = 0;
+  auto idle_poll = [&](struct pollfd * fds, nfds_t nfds, int timeout) {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        poll_timeouts.push_back(timeout);
+      }
+      cv.notify_all();
+      // Emulate idle terminal by polling only wake up pipe
+      int ret = poll(fds + 1, nfds - 1, timeout);
+      std::lock_guard<std::mutex> lk(mutex);
+      wake_ups++;
+      return ret;
+    };
+  auto read_fn = [](int, void *, size_t) -> ssize_t {
+      ADD_FAILURE() << "read() should not be called on idle terminal";
+      return 0;
+    };
+
+  auto keyboard_handler = std::make_unique<PollingKeyboardHandler>(read_fn, idle_poll);
+  {
+    // Input thread blocks in poll() without timeout
+    std::unique_lock<std::mutex> lk(mutex);
+    ASSERT_TRUE(
+      cv.wait_for(lk, std::chrono::seconds(5), [&]() {return !poll_timeouts.empty();}));
+    EXPECT_EQ(poll_timeouts, std::vector<int>({-1}));
+    EXPECT_EQ(wake_ups, 0U);
+  }
+  EXPECT_FALSE(keyboard_handler->is_deadline_tracking_enabled());
+
+  // Input thread stays blocked while idle, nothing was read, so no escape sequence is pending,
+  // and there are no deadlines to wake up for
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    EXPECT_EQ(poll_timeouts, std::vector<int>({-1}));
+    EXPECT_EQ(wake_ups, 0U);
+  }
+
+  // Destructor wakes up input thread, which exits without polling again
+  keyboard_handler.reset();
+  std::lock_guard<std::mutex> lk(mutex);
+  EXPECT_EQ(poll_timeouts, std::vector<int>({-1}));
+  EXPECT_EQ(wake_ups, 1U);
+}
+
+TEST_F(KeyboardHandlerUnixTest, too_big_dispatch_queue_capacity_leaves_terminal_untouched) {
+  size_t tcsetattr_calls = 0;
+  auto tcsetattr_fn = [&](int, int, const struct termios *) -> int {
+      tcsetattr_calls++;
+      return 0;
+    };
+  auto poll_fn = [](struct pollfd * fds, nfds_t nfds, int timeout) {
+      return poll(fds + 1, nfds - 1, timeout);
+    };
+  EXPECT_THROW(
+    DispatcherKeyboardHandler(
+      read_fn_, poll_fn, tcsetattr_fn,
+      SpscQueue<KeyboardHandlerBase::KeyEvent>::MAX_CAPACITY + 1),
+    std::invalid_argument);
+  EXPECT_EQ(tcsetattr_calls, 0U);
+}
+
+TEST_F(KeyboardHandlerUnixTest, slow_callback_does_not_block_input_in_dispatcher_thread_mode) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  const std::vector<std::string> terminal_input = {"a", "b", "c", "d", "e", "f"};
+  constexpr size_t dispatch_queue_capacity = 3;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t read_calls = 0;
+  bool callback_started = false;
+  bool release_callback = false;
+  bool input_drained = false;
+  bool callbacks_added = false;
+  std::vector<KeyCode> pressed_keys;
+
+  auto poll_fn = [&](struct pollfd * fds, nfds_t nfds, int timeout) {
+      {
+        std::unique_lock<std::mutex> lk(mutex);
+        // Don't read the first key before callbacks are registered and the rest of the input
+        // until the first key press is being dispatched
+        cv.wait(lk, [&]() {return (read_calls == 0 && callbacks_added) || callback_started;});
+        if (read_calls < terminal_input.size()) {
+          fds[0].revents = POLLIN;
+          fds[1].revents = 0;
+          return 1;
+        }
+        // Input thread is done with the last read
+        input_drained = true;
+      }
+      cv.notify_all();
+      return poll(fds + 1, nfds - 1, timeout);
+    };
+  auto read_fn = [&](int, void * buff, size_t) -> ssize_t {
+      std::lock_guard<std::mutex> lk(mutex);
+      const std::string & key = terminal_input[read_calls++];
+      memcpy(buff, key.data(), key.size());
+      return static_cast<ssize_t>(key.size());
+    };
+  auto callback = [&](KeyCode key_code, KeyModifiers) {
+      std::unique_lock<std::mutex> lk(mutex);
+      pressed_keys.push_back(key_code);
+      callback_started = true;
+      cv.notify_all();
+      cv.wait(lk, [&]() {return release_callback;});
+    };
+
+  PollingKeyboardHandler keyboard_handler(read_fn, poll_fn, dispatch_queue_capacity);
+  for (auto key_code : {KeyCode::A, KeyCode::B, KeyCode::C, KeyCode::D, KeyCode::E, KeyCode::F}) {
+    keyboard_handler.add_key_press_callback(callback, key_code);
+  }
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    callbacks_added = true;
+  }
+  cv.notify_all();
+  {
+    // Input is drained while the first callback is still running
+    std::unique_lock<std::mutex> lk(mutex);
+    ASSERT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&]() {return input_drained;}));
+  }
+  auto stats = keyboard_handler.get_dispatch_queue_stats();
+  EXPECT_EQ(stats.capacity, dispatch_queue_capacity);
+  EXPECT_EQ(stats.depth, 3U);
+  EXPECT_EQ(stats.high_water_mark, 3U);
+  EXPECT_EQ(stats.dropped_events, 2U);
+
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    release_callback = true;
+  }
+  cv.notify_all();
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    ASSERT_TRUE(
+      cv.wait_for(lk, std::chrono::seconds(5), [&]() {return pressed_keys.size() == 4;}));
+  }
+  const std::vector<KeyCode> expected_keys = {KeyCode::A, KeyCode::B, KeyCode::C, KeyCode::D};
+  EXPECT_EQ(pressed_keys, expected_keys);
+  stats = keyboard_handler.get_dispatch_queue_stats();
+  EXPECT_EQ(stats.depth, 0U);
+  EXPECT_EQ(stats.high_water_mark, 3U);
+}
+
 TEST_F(KeyboardHandlerUnixTest, no_signal_handler) {
   auto process_id = fork();
   if (process_id == 0) {  // In child process
@@ -454,8 +1402,10 @@ TEST_F(KeyboardHandlerUnixTest, force_exit_from_main_loop_after_signal_handling)
 
     {
       g_system_calls_stub->read_will_repeatedly_return("E");
-      MockKeyboardHandler keyboard_handler(read_fn_, isatty_mock, g_system_calls_stub, true);
-      keyboard_handler.unblock_read_fn_on_destruction_ = false;
+      auto poll_fn = [](struct pollfd * fds, nfds_t nfds, int timeout) {
+          return g_system_calls_stub->poll(fds, nfds, timeout);
+        };
+      PollingKeyboardHandler keyboard_handler(read_fn_, poll_fn, 0, true);
 
       while (running_) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -502,4 +1452,1367 @@ TEST_F(KeyboardHandlerUnixTest, return_old_signal_handler_after_destruction) {
   old_sigint_handler = std::signal(SIGINT, SIG_DFL);
   EXPECT_EQ(old_sigint_handler, on_signal);
 }
+
+TEST_F(KeyboardHandlerUnixTest, sigint_handler_shared_by_handlers) {
+  auto on_signal = [](int /* signal */) {
+      _exit(EXIT_SUCCESS);
+    };
+  auto old_sigint_handler = std::signal(SIGINT, on_signal);
+  EXPECT_NE(old_sigint_handler, SIG_ERR) << "Can't install SIGINT handler in test";
+  {
+    auto first_handler = std::make_unique<MockKeyboardHandler>(
+      read_fn_, isatty_mock, g_system_calls_stub, true);
+    {
+      // Should not save SIGINT handler installed by the first handler as the old one
+      MockKeyboardHandler second_handler(read_fn_, isatty_mock, g_system_calls_stub, true);
+      EXPECT_EQ(KeyboardHandlerUnixImpl::get_old_sigint_handler(), on_signal);
+      // Signal handler stays installed until the last handler is destroyed
+      first_handler.reset();
+      auto current_sigint_handler = std::signal(SIGINT, SIG_DFL);
+      EXPECT_NE(current_sigint_handler, on_signal);
+      std::signal(SIGINT, current_sigint_handler);
+    }
+  }
+  old_sigint_handler = std::signal(SIGINT, SIG_DFL);
+  EXPECT_EQ(old_sigint_handler, on_signal);
+}
+
+/// \brief Pseudo terminal pair, master side emulates keyboard of the dedicated terminal.
+class PseudoTerminal
+{
+public:
+  PseudoTerminal()
+  {
+    master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd_ == -1 || grantpt(master_fd_) == -1 || unlockpt(master_fd_) == -1) {
+      throw std::runtime_error("Can't open pseudo terminal. errno = " + std::to_string(errno));
+    }
+    slave_path_ = ptsname(master_fd_);
+  }
+
+  ~PseudoTerminal()
+  {
+    close(master_fd_);
+  }
+
+  void press_keys(const std::string & keys)
+  {
+    ASSERT_EQ(write(master_fd_, keys.data(), keys.size()), static_cast<ssize_t>(keys.size()));
+  }
+
+  /// \brief Read what was written to the terminal, waiting for at least length bytes.
+  std::string read_output(size_t length)
+  {
+    std::string output;
+    char buffer[64];
+    while (output.size() < length) {
+      struct pollfd fds = {master_fd_, POLLIN, 0};
+      if (poll(&fds, 1, 5000) != 1) {
+        break;
+      }
+      ssize_t read_bytes = read(master_fd_, buffer, sizeof(buffer));
+      if (read_bytes <= 0) {
+        break;
+      }
+      output.append(buffer, static_cast<size_t>(read_bytes));
+    }
+    return output;
+  }
+
+  const std::string & slave_path() const
+  {
+    return slave_path_;
+  }
+
+private:
+  int master_fd_ = -1;
+  std::string slave_path_;
+};
+
+bool is_echo_enabled(int fd)
+{
+  struct termios settings;
+  EXPECT_NE(tcgetattr(fd, &settings), -1);
+  return (settings.c_lflag & ECHO) != 0;
+}
+
+TEST_F(KeyboardHandlerUnixTest, read_from_dedicated_terminal_device) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  PseudoTerminal terminal;
+  int observer_fd = open(terminal.slave_path().c_str(), O_RDONLY | O_NOCTTY);
+  ASSERT_NE(observer_fd, -1);
+  ASSERT_TRUE(is_echo_enabled(observer_fd));
+
+  std::promise<KeyCode> pressed_key;
+  auto pressed_key_future = pressed_key.get_future();
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(terminal.slave_path(), false);
+    EXPECT_FALSE(is_echo_enabled(observer_fd));
+    keyboard_handler.add_key_press_callback(
+      [&pressed_key](KeyCode key_code, KeyModifiers) {pressed_key.set_value(key_code);},
+      KeyCode::Q);
+    terminal.press_keys("q");
+    ASSERT_EQ(pressed_key_future.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(pressed_key_future.get(), KeyCode::Q);
+  }
+  // Original settings restored on destruction
+  EXPECT_TRUE(is_echo_enabled(observer_fd));
+  close(observer_fd);
+
+  EXPECT_THROW(
+    KeyboardHandlerUnixImpl("/nonexistent/keyboard_handler_tty", false), std::runtime_error);
+}
+
+TEST_F(KeyboardHandlerUnixTest, kitty_keyboard_protocol_press_repeat_and_release) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyEventType = KeyboardHandler::KeyEventType;
+  using KeyEvent = std::tuple<KeyCode, KeyModifiers, KeyEventType>;
+  PseudoTerminal terminal;
+  const std::string enable_sequence = KittyKeyboardDecoder::ENABLE_SEQUENCE;
+  const std::string disable_sequence = KittyKeyboardDecoder::DISABLE_SEQUENCE;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<KeyEvent> key_events;
+  size_t key_presses_count = 0;
+  {
+    TerminalKeyboardHandler keyboard_handler(terminal.slave_path(), false);
+    // Request is written to the terminal device keyboard handler reads
+    EXPECT_TRUE(keyboard_handler.enable_kitty_keyboard_protocol());
+    EXPECT_EQ(terminal.read_output(enable_sequence.size()), enable_sequence);
+    EXPECT_FALSE(keyboard_handler.is_kitty_keyboard_protocol_active());
+
+    auto on_key_event = [&](KeyCode key_code, KeyModifiers key_modifiers, KeyEventType type) {
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          key_events.emplace_back(key_code, key_modifiers, type);
+        }
+        cv.notify_all();
+      };
+    keyboard_handler.add_key_event_callback(on_key_event, KeyCode::A);
+    keyboard_handler.add_key_event_callback(on_key_event, KeyCode::EXCLAMATION_MARK);
+    // Key event callbacks don't turn on autorepeat tracking, neither when added nor deleted
+    keyboard_handler.delete_key_press_callback(
+      keyboard_handler.add_key_event_callback(on_key_event, KeyCode::B));
+    EXPECT_FALSE(keyboard_handler.is_autorepeat_tracking_enabled());
+    keyboard_handler.add_key_event_callback(on_key_event, KeyCode::CURSOR_UP, KeyModifiers::CTRL);
+    keyboard_handler.add_key_press_callback(
+      [&](KeyCode, KeyModifiers) {
+        std::lock_guard<std::mutex> lk(mutex);
+        key_presses_count++;
+      }, KeyCode::A);
+    // Reply to the query of the keyboard mode flags, followed by key events
+    terminal.press_keys(
+      "\x1b[?15u"
+      "\x1b[97u" "\x1b[97;1:2u" "\x1b[97;1:3u"
+      "\x1b[49:33;2u"
+      "\x1b[1;5:3A");
+    const std::vector<KeyEvent> expected_key_events = {
+      {KeyCode::A, KeyModifiers::NONE, KeyEventType::PRESS},
+      {KeyCode::A, KeyModifiers::NONE, KeyEventType::REPEAT},
+      {KeyCode::A, KeyModifiers::NONE, KeyEventType::RELEASE},
+      {KeyCode::EXCLAMATION_MARK, KeyModifiers::NONE, KeyEventType::PRESS},
+      {KeyCode::CURSOR_UP, KeyModifiers::CTRL, KeyEventType::RELEASE}};
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait_for(
+        lk, std::chrono::seconds(5), [&]() {return key_events.size() >= 5;});
+      EXPECT_EQ(key_events, expected_key_events);
+      // Key press callbacks receive presses and autorepeats, but not releases
+      EXPECT_EQ(key_presses_count, 2U);
+    }
+    EXPECT_TRUE(keyboard_handler.is_kitty_keyboard_protocol_active());
+  }
+  // Keyboard mode is restored along with the terminal settings
+  EXPECT_EQ(terminal.read_output(disable_sequence.size()), disable_sequence);
+}
+
+TEST_F(KeyboardHandlerUnixTest, terminal_mode_is_disabled_after_output_fd_is_closed) {
+  PseudoTerminal terminal;
+  const std::string enable_sequence = KittyKeyboardDecoder::ENABLE_SEQUENCE;
+  const std::string disable_sequence = KittyKeyboardDecoder::DISABLE_SEQUENCE;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(terminal.slave_path(), false);
+    int output_fd = open(terminal.slave_path().c_str(), O_WRONLY | O_NOCTTY);
+    ASSERT_NE(output_fd, -1);
+    EXPECT_TRUE(keyboard_handler.enable_kitty_keyboard_protocol(output_fd));
+    EXPECT_EQ(terminal.read_output(enable_sequence.size()), enable_sequence);
+    // Descriptor number could be reused by unrelated file before settings are restored
+    close(output_fd);
+  }
+  EXPECT_EQ(terminal.read_output(disable_sequence.size()), disable_sequence);
+}
+
+TEST_F(KeyboardHandlerUnixTest, bracketed_paste_delivered_as_one_text) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  PseudoTerminal terminal;
+  const std::string enable_sequence = "\x1b[?2004h";
+  const std::string disable_sequence = "\x1b[?2004l";
+  const std::string paste_start(TerminalSequenceTokenizer::PASTE_START);
+  const std::string paste_end(TerminalSequenceTokenizer::PASTE_END);
+  std::string pasted_text;
+  for (size_t i = 0; i < 256; i++) {
+    pasted_text += "a\x1b[A\t";
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> events;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(terminal.slave_path(), false);
+    EXPECT_TRUE(keyboard_handler.enable_bracketed_paste());
+    EXPECT_EQ(terminal.read_output(enable_sequence.size()), enable_sequence);
+
+    keyboard_handler.add_key_press_callback(
+      [&](KeyCode key_code, KeyboardHandler::KeyModifiers) {
+        std::lock_guard<std::mutex> lk(mutex);
+        events.push_back(enum_key_code_to_str(key_code));
+      }, KeyCode::A);
+    auto handle = keyboard_handler.add_paste_callback(
+      [&](std::string_view text) {
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          events.emplace_back(text);
+        }
+        cv.notify_all();
+      });
+    EXPECT_NE(handle, KeyboardHandler::invalid_handle);
+    EXPECT_EQ(keyboard_handler.add_paste_callback(nullptr), KeyboardHandler::invalid_handle);
+
+    terminal.press_keys("a" + paste_start + pasted_text + paste_end + "a");
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait_for(
+        lk, std::chrono::seconds(5), [&]() {return events.size() >= 2;});
+    }
+    // Pasted text passed through the terminal without being split into key presses
+    terminal.press_keys(paste_start + "a" + paste_end);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    keyboard_handler.delete_key_press_callback(handle);
+    terminal.press_keys(paste_start + "a" + paste_end);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::lock_guard<std::mutex> lk(mutex);
+    const std::vector<std::string> expected_events = {"a", pasted_text, "a", "a"};
+    EXPECT_EQ(events, expected_events);
+  }
+  // Bracketed paste mode is reset along with the terminal settings
+  EXPECT_EQ(terminal.read_output(disable_sequence.size()), disable_sequence);
+}
+
+TEST(KittyKeyboardDecoderTest, decode_key_events) {
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyEventType = KeyboardHandler::KeyEventType;
+  KittyKeyboardDecoder::Result result;
+  auto decode = [&result](const std::string & sequence) {
+      return KittyKeyboardDecoder::decode(sequence.data(), sequence.size(), result);
+    };
+  auto legacy_sequence = [&result]() {return std::string(result.sequence, result.length);};
+
+  ASSERT_TRUE(decode("\x1b[97;5u"));
+  EXPECT_EQ(legacy_sequence(), "a");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::CTRL);
+  EXPECT_EQ(result.event_type, KeyEventType::PRESS);
+  // Shifted letter is restored from upper case by the regular parser
+  ASSERT_TRUE(decode("\x1b[97:65;2:2u"));
+  EXPECT_EQ(legacy_sequence(), "A");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::NONE);
+  EXPECT_EQ(result.event_type, KeyEventType::REPEAT);
+  // Enter, Meta is reported as Alt, Caps Lock is ignored
+  ASSERT_TRUE(decode("\x1b[13;97:3u"));
+  EXPECT_EQ(legacy_sequence(), "\n");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::ALT);
+  EXPECT_EQ(result.event_type, KeyEventType::RELEASE);
+  // Associated text is ignored
+  ASSERT_TRUE(decode("\x1b[97;1;97u"));
+  EXPECT_EQ(legacy_sequence(), "a");
+  // Modifier keys have no legacy sequence
+  ASSERT_TRUE(decode("\x1b[57441;2u"));
+  EXPECT_EQ(result.length, 0U);
+
+  ASSERT_TRUE(decode("\x1b[1;3:3D"));
+  EXPECT_EQ(legacy_sequence(), "\x1b[D");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::ALT);
+  ASSERT_TRUE(decode("\x1b[1;1:2Q"));
+  EXPECT_EQ(legacy_sequence(), "\x1bOQ");
+  ASSERT_TRUE(decode("\x1b[13~"));
+  EXPECT_EQ(legacy_sequence(), "\x1bOR");
+  ASSERT_TRUE(decode("\x1b[15;6:1~"));
+  EXPECT_EQ(legacy_sequence(), "\x1b[15~");
+  EXPECT_EQ(result.key_modifiers, KeyModifiers::SHIFT | KeyModifiers::CTRL);
+
+  EXPECT_FALSE(decode("\x1b[97;1:4u"));
+  EXPECT_FALSE(decode("\x1b[97;0u"));
+  EXPECT_FALSE(decode("\x1b[97;257u"));
+  EXPECT_FALSE(decode("\x1b[2;5C"));
+  EXPECT_FALSE(decode("\x1b[?15u"));
+  EXPECT_FALSE(decode("\x1b[9999999u"));
+  EXPECT_TRUE(KittyKeyboardDecoder::is_protocol_reply("\x1b[?15u", 6));
+  EXPECT_FALSE(KittyKeyboardDecoder::is_protocol_reply("\x1b[?u", 4));
+}
+
+TEST_F(KeyboardHandlerUnixTest, terminal_settings_shared_by_handlers_of_the_same_descriptor) {
+  PseudoTerminal terminal;
+  int terminal_fd = open(terminal.slave_path().c_str(), O_RDONLY | O_NOCTTY);
+  ASSERT_NE(terminal_fd, -1);
+  {
+    auto first_handler = std::make_unique<KeyboardHandlerUnixImpl>(terminal_fd, false);
+    {
+      // Should not save settings already changed by the first handler as original ones
+      KeyboardHandlerUnixImpl second_handler(terminal_fd, false);
+      EXPECT_FALSE(is_echo_enabled(terminal_fd));
+      first_handler.reset();
+      EXPECT_FALSE(is_echo_enabled(terminal_fd));
+    }
+    EXPECT_TRUE(is_echo_enabled(terminal_fd));
+  }
+  close(terminal_fd);
+}
+/// \brief Collects key presses from callbacks and waits until the expected number arrives.
+class KeyPressesCollector
+{
+public:
+  using KeyPress = std::tuple<KeyboardHandler::KeyCode, KeyboardHandler::KeyModifiers>;
+
+  void register_callbacks(KeyboardHandlerUnixImpl & keyboard_handler, std::vector<KeyPress> keys)
+  {
+    for (const auto & key : keys) {
+      keyboard_handler.add_key_press_callback(
+        [this](KeyboardHandler::KeyCode key_code, KeyboardHandler::KeyModifiers key_modifiers) {
+          {
+            std::lock_guard<std::mutex> lk(mutex_);
+            key_presses_.emplace_back(key_code, key_modifiers);
+          }
+          cv_.notify_all();
+        }, std::get<0>(key), std::get<1>(key));
+    }
+  }
+
+  std::vector<KeyPress> wait_for(size_t count)
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    cv_.wait_for(lk, std::chrono::seconds(5), [&]() {return key_presses_.size() >= count;});
+    return key_presses_;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<KeyPress> key_presses_;
+};
+
+TEST_F(KeyboardHandlerUnixTest, handlers_of_different_terminals_are_independent) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  PseudoTerminal first_terminal;
+  PseudoTerminal second_terminal;
+  auto first_handler =
+    std::make_unique<KeyboardHandlerUnixImpl>(first_terminal.slave_path(), false);
+  KeyboardHandlerUnixImpl second_handler(second_terminal.slave_path(), false);
+  KeyPressesCollector collector;
+  collector.register_callbacks(
+    second_handler, {{KeyCode::A, KeyModifiers::NONE}, {KeyCode::B, KeyModifiers::NONE}});
+
+  // Destruction of one handler should not stop input thread of the other one
+  first_handler.reset();
+  second_terminal.press_keys("a");
+  ASSERT_EQ(collector.wait_for(1).size(), 1u);
+  second_terminal.press_keys("b");
+  EXPECT_EQ(collector.wait_for(2).size(), 2u);
+}
+
+TEST_F(KeyboardHandlerUnixTest, shared_reactor_serves_several_terminals) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  constexpr size_t TERMINALS_COUNT = 4;
+  auto reactor = KeyboardHandlerReactor::get_shared_instance();
+  EXPECT_EQ(KeyboardHandlerReactor::get_shared_instance(), reactor);
+  std::vector<std::unique_ptr<PseudoTerminal>> terminals;
+  std::vector<std::unique_ptr<KeyboardHandlerUnixImpl>> handlers;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::pair<size_t, KeyCode>> key_presses;
+  std::set<std::thread::id> callback_threads;
+  for (size_t i = 0; i < TERMINALS_COUNT; i++) {
+    terminals.push_back(std::make_unique<PseudoTerminal>());
+    handlers.push_back(
+      std::make_unique<KeyboardHandlerUnixImpl>(terminals[i]->slave_path(), false, reactor));
+    for (KeyCode key_code : {KeyCode::Q, KeyCode::ESCAPE}) {
+      handlers[i]->add_key_press_callback(
+        [&, i](KeyCode key_code, KeyModifiers) {
+          {
+            std::lock_guard<std::mutex> lk(mutex);
+            key_presses.emplace_back(i, key_code);
+            callback_threads.insert(std::this_thread::get_id());
+          }
+          cv.notify_all();
+        }, key_code);
+    }
+  }
+  EXPECT_EQ(reactor->get_attached_count(), TERMINALS_COUNT);
+  auto wait_for_key_presses = [&](size_t count) {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait_for(lk, std::chrono::seconds(5), [&]() {return key_presses.size() >= count;});
+      return key_presses.size();
+    };
+
+  for (size_t i = 0; i < TERMINALS_COUNT; i++) {
+    terminals[i]->press_keys("q");
+  }
+  ASSERT_EQ(wait_for_key_presses(TERMINALS_COUNT), TERMINALS_COUNT);
+  // Lone ESC is delivered by the escape sequence timeout, which is tracked per terminal
+  terminals[1]->press_keys("\x1b");
+  ASSERT_EQ(wait_for_key_presses(TERMINALS_COUNT + 1), TERMINALS_COUNT + 1);
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    EXPECT_EQ(key_presses.back(), std::make_pair(size_t{1}, KeyCode::ESCAPE));
+    EXPECT_EQ(callback_threads, std::set<std::thread::id>{reactor->get_thread_id()});
+  }
+
+  // Detached handler restores its terminal, the others keep working
+  int observer_fd = open(terminals[0]->slave_path().c_str(), O_RDONLY | O_NOCTTY);
+  ASSERT_NE(observer_fd, -1);
+  EXPECT_FALSE(is_echo_enabled(observer_fd));
+  handlers[0].reset();
+  EXPECT_TRUE(is_echo_enabled(observer_fd));
+  close(observer_fd);
+  EXPECT_EQ(reactor->get_attached_count(), TERMINALS_COUNT - 1);
+  terminals[TERMINALS_COUNT - 1]->press_keys("q");
+  ASSERT_EQ(wait_for_key_presses(TERMINALS_COUNT + 2), TERMINALS_COUNT + 2);
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    EXPECT_EQ(key_presses.back(), std::make_pair(TERMINALS_COUNT - 1, KeyCode::Q));
+  }
+  handlers.clear();
+  EXPECT_EQ(reactor->get_attached_count(), 0u);
+}
+
+TEST_F(KeyboardHandlerUnixTest, reactor_calls_callbacks_without_blocking_other_handlers) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  auto reactor = std::make_shared<KeyboardHandlerReactor>();
+  PseudoTerminal slow_terminal;
+  PseudoTerminal other_terminal;
+  PseudoTerminal nested_terminal;
+  std::promise<void> callback_entered;
+  std::promise<void> release_callback;
+  std::shared_future<void> callback_released = release_callback.get_future().share();
+  size_t attached_count_in_callback = 0;
+  auto other_handler =
+    std::make_unique<KeyboardHandlerUnixImpl>(other_terminal.slave_path(), false, reactor);
+  KeyboardHandlerUnixImpl slow_handler(slow_terminal.slave_path(), false, reactor);
+  slow_handler.add_key_press_callback(
+    [&](KeyCode, KeyModifiers) {
+      {
+        // Keyboard handlers could be created and destroyed from the reactor thread
+        KeyboardHandlerUnixImpl nested_handler(nested_terminal.slave_path(), false, reactor);
+        attached_count_in_callback = reactor->get_attached_count();
+      }
+      callback_entered.set_value();
+      callback_released.wait();
+    }, KeyCode::Q);
+
+  slow_terminal.press_keys("q");
+  EXPECT_EQ(
+    callback_entered.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  // Destruction of the other keyboard handler doesn't wait for the slow callback
+  auto destroyed = std::async(std::launch::async, [&other_handler]() {other_handler.reset();});
+  EXPECT_EQ(destroyed.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  release_callback.set_value();
+  destroyed.wait();
+  EXPECT_EQ(attached_count_in_callback, 3u);
+  EXPECT_EQ(reactor->get_attached_count(), 1u);
+}
+
+TEST_F(KeyboardHandlerUnixTest, sigint_wakes_up_all_handlers_and_reactors) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  auto on_signal = [](int /* signal */) {};
+  auto old_sigint_handler = std::signal(SIGINT, on_signal);
+  ASSERT_NE(old_sigint_handler, SIG_ERR) << "Can't install SIGINT handler in test";
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t woken_up_count = 0;
+  auto poll_fn = [&](struct pollfd * fds, nfds_t nfds, int timeout) {
+      // There is no input, wait only for wake up
+      int ready = poll(fds + 1, nfds - 1, timeout);
+      if (ready > 0) {
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          woken_up_count++;
+        }
+        cv.notify_all();
+      }
+      return ready;
+    };
+  auto reactor = std::make_shared<KeyboardHandlerReactor>();
+  PseudoTerminal first_terminal;
+  PseudoTerminal second_terminal;
+  {
+    KeyboardHandlerUnixImpl reactor_handler(first_terminal.slave_path(), true, reactor);
+    PollingKeyboardHandler first_handler(read_fn_, poll_fn);
+    PollingKeyboardHandler second_handler(read_fn_, poll_fn);
+    ASSERT_EQ(reactor->get_attached_count(), 1u);
+
+    ASSERT_EQ(raise(SIGINT), 0);
+    {
+      // Both input threads are woken up, not only the one of the last handler
+      std::unique_lock<std::mutex> lk(mutex);
+      EXPECT_TRUE(
+        cv.wait_for(lk, std::chrono::seconds(5), [&]() {return woken_up_count == 2;}));
+    }
+    // Reactor is woken up too and detaches handler without waiting for a key press
+    auto start = std::chrono::steady_clock::now();
+    while (reactor->get_attached_count() > 0 &&
+      std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(reactor->get_attached_count(), 0u);
+  }
+
+  // Handler initialized after the signal is not stopped by it
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(second_terminal.slave_path(), false, reactor);
+    KeyPressesCollector collector;
+    collector.register_callbacks(keyboard_handler, {{KeyCode::Q, KeyModifiers::NONE}});
+    second_terminal.press_keys("q");
+    EXPECT_EQ(collector.wait_for(1).size(), 1u);
+  }
+  std::signal(SIGINT, old_sigint_handler);
+}
+
+TEST_F(KeyboardHandlerUnixTest, external_event_loop_dispatches_from_caller_thread) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  PseudoTerminal terminal;
+  int observer_fd = open(terminal.slave_path().c_str(), O_RDONLY | O_NOCTTY);
+  ASSERT_NE(observer_fd, -1);
+  std::vector<KeyCode> key_presses;
+  std::set<std::thread::id> callback_threads;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      KeyboardHandlerUnixImpl::EXTERNAL_EVENT_LOOP, terminal.slave_path());
+    EXPECT_FALSE(is_echo_enabled(observer_fd));
+    for (KeyCode key_code : {KeyCode::Q, KeyCode::CURSOR_UP, KeyCode::ESCAPE}) {
+      keyboard_handler.add_key_press_callback(
+        [&](KeyCode key_code, KeyModifiers) {
+          key_presses.push_back(key_code);
+          callback_threads.insert(std::this_thread::get_id());
+        }, key_code);
+    }
+    int input_fd = keyboard_handler.get_input_fd();
+    ASSERT_NE(input_fd, -1);
+    auto wait_for_input = [input_fd](int timeout) {
+        struct pollfd fds = {input_fd, POLLIN, 0};
+        return poll(&fds, 1, timeout);
+      };
+    EXPECT_EQ(keyboard_handler.process_ready(), -1);
+    EXPECT_TRUE(key_presses.empty());
+
+    // All available key presses are dispatched at once
+    terminal.press_keys("q\x1b[A");
+    ASSERT_EQ(wait_for_input(5000), 1);
+    EXPECT_EQ(keyboard_handler.process_ready(), -1);
+    EXPECT_EQ(key_presses, std::vector<KeyCode>({KeyCode::Q, KeyCode::CURSOR_UP}));
+    EXPECT_EQ(callback_threads, std::set<std::thread::id>{std::this_thread::get_id()});
+
+    // Lone ESC is dispatched once the returned timeout expires without more input
+    terminal.press_keys("\x1b");
+    ASSERT_EQ(wait_for_input(5000), 1);
+    int timeout = keyboard_handler.process_ready();
+    EXPECT_GT(timeout, 0);
+    EXPECT_EQ(key_presses.size(), 2u);
+    EXPECT_EQ(wait_for_input(timeout), 0);
+    EXPECT_EQ(keyboard_handler.process_ready(), -1);
+    EXPECT_EQ(key_presses.back(), KeyCode::ESCAPE);
+  }
+  EXPECT_TRUE(is_echo_enabled(observer_fd));
+  close(observer_fd);
+
+  KeyboardHandlerUnixImpl threaded_keyboard_handler(terminal.slave_path(), false);
+  EXPECT_EQ(threaded_keyboard_handler.get_input_fd(), -1);
+  EXPECT_THROW(threaded_keyboard_handler.process_ready(), std::logic_error);
+}
+
+TEST_F(KeyboardHandlerUnixTest, interrupted_read_keeps_incomplete_sequence) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  // Empty string stands for read() interrupted by signal
+  std::deque<std::string> reads = {"\x1b", "", "[A"};
+  std::vector<int> polled_fds;
+  std::vector<int> poll_timeouts;
+  auto poll_fn = [&](struct pollfd * fds, nfds_t nfds, int timeout) {
+      EXPECT_EQ(nfds, 2u);
+      polled_fds.push_back(fds[0].fd);
+      poll_timeouts.push_back(timeout);
+      fds[0].revents = reads.empty() ? 0 : POLLIN;
+      fds[1].revents = 0;
+      return reads.empty() ? 0 : 1;
+    };
+  auto read_fn = [&](int, void * buff, size_t) -> ssize_t {
+      std::string input = reads.front();
+      reads.pop_front();
+      if (input.empty()) {
+        errno = EINTR;
+        return -1;
+      }
+      memcpy(buff, input.data(), input.size());
+      return static_cast<ssize_t>(input.size());
+    };
+  std::vector<KeyCode> key_presses;
+  ExternalEventLoopKeyboardHandler keyboard_handler(read_fn, poll_fn);
+  for (KeyCode key_code : {KeyCode::ESCAPE, KeyCode::CURSOR_UP, KeyCode::A}) {
+    keyboard_handler.add_key_press_callback(
+      [&](KeyCode key_code, KeyModifiers) {key_presses.push_back(key_code);}, key_code);
+  }
+
+  // ESC before interrupted read is not taken for the lone ESC key
+  EXPECT_EQ(keyboard_handler.process_ready(), -1);
+  EXPECT_EQ(key_presses, std::vector<KeyCode>({KeyCode::CURSOR_UP}));
+  // process_ready() polls input through the injected function without waiting
+  EXPECT_EQ(polled_fds, std::vector<int>(4, STDIN_FILENO));
+  EXPECT_EQ(poll_timeouts, std::vector<int>(4, 0));
+}
+
+TEST_F(KeyboardHandlerUnixTest, key_sequence_callbacks) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeySequenceMode = KeyboardHandler::KeySequenceMode;
+  PseudoTerminal terminal;
+  KeyboardHandlerUnixImpl keyboard_handler(
+    KeyboardHandlerUnixImpl::EXTERNAL_EVENT_LOOP, terminal.slave_path());
+  std::vector<std::string> calls;
+  auto add_sequence = [&](
+    const std::string & name, const std::vector<KeyboardHandler::KeyAndModifiers> & sequence,
+    KeySequenceMode mode) {
+      return keyboard_handler.add_key_sequence_callback(
+        [&calls, name](KeyCode, KeyModifiers) {calls.push_back(name);}, sequence, mode);
+    };
+  for (KeyCode key_code : {KeyCode::G, KeyCode::X, KeyCode::NUMBER_5, KeyCode::NUMBER_0}) {
+    for (KeyModifiers key_modifiers : {KeyModifiers::NONE, KeyModifiers::CTRL}) {
+      keyboard_handler.add_key_press_callback(
+        [&calls](KeyCode key_code, KeyModifiers key_modifiers) {
+          auto modifiers = enum_key_modifiers_to_str(key_modifiers);
+          calls.push_back(
+            (modifiers.empty() ? "" : modifiers + " ") + enum_key_code_to_str(key_code));
+        }, key_code, key_modifiers);
+    }
+  }
+  EXPECT_EQ(
+    add_sequence("too long", std::vector<KeyboardHandler::KeyAndModifiers>(
+      KeyboardHandler::MAX_KEY_SEQUENCE_LENGTH + 1, {KeyCode::G, KeyModifiers::NONE}),
+    KeySequenceMode::SWALLOW_KEYS),
+    KeyboardHandler::invalid_handle);
+  EXPECT_EQ(
+    add_sequence("empty", {}, KeySequenceMode::SWALLOW_KEYS), KeyboardHandler::invalid_handle);
+  auto g_g = add_sequence(
+    "g g", {{KeyCode::G, KeyModifiers::NONE}, {KeyCode::G, KeyModifiers::NONE}},
+    KeySequenceMode::SWALLOW_KEYS);
+  ASSERT_NE(g_g, KeyboardHandler::invalid_handle);
+  add_sequence(
+    "C-x C-f", {{KeyCode::X, KeyModifiers::CTRL}, {KeyCode::F, KeyModifiers::CTRL}},
+    KeySequenceMode::PASS_THROUGH_KEYS);
+  auto five_zero_enter = add_sequence(
+    "5 0 Enter", {{KeyCode::NUMBER_5, KeyModifiers::NONE}, {KeyCode::NUMBER_0, KeyModifiers::NONE},
+      {KeyCode::ENTER, KeyModifiers::NONE}}, KeySequenceMode::SWALLOW_KEYS);
+  auto five = add_sequence(
+    "5", {{KeyCode::NUMBER_5, KeyModifiers::NONE}}, KeySequenceMode::SWALLOW_KEYS);
+  keyboard_handler.set_key_sequence_timeout(std::chrono::milliseconds(50));
+  EXPECT_EQ(keyboard_handler.get_key_sequence_timeout(), std::chrono::milliseconds(50));
+
+  int input_fd = keyboard_handler.get_input_fd();
+  ASSERT_NE(input_fd, -1);
+  // Returns timeout of the pending key sequence, if any
+  auto press_keys = [&](const std::string & keys) {
+      calls.clear();
+      terminal.press_keys(keys);
+      struct pollfd fds = {input_fd, POLLIN, 0};
+      EXPECT_EQ(poll(&fds, 1, 5000), 1);
+      return keyboard_handler.process_ready();
+    };
+  auto wait_for_timeout = [&](int timeout) {
+      struct pollfd fds = {input_fd, POLLIN, 0};
+      EXPECT_EQ(poll(&fds, 1, timeout), 0);
+      return keyboard_handler.process_ready();
+    };
+
+  // Completed sequences swallow their key presses, other key presses are passed through
+  EXPECT_EQ(press_keys("xggx"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"x", "g g", "x"}));
+  EXPECT_EQ(press_keys("\x18\x06"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"CTRL x", "C-x C-f"}));
+
+  // Broken sequence dispatches held back key presses before the breaking one
+  EXPECT_EQ(press_keys("50x"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"NUMBER_5", "NUMBER_0", "x"}));
+  EXPECT_EQ(press_keys("50\n"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"5 0 Enter"}));
+
+  // Sequence which is a prefix of the longer one is completed when the longer one is broken
+  EXPECT_EQ(press_keys("5x"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"5", "x"}));
+
+  // Pending sequence expires after timeout
+  int timeout = press_keys("g");
+  EXPECT_GT(timeout, 0);
+  EXPECT_TRUE(calls.empty());
+  EXPECT_EQ(wait_for_timeout(timeout), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"g"}));
+  calls.clear();
+  timeout = press_keys("5");
+  EXPECT_GT(timeout, 0);
+  EXPECT_EQ(wait_for_timeout(timeout), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"5"}));
+
+  keyboard_handler.delete_key_press_callback(g_g);
+  EXPECT_EQ(press_keys("gg"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"g", "g"}));
+
+  // Nodes of the deleted sequence are reused without its swallowing mode
+  add_sequence(
+    "g g", {{KeyCode::G, KeyModifiers::NONE}, {KeyCode::G, KeyModifiers::NONE}},
+    KeySequenceMode::PASS_THROUGH_KEYS);
+  EXPECT_EQ(press_keys("gg"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"g", "g g", "g"}));
+
+  // Longer sequence stays matched after its prefix sequence is deleted
+  keyboard_handler.delete_key_press_callback(five);
+  EXPECT_EQ(press_keys("50\n"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"5 0 Enter"}));
+  EXPECT_EQ(press_keys("5x"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"NUMBER_5", "x"}));
+  keyboard_handler.delete_key_press_callback(five_zero_enter);
+  EXPECT_EQ(press_keys("50"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"NUMBER_5", "NUMBER_0"}));
+
+  // Sequences with the common prefix are deleted one by one, duplicate handles are ignored
+  auto x_x_g = add_sequence(
+    "x x g", {{KeyCode::X, KeyModifiers::NONE}, {KeyCode::X, KeyModifiers::NONE},
+      {KeyCode::G, KeyModifiers::NONE}}, KeySequenceMode::SWALLOW_KEYS);
+  auto x_x_5 = add_sequence(
+    "x x 5", {{KeyCode::X, KeyModifiers::NONE}, {KeyCode::X, KeyModifiers::NONE},
+      {KeyCode::NUMBER_5, KeyModifiers::NONE}}, KeySequenceMode::SWALLOW_KEYS);
+  EXPECT_EQ(press_keys("xxgxx5"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"x x g", "x x 5"}));
+  keyboard_handler.delete_key_press_callbacks({x_x_g, x_x_g});
+  EXPECT_EQ(press_keys("xxgxx5"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"x", "x", "g", "x x 5"}));
+  keyboard_handler.delete_key_press_callbacks({x_x_5, x_x_g, x_x_5});
+  EXPECT_EQ(press_keys("xx5"), -1);
+  EXPECT_EQ(calls, std::vector<std::string>({"x", "x", "NUMBER_5"}));
+}
+
+TEST_F(KeyboardHandlerUnixTest, pull_key_events_from_event_queue) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyEvent = KeyboardHandler::KeyEvent;
+  PseudoTerminal terminal;
+  KeyboardHandlerUnixImpl keyboard_handler(terminal.slave_path(), false);
+  KeyEvent event;
+  EXPECT_THROW(keyboard_handler.try_pop_event(event), std::logic_error);
+  EXPECT_EQ(keyboard_handler.get_event_queue_stats().capacity, 0u);
+  keyboard_handler.enable_event_queue(2);
+  EXPECT_THROW(keyboard_handler.enable_event_queue(2), std::logic_error);
+  EXPECT_FALSE(keyboard_handler.try_pop_event(event));
+  auto wait_start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(keyboard_handler.wait_event(event, std::chrono::milliseconds(20)));
+  EXPECT_GE(std::chrono::steady_clock::now() - wait_start, std::chrono::milliseconds(20));
+
+  // Pull API coexists with callbacks
+  std::promise<void> callback_called;
+  keyboard_handler.add_key_press_callback(
+    [&callback_called](KeyCode, KeyModifiers) {callback_called.set_value();}, KeyCode::D);
+  auto press_time = std::chrono::steady_clock::now();
+  std::thread typist([&terminal]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      terminal.press_keys("Q");
+    });
+  bool popped = keyboard_handler.wait_event(event, std::chrono::seconds(5));
+  typist.join();
+  ASSERT_TRUE(popped);
+  EXPECT_EQ(event.key_code, KeyCode::Q);
+  EXPECT_EQ(event.key_modifiers, KeyModifiers::SHIFT);
+  EXPECT_EQ(event.event_type, KeyboardHandler::KeyEventType::PRESS);
+  EXPECT_GE(event.timestamp, press_time);
+  EXPECT_LE(event.timestamp, std::chrono::steady_clock::now());
+
+  // Key presses which don't fit into the full queue are dropped and counted
+  terminal.press_keys("abcd");
+  ASSERT_EQ(
+    callback_called.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  auto stats = keyboard_handler.get_event_queue_stats();
+  EXPECT_EQ(stats.capacity, 2u);
+  EXPECT_EQ(stats.depth, 2u);
+  EXPECT_EQ(stats.overflow_count, 2u);
+  ASSERT_TRUE(keyboard_handler.try_pop_event(event));
+  EXPECT_EQ(event.key_code, KeyCode::A);
+  ASSERT_TRUE(keyboard_handler.try_pop_event(event));
+  EXPECT_EQ(event.key_code, KeyCode::B);
+  EXPECT_FALSE(keyboard_handler.try_pop_event(event));
+}
+
+TEST_F(KeyboardHandlerUnixTest, raw_command_stream_from_pipe) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = KeyPressesCollector::KeyPress;
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  const std::vector<KeyPress> expected_key_presses = {
+    {KeyCode::A, KeyModifiers::NONE},
+    {KeyCode::CURSOR_UP, KeyModifiers::NONE},
+    {KeyCode::A, KeyModifiers::CTRL},
+    {KeyCode::ESCAPE, KeyModifiers::NONE}};
+  KeyPressesCollector collector;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    collector.register_callbacks(keyboard_handler, expected_key_presses);
+    // Lone ESC at the end of the stream is delivered without waiting for the escape timeout
+    const std::string input = "a\x1b[A\x01\x1b";
+    ASSERT_EQ(write(pipe_fds[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    close(pipe_fds[1]);
+    EXPECT_EQ(collector.wait_for(expected_key_presses.size()), expected_key_presses);
+  }
+  close(pipe_fds[0]);
+}
+
+TEST_F(KeyboardHandlerUnixTest, text_command_stream_from_file) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = KeyPressesCollector::KeyPress;
+  char file_path[] = "/tmp/keyboard_handler_commands_XXXXXX";
+  int file_fd = mkstemp(file_path);
+  ASSERT_NE(file_fd, -1);
+  const std::string commands = "CTRL+a\nSHIFT+F1 q\n\nALT+CURSOR_DOWN";
+  ASSERT_EQ(
+    write(file_fd, commands.data(), commands.size()), static_cast<ssize_t>(commands.size()));
+  close(file_fd);
+
+  const std::vector<KeyPress> expected_key_presses = {
+    {KeyCode::A, KeyModifiers::CTRL},
+    {KeyCode::F1, KeyModifiers::SHIFT},
+    {KeyCode::Q, KeyModifiers::NONE},
+    {KeyCode::CURSOR_DOWN, KeyModifiers::ALT}};
+  KeyPressesCollector collector;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      std::string(file_path), KeyboardHandlerUnixImpl::CommandStreamFormat::TEXT);
+    collector.register_callbacks(keyboard_handler, expected_key_presses);
+    EXPECT_EQ(collector.wait_for(expected_key_presses.size()), expected_key_presses);
+  }
+  unlink(file_path);
+}
+TEST_F(KeyboardHandlerUnixTest, coalesce_autorepeat_and_notify_about_hold_end) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = KeyPressesCollector::KeyPress;
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t repeated_presses_count = 0;
+  std::vector<size_t> hold_ends;
+  KeyPressesCollector collector;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    EXPECT_EQ(
+      keyboard_handler.add_key_repeat_callback(nullptr, KeyCode::A),
+      KeyboardHandler::invalid_handle);
+    keyboard_handler.add_key_repeat_callback(
+      [&](KeyCode, KeyModifiers, size_t repeat_count) {
+        std::lock_guard<std::mutex> lk(mutex);
+        EXPECT_GE(repeat_count, 1U);
+        repeated_presses_count += repeat_count;
+      }, KeyCode::A);
+    keyboard_handler.add_key_hold_end_callback(
+      [&](KeyCode key_code, KeyModifiers, size_t repeat_count) {
+        EXPECT_EQ(key_code, KeyCode::A);
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          hold_ends.push_back(repeat_count);
+        }
+        cv.notify_all();
+      }, KeyCode::A);
+    collector.register_callbacks(keyboard_handler, {{KeyCode::B, KeyModifiers::NONE}});
+    // Hold of A ends when other key is pressed
+    const std::string input = "aaaab";
+    ASSERT_EQ(write(pipe_fds[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    EXPECT_EQ(collector.wait_for(1), std::vector<KeyPress>({{KeyCode::B, KeyModifiers::NONE}}));
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      EXPECT_TRUE(cv.wait_for(lk, std::chrono::seconds(5), [&]() {return !hold_ends.empty();}));
+      EXPECT_EQ(repeated_presses_count, 4U);
+      EXPECT_EQ(hold_ends, std::vector<size_t>({4}));
+    }
+    close(pipe_fds[1]);
+  }
+  close(pipe_fds[0]);
+}
+
+TEST_F(KeyboardHandlerUnixTest, coalesce_key_press_callbacks_by_policy) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t key_press_calls_count = 0;
+  size_t hold_repeat_count = 0;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    KeyboardHandler::AutorepeatPolicy policy;
+    policy.coalesce_key_press_callbacks = true;
+    policy.hold_window = std::chrono::milliseconds(20);
+    keyboard_handler.set_autorepeat_policy(policy);
+    EXPECT_TRUE(keyboard_handler.get_autorepeat_policy().coalesce_key_press_callbacks);
+    EXPECT_EQ(keyboard_handler.get_autorepeat_policy().hold_window, policy.hold_window);
+    keyboard_handler.add_key_press_callback(
+      [&](KeyCode, KeyModifiers) {
+        std::lock_guard<std::mutex> lk(mutex);
+        key_press_calls_count++;
+      }, KeyCode::A);
+    keyboard_handler.add_key_hold_end_callback(
+      [&](KeyCode, KeyModifiers, size_t repeat_count) {
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          hold_repeat_count = repeat_count;
+        }
+        cv.notify_all();
+      }, KeyCode::A);
+    // Pipe write is atomic, all key presses are read out at once. Hold ends by timeout.
+    const std::string input = "aaa";
+    ASSERT_EQ(write(pipe_fds[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      EXPECT_TRUE(
+        cv.wait_for(lk, std::chrono::seconds(5), [&]() {return hold_repeat_count != 0;}));
+      EXPECT_EQ(key_press_calls_count, 1U);
+      EXPECT_EQ(hold_repeat_count, 3U);
+    }
+    close(pipe_fds[1]);
+  }
+  close(pipe_fds[0]);
+}
+
+TEST(RateLimiterTest, leading_edge_trailing_edge_and_token_bucket) {
+  using std::chrono::milliseconds;
+  const RateLimiter::time_point start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(RateLimitPolicy::leading_edge(milliseconds(0)).is_valid());
+  EXPECT_FALSE(RateLimitPolicy::token_bucket(0).is_valid());
+  EXPECT_FALSE(RateLimitPolicy::token_bucket(10, 0).is_valid());
+
+  RateLimiter leading_edge(RateLimitPolicy::leading_edge(milliseconds(100)));
+  EXPECT_TRUE(leading_edge.on_key_press(start));
+  EXPECT_FALSE(leading_edge.on_key_press(start + milliseconds(50)));
+  EXPECT_FALSE(leading_edge.on_key_press(start + milliseconds(99)));
+  EXPECT_TRUE(leading_edge.on_key_press(start + milliseconds(100)));
+  EXPECT_TRUE(leading_edge.on_key_press(start + milliseconds(500)));
+
+  // 10 calls per second with bursts up to 3 calls
+  RateLimiter token_bucket(RateLimitPolicy::token_bucket(10, 3));
+  EXPECT_TRUE(token_bucket.on_key_press(start));
+  EXPECT_TRUE(token_bucket.on_key_press(start));
+  EXPECT_TRUE(token_bucket.on_key_press(start));
+  EXPECT_FALSE(token_bucket.on_key_press(start));
+  EXPECT_FALSE(token_bucket.on_key_press(start + milliseconds(99)));
+  EXPECT_TRUE(token_bucket.on_key_press(start + milliseconds(100)));
+  EXPECT_FALSE(token_bucket.on_key_press(start + milliseconds(100)));
+  // Bucket refills in 3 intervals
+  EXPECT_TRUE(token_bucket.on_key_press(start + milliseconds(1000)));
+  EXPECT_TRUE(token_bucket.on_key_press(start + milliseconds(1000)));
+  EXPECT_TRUE(token_bucket.on_key_press(start + milliseconds(1000)));
+  EXPECT_FALSE(token_bucket.on_key_press(start + milliseconds(1000)));
+
+  RateLimiter trailing_edge(RateLimitPolicy::trailing_edge(milliseconds(100)));
+  auto deadline = RateLimiter::time_point::max();
+  EXPECT_FALSE(trailing_edge.take_deferred_call(start, deadline));
+  EXPECT_EQ(deadline, RateLimiter::time_point::max());
+  EXPECT_FALSE(trailing_edge.on_key_press(start));
+  EXPECT_FALSE(trailing_edge.on_key_press(start + milliseconds(50)));
+  EXPECT_FALSE(trailing_edge.take_deferred_call(start + milliseconds(100), deadline));
+  EXPECT_EQ(deadline, start + milliseconds(150));
+  EXPECT_TRUE(trailing_edge.take_deferred_call(start + milliseconds(150), deadline));
+  EXPECT_FALSE(trailing_edge.take_deferred_call(start + milliseconds(500), deadline));
+
+  // Shared deadline receives the earliest deferred call
+  RateLimiter short_trailing_edge(RateLimitPolicy::trailing_edge(milliseconds(10)));
+  RateLimiter long_trailing_edge(RateLimitPolicy::trailing_edge(milliseconds(100)));
+  EXPECT_FALSE(short_trailing_edge.on_key_press(start));
+  EXPECT_FALSE(long_trailing_edge.on_key_press(start));
+  deadline = RateLimiter::time_point::max();
+  EXPECT_FALSE(short_trailing_edge.take_deferred_call(start, deadline));
+  EXPECT_FALSE(long_trailing_edge.take_deferred_call(start, deadline));
+  EXPECT_EQ(deadline, start + milliseconds(10));
+}
+
+TEST_F(KeyboardHandlerUnixTest, rate_limited_callbacks) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = KeyPressesCollector::KeyPress;
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::map<KeyCode, size_t> calls_count;
+  auto callback = [&](KeyCode key_code, KeyModifiers) {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        calls_count[key_code]++;
+      }
+      cv.notify_all();
+    };
+  KeyPressesCollector collector;
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    EXPECT_EQ(
+      keyboard_handler.add_key_press_callback(
+        callback, KeyCode::A, KeyModifiers::NONE, RateLimitPolicy::token_bucket(0)),
+      KeyboardHandler::invalid_handle);
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::A, KeyModifiers::NONE,
+      RateLimitPolicy::leading_edge(std::chrono::hours(1)));
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::B, KeyModifiers::NONE, RateLimitPolicy::token_bucket(1, 2));
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::C, KeyModifiers::NONE,
+      RateLimitPolicy::trailing_edge(std::chrono::milliseconds(20)));
+    collector.register_callbacks(keyboard_handler, {{KeyCode::D, KeyModifiers::NONE}});
+
+    const std::string input = "aaabbbcccd";
+    ASSERT_EQ(write(pipe_fds[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    EXPECT_EQ(collector.wait_for(1), std::vector<KeyPress>({{KeyCode::D, KeyModifiers::NONE}}));
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      EXPECT_EQ(calls_count[KeyCode::A], 1U);
+      EXPECT_EQ(calls_count[KeyCode::B], 2U);
+      // Trailing edge callback is called after the key presses quiet down
+      EXPECT_TRUE(
+        cv.wait_for(
+          lk, std::chrono::seconds(5), [&]() {return calls_count[KeyCode::C] > 0;}));
+      EXPECT_EQ(calls_count[KeyCode::C], 1U);
+    }
+    close(pipe_fds[1]);
+  }
+  close(pipe_fds[0]);
+}
+
+TEST_F(KeyboardHandlerUnixTest, trailing_edge_callbacks_with_different_intervals) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::map<KeyCode, size_t> calls_count;
+  auto callback = [&](KeyCode key_code, KeyModifiers) {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        calls_count[key_code]++;
+      }
+      cv.notify_all();
+    };
+  {
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::A, KeyModifiers::NONE,
+      RateLimitPolicy::trailing_edge(std::chrono::milliseconds(20)));
+    keyboard_handler.add_key_press_callback(
+      callback, KeyCode::B, KeyModifiers::NONE,
+      RateLimitPolicy::trailing_edge(std::chrono::hours(1)));
+
+    // The later deadline of `b` doesn't postpone the earlier deadline of `a`
+    const std::string input = "ab";
+    ASSERT_EQ(write(pipe_fds[1], input.data(), input.size()), static_cast<ssize_t>(input.size()));
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      EXPECT_TRUE(
+        cv.wait_for(
+          lk, std::chrono::seconds(5), [&]() {return calls_count[KeyCode::A] > 0;}));
+      EXPECT_EQ(calls_count[KeyCode::A], 1U);
+      EXPECT_EQ(calls_count[KeyCode::B], 0U);
+    }
+    close(pipe_fds[1]);
+  }
+  close(pipe_fds[0]);
+}
+
+TEST_F(KeyboardHandlerUnixTest, record_and_replay_keystroke_journal) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeyModifiers = KeyboardHandler::KeyModifiers;
+  using KeyPress = KeyPressesCollector::KeyPress;
+  char journal_path[] = "/tmp/keyboard_handler_journal_XXXXXX";
+  int journal_fd = mkstemp(journal_path);
+  ASSERT_NE(journal_fd, -1);
+  close(journal_fd);
+  const std::vector<std::string> input = {"a", "\x1b[A", "\x01"};
+  const std::vector<KeyPress> expected_key_presses = {
+    {KeyCode::A, KeyModifiers::NONE},
+    {KeyCode::CURSOR_UP, KeyModifiers::NONE},
+    {KeyCode::A, KeyModifiers::CTRL}};
+  constexpr auto interval = std::chrono::milliseconds(50);
+
+  int pipe_fds[2];
+  ASSERT_NE(pipe(pipe_fds), -1);
+  {
+    KeyPressesCollector collector;
+    KeyboardHandlerUnixImpl keyboard_handler(
+      pipe_fds[0], KeyboardHandlerUnixImpl::CommandStreamFormat::RAW);
+    collector.register_callbacks(keyboard_handler, expected_key_presses);
+    keyboard_handler.start_recording(journal_path);
+    EXPECT_THROW(keyboard_handler.start_recording(journal_path), std::logic_error);
+    for (size_t i = 0; i < input.size(); i++) {
+      ASSERT_EQ(
+        write(pipe_fds[1], input[i].data(), input[i].size()),
+        static_cast<ssize_t>(input[i].size()));
+      collector.wait_for(i + 1);
+      std::this_thread::sleep_for(interval);
+    }
+    keyboard_handler.stop_recording();
+    close(pipe_fds[1]);
+  }
+  close(pipe_fds[0]);
+
+  {
+    KeystrokeJournalReader journal(journal_path);
+    KeystrokeJournalReader::Record record;
+    std::vector<KeystrokeJournalReader::Record> records;
+    while (journal.next(record)) {
+      records.push_back(record);
+    }
+    ASSERT_EQ(records.size(), input.size());
+    for (size_t i = 0; i < records.size(); i++) {
+      EXPECT_EQ(KeyPress(records[i].key_code, records[i].key_modifiers), expected_key_presses[i]);
+      EXPECT_EQ(records[i].raw, input[i]);
+      if (i > 0) {
+        EXPECT_GE(records[i].timestamp - records[i - 1].timestamp, interval);
+      }
+    }
+  }
+
+  MockKeyboardHandler keyboard_handler(read_fn_);
+  KeyPressesCollector collector;
+  collector.register_callbacks(keyboard_handler, expected_key_presses);
+  auto replay_start = std::chrono::steady_clock::now();
+  EXPECT_EQ(keyboard_handler.replay_journal(journal_path, 2.0), input.size());
+  // Two intervals between three key presses replayed twice faster
+  EXPECT_GE(std::chrono::steady_clock::now() - replay_start, interval);
+  EXPECT_EQ(collector.wait_for(input.size()), expected_key_presses);
+  EXPECT_EQ(
+    keyboard_handler.replay_journal(
+      journal_path, KeyboardHandlerUnixImpl::REPLAY_AS_FAST_AS_POSSIBLE), input.size());
+  EXPECT_EQ(collector.wait_for(input.size() * 2).size(), input.size() * 2);
+  EXPECT_THROW(keyboard_handler.replay_journal("/nonexistent/journal"), std::runtime_error);
+  unlink(journal_path);
+}
+
+namespace
+{
+/// \brief Build compiled terminfo entry with the given string capabilities.
+std::string make_compiled_terminfo(
+  const std::map<size_t, std::string> & strings, bool numbers_32bit = false)
+{
+  const std::string names = "xtest|terminal for tests";
+  std::vector<int> offsets(strings.rbegin()->first + 1, -1);
+  std::string string_table;
+  for (const auto & index_and_string : strings) {
+    offsets[index_and_string.first] = static_cast<int>(string_table.size());
+    string_table += index_and_string.second;
+    string_table += '\0';
+  }
+  std::string data;
+  auto put_int16 = [&data](int value) {
+      data += static_cast<char>(value & 0xFF);
+      data += static_cast<char>((value >> 8) & 0xFF);
+    };
+  put_int16(numbers_32bit ? 01036 : 0432);
+  put_int16(static_cast<int>(names.size() + 1));
+  put_int16(1);  // booleans
+  put_int16(2);  // numbers
+  put_int16(static_cast<int>(offsets.size()));
+  put_int16(static_cast<int>(string_table.size()));
+  data += names;
+  data += '\0';
+  data += '\1';
+  if (data.size() % 2 != 0) {
+    data += '\0';
+  }
+  for (int number : {80, 24}) {
+    put_int16(number);
+    if (numbers_32bit) {
+      put_int16(0);
+    }
+  }
+  for (int offset : offsets) {
+    put_int16(offset);
+  }
+  return data + string_table;
+}
+
+void write_file(const std::string & path, const std::string & contents)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(fd, -1) << path;
+  EXPECT_EQ(write(fd, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+  close(fd);
+}
+
+void remove_directory(const std::string & path)
+{
+  DIR * dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  while (struct dirent * entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    const std::string entry_path = path + "/" + name;
+    struct stat entry_stat;
+    if (lstat(entry_path.c_str(), &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode)) {
+      remove_directory(entry_path);
+    } else {
+      unlink(entry_path.c_str());
+    }
+  }
+  closedir(dir);
+  rmdir(path.c_str());
+}
+}  // namespace
+
+TEST(TerminfoKeyMapTest, parse_compiled_terminfo) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  using KeySequences = std::vector<std::pair<KeyCode, std::string>>;
+  auto parse = [](const std::string & terminfo, KeySequences & key_sequences) {
+      std::vector<TerminfoKeyMap::KeySequence> parsed;
+      bool result = TerminfoKeyMap::parse_key_sequences(terminfo.data(), terminfo.size(), parsed);
+      key_sequences.clear();
+      for (const auto & key_sequence : parsed) {
+        key_sequences.emplace_back(key_sequence.key_code, key_sequence.sequence);
+      }
+      return result;
+    };
+  // kbs, kf1 (empty), khome, kcuu1, kend and kf12, along with some non key capabilities
+  const std::map<size_t, std::string> strings = {
+    {5, "\x1b[H\x1b[2J"}, {55, "\x08"}, {66, ""}, {76, "\x1b[7~"}, {87, "\x1bOA"},
+    {164, "\x1b[8~"}, {217, "\x1b[24~"}};
+  const KeySequences expected = {
+    {KeyCode::BACK_SPACE, "\x08"}, {KeyCode::HOME, "\x1b[7~"}, {KeyCode::CURSOR_UP, "\x1bOA"},
+    {KeyCode::END, "\x1b[8~"}, {KeyCode::F12, "\x1b[24~"}};
+  KeySequences key_sequences;
+  ASSERT_TRUE(parse(make_compiled_terminfo(strings), key_sequences));
+  EXPECT_EQ(key_sequences, expected);
+  ASSERT_TRUE(parse(make_compiled_terminfo(strings, true), key_sequences));
+  EXPECT_EQ(key_sequences, expected);
+  // Entry with fewer string capabilities than the index of the key capability
+  ASSERT_TRUE(parse(make_compiled_terminfo({{87, "\x1b[A"}}), key_sequences));
+  EXPECT_EQ(key_sequences, (KeySequences{{KeyCode::CURSOR_UP, "\x1b[A"}}));
+
+  std::string terminfo = make_compiled_terminfo(strings);
+  EXPECT_FALSE(parse(terminfo.substr(0, terminfo.size() - 1), key_sequences));
+  EXPECT_FALSE(parse(terminfo.substr(0, 11), key_sequences));
+  terminfo[0] = 'x';
+  EXPECT_FALSE(parse(terminfo, key_sequences));
+}
+
+TEST_F(KeyboardHandlerUnixTest, terminfo_key_map_with_cache) {
+  using KeyCode = KeyboardHandler::KeyCode;
+  char temp_dir[] = "/tmp/keyboard_handler_terminfo_XXXXXX";
+  ASSERT_NE(mkdtemp(temp_dir), nullptr);
+  const std::string terminfo_dir = std::string(temp_dir) + "/terminfo";
+  const std::string cache_dir = std::string(temp_dir) + "/cache/keyboard_handler";
+  ASSERT_EQ(mkdir(terminfo_dir.c_str(), 0755), 0);
+  ASSERT_EQ(mkdir((terminfo_dir + "/x").c_str(), 0755), 0);
+  const std::string terminfo_path = terminfo_dir + "/x/xtest";
+  // rxvt like sequences of the Home and End keys, cursor keys in application mode
+  write_file(
+    terminfo_path,
+    make_compiled_terminfo({{76, "\x1b[7~"}, {87, "\x1bOA"}, {164, "\x1b[8~"}}));
+
+  const char * old_terminfo = getenv("TERMINFO");
+  const std::string old_terminfo_value = old_terminfo != nullptr ? old_terminfo : "";
+  setenv("TERMINFO", terminfo_dir.c_str(), 1);
+  EXPECT_EQ(TerminfoKeyMap::find_terminfo_file("xtest"), terminfo_path);
+  EXPECT_EQ(TerminfoKeyMap::find_terminfo_file("../xtest"), "");
+
+  const TerminalSequenceTrie & fallback_trie = KeyMapAccessor::DEFAULT_STATIC_KEY_TRIE;
+  auto check_trie = [](const TerminalSequenceTrie & trie) {
+      EXPECT_EQ(trie.find("\x1b[7~", 4), KeyCode::HOME);
+      EXPECT_EQ(trie.find("\x1b[8~", 4), KeyCode::END);
+      EXPECT_EQ(trie.find("\x1bOA", 3), KeyCode::CURSOR_UP);
+      // Keys which terminal sends in normal mode are still recognized by fallback sequences
+      EXPECT_EQ(trie.find("\x1b[A", 3), KeyCode::CURSOR_UP);
+      EXPECT_EQ(trie.find("a", 1), KeyCode::A);
+    };
+  {
+    TerminfoKeyMap key_map(terminfo_path, fallback_trie, cache_dir);
+    EXPECT_FALSE(key_map.is_loaded_from_cache());
+    check_trie(key_map.get_trie());
+  }
+  {
+    TerminfoKeyMap key_map(terminfo_path, fallback_trie, cache_dir);
+    EXPECT_TRUE(key_map.is_loaded_from_cache());
+    check_trie(key_map.get_trie());
+  }
+
+  // Corrupted cache is rebuilt
+  DIR * dir = opendir(cache_dir.c_str());
+  ASSERT_NE(dir, nullptr);
+  std::string cache_path;
+  while (struct dirent * entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      cache_path = cache_dir + "/" + entry->d_name;
+    }
+  }
+  closedir(dir);
+  int cache_fd = open(cache_path.c_str(), O_WRONLY);
+  ASSERT_NE(cache_fd, -1);
+  const std::string garbage(256, '\xff');
+  EXPECT_EQ(
+    pwrite(cache_fd, garbage.data(), garbage.size(), sizeof(TerminalSequenceTrie) - 512),
+    static_cast<ssize_t>(garbage.size()));
+  close(cache_fd);
+  {
+    TerminfoKeyMap key_map(terminfo_path, fallback_trie, cache_dir);
+    EXPECT_FALSE(key_map.is_loaded_from_cache());
+    check_trie(key_map.get_trie());
+  }
+  {
+    TerminfoKeyMap key_map(terminfo_path, fallback_trie, cache_dir);
+    EXPECT_TRUE(key_map.is_loaded_from_cache());
+  }
+
+  {
+    MockKeyboardHandler keyboard_handler(read_fn_);
+    EXPECT_FALSE(keyboard_handler.load_terminfo_key_map("nonexistent-terminal", cache_dir));
+    const char END[] = "\x1b[8~";
+    EXPECT_EQ(
+      std::get<0>(keyboard_handler.parse_input_mock(END, sizeof(END))), KeyCode::UNKNOWN);
+    EXPECT_TRUE(keyboard_handler.load_terminfo_key_map("xtest", cache_dir));
+    EXPECT_EQ(std::get<0>(keyboard_handler.parse_input_mock(END, sizeof(END))), KeyCode::END);
+    // Reloading replaces and frees previous key map
+    for (int i = 0; i < 3; i++) {
+      EXPECT_TRUE(keyboard_handler.load_terminfo_key_map("xtest", cache_dir));
+      EXPECT_EQ(std::get<0>(keyboard_handler.parse_input_mock(END, sizeof(END))), KeyCode::END);
+      EXPECT_FALSE(keyboard_handler.get_terminal_sequence(KeyCode::END).empty());
+    }
+  }
+  EXPECT_THROW(
+    TerminfoKeyMap(terminfo_dir + "/x", fallback_trie, cache_dir), std::runtime_error);
+
+  if (old_terminfo != nullptr) {
+    setenv("TERMINFO", old_terminfo_value.c_str(), 1);
+  } else {
+    unsetenv("TERMINFO");
+  }
+  remove_directory(temp_dir);
+}
 #endif  // #ifndef _WIN32
@@ -183,7 +183,7 @@ public:
 
   size_t get_number_of_registered_callbacks() const
   {
-    return callbacks_.size();
+    return get_callbacks_count();
   }
 
 private: